@@ -0,0 +1,189 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  generic dbus active agent
+
+  listens for a configurable signal announcing the focused process, for
+  shells and compositors that publish focus changes on the bus. the first
+  integer argument of the signal is the pid. root may pass the uid as second
+  integer argument, otherwise the uid is the unix user of the sender and the
+  process has to belong to that user.
+
+  the daemon is only connected to the system bus. focus signals on the
+  session bus don't reach it, the shell extension or a small helper in the
+  session has to emit the signal on the system bus, ie.
+    dbus-send --system --type=signal / org.example.Focus.ActiveChanged int32:PID
+  the default system bus policy allows broadcasting signals.
+*/
+
+#include "config.h"
+#include "ulatency.h"
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+#include <glib.h>
+
+#define SENDER_CACHE_SIZE 256
+
+static guint dbusagent_id; // unique plugin id
+static gchar *agent_interface = NULL;
+static gchar *agent_member = NULL;
+static GHashTable *sender_uids = NULL; // unique bus name -> uid + 1
+
+static int get_uint_arg(DBusMessageIter *iter, guint64 *value) {
+  dbus_int32_t i32;
+  dbus_uint32_t u32;
+  dbus_int64_t i64;
+  dbus_uint64_t u64;
+
+  switch(dbus_message_iter_get_arg_type(iter)) {
+    case DBUS_TYPE_INT32:
+      dbus_message_iter_get_basic(iter, &i32);
+      if(i32 < 0)
+        return FALSE;
+      *value = i32;
+      return TRUE;
+    case DBUS_TYPE_UINT32:
+      dbus_message_iter_get_basic(iter, &u32);
+      *value = u32;
+      return TRUE;
+    case DBUS_TYPE_INT64:
+      dbus_message_iter_get_basic(iter, &i64);
+      if(i64 < 0)
+        return FALSE;
+      *value = i64;
+      return TRUE;
+    case DBUS_TYPE_UINT64:
+      dbus_message_iter_get_basic(iter, &u64);
+      *value = u64;
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// unique names are never reused, so the uid of a sender can be cached
+static uid_t get_sender_uid(DBusConnection *c, const char *sender) {
+  DBusError error;
+  unsigned long uid;
+  gpointer cached;
+
+  if(!sender)
+    return (uid_t)-1;
+
+  cached = g_hash_table_lookup(sender_uids, sender);
+  if(cached)
+    return (uid_t)(GPOINTER_TO_UINT(cached) - 1);
+
+  dbus_error_init(&error);
+  uid = dbus_bus_get_unix_user(c, sender, &error);
+  if(uid == (unsigned long)-1) {
+    g_debug("dbusagent: can't get unix user of %s: %s", sender, error.message);
+    dbus_error_free(&error);
+    return (uid_t)-1;
+  }
+
+  if(g_hash_table_size(sender_uids) >= SENDER_CACHE_SIZE)
+    g_hash_table_remove_all(sender_uids);
+  g_hash_table_insert(sender_uids, g_strdup(sender), GUINT_TO_POINTER(uid + 1));
+  return (uid_t)uid;
+}
+
+static DBusHandlerResult dbusagent_filter(DBusConnection *c, DBusMessage *m, void *data) {
+  DBusMessageIter iter;
+  guint64 pid, tmpu;
+  uid_t caller, uid;
+  u_proc *proc;
+
+  if(!dbus_message_is_signal(m, agent_interface, agent_member))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if(!dbus_message_iter_init(m, &iter) || !get_uint_arg(&iter, &pid) || !pid) {
+    g_debug("dbusagent: %s.%s without pid", agent_interface, agent_member);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  caller = get_sender_uid(c, dbus_message_get_sender(m));
+  if(caller == (uid_t)-1)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if(caller != 0) {
+    // users may only report their own processes, so they can't move
+    // processes of others or take the active list of another user
+    proc = proc_by_pid((pid_t)pid);
+    if(!proc || !u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE) ||
+       proc->proc.euid != caller) {
+      g_debug("dbusagent: %d reported pid %d of another user", caller, (int)pid);
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    uid = caller;
+  } else if(dbus_message_iter_next(&iter) && get_uint_arg(&iter, &tmpu)) {
+    uid = (uid_t)tmpu;
+  } else {
+    // root did not tell the user, so it is the owner of the process
+    proc = proc_by_pid((pid_t)pid);
+    if(!proc || !u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE))
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    uid = proc->proc.ruid;
+  }
+
+  if(active_agent_claim(uid, dbusagent_id))
+    set_active_pid_debounced(uid, (guint)pid);
+
+  // other filters may be interested in the signal as well
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+int dbusagent_init() {
+  DBusConnection *c;
+  DBusError error;
+  gchar *rule;
+
+  agent_interface = g_key_file_get_string(config_data, "dbusagent", "interface", NULL);
+  agent_member = g_key_file_get_string(config_data, "dbusagent", "member", NULL);
+  if(!agent_interface || !agent_member) {
+    g_message("dbusagent: no signal configured. disabled");
+    return 0;
+  }
+
+  if(!U_dbus_connection) {
+    g_warning("dbusagent: dbus connection missing");
+    return 1;
+  }
+  c = dbus_g_connection_get_connection(U_dbus_connection);
+
+  dbusagent_id = active_agent_register("dbusagent");
+  sender_uids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  rule = g_strdup_printf("type='signal',interface='%s',member='%s'",
+                         agent_interface, agent_member);
+  dbus_error_init(&error);
+  dbus_bus_add_match(c, rule, &error);
+  if(dbus_error_is_set(&error)) {
+    g_warning("dbusagent: can't add match %s: %s", rule, error.message);
+    dbus_error_free(&error);
+    g_free(rule);
+    return 1;
+  }
+  g_free(rule);
+
+  dbus_connection_add_filter(c, dbusagent_filter, NULL, NULL);
+  g_message("dbusagent: listen for %s.%s", agent_interface, agent_member);
+  return 0;
+}
@@ -0,0 +1,499 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  active agent for wlroots based compositors
+
+  connects to the wayland compositor of each user session and listens to the
+  wlr-foreign-toplevel-management protocol. the connection never blocks the
+  daemon, all events are read when the main loop sees the socket readable.
+
+  the protocol does not tell the pid of a toplevel, so the pid is a guess:
+  the app_id is matched against the process names of the user and the
+  oldest matching process wins. that is the main process of most
+  applications, but with several instances of a program the focus always
+  goes to the first one started, and app_ids that differ from the process
+  name (ie. flatpak or wrapper scripts) find nothing.
+*/
+
+#include "config.h"
+#include "ulatency.h"
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <wayland-client.h>
+#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
+
+#define DEFAULT_SYNC_INTERVAL 0
+#define RETRY_TIMEOUT 30
+#define RETRY_NEW_SESSION 10    // retries for a new session without compositor
+#define TOPLEVEL_MANAGER_VERSION 3
+
+struct wayland_server {
+  uid_t uid;
+  gchar *socket;           // absolute path of the compositor socket
+  time_t last_try;
+  struct wl_display *display;
+  struct wl_registry *registry;
+  struct zwlr_foreign_toplevel_manager_v1 *manager;
+  struct wl_callback *sync;  // pending until the globals are announced
+  int ready;               // globals announced, manager must be bound
+  guint watch;             // main loop source watching the connection
+  GList *toplevels;        // list of struct toplevel
+};
+
+struct toplevel {
+  struct wayland_server *ws;
+  struct zwlr_foreign_toplevel_handle_v1 *handle;
+  gchar *app_id;
+  int activated;
+  int pending_activated;   // state until the next done event
+};
+
+static int wlrwatch_id; // unique plugin id
+static GList *server_list = NULL;  // list of wayland_server objects
+static guint retry_source = 0;     // timeout while compositors are missing
+static int retry_new = 0;          // retries left for new sessions
+
+static void schedule_retry();
+
+static void free_toplevel(struct toplevel *tl) {
+  zwlr_foreign_toplevel_handle_v1_destroy(tl->handle);
+  g_free(tl->app_id);
+  g_slice_free(struct toplevel, tl);
+}
+
+// disconnect from the compositor and stop watching the connection
+static void close_connection(struct wayland_server *ws) {
+  if(ws->watch) {
+      g_source_remove(ws->watch);
+      ws->watch = 0;
+  }
+  g_list_free_full(ws->toplevels, (GDestroyNotify)free_toplevel);
+  ws->toplevels = NULL;
+  if(ws->sync)
+      wl_callback_destroy(ws->sync);
+  ws->sync = NULL;
+  ws->ready = FALSE;
+  if(ws->manager)
+      zwlr_foreign_toplevel_manager_v1_destroy(ws->manager);
+  ws->manager = NULL;
+  if(ws->registry)
+      wl_registry_destroy(ws->registry);
+  ws->registry = NULL;
+  if(ws->display)
+      wl_display_disconnect(ws->display);
+  ws->display = NULL;
+}
+
+static void free_wayland_server(struct wayland_server *ws) {
+  g_debug("remove wayland server: %s", ws->socket);
+  close_connection(ws);
+  active_agent_release(ws->uid, wlrwatch_id);
+  g_free(ws->socket);
+  g_slice_free(struct wayland_server, ws);
+}
+
+// the kernel truncates the process name to 15 characters
+static int match_comm(const char *comm, const char *name) {
+  size_t len = strlen(comm);
+
+  if(!len)
+    return FALSE;
+  if(len < 15)
+    return g_ascii_strcasecmp(comm, name) == 0;
+  return g_ascii_strncasecmp(comm, name, len) == 0;
+}
+
+/*
+  finds the process of an app_id. tries the full app_id first, then the last
+  part of reverse domain names like org.gnome.Nautilus
+*/
+static pid_t find_app_pid(uid_t uid, const char *app_id) {
+  GHashTableIter iter;
+  gpointer key;
+  u_proc *proc, *best = NULL;
+  const char *tail = strrchr(app_id, '.');
+
+  tail = tail ? tail + 1 : NULL;
+
+  g_hash_table_iter_init (&iter, processes);
+  while(g_hash_table_iter_next (&iter, &key, (gpointer *)&proc)) {
+    if(U_PROC_IS_INVALID(proc) ||
+       !U_PROC_HAS_FIELDS(proc, UPROC_FIELD_STAT | UPROC_FIELD_STATUS) ||
+       proc->proc.ruid != uid)
+      continue;
+    if(!match_comm(proc->proc.cmd, app_id) &&
+       !(tail && *tail && match_comm(proc->proc.cmd, tail)))
+      continue;
+    if(!best || proc->proc.start_time < best->proc.start_time)
+      best = proc;
+  }
+  return best ? best->pid : 0;
+}
+
+static void toplevel_handle_title(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle, const char *title) {
+}
+
+static void toplevel_handle_app_id(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle, const char *app_id) {
+  struct toplevel *tl = data;
+
+  g_free(tl->app_id);
+  tl->app_id = g_strdup(app_id);
+}
+
+static void toplevel_handle_output_enter(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle, struct wl_output *output) {
+}
+
+static void toplevel_handle_output_leave(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle, struct wl_output *output) {
+}
+
+static void toplevel_handle_state(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle, struct wl_array *state) {
+  struct toplevel *tl = data;
+  uint32_t *entry;
+
+  tl->pending_activated = FALSE;
+  wl_array_for_each(entry, state) {
+    if(*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED)
+      tl->pending_activated = TRUE;
+  }
+}
+
+// all properties of the toplevel are sent, a new activation is a focus change
+static void toplevel_handle_done(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle) {
+  struct toplevel *tl = data;
+  struct wayland_server *ws = tl->ws;
+  pid_t pid;
+
+  if(tl->pending_activated && !tl->activated && tl->app_id &&
+     active_agent_claim(ws->uid, wlrwatch_id)) {
+    pid = find_app_pid(ws->uid, tl->app_id);
+    if(pid)
+      set_active_pid_debounced(ws->uid, pid);
+    else
+      g_debug("wlrwatch: no process for app_id %s", tl->app_id);
+  }
+  tl->activated = tl->pending_activated;
+}
+
+static void toplevel_handle_closed(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle) {
+  struct toplevel *tl = data;
+
+  tl->ws->toplevels = g_list_remove(tl->ws->toplevels, tl);
+  free_toplevel(tl);
+}
+
+static void toplevel_handle_parent(void *data,
+    struct zwlr_foreign_toplevel_handle_v1 *handle,
+    struct zwlr_foreign_toplevel_handle_v1 *parent) {
+}
+
+static const struct zwlr_foreign_toplevel_handle_v1_listener toplevel_listener = {
+  .title = toplevel_handle_title,
+  .app_id = toplevel_handle_app_id,
+  .output_enter = toplevel_handle_output_enter,
+  .output_leave = toplevel_handle_output_leave,
+  .state = toplevel_handle_state,
+  .done = toplevel_handle_done,
+  .closed = toplevel_handle_closed,
+  .parent = toplevel_handle_parent,
+};
+
+static void manager_handle_toplevel(void *data,
+    struct zwlr_foreign_toplevel_manager_v1 *manager,
+    struct zwlr_foreign_toplevel_handle_v1 *handle) {
+  struct wayland_server *ws = data;
+  struct toplevel *tl = g_slice_new0(struct toplevel);
+
+  tl->ws = ws;
+  tl->handle = handle;
+  ws->toplevels = g_list_prepend(ws->toplevels, tl);
+  zwlr_foreign_toplevel_handle_v1_add_listener(handle, &toplevel_listener, tl);
+}
+
+static void manager_handle_finished(void *data,
+    struct zwlr_foreign_toplevel_manager_v1 *manager) {
+  struct wayland_server *ws = data;
+
+  // the compositor destroyed the object already
+  zwlr_foreign_toplevel_manager_v1_destroy(ws->manager);
+  ws->manager = NULL;
+}
+
+static const struct zwlr_foreign_toplevel_manager_v1_listener manager_listener = {
+  .toplevel = manager_handle_toplevel,
+  .finished = manager_handle_finished,
+};
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+    uint32_t name, const char *interface, uint32_t version) {
+  struct wayland_server *ws = data;
+
+  if(ws->manager ||
+     strcmp(interface, zwlr_foreign_toplevel_manager_v1_interface.name))
+    return;
+
+  ws->manager = wl_registry_bind(registry, name,
+      &zwlr_foreign_toplevel_manager_v1_interface,
+      MIN(version, TOPLEVEL_MANAGER_VERSION));
+  zwlr_foreign_toplevel_manager_v1_add_listener(ws->manager, &manager_listener, ws);
+}
+
+static void registry_handle_global_remove(void *data,
+    struct wl_registry *registry, uint32_t name) {
+}
+
+static const struct wl_registry_listener registry_listener = {
+  .global = registry_handle_global,
+  .global_remove = registry_handle_global_remove,
+};
+
+// the compositor answered the sync request, all globals were announced
+static void sync_handle_done(void *data, struct wl_callback *callback,
+                             uint32_t serial) {
+  struct wayland_server *ws = data;
+
+  wl_callback_destroy(ws->sync);
+  ws->sync = NULL;
+  ws->ready = TRUE;
+  if(!ws->manager)
+    g_message("compositor at %s does not support wlr-foreign-toplevel", ws->socket);
+}
+
+static const struct wl_callback_listener sync_listener = {
+  .done = sync_handle_done,
+};
+
+// called from the main loop when the compositor sent something. the socket
+// is readable, so reading does not block
+static gboolean wayland_server_event(GIOChannel *source, GIOCondition condition,
+                                     gpointer data) {
+  struct wayland_server *ws = data;
+  int error = (condition & (G_IO_ERR | G_IO_HUP)) != 0;
+
+  while(!error && wl_display_prepare_read(ws->display) != 0)
+    error = wl_display_dispatch_pending(ws->display) == -1;
+  if(!error && (wl_display_read_events(ws->display) == -1 ||
+                wl_display_dispatch_pending(ws->display) == -1))
+    error = TRUE;
+
+  if(error || (ws->ready && !ws->manager)) {
+    g_debug("got connection problems. disconnectd %s", ws->socket);
+    // the source is removed by returning FALSE
+    ws->watch = 0;
+    close_connection(ws);
+    schedule_retry();
+    return FALSE;
+  }
+  // requests are small, a full socket buffer is retried on the next event
+  wl_display_flush(ws->display);
+  return TRUE;
+}
+
+static int create_connection(struct wayland_server *ws) {
+  GIOChannel *channel;
+
+  ws->last_try = time(NULL);
+  ws->display = wl_display_connect(ws->socket);
+  if(!ws->display) {
+    g_debug("can't connect to %s", ws->socket);
+    return FALSE;
+  }
+
+  // no roundtrips, the answers are handled in wayland_server_event. the sync
+  // is answered after the globals, so a missing manager is noticed there
+  ws->registry = wl_display_get_registry(ws->display);
+  wl_registry_add_listener(ws->registry, &registry_listener, ws);
+  ws->sync = wl_display_sync(ws->display);
+  wl_callback_add_listener(ws->sync, &sync_listener, ws);
+  if(wl_display_flush(ws->display) == -1 && errno != EAGAIN) {
+    close_connection(ws);
+    return FALSE;
+  }
+
+  channel = g_io_channel_unix_new(wl_display_get_fd(ws->display));
+  ws->watch = g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                             wayland_server_event, ws);
+  g_io_channel_unref(channel);
+
+  g_message("wayland compositor observation active: %s", ws->socket);
+  return TRUE;
+}
+
+// reconnects lost compositors, but not more often than RETRY_TIMEOUT
+static void test_connection(struct wayland_server *ws) {
+  if(ws->display)
+    return;
+  if(ws->last_try && ws->last_try + RETRY_TIMEOUT > time(NULL))
+    return;
+  create_connection(ws);
+}
+
+// returns the first value of an environment variable of the user
+static gchar *get_user_env(uid_t uid, const char *name) {
+  GPtrArray *values = search_user_env(uid, name, FALSE);
+  gchar *rv = NULL;
+
+  if(values->len)
+    rv = g_strdup(g_ptr_array_index(values, 0));
+  g_ptr_array_unref(values);
+  return rv;
+}
+
+// builds the socket path like libwayland does for the user
+static gchar *get_wayland_socket(uid_t uid) {
+  gchar *display, *runtime, *rv;
+
+  display = get_user_env(uid, "WAYLAND_DISPLAY");
+  if(!display)
+    return NULL;
+  if(display[0] == '/')
+    return display;
+
+  runtime = get_user_env(uid, "XDG_RUNTIME_DIR");
+  if(!runtime)
+    runtime = g_strdup_printf("/run/user/%d", uid);
+  rv = g_build_filename(runtime, display, NULL);
+  g_free(runtime);
+  g_free(display);
+  return rv;
+}
+
+static struct wayland_server *find_server(uid_t uid) {
+  GList *cur;
+
+  for(cur = server_list; cur; cur = g_list_next(cur)) {
+    if(((struct wayland_server *)cur->data)->uid == uid)
+      return cur->data;
+  }
+  return NULL;
+}
+
+static int has_session(uid_t uid) {
+  GList *cur;
+
+  for(cur = U_session_list; cur; cur = g_list_next(cur)) {
+    if(((u_session *)cur->data)->uid == uid)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// returns TRUE if a compositor should be retried later
+static int sync_servers() {
+  GList *cur, *next;
+  struct wayland_server *ws;
+  gchar *socket;
+  uid_t uid;
+  int missing = FALSE;
+
+  // remove compositors of users without session or a changed socket
+  for(cur = server_list; cur; cur = next) {
+    next = g_list_next(cur);
+    ws = cur->data;
+    socket = has_session(ws->uid) ? get_wayland_socket(ws->uid) : NULL;
+    if(!socket || strcmp(socket, ws->socket)) {
+      server_list = g_list_delete_link(server_list, cur);
+      free_wayland_server(ws);
+    }
+    g_free(socket);
+  }
+
+  for(cur = U_session_list; cur; cur = g_list_next(cur)) {
+    uid = ((u_session *)cur->data)->uid;
+    if(find_server(uid))
+      continue;
+    socket = get_wayland_socket(uid);
+    if(!socket) {
+      // the compositor of a new session may not run yet, or it is no
+      // wayland session at all
+      if(retry_new > 0)
+        missing = TRUE;
+      continue;
+    }
+    ws = g_slice_new0(struct wayland_server);
+    ws->uid = uid;
+    ws->socket = socket;
+    server_list = g_list_append(server_list, ws);
+  }
+
+  for(cur = server_list; cur; cur = g_list_next(cur)) {
+    ws = cur->data;
+    test_connection(ws);
+    if(!ws->display)
+      missing = TRUE;
+  }
+  return missing;
+}
+
+// runs while compositors are lost or new sessions have none yet
+static gboolean retry_connections(gpointer data) {
+  if(retry_new > 0)
+    retry_new--;
+  if(sync_servers())
+    return TRUE;
+  retry_source = 0;
+  return FALSE;
+}
+
+static void schedule_retry() {
+  if(!retry_source)
+    retry_source = g_timeout_add_seconds(RETRY_TIMEOUT, retry_connections, NULL);
+}
+
+static gboolean update_all_server(gpointer data) {
+  if(sync_servers())
+    schedule_retry();
+  return TRUE;
+}
+
+static void sessions_changed(gpointer data) {
+  // the session is reported before its compositor runs
+  retry_new = RETRY_NEW_SESSION;
+  update_all_server(NULL);
+}
+
+int wlrwatch_init() {
+  GError *error = NULL;
+  int interval;
+
+  wlrwatch_id = active_agent_register("wlrwatch");
+
+  interval = g_key_file_get_integer(config_data, "wlrwatch", "sync_interval", &error);
+  if(error && error->code) {
+    interval = DEFAULT_SYNC_INTERVAL;
+    g_error_free(error);
+  }
+  // new and removed sessions are reported, the sync interval is a fallback
+  u_session_add_listener(sessions_changed, NULL);
+  if(interval > 0)
+    g_timeout_add_seconds(interval, update_all_server, NULL);
+  update_all_server(NULL);
+  g_message("wayland compositor observation active. session sync interval: %ds", interval);
+  return 0;
+}
@@ -46,8 +46,11 @@
 
 
 
-#define DEFAULT_INTERVAL 1000
+// sessions are synced on consolekit changes, no periodic sync by default
+#define DEFAULT_SYNC_INTERVAL 0
 #define RETRY_TIMEOUT 30
+// maximum number of window -> pid mappings kept per server
+#define WINDOW_CACHE_SIZE 512
 
 struct x_server {
   char *name; // unique name for identification
@@ -62,17 +65,37 @@ struct x_server {
   xcb_atom_t window_atom;
   xcb_atom_t cardinal_atom;
   xcb_atom_t string_atom;
+  guint watch;             // main loop source watching the connection
+  GHashTable *pid_cache;   // window -> pid, 0 for windows of other hosts,
+                           // dropped on DestroyNotify of the window
 };
 
-static void free_x_server(struct x_server *xs) {
-  g_debug("remove x_server display: %s", xs->display);
+// disconnect from the x server and stop watching the connection
+static void close_connection(struct x_server *xs) {
+  if(xs->watch) {
+      g_source_remove(xs->watch);
+      xs->watch = 0;
+  }
   if(xs->connection)
       xcb_disconnect (xs->connection);
+  xs->connection = NULL;
+  xs->screen = NULL;
+  if(xs->pid_cache)
+      g_hash_table_remove_all(xs->pid_cache);
+}
+
+static int xwatch_id; // unique plugin id
+
+static void free_x_server(struct x_server *xs) {
+  g_debug("remove x_server display: %s", xs->display);
+  close_connection(xs);
+  active_agent_release(xs->uid, xwatch_id);
+  if(xs->pid_cache)
+      g_hash_table_destroy(xs->pid_cache);
   g_free(xs->name);
   g_free(xs->display);
 }
 
-static int xwatch_id; // unique plugin id
 static GList *server_list = NULL;  // list of x_server objects
 static char *localhost; // char of localhost
 
@@ -134,6 +157,10 @@ get_localhost()
   return buf;
 }
 
+static gboolean x_server_event(GIOChannel *source, GIOCondition condition,
+                               gpointer data);
+static void update_active(struct x_server *xs);
+
 int create_connection(struct x_server *xs) {
   int  screenNum, i, dsp, parsed = 0;
   char *host;
@@ -166,7 +193,7 @@ int create_connection(struct x_server *xs) {
   pw = getpwuid(xs->uid);
   save_home = g_strdup(getenv("HOME"));
   save_xauth = g_strdup(getenv("XAUTHORITY"));
-  xauthptr = search_user_env(xs->uid, "XAUTHORITY", TRUE);
+  xauthptr = search_user_env(xs->uid, "XAUTHORITY", FALSE);
 
   setenv("HOME", pw->pw_dir, 1);
   unsetenv("XAUTHORITY");
@@ -254,6 +281,24 @@ int create_connection(struct x_server *xs) {
   xs->cardinal_atom = get_atom (xs->connection, cardinal_ck);
   xs->string_atom = get_atom (xs->connection, string_ck);
 
+  // get notified when the window manager changes _NET_ACTIVE_WINDOW instead
+  // of polling it
+  uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+  xcb_change_window_attributes (xs->connection, xs->screen->root,
+                                XCB_CW_EVENT_MASK, &mask);
+  xcb_flush (xs->connection);
+
+  GIOChannel *channel = g_io_channel_unix_new (xcb_get_file_descriptor (xs->connection));
+  xs->watch = g_io_add_watch (channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                              x_server_event, xs);
+  g_io_channel_unref (channel);
+
+  if(!xs->pid_cache)
+    xs->pid_cache = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  // the active window may have been set before we connected
+  update_active(xs);
+
   return TRUE;
 
 error:
@@ -282,9 +327,7 @@ int test_connection(struct x_server *xs) {
 
     if(xs->connection) {
         if(xcb_connection_has_error(xs->connection)) {
-            xcb_disconnect(xs->connection);
-            xs->connection = NULL;
-            xs->screen = NULL;
+            close_connection(xs);
             g_debug("got connection problems. disconnectd %s", xs->display);
         } else {
           return TRUE;
@@ -342,80 +385,72 @@ struct x_server *add_connection(const char *name, uid_t uid, const char *display
   return nc;
 }
 
-pid_t read_pid(struct x_server *conn, int *err) {
-  xcb_generic_error_t *error;
-  *err = 0;
+/*
+ * reads the pid of a window. the _NET_WM_PID and WM_CLIENT_MACHINE requests
+ * are sent together, so they cost a single round trip. results are cached
+ * per window, windows of other hosts are cached with pid 0.
+ */
+static pid_t read_window_pid(struct x_server *conn, xcb_window_t win, int *err) {
+  xcb_generic_error_t *error = NULL, *error2 = NULL;
+  gpointer cached;
   pid_t rv = 0;
 
-  dprint("dsp: %s xs: %p conn: %p\n", conn->display, conn, conn->connection);
-
-  xcb_get_property_cookie_t naw =
-    xcb_get_property (conn->connection,
-                      0,
-                      conn->screen->root,
-                      conn->atom_active,
-                      conn->window_atom,
-                      0,
-                      1);
-
-  xcb_get_property_reply_t *rep =
-    xcb_get_property_reply (conn->connection,
-                          naw,
-                          &error);
-
-  if(!rep || !xcb_get_property_value_length(rep))
-    return 0;
+  *err = 0;
 
-  dprint("len: %d ", xcb_get_property_value_length (rep));
-  uint32_t *win = xcb_get_property_value(rep);
-  dprint("win: 0x%x\n", *win);
-  g_free(rep);
+  if(conn->pid_cache &&
+     g_hash_table_lookup_extended(conn->pid_cache, GUINT_TO_POINTER(win),
+                                  NULL, &cached)) {
+    rv = GPOINTER_TO_UINT(cached);
+    // window ids get reused, so a stale pid is looked up again
+    if(!rv || proc_by_pid(rv))
+      return rv;
+    g_hash_table_remove(conn->pid_cache, GUINT_TO_POINTER(win));
+    rv = 0;
+  }
 
   xcb_get_property_cookie_t caw =
     xcb_get_property (conn->connection,
                     0,
-                    *win,
+                    win,
                     conn->atom_pid,
                     conn->cardinal_atom,
                     0,
                     1);
 
-  xcb_get_property_reply_t *rep2 =
-    xcb_get_property_reply (conn->connection,
-                        caw,
-                        &error);
-
-  if((error && error->response_type == 0) || 
-     !rep2 || !xcb_get_property_value_length(rep2)) {
-    g_free(rep2);
-    goto error;
-  }
-
-  dprint("len: %d ", xcb_get_property_value_length (rep2));
-  uint32_t *pid = xcb_get_property_value(rep2);
-  dprint("pid: %d\n", *pid);
-  g_free(rep2);
-
   xcb_get_property_cookie_t ccaw =
     xcb_get_property (conn->connection,
                   0,
-                  *win,
+                  win,
                   conn->atom_client,
                   conn->string_atom,
                   0,
                   strlen(localhost));
 
-  xcb_get_property_reply_t *rep3 =
+  xcb_get_property_reply_t *rep2 =
     xcb_get_property_reply (conn->connection,
-                        ccaw,
+                        caw,
                         &error);
 
-  if((error && error->response_type == 0) ||
-    !rep3 || !xcb_get_property_value_length(rep3)) {
+  xcb_get_property_reply_t *rep3 =
+    xcb_get_property_reply (conn->connection,
+                        ccaw,
+                        &error2);
+
+  if(error || !rep2 || !xcb_get_property_value_length(rep2) ||
+     error2 || !rep3 || !xcb_get_property_value_length(rep3)) {
+    if(!error)
+      error = error2;
+    else
+      free(error2);
+    g_free(rep2);
     g_free(rep3);
     goto error;
   }
 
+  dprint("len: %d ", xcb_get_property_value_length (rep2));
+  uint32_t *pid = xcb_get_property_value(rep2);
+  dprint("pid: %d\n", *pid);
+
   char *client =  xcb_get_property_value(rep3);
 #ifdef DEBUG_XWATCH
   char *tmp = g_strndup(xcb_get_property_value(rep3), xcb_get_property_value_length(rep3));
@@ -426,26 +461,178 @@ pid_t read_pid(struct x_server *conn, int *err) {
     rv = *pid;
   }
 
+  g_free(rep2);
   g_free(rep3);
 
+  if(conn->pid_cache) {
+    uint32_t mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+
+    if(g_hash_table_size(conn->pid_cache) >= WINDOW_CACHE_SIZE)
+      g_hash_table_remove_all(conn->pid_cache);
+    g_hash_table_insert(conn->pid_cache, GUINT_TO_POINTER(win),
+                        GUINT_TO_POINTER(rv));
+    // window ids are reused, so forget the window when it is destroyed
+    xcb_change_window_attributes (conn->connection, win,
+                                  XCB_CW_EVENT_MASK, &mask);
+    xcb_flush (conn->connection);
+  }
+
   return rv;
 error:
-  // error in connection. free x_server connection
-  if(error && error->response_type == 0 && error->error_code == 3)
+  // windows without the properties are no error
+  if(!error || error->error_code == 3) {
+    free(error);
     return 0;
+  }
+  // error in connection. free x_server connection
   *err = 1;
-  if(error)
-    g_debug("xcb error: %d %d\n", error->response_type, error->error_code);
+  g_debug("xcb error: %d %d\n", error->response_type, error->error_code);
+  free(error);
   return 0;
 }
 
+pid_t read_pid(struct x_server *conn, int *err) {
+  xcb_generic_error_t *error = NULL;
+  xcb_window_t win;
+  *err = 0;
+
+  dprint("dsp: %s xs: %p conn: %p\n", conn->display, conn, conn->connection);
+
+  xcb_get_property_cookie_t naw =
+    xcb_get_property (conn->connection,
+                      0,
+                      conn->screen->root,
+                      conn->atom_active,
+                      conn->window_atom,
+                      0,
+                      1);
+
+  xcb_get_property_reply_t *rep =
+    xcb_get_property_reply (conn->connection,
+                          naw,
+                          &error);
+
+  if(error) {
+    *err = 1;
+    free(error);
+    g_free(rep);
+    return 0;
+  }
+
+  if(!rep || !xcb_get_property_value_length(rep)) {
+    g_free(rep);
+    return 0;
+  }
+
+  dprint("len: %d ", xcb_get_property_value_length (rep));
+  win = *(xcb_window_t *)xcb_get_property_value(rep);
+  dprint("win: 0x%x\n", win);
+  g_free(rep);
+
+  if(!win)
+    return 0;
+
+  return read_window_pid(conn, win, err);
+}
+
+/*
+ * returns if xwatch tracks the active processes of the user of the server.
+ * we take over the active pid if noone is doing it.
+ */
+static int is_active_agent(struct x_server *xs) {
+  return active_agent_claim(xs->uid, xwatch_id);
+}
+
+// reads the active window of a server and marks its process active
+static void update_active(struct x_server *xs) {
+  pid_t pid;
+  int error = 0;
+
+  if(!xs->connection || !is_active_agent(xs))
+    return;
+
+  pid = read_pid(xs, &error);
+
+  if(pid && error == 0) {
+    //printf ("current uid: %d pid: %d\n", xs->uid, pid);
+    set_active_pid_debounced(xs->uid, pid);
+  }
+}
+
+static guint retry_source = 0;
+
+// reconnects lost servers. only scheduled while one is lost, so connected
+// servers cause no wakeups
+static gboolean retry_connections(gpointer data) {
+  GList *cur;
+  struct x_server *xs;
+  int lost = FALSE;
+
+  for(cur = server_list; cur; cur = g_list_next(cur)) {
+    xs = cur->data;
+    if(xs->connection || !is_active_agent(xs))
+      continue;
+    test_connection(xs);
+    if(!xs->connection)
+      lost = TRUE;
+  }
+  if(lost)
+    return TRUE;
+  retry_source = 0;
+  return FALSE;
+}
+
+static void schedule_retry() {
+  if(!retry_source)
+    retry_source = g_timeout_add_seconds(RETRY_TIMEOUT, retry_connections, NULL);
+}
+
+// called from the main loop when the x server sent something
+static gboolean x_server_event(GIOChannel *source, GIOCondition condition,
+                               gpointer data) {
+  struct x_server *xs = data;
+  xcb_generic_event_t *ev;
+  int changed;
+
+  do {
+    changed = FALSE;
+    // reading replies may queue new events, so poll until nothing changed
+    while((ev = xcb_poll_for_event(xs->connection))) {
+      switch(ev->response_type & ~0x80) {
+        case XCB_PROPERTY_NOTIFY:
+          if(((xcb_property_notify_event_t *)ev)->atom == xs->atom_active)
+            changed = TRUE;
+          break;
+        case XCB_DESTROY_NOTIFY:
+          if(xs->pid_cache)
+            g_hash_table_remove(xs->pid_cache,
+                GUINT_TO_POINTER(((xcb_destroy_notify_event_t *)ev)->window));
+          break;
+      }
+      free(ev);
+    }
+
+    if(xcb_connection_has_error(xs->connection)) {
+      g_debug("got connection problems. disconnectd %s", xs->display);
+      // the source is removed by returning FALSE
+      xs->watch = 0;
+      close_connection(xs);
+      schedule_retry();
+      return FALSE;
+    }
+
+    if(changed)
+      update_active(xs);
+  } while(changed);
+
+  return TRUE;
+}
 
 
 #ifndef TEST_XWATCH
 
 static gboolean update_all_server(gpointer data) {
   GList *cur;
-  pid_t pid;
   int i;
   u_session *sess;
   GList *csess;
@@ -494,39 +681,27 @@ static gboolean update_all_server(gpointer data) {
     csess = g_list_next(csess);
   }
 
-  int error = 0;
+  // active windows are tracked by events. here we only reconnect lost
+  // servers, which reads the active window again
   cur = server_list;
   while(cur) {
-    struct x_server *xs = cur->data;
-    struct user_active *ua = get_userlist(xs->uid, TRUE);
-
-    // we take over the active pid if noone is doing it
-    if(ua->active_agent == USER_ACTIVE_AGENT_NONE)
-        ua->active_agent = xwatch_id;
-
-    // test if another agent is doing the active pid
-    if(ua->active_agent != xwatch_id) {
-        cur = g_list_next(cur);
-        continue;
-    }
-
-    // if we can't connect, skip
-    if(!test_connection(xs)) {
-      cur = g_list_next(cur);
-      continue;
-    }
-
-    pid = read_pid(xs, &error);
-
-    if(pid && error == 0) {
-      //printf ("current uid: %d pid: %d\n", xs->uid, pid);
-      set_active_pid(xs->uid, pid);
+    xs = cur->data;
+    if((!xs->connection || xcb_connection_has_error(xs->connection)) &&
+       is_active_agent(xs)) {
+      test_connection(xs);
+      if(!xs->connection)
+        schedule_retry();
     }
-
     cur = g_list_next(cur);
   }
   return TRUE;
 }
+
+static void sessions_changed(gpointer data) {
+  // the consolekit signal may arrive before the x server accepts clients,
+  // failed connections are retried
+  update_all_server(NULL);
+}
 #endif
 
 int xwatch_init() {
@@ -535,14 +710,18 @@ int xwatch_init() {
     g_warning("can't find localhost name\n");
     return 0;
   }
-  xwatch_id = get_plugin_id();
+  xwatch_id = active_agent_register("xwatch");
 #ifndef TEST_XWATCH
   GError *error = NULL;
-  int interval = g_key_file_get_integer(config_data, "xwatch", "poll_interval", &error);
+  int interval = g_key_file_get_integer(config_data, "xwatch", "sync_interval", &error);
   if(error && error->code)
-    interval = DEFAULT_INTERVAL;
-  g_timeout_add(interval, update_all_server, NULL);
-  g_message("x server observation active. poll interval: %d", interval);
+    interval = DEFAULT_SYNC_INTERVAL;
+  // new and removed sessions are reported, the sync interval is a fallback
+  u_session_add_listener(sessions_changed, NULL);
+  if(interval > 0)
+    g_timeout_add_seconds(interval, update_all_server, NULL);
+  update_all_server(NULL);
+  g_message("x server observation active. session sync interval: %ds", interval);
 #endif
   return 0;
 }
@@ -66,12 +66,7 @@ BottleNeck = {
 
   set_scheduler = function(self, dev, scheduler)
     local path = ulatency.mountpoints["sysfs"] .. "/block/" .. dev .. "/queue/scheduler"
-    local fp = io.open(path, "w")
-    if not fp then
-      return
-    end
-    fp:write(tostring(scheduler))
-    fp:close()
+    ulatency.write_async(path, tostring(scheduler))
   end,
 
   set_isolation = function(self, dev, value)
@@ -81,20 +76,11 @@ BottleNeck = {
     ulatency.log_debug("IO: set group isolation on dev "..dev.." to "..tostring(value))
     self.last_set[dev] = value
     local path = ulatency.mountpoints["sysfs"] .. "/block/" .. dev .. "/queue/iosched/group_isolation"
-    local fp = io.open(path, "w")
-    if not fp then
-      return
-    end
-    fp:write(tostring(value))
-    fp:close()
+    ulatency.write_async(path, tostring(value))
   end,
 
-  parse_data = function(self)
-    fp = io.open("/proc/diskstats", "r")
-    if not fp then
-      return
-    end
-    for line in fp:lines() do
+  parse_data = function(self, data)
+    for line in string.gmatch(data, "[^\n]+") do
       local chunks = string.split(line, " ")
       self:add_entry(chunks)
     end
@@ -120,9 +106,18 @@ BottleNeck = {
   end,
 
   iterate = function(self)
-    -- called from timeout function
-    self:parse_data()
-    self:decide()
+    -- called from timeout function. a slow read must not pile up requests
+    if self.reading then
+      return
+    end
+    self.reading = true
+    ulatency.read_async(ulatency.proc_root .. "/proc/diskstats", function(data)
+      self.reading = false
+      if data then
+        self:parse_data(data)
+        self:decide()
+      end
+    end)
   end
 
 }
@@ -94,28 +94,19 @@ ProtectorMemory = {
       ulatency.add_flag(flag)
     end
 
-    return true
-  end,
-  check = function(self, proc)
-    self.poison_groups[proc.pgrp] = (self.poison_groups[proc.pgrp] or 0) + proc.vm_rss
-    self.targets[#self.targets+1] = proc
-    table.sort(self.targets, 
-               function(a, b)
-                if a.is_invalid or b.is_invalid then
-                  return false
-                end
-                return a.rss > b.rss
-               end)
-    self.targets[max_targets+1] = nil
-
+    -- the targets come from scans over the hot fields of all processes,
+    -- so the processes are not walked one by one
+    self.targets = ulatency.top_processes("rss", max_targets)
     if target_max_rss then
-      if proc.rss >= target_max_rss then
-        self.sure_targets[#self.sure_targets+1] = proc
-      end
+      self.sure_targets = ulatency.processes_above("rss", target_max_rss)
     end
-    return 0
+    -- keyed by proc.pgrp, the fake pgrp of a process if the rules set one
+    self.poison_groups = ulatency.sum_processes("vm_rss", "pgrp")
+    self:poison()
+    -- nothing left to do per process
+    return false
   end,
-  postcheck = function(self)
+  poison = function(self)
     --pprint(self.targets)
     --pprint(self.sure_targets)
     --pprint(self.poison_groups)
@@ -155,7 +146,6 @@ ProtectorMemory = {
         proc:add_flag(flag)
       end
     end
-    rv = ulatency.filter_rv(ulatency.FILTER_STOP)
   end,
   
 }
@@ -157,9 +157,11 @@ function Scheduler:all()
   self:update_caches()
 
   ulatency.log_debug("scheduler filter:".. tostring(self.C_FILTER))
+  local reason = self.C_FILTER and ulatency.SCHEDULED_ITERATION or ulatency.SCHEDULED_FULL
+  self.REPORT = ulatency.has_scheduled_listeners()
   for k,proc in ipairs(ulatency.list_processes(self.C_FILTER)) do
     --print("sched", proc, proc.cmdline)
-    self:one(proc, false)
+    self:_one(proc, false, nil, reason)
   end
   self.C_FILTER = true
   self.ITERATION = self.ITERATION + 1
@@ -191,16 +193,79 @@ function Scheduler:load_config(name)
   return true
 end
 
+-- the tables are shared snapshots, valid until the main loop runs again.
+-- don't modify them
 function Scheduler:update_caches()
   Scheduler.meminfo = ulatency.get_meminfo()
   Scheduler.vminfo = ulatency.get_vminfo()
 end
 
 function Scheduler:one(proc)
-  return self:_one(proc, true)
+  self.REPORT = ulatency.has_scheduled_listeners()
+  return self:_one(proc, true, nil, ulatency.SCHEDULED_SINGLE)
 end
 
-function Scheduler:_one(proc, single)
+-- queues the decision for the ProcessScheduled signal and the status file.
+-- the daemon remembers the last group per subsystem to mark changes
+local function report_scheduled(proc, subsys, group, reason)
+  ulatency.report_scheduled(proc.pid, subsys, group.name, reason)
+end
+
+-- a focus change only flips the active state of a process. the groups it was
+-- mapped to are remembered per active state, so flipping back to a state
+-- seen before skips the mapping. any other change of the process, a change
+-- of the system flags (ie. pressure or emergency) or a full run forgets them.
+local function active_state(proc)
+  local pos = proc.active_pos
+  if pos > 1 then
+    return 2
+  end
+  return pos
+end
+
+local function remember_targets(proc, targets, reason)
+  local known = proc.data.sched_targets
+  local generation = ulatency.get_flags_generation()
+  if not known or proc.changed ~= 0 or reason == ulatency.SCHEDULED_FULL or
+     known.flags ~= generation then
+    known = {flags = generation}
+    proc.data.sched_targets = known
+  end
+  known[active_state(proc)] = targets
+end
+
+-- moves a process into the remembered groups of its active state.
+-- returns false if it has to go through the mapping
+function Scheduler:_focus_one(proc, pending)
+  local known = proc.data.sched_targets
+  local targets = known and known[active_state(proc)]
+  if not targets or proc.changed ~= 0 or proc.block_scheduler ~= 0 or
+     known.flags ~= ulatency.get_flags_generation() then
+    return false
+  end
+  for subsys, group in pairs(targets) do
+    if CGroup.get_group(subsys.."/"..group.name) ~= group then
+      -- removed by the cleanup meanwhile
+      return false
+    end
+  end
+  local tasks = proc:get_current_task_pids(true)
+  if not tasks then
+    return true
+  end
+  for subsys, group in pairs(targets) do
+    group:run_adjust(proc)
+    group:add_task_list(proc.pid, tasks)
+    if self.REPORT then
+      report_scheduled(proc, subsys, group, ulatency.SCHEDULED_FOCUS)
+    end
+    pending[group] = true
+  end
+  return true
+end
+
+function Scheduler:_one(proc, single, pending, reason)
+  local targets = {}
   if not self.MAPPING then
     self:load_config()
   end
@@ -225,27 +290,76 @@ function Scheduler:_one(proc, single)
         --pprint(mappings)
         --print(tostring(proc.pid) .. " : ".. tostring(group))
         if group then
-          if group:is_dirty() then
+          if group:is_dirty() and not pending then
             group:commit()
           end
           --print("add task", proc.pid, group)
           -- get_current_tasks can fail if the process is already dead
           local tasks = proc:get_current_task_pids(true)
           if tasks then
+            targets[subsys] = group
             group:add_task_list(proc.pid, tasks)
-            group:commit()
+            if self.REPORT then
+              report_scheduled(proc, subsys, group, reason or 0)
+            end
+            if pending then
+              pending[group] = true
+            else
+              group:commit()
+            end
           end
         else
           ulatency.log_debug("no group found for: "..tostring(proc).." subsystem:"..tostring(subsys))
         end
       end
     end
+    remember_targets(proc, targets, reason)
     proc:clear_changed()
     --pprint(build_path_parts(proc, res))
   end
   return true
 end
 
+-- schedules a list of processes at once. all processes are mapped first and
+-- every target cgroup is written once afterwards, instead of opening the
+-- tasks file for each process.
+function Scheduler:many(procs, reason)
+  local pending = {}
+  self.REPORT = ulatency.has_scheduled_listeners()
+  self:update_caches()
+  for i, proc in ipairs(procs) do
+    self:_one(proc, false, pending, reason or ulatency.SCHEDULED_REQUEST)
+  end
+  for cgr, _ in pairs(pending) do
+    cgr:commit()
+  end
+  return true
+end
+
+-- fast path for focus changes. group holds the processes of the focused
+-- process group and of the one that lost the focus. processes unchanged
+-- since their last scheduling go to the groups remembered for their new
+-- active state, the others run through the mapping. every target group is
+-- written once at the end.
+function Scheduler:focus(proc, group)
+  local pending = {}
+  local caches = false
+  self.REPORT = ulatency.has_scheduled_listeners()
+  for i, member in ipairs(group) do
+    if not self:_focus_one(member, pending) then
+      if not caches then
+        self:update_caches()
+        caches = true
+      end
+      self:_one(member, false, pending, ulatency.SCHEDULED_FOCUS)
+    end
+  end
+  for cgr, _ in pairs(pending) do
+    cgr:commit()
+  end
+  return true
+end
+
 function Scheduler:list_configs()
   rv = {}
   for k,v in pairs(getfenv()) do
@@ -0,0 +1,32 @@
+#!/bin/sh
+# syscalls of a full process update with and without the io_uring engine
+#
+# runs the daemon with tests/bench_proc_io.lua under strace, once without
+# update rounds and once with $ROUNDS, so the startup calls cancel out.
+# prints the open, read, close and io_uring_enter calls per round.
+#
+#   sudo scripts/bench_proc_io.sh [rounds]
+
+ROUNDS=${1:-5}
+DAEMON=${DAEMON:-src/ulatencyd}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+count() {
+  env BENCH_MODE=$1 BENCH_ROUNDS=$2 \
+    strace -f -c -o "$OUT/$1.$2" -e trace=open,openat,read,close,io_uring_enter \
+    "$DAEMON" -r tests --rule-pattern bench_proc_io.lua > /dev/null 2>&1
+  # calls is the 4th column, the errors column is empty for calls that never
+  # failed. the total line has no usecs/call, it is summed up again below
+  awk '$1 ~ /^[0-9.]+$/ && $NF != "total" { print $NF, $4 }' "$OUT/$1.$2"
+}
+
+for mode in read uring; do
+  count $mode 0 > "$OUT/base"
+  count $mode $ROUNDS > "$OUT/run"
+  printf '%-10s' $mode
+  awk -v rounds=$ROUNDS '
+    NR == FNR { base[$1] = $2; next }
+    { n = ($2 - base[$1]) / rounds; sum += n; printf " %s=%.0f", $1, n }
+    END { printf " total=%.0f per round\n", sum }' "$OUT/base" "$OUT/run"
+done
@@ -0,0 +1,184 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  asynchronous file io
+
+  reads and writes of /proc, /sys and cgroup files are done by a helper
+  thread, so a kernel holding a lock on them does not stall the main loop.
+  the results are handed back to the main loop, where the done callback runs.
+  there is only one worker, so requests finish in the order they were queued.
+*/
+
+#include "config.h"
+#include "ulatency.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <unistd.h>
+
+#define ASYNC_READ_CHUNK 4096
+
+static GThreadPool *async_pool = NULL;
+
+static void async_req_free(u_async_req *req) {
+  g_free(req->path);
+  if(req->chunks)
+    g_ptr_array_free(req->chunks, TRUE);
+  if(req->data)
+    g_string_free(req->data, TRUE);
+  g_slice_free(u_async_req, req);
+}
+
+// runs in the main loop
+static gboolean async_finish(gpointer data) {
+  u_async_req *req = data;
+
+  if(req->done)
+    req->done(req);
+  async_req_free(req);
+  return FALSE;
+}
+
+static void async_do_read(u_async_req *req) {
+  int fd;
+  gsize used;
+  ssize_t len;
+
+  fd = open(req->path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1) {
+    req->error = errno;
+    return;
+  }
+  req->data = g_string_sized_new(ASYNC_READ_CHUNK);
+  while(TRUE) {
+    used = req->data->len;
+    g_string_set_size(req->data, used + ASYNC_READ_CHUNK);
+    len = read(fd, req->data->str + used, ASYNC_READ_CHUNK);
+    if(len < 0 && errno == EINTR) {
+      g_string_set_size(req->data, used);
+      continue;
+    }
+    if(len < 0)
+      req->error = errno;
+    g_string_set_size(req->data, used + MAX(len, 0));
+    if(len <= 0)
+      break;
+  }
+  close(fd);
+}
+
+static void async_do_write(u_async_req *req) {
+  int fd, i;
+  const char *chunk;
+
+#ifdef HAVE_IO_URING
+  if(u_uring_write(req->path, req->chunks, &req->error))
+    return;
+#endif
+  fd = open(req->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd == -1) {
+    req->error = errno;
+    return;
+  }
+  // every chunk is a single write, cgroup tasks files take one pid per write.
+  // a failing chunk, ie. of a dead pid, does not stop the others
+  for(i = 0; i < req->chunks->len; i++) {
+    chunk = g_ptr_array_index(req->chunks, i);
+    if(write(fd, chunk, strlen(chunk)) == -1)
+      req->error = errno;
+  }
+  close(fd);
+}
+
+static void async_worker(gpointer data, gpointer user_data) {
+  u_async_req *req = data;
+
+  if(req->type == U_ASYNC_READ)
+    async_do_read(req);
+  else
+    async_do_write(req);
+  g_idle_add(async_finish, req);
+}
+
+static void async_queue(u_async_req *req) {
+  if(async_pool) {
+    g_thread_pool_push(async_pool, req, NULL);
+  } else {
+    // no thread, do it now but still report from the main loop
+    async_worker(req, NULL);
+  }
+}
+
+/**
+ * start the io helper thread
+ *
+ * @return TRUE if requests are handled by the thread
+ */
+int u_async_init() {
+  GError *error = NULL;
+
+  async_pool = g_thread_pool_new(async_worker, NULL, 1, FALSE, &error);
+  if(!async_pool) {
+    g_warning("async io: can't create worker: %s. io will block",
+              error ? error->message : "unknown");
+    g_clear_error(&error);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * read a file in the background
+ * @arg path file to read
+ * @arg done called in the main loop with the content in data or error set
+ * @arg user_data passed in the request
+ */
+void u_async_read(const char *path, u_async_done done, gpointer user_data) {
+  u_async_req *req = g_slice_new0(u_async_req);
+
+  req->type = U_ASYNC_READ;
+  req->path = g_strdup(path);
+  req->done = done;
+  req->user_data = user_data;
+  async_queue(req);
+}
+
+/**
+ * write a file in the background
+ * @arg path file to write, it is truncated like io.open(path, "w") does
+ * @arg chunks #GPtrArray of strings, each one written by a single write().
+ * the array is owned by the request afterwards and must free its elements
+ * @arg done optional callback, called in the main loop with error set on
+ * failure
+ * @arg user_data passed in the request
+ */
+void u_async_write(const char *path, GPtrArray *chunks, u_async_done done,
+                   gpointer user_data) {
+  u_async_req *req = g_slice_new0(u_async_req);
+
+  req->type = U_ASYNC_WRITE;
+  req->path = g_strdup(path);
+  req->chunks = chunks;
+  req->done = done;
+  req->user_data = user_data;
+  async_queue(req);
+}
@@ -27,6 +27,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 #include <fcntl.h>
 #include <glib.h>
 #include <stdio.h>
@@ -57,24 +58,49 @@ static double _last_percent;
 // flag list of system wide flags
 GList *system_flags;
 int    system_flags_changed;
+// unlike system_flags_changed it is never reset, so results computed under
+// some system flags can tell if they are still valid
+guint  system_flags_generation;
 // delay rules execution
 static long int delay;
-static GPtrArray *delay_stack;
 
 // profiling timers
 struct u_timer timer_filter;
 struct u_timer timer_scheduler;
 struct u_timer timer_parse;
 
+// statistics of partial process updates
+struct u_proc_read_stats U_proc_read_stats;
+
+// per process history
+#define HISTORY_LEN_DEFAULT 10
+#define HISTORY_RATE_TAU 30.0 // secs, time constant of cpu_rate and io_rate
+static guint history_len;
 
 
 // delay new processes
+// new processes wait in a hashed timing wheel until they are older then delay.
+// delay_index maps pid -> #delay_proc, so lookup and removal need no scan.
+
+#define DELAY_WHEEL_SLOTS 64
 
 struct delay_proc {
-	struct timespec when;
+	gint64  when;     // monotonic time in ms the process was added
 	u_proc  *proc;
+	guint   slot;     // slot in delay_wheel
+	GList   *link;    // link in the slot queue
 };
 
+static GQueue delay_wheel[DELAY_WHEEL_SLOTS];
+static GHashTable *delay_index;
+static guint delay_cursor;      // slot processed last
+static gint64 delay_last;       // time delay_cursor was reached
+static guint delay_ticks;       // number of slots a process waits
+static guint delay_tick_ms;     // length of one slot
+static guint delay_source;      // id of the pending timeout or 0
+
+static void delay_clear();
+
 
 double get_last_load() {
   return _last_load;
@@ -143,6 +169,10 @@ static void u_proc_remove_child_nodes(u_proc *proc) {
 }
 
 
+static void delay_proc_free(gpointer data) {
+  g_slice_free(struct delay_proc, data);
+}
+
 /**
  * remove pid from delay stack
  * @arg pid #pid_t pid
@@ -153,18 +183,14 @@ static void u_proc_remove_child_nodes(u_proc *proc) {
  */
 
 static void remove_proc_from_delay_stack(pid_t pid) {
-  int i = 0;
   struct delay_proc *cur;
 
-  for(i = 0; i < delay_stack->len;) {
-      cur = g_ptr_array_index(delay_stack, i);
-      if(cur->proc->pid == pid) {
-          u_trace("remove delay %d %d:%d", pid, i, delay_stack->len);
-          g_ptr_array_remove_index_fast(delay_stack, i);
-      } else {
-        i++;
-      }
-  }
+  cur = g_hash_table_lookup(delay_index, GUINT_TO_POINTER(pid));
+  if(!cur)
+    return;
+  u_trace("remove delay %d slot %d", pid, cur->slot);
+  g_queue_delete_link(&delay_wheel[cur->slot], cur->link);
+  g_hash_table_remove(delay_index, GUINT_TO_POINTER(pid));
 }
 
 /**
@@ -174,15 +200,7 @@ static void remove_proc_from_delay_stack(pid_t pid) {
  * @return boolean
  */
 static int pid_in_delay_stack(pid_t pid) {
-  int i = 0;
-  struct delay_proc *cur;
-
-  for(i = 0; i < delay_stack->len; i++) {
-      cur = g_ptr_array_index(delay_stack, i);
-      if(cur->proc->pid == pid)
-          return TRUE;
-  }
-  return FALSE;
+  return g_hash_table_lookup(delay_index, GUINT_TO_POINTER(pid)) != NULL;
 }
 
 
@@ -201,19 +219,22 @@ void u_proc_free(void *ptr) {
 
   g_assert(proc->ref == 0);
 
-  g_free(proc->cmdfile);
   g_free(proc->exe);
-  g_free(proc->cmdline_match);
   g_strfreev(proc->cgroup_origin);
-  if(proc->environ)
-      g_hash_table_unref(proc->environ);
-  if(proc->cmdline)
-      g_ptr_array_unref(proc->cmdline);
+  u_env_index_remove(proc);
+  // cmdfile and cmdline_match point into the cmdline block
+  g_free(proc->environ);
+  g_free(proc->cmdline);
+  g_free(proc->filter_match);
 
   if(proc->lua_data) {
     luaL_unref(lua_main_state, LUA_REGISTRYINDEX, proc->lua_data);
   }
   g_hash_table_destroy (proc->skip_filter);
+  if(proc->scheduled)
+    g_hash_table_destroy (proc->scheduled);
+  g_free(proc->history);
+  u_hot_remove(proc);
 
   //if(proc->tasks)
   g_ptr_array_free(proc->tasks, TRUE);
@@ -241,6 +262,97 @@ void u_proc_free_task(void *ptr) {
 }
 
 
+/**
+ * allocate a history ring
+ * @arg len number of samples
+ *
+ * INTERNAL: the arrays are placed behind the struct in the same block, so
+ * g_free() releases everything.
+ *
+ * @return new #u_proc_history
+ */
+static struct u_proc_history *u_proc_history_new(guint len) {
+  struct u_proc_history *h;
+  char *data;
+
+  h = g_malloc0(sizeof(struct u_proc_history) +
+                len * (sizeof(gdouble) + 5 * sizeof(guint64) + sizeof(guint8)));
+  data = (char *)(h + 1);
+  h->len = len;
+  h->time = (gdouble *)data;
+  data += len * sizeof(gdouble);
+  h->cpu = (guint64 *)data;
+  h->maj_flt = h->cpu + len;
+  h->rss = h->maj_flt + len;
+  h->read_bytes = h->rss + len;
+  h->write_bytes = h->read_bytes + len;
+  h->io_valid = (guint8 *)(h->write_bytes + len);
+  return h;
+}
+
+/**
+ * record a sample of a process
+ * @arg proc #u_proc with stat fields
+ *
+ * appends cpu time, major faults, rss and storage io to the history ring and
+ * updates the cpu and io rates. the length of the ring is set by
+ * `[core] history_len`, 0 disables the history.
+ */
+void u_proc_history_sample(u_proc *proc) {
+  struct u_proc_history *h = proc->history;
+  guint last, i;
+  gdouble now, dt, weight;
+  guint64 read_bytes = 0, write_bytes = 0;
+  gboolean have_io;
+  struct timespec ts;
+
+  if(!history_len)
+    return;
+  if(!h)
+    h = proc->history = u_proc_history_new(history_len);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec + ts.tv_nsec / 1e9;
+  // /proc/#/io is only readable for own processes without CAP_SYS_PTRACE.
+  // a failed read keeps the last counters, so no fake drop or jump shows up
+  have_io = u_read_io(proc->pid, &read_bytes, &write_bytes);
+  if(!have_io && h->count) {
+    last = (h->head + h->len - 1) % h->len;
+    read_bytes = h->read_bytes[last];
+    write_bytes = h->write_bytes[last];
+  }
+
+  i = h->head;
+  h->time[i] = now;
+  h->cpu[i] = proc->proc.utime + proc->proc.stime;
+  h->maj_flt[i] = proc->proc.maj_flt;
+  h->rss[i] = proc->proc.rss;
+  h->read_bytes[i] = read_bytes;
+  h->write_bytes[i] = write_bytes;
+  h->io_valid[i] = have_io;
+
+  if(h->count) {
+    last = (i + h->len - 1) % h->len;
+    dt = now - h->time[last];
+    if(dt > 0) {
+      // time based weight, so irregular sample intervals decay the same
+      weight = 1.0 - exp(-dt / HISTORY_RATE_TAU);
+      h->cpu_rate += weight *
+        ((gdouble)(h->cpu[i] - h->cpu[last]) * 100 / Hertz / dt - h->cpu_rate);
+      // the io delta needs counters on both ends, a sample without them
+      // would turn everything read before into one burst
+      if(have_io && h->io_valid[last])
+        h->io_rate += weight *
+          ((gdouble)((read_bytes - h->read_bytes[last]) +
+                     (write_bytes - h->write_bytes[last])) / dt - h->io_rate);
+    }
+  }
+
+  h->head = (i + 1) % h->len;
+  if(h->count < h->len)
+    h->count++;
+}
+
 /**
  * allocate new #u_proc
  * @arg proc pointer to #proc_t datastructure
@@ -267,6 +379,7 @@ u_proc* u_proc_new(proc_t *proc) {
   rv->flags = NULL;
   rv->changed = TRUE;
   rv->node = g_node_new(rv);
+  rv->slot = -1;
 
   if(proc) {
     rv->pid = proc->tid;
@@ -345,54 +458,54 @@ int u_proc_ensure(u_proc *proc, enum ENSURE_WHAT what, int update) {
       return TRUE;
   } else if(what == ENVIRONMENT) {
       if(update && proc->environ) {
-          g_hash_table_unref(proc->environ);
+          g_free(proc->environ);
           proc->environ = NULL;
       }
       if(!proc->environ)
-          proc->environ = u_read_env_hash (proc->pid);
+          proc->environ = u_read_0file_vec (proc->pid, "environ", FALSE);
+      if(proc->environ)
+          proc->fields |= UPROC_FIELD_ENVIRON;
+      else
+          proc->fields &= ~UPROC_FIELD_ENVIRON;
+      // a fresh environment replaces the indexed values
+      if(update)
+          u_env_index_update(proc);
       return (proc->environ != NULL);
   } else if(what == CMDLINE) {
       if(update && proc->cmdline) {
-          g_ptr_array_unref(proc->cmdline);
+          g_free(proc->cmdline);
           proc->cmdline = NULL;
       }
+      // a new cmdline means exec, which may set a new environment
+      if(update)
+          u_env_index_update(proc);
       if(!proc->cmdline) {
-          int i;
           gchar *tmp, *tmp2;
 
-          g_free(proc->cmdline_match);
           proc->cmdline_match = NULL;
+          proc->cmdfile = NULL;
+          // filter patterns are matched against the new cmdline
+          proc->filter_match_gen = 0;
 
-          GString *match = g_string_new("");
-          proc->cmdline = u_read_0file (proc->pid, "cmdline");
-          // update cmd
-          if(proc->cmdline) {
-              for(i = 0; i < proc->cmdline->len; i++) {
-                  if(i)
-                      match = g_string_append_c(match, ' ');
-                  match = g_string_append(match, g_ptr_array_index(proc->cmdline, i));
-              }
-              proc->cmdline_match = g_string_free(match, FALSE);
-              // empty command line, for kernel threads for example
-              if(!proc->cmdline->len)
-                return FALSE;
-              if(proc->cmdfile) {
-                g_free(proc->cmdfile);
-                proc->cmdfile = NULL;
-              }
-              tmp = g_ptr_array_index(proc->cmdline, 0);
-              if(tmp) {
-                  tmp2 = g_strrstr_len(tmp, -1, "/");
-                  if(tmp2 == NULL) {
-                    proc->cmdfile = g_strdup(tmp);
-                  } else if((tmp2+1-tmp) < strlen(tmp)) {
-                    proc->cmdfile = g_strdup(tmp2+1);
-                  }
-              }
-              return TRUE;
-          } else {
+          proc->cmdline = u_read_0file_vec (proc->pid, "cmdline", TRUE);
+          if(!proc->cmdline) {
+              proc->fields &= ~UPROC_FIELD_CMDLINE;
               return FALSE;
           }
+          proc->fields |= UPROC_FIELD_CMDLINE;
+          proc->cmdline_match = proc->cmdline->joined;
+          // empty command line, for kernel threads for example
+          if(!proc->cmdline->len)
+              return FALSE;
+          // update cmd
+          tmp = U_STR_VEC_INDEX(proc->cmdline, 0);
+          tmp2 = strrchr(tmp, '/');
+          if(tmp2 == NULL) {
+              proc->cmdfile = tmp;
+          } else if(*(tmp2+1)) {
+              proc->cmdfile = tmp2+1;
+          }
+          return TRUE;
       }
       return (proc->cmdline != NULL);
   } else if(what == EXE) {
@@ -404,7 +517,7 @@ int u_proc_ensure(u_proc *proc, enum ENSURE_WHAT what, int update) {
           proc->exe = NULL;
       }
       if(!proc->exe) {
-        path = g_strdup_printf ("/proc/%u/exe", (guint)proc->pid);
+        path = g_strdup_printf ("%s/proc/%u/exe", proc_root, (guint)proc->pid);
         out = readlink(path, (char *)&buf, PATH_MAX);
         buf[out] = 0;
         if(out > 0) {
@@ -414,8 +527,10 @@ int u_proc_ensure(u_proc *proc, enum ENSURE_WHAT what, int update) {
                 out -= 10;
             }
             proc->exe = g_strndup((char *)&buf, out);
+            proc->fields |= UPROC_FIELD_EXE;
         } else {
             g_free(path);
+            proc->fields &= ~UPROC_FIELD_EXE;
             return FALSE;
         }
         g_free(path);
@@ -444,7 +559,7 @@ GArray *u_proc_get_current_task_pids(u_proc *proc) {
     struct dirent   *dit;
     pid_t tpid;
 
-    char *path = g_strdup_printf("/proc/%d/task", proc->pid);
+    char *path = g_strdup_printf("%s/proc/%d/task", proc_root, proc->pid);
     dip = opendir(path);
 
     if(!dip)
@@ -494,6 +609,8 @@ static void processes_free_value(gpointer data) {
 
   U_PROC_SET_STATE(proc, UPROC_INVALID);
   u_proc_remove_child_nodes(proc);
+  u_env_index_remove(proc);
+  u_hot_remove(proc);
   // remove it from the delay stack
   remove_proc_from_delay_stack(proc->pid);
 
@@ -639,13 +756,126 @@ static void rebuild_tree() {
  * @return boolean if a major change detected
  */
 
-static int detect_changed(proc_t *old, proc_t *new) {
-  // detects changes of main paramenters
-  if(old->euid != new->euid || old->session != new->session ||
-     old->egid != new->egid || old->pgrp != new->pgrp ||
-     old->sched != new->sched || old->rtprio != new->rtprio)
-     return 1;
-  return 0;
+/**
+ * number of files behind fields
+ * @arg fields bitmask of #U_PROC_FIELDS
+ *
+ * INTERNAL: counts the /proc files that need to be read for the basic fields.
+ * groups and wchan are derived from status and stat and cost no extra file.
+ *
+ * @return number of files
+ */
+static int fields_files(int fields) {
+  return !!(fields & UPROC_FIELD_STAT) + !!(fields & UPROC_FIELD_STATM) +
+         !!(fields & UPROC_FIELD_STATUS) + !!(fields & UPROC_FIELD_CGROUP);
+}
+
+/**
+ * fields filled by openproc flags
+ * @arg flags PROC_FILL* flags passed to openproc
+ *
+ * INTERNAL: maps the flags of a #PROCTAB to the #U_PROC_FIELDS they fill.
+ *
+ * @return bitmask of #U_PROC_FIELDS
+ */
+static int fields_from_openproc(unsigned flags) {
+  int rv = 0;
+  if(flags & PROC_FILLSTAT)
+    rv |= UPROC_FIELD_STAT;
+  if(flags & PROC_FILLMEM)
+    rv |= UPROC_FIELD_STATM;
+  if(flags & PROC_FILLSTATUS)
+    rv |= UPROC_FIELD_STATUS;
+  if(flags & PROC_FILLCGROUP)
+    rv |= UPROC_FIELD_CGROUP;
+  if((flags & PROC_FILLSUPGRP) && (flags & PROC_FILLSTATUS))
+    rv |= UPROC_FIELD_GROUPS;
+  if((flags & PROC_FILLWCHAN) && (flags & PROC_FILLSTAT))
+    rv |= UPROC_FIELD_WCHAN;
+  return rv;
+}
+
+/**
+ * ensures parts of #u_proc
+ * @arg proc a #u_proc
+ * @arg fields bitmask of #U_PROC_FIELDS to fill
+ * @arg update force update
+ *
+ * Ensures the requested fields are filled by reading only the /proc files
+ * backing them, instead of doing a full update of the process like
+ * u_proc_ensure(proc, BASIC, ...) does. Environment, cmdline and exe fields
+ * are handed over to u_proc_ensure.
+ *
+ * @return @success
+ */
+int u_proc_ensure_fields(u_proc *proc, int fields, int update) {
+  int want, refresh;
+  unsigned flags = 0;
+
+  if((fields & UPROC_FIELD_ENVIRON) && !u_proc_ensure(proc, ENVIRONMENT, update))
+    return FALSE;
+  if((fields & UPROC_FIELD_CMDLINE) && !u_proc_ensure(proc, CMDLINE, update))
+    return FALSE;
+  if((fields & UPROC_FIELD_EXE) && !u_proc_ensure(proc, EXE, update))
+    return FALSE;
+
+  want = fields & UPROC_FIELDS_BASIC;
+  if(!update)
+    want &= ~proc->fields;
+  if(!want)
+    return TRUE;
+
+  if(U_PROC_IS_INVALID(proc))
+    return FALSE;
+
+  // derived fields need their source file
+  if(want & UPROC_FIELD_GROUPS)
+    want |= UPROC_FIELD_STATUS;
+  if(want & UPROC_FIELD_WCHAN)
+    want |= UPROC_FIELD_STAT;
+
+  if(want & UPROC_FIELD_STAT)
+    flags |= PROC_FILLSTAT;
+  if(want & UPROC_FIELD_STATM)
+    flags |= PROC_FILLMEM;
+  if(want & UPROC_FIELD_STATUS)
+    flags |= PROC_FILLSTATUS | PROC_FILLUSR | PROC_FILLGRP;
+  if(want & UPROC_FIELD_GROUPS)
+    flags |= PROC_FILLSUPGRP;
+  if(want & UPROC_FIELD_WCHAN)
+    flags |= PROC_FILLWCHAN;
+  if(want & UPROC_FIELD_CGROUP)
+    flags |= PROC_FILLCGROUP;
+
+  // only values that were valid before can be compared for changes
+  refresh = (want & (UPROC_FIELD_STAT | UPROC_FIELD_STATUS)) &&
+            U_PROC_HAS_FIELDS(proc, want & (UPROC_FIELD_STAT | UPROC_FIELD_STATUS));
+
+  if(!fill_proc_fields(proc->pid, &(proc->proc), flags)) {
+    // the process is gone, the next update will remove it
+    proc->fields &= ~want;
+    return FALSE;
+  }
+
+  U_proc_read_stats.lazy_reads++;
+  U_proc_read_stats.files_read += fields_files(want);
+  U_proc_read_stats.files_avoided += fields_files(UPROC_FIELDS_BASIC) -
+                                     fields_files(want);
+
+  // the hot store still holds the values of the last parse
+  if(refresh)
+    proc->changed = proc->changed | u_hot_changed(proc, &(proc->proc));
+  u_hot_store(proc);
+  if(want & UPROC_FIELD_STAT)
+    proc->received_rt |= (proc->proc.sched == SCHED_FIFO || proc->proc.sched == SCHED_RR);
+  if((want & UPROC_FIELD_CGROUP) && !proc->cgroup_origin)
+    proc->cgroup_origin = g_strdupv(proc->proc.cgroup);
+
+  proc->fields |= want;
+  if(U_PROC_HAS_FIELDS(proc, UPROC_FIELDS_BASIC))
+    U_PROC_SET_STATE(proc, UPROC_BASIC);
+
+  return TRUE;
 }
 
 /**
@@ -771,6 +1001,7 @@ static void process_workarrounds(u_proc *proc, u_proc *parent) {
   // do various workaround jobs here...
   fake_var_fix(fake_pgrp, pgrp);
   fake_var_fix(fake_session, session);
+  u_hot_regroup(proc);
 }
 
 #undef fake_var_fix
@@ -797,6 +1028,7 @@ int update_processes_run(PROCTAB *proctab, int full) {
   int rrt;
   int rv = 0;
   int i;
+  int is_new, exec;
   GList *updated = NULL;
   
   if(full)
@@ -809,6 +1041,9 @@ int update_processes_run(PROCTAB *proctab, int full) {
   memset(&buf, 0, sizeof(proc_t));
   while(readproc(proctab, &buf)){
     proc = proc_by_pid(buf.tid);
+    // placeholders of delayed processes were never read before
+    is_new = (proc == NULL) ||
+             (U_PROC_HAS_STATE(proc, UPROC_NEW) && !proc->env_values);
     if(proc) {
       // we need to clear the task array first to detect which dynamic mallocs
       // need to be freed as readproc likes to reuse pointers on some dynamic
@@ -822,12 +1057,13 @@ int update_processes_run(PROCTAB *proctab, int full) {
     } else {
       proc = u_proc_new(&buf);
       g_hash_table_insert(processes, GUINT_TO_POINTER(proc->pid), proc);
+      u_hot_add(proc);
       // we save the origin of cgroups for scheduler constrains
     }
     // must still have the process allocated
 
     // detect change of important parameters that will cause a reschedule
-    proc->changed = proc->changed | detect_changed(&(proc->proc), &buf);
+    proc->changed = proc->changed | u_hot_changed(proc, &buf);
     // remove it from delay stack
     remove_proc_from_delay_stack(proc->pid);
     if(full)
@@ -836,7 +1072,13 @@ int update_processes_run(PROCTAB *proctab, int full) {
     //save rt received flag
     rrt = proc->received_rt;
 
+    // without exec events a new command name is the only sign of an exec
+    exec = !is_new && strncmp(proc->proc.cmd, buf.cmd, sizeof(buf.cmd));
+
     memcpy(&(proc->proc), &buf, sizeof(proc_t));
+    u_hot_store(proc);
+    proc->fields = (proc->fields & ~UPROC_FIELDS_BASIC) |
+                   fields_from_openproc(proctab->flags);
 
     proc->received_rt |= (proc->proc.sched == SCHED_FIFO || proc->proc.sched == SCHED_RR);
 
@@ -853,6 +1095,15 @@ int update_processes_run(PROCTAB *proctab, int full) {
     if(!proc->cgroup_origin)
       proc->cgroup_origin = g_strdupv(proc->proc.cgroup);
 
+    if(full)
+      u_proc_history_sample(proc);
+
+    // processes not known from fork or exec events are indexed once
+    if(is_new)
+      u_env_index_update(proc);
+    else if(exec)
+      u_proc_ensure(proc, CMDLINE, TRUE);
+
     U_PROC_UNSET_STATE(proc, UPROC_NEW);
     U_PROC_SET_STATE(proc, UPROC_ALIVE);
     if((proctab->flags & OPENPROC_FLAGS) == OPENPROC_FLAGS) {
@@ -906,8 +1157,7 @@ int update_processes_run(PROCTAB *proctab, int full) {
                                 &run);
     // we can completly clean the delay stack as all processes are now processed
     // missing so will cause scheduling for dead processes
-    if(delay_stack->len)
-      g_ptr_array_remove_range(delay_stack, 0, delay_stack->len);
+    delay_clear();
   }
   if(full_update) {
     rebuild_tree();
@@ -927,71 +1177,160 @@ int process_update_all() {
   int rv;
   PROCTAB *proctab;
   proctab = openproc(OPENPROC_FLAGS);
+#ifdef HAVE_IO_URING
+  u_uring_prefetch_begin(NULL);
+#endif
   rv = update_processes_run(proctab, TRUE);
+#ifdef HAVE_IO_URING
+  u_uring_prefetch_end();
+#endif
   closeproc(proctab);
   return rv;
 }
 
 
-// calculated the difference between two timespec values
-static struct timespec diff(struct timespec start, struct timespec end)
-{
-	struct timespec temp;
-	if ((end.tv_nsec-start.tv_nsec)<0) {
-		temp.tv_sec = end.tv_sec-start.tv_sec-1;
-		temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
-	} else {
-		temp.tv_sec = end.tv_sec-start.tv_sec;
-		temp.tv_nsec = end.tv_nsec-start.tv_nsec;
-	}
-	return temp;
+// current monotonic time in ms
+static gint64 delay_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (gint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static gboolean run_new_pid(gpointer ign);
+
+/**
+ * arm delay timer
+ * @arg now current time from delay_now()
+ *
+ * INTERNAL: adds a timeout for the next non empty slot of the delay wheel.
+ * No timeout is running while the wheel is empty.
+ *
+ * @return none
+ */
+static void delay_schedule(gint64 now) {
+  guint i;
+  gint64 wait;
+
+  if(delay_source || !g_hash_table_size(delay_index))
+    return;
+
+  for(i = 1; i < DELAY_WHEEL_SLOTS; i++) {
+    if(delay_wheel[(delay_cursor + i) % DELAY_WHEEL_SLOTS].length)
+      break;
+  }
+  wait = (gint64)i * delay_tick_ms - (now - delay_last);
+  delay_source = g_timeout_add(MAX(wait, 1), run_new_pid, NULL);
+}
+
+/**
+ * add process to delay stack
+ * @arg proc #u_proc to delay
+ *
+ * INTERNAL: puts the process into the slot of the delay wheel that is run
+ * after the configured delay.
+ *
+ * @return none
+ */
+static void delay_add(u_proc *proc) {
+  struct delay_proc *lp;
+  gint64 now = delay_now();
+  gint64 steps;
+
+  remove_proc_from_delay_stack(proc->pid);
+
+  // catch up with the time passed since the last run. the slots before the
+  // pending timeout are empty, so they can be skipped
+  if(!g_hash_table_size(delay_index)) {
+    delay_last = now;
+  } else {
+    steps = (now - delay_last) / delay_tick_ms;
+    while(steps-- > 0 &&
+          !delay_wheel[(delay_cursor + 1) % DELAY_WHEEL_SLOTS].length) {
+      delay_cursor = (delay_cursor + 1) % DELAY_WHEEL_SLOTS;
+      delay_last += delay_tick_ms;
+    }
+  }
+
+  lp = g_slice_new(struct delay_proc);
+  lp->proc = proc;
+  lp->when = now;
+  lp->slot = (delay_cursor + delay_ticks + 1) % DELAY_WHEEL_SLOTS;
+  g_queue_push_tail(&delay_wheel[lp->slot], lp);
+  lp->link = g_queue_peek_tail_link(&delay_wheel[lp->slot]);
+  g_hash_table_insert(delay_index, GUINT_TO_POINTER(proc->pid), lp);
+
+  delay_schedule(now);
 }
 
+/**
+ * clear delay stack
+ *
+ * INTERNAL: removes all processes from the delay stack
+ *
+ * @return none
+ */
+static void delay_clear() {
+  int i;
+
+  g_hash_table_remove_all(delay_index);
+  for(i = 0; i < DELAY_WHEEL_SLOTS; i++)
+    g_queue_clear(&delay_wheel[i]);
+  if(delay_source) {
+    g_source_remove(delay_source);
+    delay_source = 0;
+  }
+}
 
 /**
  * runs process from delay stack
  *
- * called by timeout to check if processes from the delay stack are old enough
- * to be run through the filters and scheduler
+ * called by timeout when a slot of the delay wheel is due. processes old enough
+ * are run through the filters and scheduler. the timeout rearms itself for the
+ * next non empty slot.
  *
- * @return number of process updated
+ * @return FALSE
  */
-static int run_new_pid(gpointer ign) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+static gboolean run_new_pid(gpointer ign) {
+    gint64 now = delay_now();
     struct delay_proc *cur;
-    struct timespec td;
-    int i;
+    GQueue *slot;
+    gint64 steps;
+    guint i, next;
 
     GArray *targets = NULL;
 
-    if(!delay_stack->len)
-      return TRUE;
-
+    delay_source = 0;
     targets = g_array_new(TRUE, FALSE, sizeof(pid_t));
 
-    for(i = 0; i < delay_stack->len;i++) {
-        cur = g_ptr_array_index(delay_stack, i);
-        td = diff(cur->when, now);
-        //printf("test %d  %ld >= %ld\n",  cur->proc->pid, (td.tv_sec * 1000000000 + td.tv_nsec), delay);
-        if((td.tv_sec * 1000000000 + td.tv_nsec) >= delay) {
-            u_trace("run filter for %d", cur->proc->pid);
-            g_array_append_val(targets, cur->proc->pid);
-            // enforce the scheduler on run when moved from the delay queue
-            cur->proc->changed = TRUE;
+    steps = MIN((now - delay_last) / delay_tick_ms, DELAY_WHEEL_SLOTS);
+    for(; steps > 0; steps--) {
+        delay_cursor = (delay_cursor + 1) % DELAY_WHEEL_SLOTS;
+        delay_last += delay_tick_ms;
+        slot = &delay_wheel[delay_cursor];
+        // entries not due yet move on to the next slot
+        for(i = slot->length; i; i--) {
+            cur = g_queue_pop_head(slot);
+            if(now - cur->when >= delay) {
+                u_trace("run filter for %d", cur->proc->pid);
+                g_array_append_val(targets, cur->proc->pid);
+                // enforce the scheduler on run when moved from the delay queue
+                cur->proc->changed = TRUE;
+                g_hash_table_remove(delay_index, GUINT_TO_POINTER(cur->proc->pid));
+            } else {
+                next = (delay_cursor + 1) % DELAY_WHEEL_SLOTS;
+                cur->slot = next;
+                g_queue_push_tail(&delay_wheel[next], cur);
+                cur->link = g_queue_peek_tail_link(&delay_wheel[next]);
+            }
         }
     }
-    process_new_list(targets, TRUE, FALSE);
 
-    // process_new_list removes the entries it processes from the delay stack
-    // buf it the process is dead already, they stay here in the list. we make
-    // sure they are removed.
-    for(i=0; i<targets->len; i++) {
-      remove_proc_from_delay_stack(g_array_index(targets, pid_t, i));
-    }
+    if(targets->len)
+      process_new_list(targets, TRUE, FALSE);
 
     g_array_unref(targets);
-    return TRUE;
+    delay_schedule(delay_now());
+    return FALSE;
 }
 
 
@@ -1013,7 +1352,6 @@ static int run_new_pid(gpointer ign) {
  */
 gboolean process_new_delay(pid_t pid, pid_t parent) {
   u_proc *proc, *proc_parent;
-  struct delay_proc *lp;
   g_assert(pid != 0);
   if(!delay) {
       return process_new(pid, TRUE);
@@ -1030,6 +1368,7 @@ gboolean process_new_delay(pid_t pid, pid_t parent) {
       proc_parent = parent_proc_by_pid(parent, proc);
       g_node_append(proc_parent->node, proc->node);
       g_hash_table_insert(processes, GUINT_TO_POINTER(pid), proc);
+      u_hot_add(proc);
     } else {
       if(!process_update_pid(pid))
         return FALSE;
@@ -1037,10 +1376,7 @@ gboolean process_new_delay(pid_t pid, pid_t parent) {
       if(!proc)
         return FALSE;
     }
-    lp = g_malloc(sizeof(struct delay_proc));
-    lp->proc = proc;
-    clock_gettime(CLOCK_MONOTONIC, &(lp->when));
-    g_ptr_array_add(delay_stack, lp);
+    delay_add(proc);
     proc->changed = FALSE;
     filter_for_proc(proc, filter_fast_list);
     if(proc->changed)
@@ -1090,7 +1426,15 @@ int process_update_pids(pid_t pids[]) {
   PROCTAB *proctab;
   u_timer_start(&timer_parse);
   proctab = openproc(OPENPROC_FLAGS | PROC_PID, pids);
+#ifdef HAVE_IO_URING
+  // a single pid gains nothing from a batch
+  if(pids[0] && pids[1])
+    u_uring_prefetch_begin(pids);
+#endif
   rv = update_processes_run(proctab, FALSE);
+#ifdef HAVE_IO_URING
+  u_uring_prefetch_end();
+#endif
   u_timer_stop(&timer_parse);
   closeproc(proctab);
   return rv;
@@ -1192,6 +1536,43 @@ int process_run_one(u_proc *proc, int update, int instant) {
   return TRUE;
 }
 
+/**
+ * run filters and scheduler on a set of processes
+ * @arg procs #GPtrArray of #u_proc
+ * @arg update update processes before run
+ *
+ * Runs the filters on each process and passes the whole set to the
+ * scheduler at once, so every target cgroup is written only once.
+ *
+ * @return boolean. Sucess
+ */
+int process_run_list(GPtrArray *procs, int update) {
+  GPtrArray *run = procs;
+  u_proc *proc;
+  pid_t pid;
+  int i;
+
+  if(update) {
+    // dead processes are dropped by the update
+    run = g_ptr_array_sized_new(procs->len);
+    for(i = 0; i < procs->len; i++) {
+      pid = ((u_proc *)g_ptr_array_index(procs, i))->pid;
+      process_update_pid(pid);
+      proc = g_hash_table_lookup(processes, GUINT_TO_POINTER(pid));
+      if(proc)
+        g_ptr_array_add(run, proc);
+    }
+  }
+
+  for(i = 0; i < run->len; i++)
+    filter_for_proc(g_ptr_array_index(run, i), filter_list);
+  scheduler_run_list(run);
+
+  if(run != procs)
+    g_ptr_array_free(run, TRUE);
+  return TRUE;
+}
+
 
 /**
  * free flags
@@ -1256,6 +1637,7 @@ int u_flag_add(u_proc *proc, u_flag *flag) {
     if(!g_list_find(system_flags, flag)) {
       system_flags = g_list_insert(system_flags, flag, 0);
       INC_REF(flag);
+      system_flags_generation++;
     }
   }
   return TRUE;
@@ -1281,6 +1663,7 @@ int u_flag_del(u_proc *proc, u_flag *flag) {
   } else {
     if(g_list_index(system_flags, flag) != -1) {
       DEC_REF(flag);
+      system_flags_generation++;
     }
     system_flags = g_list_remove(system_flags, flag);
     return TRUE;
@@ -1339,6 +1722,7 @@ int NAME (u_proc *proc, ARG ) { \
       DEC_REF(item->data); \
       item->data = NULL; \
       system_flags_changed = 1; \
+      system_flags_generation++; \
       rv ++; \
       g_list_free(item); \
     } \
@@ -1375,6 +1759,7 @@ int u_flag_clear_all(u_proc *proc) {
       g_list_free(item);
       rv++;
       system_flags_changed = 1;
+      system_flags_generation++;
     }
     g_list_free(system_flags);
   }
@@ -1511,12 +1896,110 @@ int scheduler_run_one(u_proc *proc) {
     u_timer_start(&timer_scheduler);
     rv = scheduler.one(proc);
     u_timer_stop(&timer_scheduler);
+    u_netlink_placed(proc->pid);
     return rv;
   }
   g_log(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "no scheduler.one set");
   return 1;
 }
 
+/**
+ * run the scheduler on a set of processes
+ * @arg procs #GPtrArray of #u_proc
+ *
+ * Passes all processes at once to scheduler.many, which writes each target
+ * cgroup only once. Falls back to scheduler.one on every process.
+ *
+ * @return 0 on success
+ */
+int scheduler_run_list(GPtrArray *procs) {
+  int i, rv = 0;
+
+  if(!procs->len)
+    return 0;
+  if(!scheduler.many && !scheduler.one) {
+    g_log(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "no scheduler.one set");
+    return 1;
+  }
+
+  u_timer_start(&timer_scheduler);
+  if(scheduler.many) {
+    rv = scheduler.many(procs);
+  } else {
+    for(i = 0; i < procs->len; i++)
+      rv |= scheduler.one(g_ptr_array_index(procs, i));
+  }
+  u_timer_stop(&timer_scheduler);
+  for(i = 0; i < procs->len; i++)
+    u_netlink_placed(((u_proc *)g_ptr_array_index(procs, i))->pid);
+  return rv;
+}
+
+/**
+ * INTERNAL: add all valid processes of process group \a pgrp to \a group
+ *
+ * the members come from the group index of the hot store, no process scan.
+ */
+static void focus_collect_group(GPtrArray *group, pid_t pgrp) {
+  guint i, start = group->len;
+  u_proc *proc;
+
+  u_hot_group_members(pgrp, group);
+  for(i = start; i < group->len;) {
+    proc = g_ptr_array_index(group, i);
+    if(U_PROC_IS_INVALID(proc) || !U_PROC_HAS_FIELDS(proc, UPROC_FIELD_STAT))
+      g_ptr_array_remove_index_fast(group, i);
+    else
+      i++;
+  }
+}
+
+/**
+ * run the scheduler fast path on a focus change
+ * @arg proc #u_proc that became the active process
+ * @arg prev #u_proc that was the active process before or NULL
+ *
+ * A focus change only moves processes between the active and inactive
+ * branches of the mapping, so the filters are not run again. The process
+ * groups of \a proc and \a prev are collected and passed in one batch to
+ * scheduler.focus, which writes each target cgroup only once. Falls back to
+ * scheduler_run_list() if the scheduler has no focus handler.
+ *
+ * @return 0 on success
+ */
+int scheduler_run_focus(u_proc *proc, u_proc *prev) {
+  GPtrArray *group;
+  int rv = 0;
+
+  if(!u_proc_ensure_fields(proc, UPROC_FIELD_STAT, FALSE))
+    return 1;
+  if(prev && (prev == proc || !u_proc_ensure_fields(prev, UPROC_FIELD_STAT, FALSE)))
+    prev = NULL;
+
+  group = g_ptr_array_sized_new(16);
+  if(U_PROC_PGRP(proc) > 0)
+    focus_collect_group(group, U_PROC_PGRP(proc));
+  else
+    g_ptr_array_add(group, proc);
+  if(prev) {
+    if(U_PROC_PGRP(prev) > 0 && U_PROC_PGRP(prev) != U_PROC_PGRP(proc))
+      focus_collect_group(group, U_PROC_PGRP(prev));
+    else if(U_PROC_PGRP(prev) <= 0)
+      g_ptr_array_add(group, prev);
+  }
+
+  if(scheduler.focus) {
+    u_timer_start(&timer_scheduler);
+    rv = scheduler.focus(proc, group);
+    u_timer_stop(&timer_scheduler);
+  } else {
+    rv = scheduler_run_list(group);
+  }
+
+  g_ptr_array_free(group, TRUE);
+  return rv;
+}
+
 void filter_for_proc(u_proc *proc, GList *list) {
   /* run all filters on one proc */
   u_timer_start(&timer_filter);
@@ -1570,7 +2053,12 @@ static void update_caches() {
   double a, b;
   
   loadavg(&_last_load, &a, &b);
-  _last_percent = (_last_load / (double)smp_num_cpus);
+  // the load average is only a guess until two samples of /proc/stat exist
+  if(u_cpu_usage_update())
+    _last_percent = U_cpu_usage.total;
+  else
+    _last_percent = MIN(_last_load / (double)smp_num_cpus * 100, 100.0);
+  u_cgroup_cpu_expire();
 
 }
 
@@ -1580,6 +2068,7 @@ int iterate(gpointer rv) {
   GTimer *timer = g_timer_new();
   gdouble last, current, tparse, tfilter, tscheduler;
   gulong dump;
+  struct u_status_timings timings;
 
   tparse = g_timer_elapsed(timer_parse.timer, &dump);
   tfilter = g_timer_elapsed(timer_filter.timer, &dump);
@@ -1587,6 +2076,25 @@ int iterate(gpointer rv) {
 
   g_debug("spend between iterations: update=%0.2F filter=%0.2F scheduler=%0.2F total=%0.2F", 
           tparse, tfilter, tscheduler, (tparse + tfilter + tscheduler));
+  g_debug("partial process reads: %" G_GUINT64_FORMAT " files read=%" G_GUINT64_FORMAT
+          " avoided=%" G_GUINT64_FORMAT, U_proc_read_stats.lazy_reads,
+          U_proc_read_stats.files_read, U_proc_read_stats.files_avoided);
+  g_debug("filter matches: processes=%" G_GUINT64_FORMAT " cached=%" G_GUINT64_FORMAT
+          " regex=%" G_GUINT64_FORMAT, U_filter_match_stats.scans,
+          U_filter_match_stats.cached, U_filter_match_stats.regex);
+  g_debug("focus changes: %" G_GUINT64_FORMAT " applied=%" G_GUINT64_FORMAT
+          " merged=%" G_GUINT64_FORMAT " placed=%" G_GUINT64_FORMAT
+          " over budget=%" G_GUINT64_FORMAT " latency last=%0.2Fms max=%0.2Fms",
+          U_focus_stats.requests, U_focus_stats.applied, U_focus_stats.merged,
+          U_focus_stats.placed, U_focus_stats.over_budget,
+          U_focus_stats.latency_last, U_focus_stats.latency_max);
+#ifdef POLKIT_FOUND
+  g_debug("polkit checks: cached=%" G_GUINT64_FORMAT " asked=%" G_GUINT64_FORMAT
+          " invalidated=%" G_GUINT64_FORMAT " latency avg=%0.2Fms max=%0.2Fms",
+          U_polkit_stats.hits, U_polkit_stats.misses, U_polkit_stats.invalidated,
+          U_polkit_stats.misses ? U_polkit_stats.latency_total * 1000 / U_polkit_stats.misses : 0.0,
+          U_polkit_stats.latency_max * 1000);
+#endif
 
   g_timer_start(timer);
   u_flag_clear_timeout(NULL, timeout);
@@ -1611,6 +2119,14 @@ int iterate(gpointer rv) {
 
   clear_process_changed();
   system_flags_changed = 0;
+#ifdef ENABLE_DBUS
+  u_dbus_scheduled_flush();
+#endif
+  timings.update = tparse;
+  timings.filter = tfilter;
+  timings.scheduler = tscheduler;
+  timings.total = current;
+  u_status_update(iteration, &timings);
   // g_timer_reset causes strange effects...
   g_timer_destroy(timer);
 
@@ -1787,6 +2303,7 @@ int u_dbus_setup();
 int core_init() {
   // load config
   int i;
+  GError *error = NULL;
   iteration = 1;
   filter_list = NULL;
 
@@ -1831,14 +2348,32 @@ int core_init() {
 #else
   U_polkit_authority = polkit_authority_get();
 #endif
+  u_polkit_init();
 #endif
   // delay stack 
-  delay_stack = g_ptr_array_new_with_free_func(free);
+  delay_index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                      delay_proc_free);
   delay = g_key_file_get_integer(config_data, CONFIG_CORE, "delay_new_pid", NULL);
+  // a new process waits half a turn of the wheel
+  delay_ticks = DELAY_WHEEL_SLOTS / 2;
+  delay_tick_ms = MAX((delay + delay_ticks - 1) / delay_ticks, 1);
 
   processes_tree = g_node_new(NULL);
   processes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, 
                                     processes_free_value);
+  u_env_index_init();
+  u_status_init();
+  u_async_init();
+#ifdef HAVE_IO_URING
+  u_uring_init();
+#endif
+
+  i = g_key_file_get_integer(config_data, CONFIG_CORE, "history_len", &error);
+  if(error) {
+    i = HISTORY_LEN_DEFAULT;
+    g_clear_error(&error);
+  }
+  history_len = CLAMP(i, 0, 1024);
 
   // configure lua
   lua_main_state = luaL_newstate();
@@ -1856,10 +2391,6 @@ int core_init() {
     g_log(G_LOG_DOMAIN, G_LOG_LEVEL_ERROR, "can't load core library");
 
   g_log(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "core initialized");
-  if(delay)
-    g_timeout_add((int)(delay / 3), run_new_pid, NULL);
-  // we save delay as ns for easier comparison
-  delay = delay * 1000000;
   return 1;
 }
 
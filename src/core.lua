@@ -147,6 +147,86 @@ function ulatency.find_flag(lst, match)
   end
 end
 
+-- luajit ffi access to the process structs. the daemon exports the layout,
+-- the cdefs only describe the exported fields and pad the rest
+if jit and ulatency.ffi_layout then
+  local ffi = require("ffi")
+  -- order of the FFI_KIND enum in lua_binding.c
+  local FFI_UNSIGNED, FFI_SIGNED, FFI_CHARS, FFI_STRING, FFI_LIST, FFI_PROC_T = 0, 1, 2, 3, 4, 5
+
+  local function field_type(field)
+    if field.kind == FFI_UNSIGNED then
+      return "uint"..(field.size * 8).."_t "..field.name
+    elseif field.kind == FFI_SIGNED then
+      return "int"..(field.size * 8).."_t "..field.name
+    elseif field.kind == FFI_CHARS then
+      return "char "..field.name.."["..field.size.."]"
+    elseif field.kind == FFI_STRING then
+      return "const char *"..field.name
+    elseif field.kind == FFI_LIST then
+      return "ul_GList *"..field.name
+    elseif field.kind == FFI_PROC_T then
+      return "ul_proc_t "..field.name
+    end
+  end
+
+  local function build_struct(name, layout)
+    local fields = table.copy(layout.fields)
+    local rv = {}
+    local pos = 0
+    table.sort(fields, function(a, b) return a.offset < b.offset end)
+    for i, field in ipairs(fields) do
+      if field.offset > pos then
+        rv[#rv+1] = "uint8_t _pad"..i.."["..(field.offset - pos).."];"
+      end
+      rv[#rv+1] = field_type(field)..";"
+      pos = field.offset + field.size
+    end
+    if layout.size > pos then
+      rv[#rv+1] = "uint8_t _pad_end["..(layout.size - pos).."];"
+    end
+    return "typedef struct __attribute__((packed)) {\n  "..
+           table.concat(rv, "\n  ").."\n} "..name..";\n"
+  end
+
+  local layout = ulatency.ffi_layout()
+  ffi.cdef("typedef struct ul_GList { void *data; struct ul_GList *next; struct ul_GList *prev; } ul_GList;\n"..
+           build_struct("ul_proc_t", layout.proc_t)..
+           build_struct("ul_u_proc", layout.u_proc)..
+           build_struct("ul_u_flag", layout.u_flag))
+
+  local u_proc_ptr = ffi.typeof("ul_u_proc *")
+  local u_flag_ptr = ffi.typeof("ul_u_flag *")
+
+  --! @brief returns the process as ffi cdata
+  --! @param proc u_proc
+  --! @return ul_u_proc cdata. proc_t fields are read as cdata.proc.rss. only
+  --! valid during the current rule call
+  function ulatency.ffi_proc(proc)
+    return ffi.cast(u_proc_ptr, proc:cdata())
+  end
+
+  --! @brief returns the flag as ffi cdata
+  --! @param flag u_flag
+  --! @return ul_u_flag cdata, only valid during the current rule call
+  function ulatency.ffi_flag(flag)
+    return ffi.cast(u_flag_ptr, flag:cdata())
+  end
+
+  --! @brief iterates the flags of a process as ffi cdata
+  --! @param cproc ul_u_proc cdata
+  function ulatency.ffi_flags(cproc)
+    local cur = cproc.flags
+    return function()
+      if cur ~= nil then
+        local flag = ffi.cast(u_flag_ptr, cur.data)
+        cur = cur.next
+        return flag
+      end
+    end
+  end
+end
+
 -- load defaults.conf
 if(not ulatency.load_rule("../cgroups.conf")) then
   if(not ulatency.load_rule("../conf/cgroups.conf")) then
@@ -154,11 +234,28 @@ if(not ulatency.load_rule("../cgroups.conf")) then
   end
 end
 
+-- when replaying a captured fixture, /proc and /sys are read below
+-- ulatency.proc_root. the groups are written into a scratch copy of the
+-- captured cgroup tree, so the fixture stays the same for the next run.
+-- the daemon removes CGROUP_SCRATCH when it exits.
+local ROOT = ulatency.proc_root or ""
+if ROOT ~= "" then
+  local fd = io.popen("mktemp -d -t ulatencyd-cgroups.XXXXXX", "r")
+  CGROUP_SCRATCH = fd:read("*l")
+  fd:close()
+  if not CGROUP_SCRATCH then
+    error("can't create a scratch directory for the cgroups of the fixture")
+  end
+  os.execute(string.format("cp -a '%s/.' '%s'", ROOT .. CGROUP_ROOT, CGROUP_SCRATCH))
+  ulatency.log_info("cgroups of the fixture are written to "..CGROUP_SCRATCH)
+  CGROUP_ROOT = CGROUP_SCRATCH
+end
+
 -- build a list of usefull mountpoints
 ulatency.mountpoints = {}
 
 local function load_mountpoints()
-  local fp = io.open("/proc/mounts")
+  local fp = io.open(ROOT .. "/proc/mounts")
   local good = { sysfs=true, debugfs=true }
 
   if not fp then
@@ -203,7 +300,7 @@ function ulatency.get_cgroup_subsystems()
   end
   __CGROUP_AVAIL = {}
   __CGROUP_HAS = {}
-  for line in io.lines("/proc/cgroups") do 
+  for line in io.lines(ROOT .. "/proc/cgroups") do 
     if string.sub(line, 1, 2) ~= "#" then
       local var = string.gmatch(line, "(%w+)%s+.+")()
       __CGROUP_AVAIL[#__CGROUP_AVAIL+1] = var
@@ -217,7 +314,7 @@ end
 
 function ulatency.get_sysctl(name)
   local pname = string.gsub(name, "%.", "/")
-  local fp = io.open("/proc/sys/" .. pname)
+  local fp = io.open(ROOT .. "/proc/sys/" .. pname)
   if not fp then
     return nil
   end
@@ -227,8 +324,13 @@ function ulatency.get_sysctl(name)
 end
 
 function ulatency.set_sysctl(name, value)
+  -- the fixture is not modified
+  if ROOT ~= "" then
+    ulatency.log_debug("replay: not setting sysctl "..name.." to "..tostring(value))
+    return true
+  end
   local pname = string.gsub(name, "%.", "/")
-  local fp = io.open("/proc/sys/" .. pname, "w")
+  local fp = io.open(ROOT .. "/proc/sys/" .. pname, "w")
   if not fp then
     return false
   end
@@ -292,6 +394,10 @@ local function is_mounted(mnt_pnt)
   if string.sub(mnt_pnt, #mnt_pnt) == "/" then
     mnt_pnt = string.sub(mnt_pnt, 1, #mnt_pnt-1)
   end
+  -- a fixture has plain directories, nothing is mounted there
+  if ROOT ~= "" then
+    return mkdirp(mnt_pnt)
+  end
   for line in io.lines("/proc/mounts") do
     if string.find(line, mnt_pnt) then
       return true
@@ -314,7 +420,7 @@ if not is_mounted(CGROUP_ROOT) then
 end
 
 -- disable the autogrouping
-local fp = io.open("/proc/sys/kernel/sched_autogroup_enabled", "w")
+local fp = ROOT == "" and io.open("/proc/sys/kernel/sched_autogroup_enabled", "w")
 if fp then
   ulatency.log_info("disable sched_autogroup in linux kernel")
   fp:write("0")
@@ -355,8 +461,11 @@ for n,v in pairs(CGROUP_MOUNTPOINTS) do
       end
     end
     local fp = io.open(path.."/release_agent", "r")
-    local ragent = fp:read("*a")
-    fp:close()
+    local ragent = ""
+    if fp then
+      ragent = fp:read("*a")
+      fp:close()
+    end
     -- we only write a release agent if not already one. update if it looks like
     -- a ulatencyd release agent
     if ragent == "" or ragent == "\n" or string.sub(ragent, -22) == '/ulatencyd_cleanup.lua' then
@@ -383,31 +492,64 @@ __found_one_group = nil
 
 CGroupMeta = { __index = CGroup, __tostring = CGroup_tostring}
 
-local function cgroups_cleanup()
-  local to_remove = {}
+-- the tasks files are read in the background, the groups are removed when
+-- all reads are done. a group with tasks queued or still being written may
+-- look empty in its tasks file, so it is kept
+local cleanup_pending = 0
+
+local function is_idle(c)
+  return #rawget(c, "new_tasks") == 0 and rawget(c, "writes") == 0
+end
+
+-- a directory with sub groups can't be removed
+local function has_children(group)
+  local prefix = group.."/"
   for n, c in pairs(_CGroup_Cache) do
-    if c:can_be_removed() then
-      to_remove[#to_remove + 1] = n
+    if string.sub(n, 1, #prefix) == prefix then
+      return true
     end
   end
-  for i,group in ipairs(to_remove) do
-    local needed = false
-    for i, test in ipairs(to_remove) do
-      if string.sub(test, 1, #group) == group then
-        needed = true
-        break
-      end
-    end
-    if not needed then
-      _CGroup_Cache[group]:remove()
+  return false
+end
+
+local function cgroups_remove(to_remove)
+  -- children first, their parents may be empty afterwards
+  table.sort(to_remove, function(a, b) return #a > #b end)
+  for i, group in ipairs(to_remove) do
+    local c = _CGroup_Cache[group]
+    -- the group may have been used again while the reads were pending
+    if c and is_idle(c) and not has_children(group) then
+      c:remove()
       _CGroup_Cache[group] = nil
     end
   end
+end
+
+local function cgroups_cleanup()
+  if cleanup_pending > 0 then
+    return true
+  end
+  local to_remove = {}
+  for n, c in pairs(_CGroup_Cache) do
+    if is_idle(c) then
+      cleanup_pending = cleanup_pending + 1
+      c:get_tasks_async(function(tasks)
+        if #tasks == 0 and is_idle(c) then
+          to_remove[#to_remove + 1] = n
+        end
+        cleanup_pending = cleanup_pending - 1
+        if cleanup_pending == 0 then
+          cgroups_remove(to_remove)
+        end
+      end)
+    end
+  end
 
   return true
 end
 
 ulatency.add_timeout(cgroups_cleanup, 120000)
+CGroup.cleanup = cgroups_cleanup
 
 function CGroup.new(name, init, tree)
   tree = tree or "cpu"
@@ -422,7 +564,7 @@ function CGroup.new(name, init, tree)
   end
   uncommited=table.merge(cinit, init or {})
   rv = setmetatable( {name=name, uncommited=uncommited, new_tasks={},
-                      tree=tree, adjust={}, used=false}, CGroupMeta)
+                      tree=tree, adjust={}, used=false, writes=0}, CGroupMeta)
   _CGroup_Cache[tree..'/'..name] = rv
   return rv
 end
@@ -444,6 +586,13 @@ function CGroup:path(file)
   end
 end
 
+--! @brief cpu usage of the group
+--! @return percent of one cpu since the last tick, nil if the tree has no
+--! cpu accounting
+function CGroup:get_cpu_rate()
+  return ulatency.get_cgroup_cpu_rate(self:path())
+end
+
 function CGroup:path_parts()
   return self.name:split("/")
 end
@@ -475,6 +624,8 @@ function CGroup:set_value(key, value)
   uncommited[key] = value
 end
 
+-- get_tasks and has_tasks read at once, for rules that need the answer in
+-- place. the cleanup uses get_tasks_async
 function CGroup:get_tasks()
   local t_file = self:path("tasks")
   if posix.access(t_file, posix.R_OK) ~= 0 then
@@ -487,6 +638,18 @@ function CGroup:get_tasks()
   return rv
 end
 
+--! @brief reads the tasks of the group in the background
+--! @param fnc function(tasks) called with the list of pids
+function CGroup:get_tasks_async(fnc)
+  ulatency.read_async(self:path("tasks"), function(data)
+    local rv = {}
+    for pid in string.gmatch(data or "", "%d+") do
+      rv[#rv+1] = tonumber(pid)
+    end
+    fnc(rv)
+  end)
+end
+
 function CGroup:has_tasks()
   local rv = false
   local t_file = self:path("tasks")
@@ -585,6 +748,9 @@ function CGroup:remove()
 end
 
 
+-- the directory and the parameters are written at once, they are needed
+-- before tasks can be moved and change seldom. only the tasks go to the
+-- background, writes counts the unfinished ones
 function CGroup:commit()
   mkdirp(self:path())
   local uncommited = rawget(self, "uncommited")
@@ -608,39 +774,39 @@ function CGroup:commit()
       end
     end
   end
-  local t_file = self:path("tasks")
-  local fp = io.open(t_file, "w")
-  if fp then
-    local pids = rawget(self, "new_tasks")
-    if pids then
-      for i, pid in ipairs(pids) do
-        fp:write(tostring(pid)..'\n')
-        fp:flush()
-      end
-      ulatency.log_sched("Move to "..tostring(self).." tasks: "..table.concat(pids, ","))
-      rawset(self, "new_tasks", {})
+  local pids = rawget(self, "new_tasks")
+  if pids and #pids > 0 then
+    -- one write per pid, the kernel takes only one pid per write
+    local chunks = {}
+    for i, pid in ipairs(pids) do
+      chunks[i] = tostring(pid)..'\n'
     end
-    fp:close()
+    rawset(self, "writes", rawget(self, "writes") + 1)
+    ulatency.write_async(self:path("tasks"), chunks, function(ok, err)
+      rawset(self, "writes", rawget(self, "writes") - 1)
+      if not ok then
+        -- usually a process that exited meanwhile
+        ulatency.log_debug("moving tasks to "..tostring(self).." failed: "..tostring(err))
+      end
+    end)
+    ulatency.log_sched("Move to "..tostring(self).." tasks: "..table.concat(pids, ","))
+    rawset(self, "new_tasks", {})
   end
 end
 
 function CGroup:add_children(proc, fnc)
-  function add_childs(list)
-    for i,v in pairs(list) do
-      self:add_task(v.pid)
-      if fnc then
-        fnc(v)
-      end
-    end
-    for i,v in pairs(list) do
-      add_childs(v:get_children())
-    end
+  if fnc then
+    proc:walk_subtree(function(child)
+      self:add_task(child.pid)
+      fnc(child)
+    end)
+  else
+    self:add_task_list(proc.pid, proc:subtree_pids())
   end
-  add_childs(proc:get_children())
 end
 
 function CGroup.create_isolation_group(proc, children, fnc)
-  ng = CGroup.new("iso_"..tostring(pid))
+  ng = CGroup.new("iso_"..tostring(proc.pid))
   ng:commit()
   ng:add_task(proc.pid)
   proc:set_block_scheduler(1)
@@ -70,6 +70,7 @@ DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
 //"      <arg type=\"i\" name=\"priority\" direction=\"in\" />\n"
 //"    </method>\n"
 "    <property name=\"activeListLength\" type=\"q\" access=\"readwrite\"/>\n"
+"    <property name=\"activeAgent\" type=\"s\" access=\"read\"/>\n"
 "  </interface>\n"
 INTROSPECT
 "</node>\n";
@@ -121,6 +122,33 @@ DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
 "      <arg type=\"b\" name=\"update\" direction=\"in\" />\n"
 "      <arg type=\"b\" name=\"success\" direction=\"out\" />\n"
 "    </method>\n"
+"    <method name=\"addFlagBatch\">\n"
+"      <arg type=\"a(ttsstixxb)\" name=\"flags\" direction=\"in\" />\n"
+"      <arg type=\"b\" name=\"schedule\" direction=\"in\" />\n"
+"      <arg type=\"at\" name=\"failed\" direction=\"out\" />\n"
+"    </method>\n"
+"    <method name=\"delFlagBatch\">\n"
+"      <arg type=\"a(tt)\" name=\"flags\" direction=\"in\" />\n"
+"      <arg type=\"b\" name=\"schedule\" direction=\"in\" />\n"
+"      <arg type=\"at\" name=\"failed\" direction=\"out\" />\n"
+"    </method>\n"
+"    <method name=\"clearFlagsBatch\">\n"
+"      <arg type=\"at\" name=\"pids\" direction=\"in\" />\n"
+"      <arg type=\"b\" name=\"schedule\" direction=\"in\" />\n"
+"      <arg type=\"at\" name=\"failed\" direction=\"out\" />\n"
+"    </method>\n"
+"    <method name=\"scheduleTaskBatch\">\n"
+"      <arg type=\"at\" name=\"pids\" direction=\"in\" />\n"
+"      <arg type=\"b\" name=\"update\" direction=\"in\" />\n"
+"      <arg type=\"at\" name=\"failed\" direction=\"out\" />\n"
+"    </method>\n"
+"    <method name=\"subscribeScheduled\">\n"
+"    </method>\n"
+"    <method name=\"unsubscribeScheduled\">\n"
+"    </method>\n"
+"    <signal name=\"ProcessScheduled\">\n"
+"      <arg type=\"a(tssu)\" name=\"decisions\" />\n"
+"    </signal>\n"
 "    <property name=\"config\" type=\"s\" access=\"read\"/>\n"
 "    <property name=\"version\" type=\"s\" access=\"read\"/>\n"
 "  </interface>\n"
@@ -187,7 +215,7 @@ static DBusHandlerResult dbus_user_handler(DBusConnection *c, DBusMessage *m, vo
 
           goto finish;
         }
-        set_active_pid(uid, pid);
+        set_active_pid_debounced(uid, pid);
         ret = dbus_message_new_method_return(m);
 
         goto finish;
@@ -238,6 +266,13 @@ static DBusHandlerResult dbus_user_handler(DBusConnection *c, DBusMessage *m, vo
                                           DBUS_TYPE_INVALID);
                 goto finish;
             }
+            if(g_strcmp0(property, "activeAgent") == 0) {
+                const char *agent = active_agent_name(ua->active_agent);
+                dbus_message_append_args (ret,
+                                          DBUS_TYPE_STRING, &agent,
+                                          DBUS_TYPE_INVALID);
+                goto finish;
+            }
 
             dbus_message_unref(ret);
             return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
@@ -400,6 +435,246 @@ static void set_config_callback(struct callback_data *data) {
     dbus_message_unref(ret);
 }
 
+/*
+  batch requests
+
+  the batch methods take arrays of the single call arguments. the caller is
+  looked up once for the whole batch, entries of unknown or foreign pids are
+  skipped and returned as failed. the scheduler runs once over all affected
+  processes afterwards.
+*/
+
+struct batch {
+    uid_t caller;
+    GPtrArray *procs;     // affected processes in request order
+    GHashTable *seen;     // pid -> u_proc of procs
+    GArray *failed;       // pids skipped
+};
+
+static void batch_init(struct batch *b, uid_t caller) {
+    b->caller = caller;
+    b->procs = g_ptr_array_new();
+    b->seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    b->failed = g_array_new(FALSE, FALSE, sizeof(dbus_uint64_t));
+}
+
+// returns the process if the caller may change it, records failures
+static u_proc *batch_get_proc(struct batch *b, dbus_uint64_t tpid) {
+    u_proc *proc = proc_by_pid_with_retry((pid_t)tpid);
+
+    // euid comes from the status file, which is read lazily
+    if(!proc || (b->caller != 0 &&
+                 (!u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE) ||
+                  b->caller != proc->proc.euid))) {
+        g_array_append_val(b->failed, tpid);
+        return NULL;
+    }
+    if(!g_hash_table_lookup(b->seen, GUINT_TO_POINTER(proc->pid))) {
+        g_hash_table_insert(b->seen, GUINT_TO_POINTER(proc->pid), proc);
+        g_ptr_array_add(b->procs, proc);
+    }
+    return proc;
+}
+
+// appends the failed pids to the reply and frees the batch
+static void batch_finish(struct batch *b, DBusMessage *ret) {
+    DBusMessageIter imsg, array;
+    int i;
+
+    dbus_message_iter_init_append(ret, &imsg);
+    dbus_message_iter_open_container(&imsg, DBUS_TYPE_ARRAY, "t", &array);
+    for(i = 0; i < b->failed->len; i++)
+        dbus_message_iter_append_basic(&array, DBUS_TYPE_UINT64,
+                                       &g_array_index(b->failed, dbus_uint64_t, i));
+    dbus_message_iter_close_container(&imsg, &array);
+
+    g_ptr_array_free(b->procs, TRUE);
+    g_hash_table_destroy(b->seen);
+    g_array_free(b->failed, TRUE);
+}
+
+// reads the trailing boolean after the array of a batch request
+static dbus_bool_t batch_get_flag(DBusMessageIter *imsg) {
+    dbus_bool_t rv;
+
+    dbus_message_iter_next(imsg);
+    dbus_message_iter_get_basic(imsg, &rv);
+    return rv;
+}
+
+/*
+  ProcessScheduled signal
+
+  scheduling decisions are queued and broadcast as one signal with an array
+  of (pid, subsystem, group, reason) entries. the queue is flushed at the end
+  of each iteration, but not more often than [dbus] scheduled_interval
+  milliseconds, and holds at most [dbus] scheduled_max entries. clients
+  announce themselves with subscribeScheduled, without subscribers nothing
+  is recorded at all.
+*/
+
+#define SCHEDULED_INTERVAL_DEFAULT 1000
+#define SCHEDULED_MAX_DEFAULT 4096
+
+struct scheduled_entry {
+    dbus_uint64_t pid;
+    gchar *subsystem;
+    gchar *group;
+    dbus_uint32_t reason;
+};
+
+static GHashTable *scheduled_subscribers = NULL; // unique name -> name
+static GArray *scheduled_queue = NULL;
+static GTimer *scheduled_timer = NULL;   // time since the last signal
+static guint scheduled_timeout = 0;
+static gint scheduled_interval = SCHEDULED_INTERVAL_DEFAULT;
+static guint scheduled_max = SCHEDULED_MAX_DEFAULT;
+static guint64 scheduled_dropped = 0;
+
+int u_dbus_scheduled_listeners() {
+    return scheduled_subscribers ? g_hash_table_size(scheduled_subscribers) : 0;
+}
+
+static void scheduled_clear() {
+    struct scheduled_entry *entry;
+    int i;
+
+    for(i = 0; i < scheduled_queue->len; i++) {
+        entry = &g_array_index(scheduled_queue, struct scheduled_entry, i);
+        g_free(entry->subsystem);
+        g_free(entry->group);
+    }
+    g_array_set_size(scheduled_queue, 0);
+}
+
+static void scheduled_send() {
+    DBusConnection *c;
+    DBusMessage *sig;
+    DBusMessageIter imsg, array, strukt;
+    struct scheduled_entry *entry;
+    int i;
+
+    if(!U_dbus_connection || !scheduled_queue->len)
+        return;
+    c = dbus_g_connection_get_connection(U_dbus_connection);
+
+    sig = dbus_message_new_signal(U_DBUS_SYSTEM_PATH, U_DBUS_SYSTEM_INTERFACE,
+                                  "ProcessScheduled");
+    dbus_message_iter_init_append(sig, &imsg);
+    dbus_message_iter_open_container(&imsg, DBUS_TYPE_ARRAY, "(tssu)", &array);
+    for(i = 0; i < scheduled_queue->len; i++) {
+        entry = &g_array_index(scheduled_queue, struct scheduled_entry, i);
+        dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &strukt);
+        dbus_message_iter_append_basic(&strukt, DBUS_TYPE_UINT64, &entry->pid);
+        dbus_message_iter_append_basic(&strukt, DBUS_TYPE_STRING, &entry->subsystem);
+        dbus_message_iter_append_basic(&strukt, DBUS_TYPE_STRING, &entry->group);
+        dbus_message_iter_append_basic(&strukt, DBUS_TYPE_UINT32, &entry->reason);
+        dbus_message_iter_close_container(&array, &strukt);
+    }
+    dbus_message_iter_close_container(&imsg, &array);
+
+    dbus_connection_send(c, sig, NULL);
+    dbus_message_unref(sig);
+
+    if(scheduled_dropped) {
+        g_debug("ProcessScheduled: dropped %" G_GUINT64_FORMAT " entries", scheduled_dropped);
+        scheduled_dropped = 0;
+    }
+}
+
+static gboolean scheduled_timeout_cb(gpointer data) {
+    scheduled_timeout = 0;
+    u_dbus_scheduled_flush();
+    return FALSE;
+}
+
+// sends the queued decisions unless the last signal is too recent
+void u_dbus_scheduled_flush() {
+    gdouble wait;
+
+    if(!scheduled_queue || !scheduled_queue->len)
+        return;
+
+    wait = scheduled_interval - g_timer_elapsed(scheduled_timer, NULL) * 1000;
+    if(wait > 0) {
+        if(!scheduled_timeout)
+            scheduled_timeout = g_timeout_add((guint)wait + 1, scheduled_timeout_cb, NULL);
+        return;
+    }
+
+    if(scheduled_timeout) {
+        g_source_remove(scheduled_timeout);
+        scheduled_timeout = 0;
+    }
+    if(u_dbus_scheduled_listeners())
+        scheduled_send();
+    scheduled_clear();
+    g_timer_start(scheduled_timer);
+}
+
+void u_dbus_scheduled_add(pid_t pid, const char *subsystem, const char *group, guint reason) {
+    struct scheduled_entry entry;
+
+    if(!u_dbus_scheduled_listeners())
+        return;
+    if(scheduled_queue->len >= scheduled_max) {
+        scheduled_dropped++;
+        return;
+    }
+    entry.pid = pid;
+    entry.subsystem = g_strdup(subsystem);
+    entry.group = g_strdup(group);
+    entry.reason = reason;
+    g_array_append_val(scheduled_queue, entry);
+
+    // decisions outside of iterations are sent by the timeout
+    if(!scheduled_timeout)
+        scheduled_timeout = g_timeout_add(scheduled_interval, scheduled_timeout_cb, NULL);
+}
+
+static DBusHandlerResult scheduled_owner_filter(DBusConnection *c, DBusMessage *m, void *user_data) {
+    const char *name, *old_owner, *new_owner;
+
+    if(dbus_message_is_signal(m, DBUS_INTERFACE_DBUS, "NameOwnerChanged") &&
+       dbus_message_get_args(m, NULL,
+                             DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner,
+                             DBUS_TYPE_STRING, &new_owner,
+                             DBUS_TYPE_INVALID) &&
+       !new_owner[0] && g_hash_table_remove(scheduled_subscribers, name)) {
+        g_debug("ProcessScheduled: %s left, %d subscribers", name,
+                u_dbus_scheduled_listeners());
+    }
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void scheduled_init(DBusConnection *c) {
+    GError *error = NULL;
+    gint max;
+
+    scheduled_interval = g_key_file_get_integer(config_data, "dbus", "scheduled_interval", &error);
+    if(error && error->code) {
+        scheduled_interval = SCHEDULED_INTERVAL_DEFAULT;
+        g_clear_error(&error);
+    }
+    max = g_key_file_get_integer(config_data, "dbus", "scheduled_max", &error);
+    if(error && error->code) {
+        max = SCHEDULED_MAX_DEFAULT;
+        g_clear_error(&error);
+    }
+    scheduled_max = MAX(max, 1);
+
+    scheduled_subscribers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    scheduled_queue = g_array_new(FALSE, FALSE, sizeof(struct scheduled_entry));
+    scheduled_timer = g_timer_new();
+
+    // only names that lost their owner, not every name change on the bus
+    dbus_bus_add_match(c, "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                          "interface='" DBUS_INTERFACE_DBUS "',"
+                          "member='NameOwnerChanged',arg2=''", NULL);
+    dbus_connection_add_filter(c, scheduled_owner_filter, NULL, NULL);
+}
+
 static DBusHandlerResult dbus_system_handler(DBusConnection *c, DBusMessage *m, void *userdata) {
     DBusError error;
     DBusMessage *ret = NULL;
@@ -471,7 +746,10 @@ static DBusHandlerResult dbus_system_handler(DBusConnection *c, DBusMessage *m,
         if(!proc)
             PUSH_ERROR(U_DBUS_ERROR_NO_PID, "wrong arguments")
 
-        if(caller != 0 && caller != proc->proc.euid)
+        // euid comes from the status file, which is read lazily
+        if(caller != 0 &&
+           (!u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE) ||
+            caller != proc->proc.euid))
             PUSH_ERROR(DBUS_ERROR_ACCESS_DENIED, "access denied")
 
         flag = u_flag_new((void *)U_DBUS_POINTER, name);
@@ -519,7 +797,10 @@ static DBusHandlerResult dbus_system_handler(DBusConnection *c, DBusMessage *m,
         if(!proc)
             PUSH_ERROR(U_DBUS_ERROR_NO_PID, "wrong arguments")
 
-        if(caller != 0 && caller != proc->proc.euid)
+        // euid comes from the status file, which is read lazily
+        if(caller != 0 &&
+           (!u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE) ||
+            caller != proc->proc.euid))
             PUSH_ERROR(DBUS_ERROR_ACCESS_DENIED, "access denied")
 
         if(is2) {
@@ -552,7 +833,10 @@ static DBusHandlerResult dbus_system_handler(DBusConnection *c, DBusMessage *m,
         if(!proc)
             PUSH_ERROR(U_DBUS_ERROR_NO_PID, "wrong arguments")
 
-        if(caller != 0 && caller != proc->proc.euid)
+        // euid comes from the status file, which is read lazily
+        if(caller != 0 &&
+           (!u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE) ||
+            caller != proc->proc.euid))
             PUSH_ERROR(DBUS_ERROR_ACCESS_DENIED, "access denied")
 
         ret = dbus_message_new_method_return(m);
@@ -567,6 +851,149 @@ static DBusHandlerResult dbus_system_handler(DBusConnection *c, DBusMessage *m,
         ret = dbus_message_new_method_return(m);
         goto finish;
 
+    } else if(dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "addFlagBatch")) {
+        struct batch b;
+        DBusMessageIter array, strukt;
+        dbus_uint64_t tpid, ttid, timeout;
+        dbus_int32_t priority;
+        dbus_int64_t value, threshold;
+        dbus_bool_t inherit;
+        const char *name, *reason;
+        u_proc *proc;
+        u_flag *flag;
+
+        if(!dbus_message_has_signature(m, "a(ttsstixxb)b") ||
+           !dbus_message_iter_init(m, &imsg))
+            PUSH_ERROR(DBUS_ERROR_INVALID_ARGS, "wrong arguments")
+
+        GET_CALLER()
+
+        batch_init(&b, caller);
+        dbus_message_iter_recurse(&imsg, &array);
+        while(dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+            dbus_message_iter_recurse(&array, &strukt);
+            #define NEXT_ARG(VAR) \
+                dbus_message_iter_get_basic(&strukt, &VAR); \
+                dbus_message_iter_next(&strukt);
+            NEXT_ARG(tpid)
+            NEXT_ARG(ttid)
+            NEXT_ARG(name)
+            NEXT_ARG(reason)
+            NEXT_ARG(timeout)
+            NEXT_ARG(priority)
+            NEXT_ARG(value)
+            NEXT_ARG(threshold)
+            NEXT_ARG(inherit)
+            #undef NEXT_ARG
+            dbus_message_iter_next(&array);
+
+            proc = batch_get_proc(&b, tpid);
+            if(!proc)
+                continue;
+
+            flag = u_flag_new((void *)U_DBUS_POINTER, name);
+            flag->reason = g_strdup(reason);
+            flag->tid = (pid_t)ttid;
+            flag->timeout = timeout;
+            flag->priority = priority;
+            flag->value = value;
+            flag->threshold = threshold;
+            flag->inherit = inherit;
+
+            u_flag_add(proc, flag);
+            DEC_REF(flag);
+        }
+
+        if(batch_get_flag(&imsg))
+            process_run_list(b.procs, FALSE);
+
+        ret = dbus_message_new_method_return(m);
+        batch_finish(&b, ret);
+        goto finish;
+
+    } else if(dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "delFlagBatch")) {
+        struct batch b;
+        DBusMessageIter array, strukt;
+        dbus_uint64_t tpid, id;
+        u_proc *proc;
+
+        if(!dbus_message_has_signature(m, "a(tt)b") ||
+           !dbus_message_iter_init(m, &imsg))
+            PUSH_ERROR(DBUS_ERROR_INVALID_ARGS, "wrong arguments")
+
+        GET_CALLER()
+
+        batch_init(&b, caller);
+        dbus_message_iter_recurse(&imsg, &array);
+        while(dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+            dbus_message_iter_recurse(&array, &strukt);
+            dbus_message_iter_get_basic(&strukt, &tpid);
+            dbus_message_iter_next(&strukt);
+            dbus_message_iter_get_basic(&strukt, &id);
+            dbus_message_iter_next(&array);
+
+            proc = batch_get_proc(&b, tpid);
+            if(proc)
+                u_flag_clear_flag(proc, (void *)id);
+        }
+
+        if(batch_get_flag(&imsg))
+            process_run_list(b.procs, FALSE);
+
+        ret = dbus_message_new_method_return(m);
+        batch_finish(&b, ret);
+        goto finish;
+
+    } else if(dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "clearFlagsBatch") ||
+              (is2 = dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "scheduleTaskBatch"))) {
+        struct batch b;
+        DBusMessageIter array;
+        dbus_uint64_t tpid;
+        u_proc *proc;
+
+        if(!dbus_message_has_signature(m, "atb") ||
+           !dbus_message_iter_init(m, &imsg))
+            PUSH_ERROR(DBUS_ERROR_INVALID_ARGS, "wrong arguments")
+
+        GET_CALLER()
+
+        batch_init(&b, caller);
+        dbus_message_iter_recurse(&imsg, &array);
+        while(dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_UINT64) {
+            dbus_message_iter_get_basic(&array, &tpid);
+            dbus_message_iter_next(&array);
+
+            proc = batch_get_proc(&b, tpid);
+            if(proc && !is2)
+                u_flag_clear_source(proc, U_DBUS_POINTER);
+        }
+
+        // scheduleTaskBatch always schedules, the flag tells to update first
+        if(is2)
+            process_run_list(b.procs, batch_get_flag(&imsg));
+        else if(batch_get_flag(&imsg))
+            process_run_list(b.procs, FALSE);
+
+        ret = dbus_message_new_method_return(m);
+        batch_finish(&b, ret);
+        goto finish;
+
+    } else if(dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "subscribeScheduled") ||
+              (is2 = dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "unsubscribeScheduled"))) {
+        const char *sender = dbus_message_get_sender(m);
+
+        if(!sender)
+            PUSH_ERROR(DBUS_ERROR_INVALID_ARGS, "wrong arguments")
+
+        if(is2)
+            g_hash_table_remove(scheduled_subscribers, sender);
+        else
+            g_hash_table_insert(scheduled_subscribers, g_strdup(sender), NULL);
+        g_debug("ProcessScheduled: %d subscribers", u_dbus_scheduled_listeners());
+
+        ret = dbus_message_new_method_return(m);
+        goto finish;
+
     } else if(dbus_message_is_method_call(m, U_DBUS_SYSTEM_INTERFACE, "setSchedulerConfig")) {
         u_scheduler *sched = scheduler_get();
         char *tmps = NULL;
@@ -771,6 +1198,7 @@ gboolean u_dbus_setup() {
 
     dbus_connection_register_object_path(c, U_DBUS_USER_PATH, &utable, NULL);
     dbus_connection_register_object_path(c, U_DBUS_SYSTEM_PATH, &stable, NULL);
+    scheduled_init(c);
 
     //systemd_init();
     consolekit_init();
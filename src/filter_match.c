@@ -0,0 +1,345 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  re_basename and re_cmdline of all filters in one matcher
+
+  most filter patterns are lists of names like "cron|anacron". the names of
+  all filters go into one aho-corasick automaton for the basename and one
+  for the cmdline, so a single pass over each string finds every filter it
+  matches. the result is kept as bit set in the process until its cmdline
+  is read again, all later filter checks of that process are a bit test.
+
+  patterns that are not a plain alternation of names stay a GRegex and are
+  matched one by one, like before.
+*/
+
+#include "config.h"
+#include "ulatency.h"
+
+#include <string.h>
+#include <glib.h>
+
+enum { MATCH_BASENAME, MATCH_CMDLINE, MATCH_KINDS };
+
+struct match_pattern {
+  GRegex   *re[MATCH_KINDS];
+  gboolean  literal[MATCH_KINDS];   //!< part of the automaton
+};
+
+// deterministic automaton, every state has a transition for every class
+struct match_automaton {
+  guint     n_states;
+  guint     n_classes;
+  guint8    classes[256];           //!< byte -> character class, 0 for unused bytes
+  guint32  *next;                   //!< n_states * n_classes transitions
+  guint32  *out;                    //!< n_states * words, filters matching in the state
+  guint8   *has_out;
+};
+
+static GArray *patterns = NULL;     // struct match_pattern, index is the id
+static struct match_automaton automata[MATCH_KINDS];
+static guint words = 0;             // guint32 per bit set
+static guint generation = 1;        // bit sets of older generations are stale
+static gboolean dirty = FALSE;
+
+struct u_filter_match_stats U_filter_match_stats;
+
+/**
+ * split a pattern into the names of an alternation
+ * @arg pattern regular expression
+ *
+ * a leading or trailing ".*" is dropped, it changes nothing in an unanchored
+ * search. escaped punctuation is taken literally.
+ *
+ * @return NULL terminated names or NULL if the pattern is more than that
+ */
+static gchar **split_literals(const char *pattern) {
+  GPtrArray *rv = g_ptr_array_new();
+  GString *cur = g_string_new(NULL);
+  const char *p = pattern;
+
+  for(;;) {
+    if(!strncmp(p, ".*", 2) && !cur->len)
+      p += 2;
+    if(!*p || *p == '|') {
+      if(!cur->len)
+        goto fail;
+      g_ptr_array_add(rv, g_string_free(cur, FALSE));
+      if(!*p)
+        break;
+      cur = g_string_new(NULL);
+      p++;
+      continue;
+    }
+    if(*p == '\\') {
+      if(!p[1] || g_ascii_isalnum(p[1]))
+        goto fail;
+      g_string_append_c(cur, p[1]);
+      p += 2;
+      continue;
+    }
+    if(*p == '.' && p[1] == '*' && (!p[2] || p[2] == '|')) {
+      p += 2;
+      continue;
+    }
+    if(strchr("^$.[]()?*+{}", *p))
+      goto fail;
+    g_string_append_c(cur, *p++);
+  }
+  g_ptr_array_add(rv, NULL);
+  return (gchar **)g_ptr_array_free(rv, FALSE);
+
+fail:
+  g_string_free(cur, TRUE);
+  g_ptr_array_add(rv, NULL);
+  g_strfreev((gchar **)g_ptr_array_free(rv, FALSE));
+  return NULL;
+}
+
+static void automaton_free(struct match_automaton *a) {
+  g_free(a->next);
+  g_free(a->out);
+  g_free(a->has_out);
+  memset(a, 0, sizeof(struct match_automaton));
+}
+
+#define NEXT(A,S,C) ((A)->next[(S) * (A)->n_classes + (C)])
+#define OUT(A,S) ((A)->out + (S) * words)
+
+/**
+ * build the automaton of one kind of patterns
+ * @arg a automaton
+ * @arg kind MATCH_BASENAME or MATCH_CMDLINE
+ */
+static void automaton_build(struct match_automaton *a, int kind) {
+  struct match_pattern *mp;
+  gchar **names;
+  guint32 *fail, *queue;
+  guint alloc = 64, head = 0, tail = 0;
+  guint i, j, c, s, u;
+  const guint8 *n;
+
+  automaton_free(a);
+
+  // character classes of all bytes used in the names
+  a->n_classes = 1;
+  for(i = 0; i < patterns->len; i++) {
+    mp = &g_array_index(patterns, struct match_pattern, i);
+    if(!mp->literal[kind])
+      continue;
+    names = split_literals(g_regex_get_pattern(mp->re[kind]));
+    for(j = 0; names[j]; j++)
+      for(n = (const guint8 *)names[j]; *n; n++)
+        if(!a->classes[*n])
+          a->classes[*n] = a->n_classes++;
+    g_strfreev(names);
+  }
+
+  // the trie, G_MAXUINT32 for missing transitions
+  a->n_states = 1;
+  a->next = g_new(guint32, alloc * a->n_classes);
+  a->out = g_new0(guint32, alloc * words);
+  a->has_out = g_new0(guint8, alloc);
+  memset(a->next, 0xff, a->n_classes * sizeof(guint32));
+  for(i = 0; i < patterns->len; i++) {
+    mp = &g_array_index(patterns, struct match_pattern, i);
+    if(!mp->literal[kind])
+      continue;
+    names = split_literals(g_regex_get_pattern(mp->re[kind]));
+    for(j = 0; names[j]; j++) {
+      s = 0;
+      for(n = (const guint8 *)names[j]; *n; n++) {
+        c = a->classes[*n];
+        if(NEXT(a, s, c) == G_MAXUINT32) {
+          if(a->n_states == alloc) {
+            alloc *= 2;
+            a->next = g_renew(guint32, a->next, alloc * a->n_classes);
+            a->out = g_renew(guint32, a->out, alloc * words);
+            a->has_out = g_renew(guint8, a->has_out, alloc);
+          }
+          u = a->n_states++;
+          memset(&NEXT(a, u, 0), 0xff, a->n_classes * sizeof(guint32));
+          memset(OUT(a, u), 0, words * sizeof(guint32));
+          a->has_out[u] = 0;
+          NEXT(a, s, c) = u;
+        }
+        s = NEXT(a, s, c);
+      }
+      OUT(a, s)[i / 32] |= 1u << (i % 32);
+      a->has_out[s] = 1;
+    }
+    g_strfreev(names);
+  }
+
+  // breadth first: fail links, outputs of the suffixes and the missing
+  // transitions, which go where the fail link state goes
+  fail = g_new0(guint32, a->n_states);
+  queue = g_new(guint32, a->n_states);
+  for(c = 0; c < a->n_classes; c++) {
+    u = NEXT(a, 0, c);
+    if(u == G_MAXUINT32) {
+      NEXT(a, 0, c) = 0;
+    } else {
+      fail[u] = 0;
+      queue[tail++] = u;
+    }
+  }
+  while(head < tail) {
+    s = queue[head++];
+    for(c = 0; c < a->n_classes; c++) {
+      u = NEXT(a, s, c);
+      if(u == G_MAXUINT32) {
+        NEXT(a, s, c) = NEXT(a, fail[s], c);
+        continue;
+      }
+      fail[u] = NEXT(a, fail[s], c);
+      if(a->has_out[fail[u]]) {
+        for(j = 0; j < words; j++)
+          OUT(a, u)[j] |= OUT(a, fail[u])[j];
+        a->has_out[u] = 1;
+      }
+      queue[tail++] = u;
+    }
+  }
+  g_free(fail);
+  g_free(queue);
+}
+
+static void automaton_scan(struct match_automaton *a, const char *str, guint32 *bits) {
+  const guint8 *p = (const guint8 *)str;
+  guint32 s = 0;
+  guint j;
+
+  if(a->n_states <= 1)
+    return;
+  for(; *p; p++) {
+    s = NEXT(a, s, a->classes[*p]);
+    if(a->has_out[s])
+      for(j = 0; j < words; j++)
+        bits[j] |= OUT(a, s)[j];
+  }
+}
+
+#undef NEXT
+#undef OUT
+
+static void matcher_build() {
+  struct match_pattern *mp;
+  guint i, literal = 0, regex = 0;
+  int k;
+
+  words = (patterns->len + 31) / 32;
+  for(k = 0; k < MATCH_KINDS; k++)
+    automaton_build(&automata[k], k);
+  for(i = 0; i < patterns->len; i++) {
+    mp = &g_array_index(patterns, struct match_pattern, i);
+    for(k = 0; k < MATCH_KINDS; k++) {
+      if(mp->literal[k])
+        literal++;
+      else if(mp->re[k])
+        regex++;
+    }
+  }
+  generation++;
+  dirty = FALSE;
+  g_debug("filter matcher: %u patterns in the automata (%u and %u states), %u regular expressions",
+          literal, automata[MATCH_BASENAME].n_states, automata[MATCH_CMDLINE].n_states, regex);
+}
+
+static gboolean regex_match(struct match_pattern *mp, int kind, const char *str) {
+  if(!mp->re[kind] || mp->literal[kind] || !str)
+    return FALSE;
+  U_filter_match_stats.regex++;
+  return g_regex_match(mp->re[kind], str, 0, NULL);
+}
+
+/**
+ * add the patterns of a filter to the shared matcher
+ * @arg basename compiled re_basename or NULL
+ * @arg cmdline compiled re_cmdline or NULL
+ *
+ * @return id for u_filter_match
+ */
+int u_filter_match_add(GRegex *basename, GRegex *cmdline) {
+  struct match_pattern mp;
+  gchar **names;
+  int k;
+
+  if(!patterns)
+    patterns = g_array_new(FALSE, TRUE, sizeof(struct match_pattern));
+  memset(&mp, 0, sizeof(mp));
+  mp.re[MATCH_BASENAME] = basename;
+  mp.re[MATCH_CMDLINE] = cmdline;
+  for(k = 0; k < MATCH_KINDS; k++) {
+    if(!mp.re[k])
+      continue;
+    names = split_literals(g_regex_get_pattern(mp.re[k]));
+    mp.literal[k] = (names != NULL);
+    g_strfreev(names);
+  }
+  g_array_append_val(patterns, mp);
+  dirty = TRUE;
+  return patterns->len - 1;
+}
+
+/**
+ * check if the patterns of a filter match a process
+ * @arg proc #u_proc
+ * @arg id returned by u_filter_match_add
+ *
+ * the first call for a process matches all filters at once, the result is
+ * kept until the cmdline of the process is read again.
+ *
+ * @return TRUE if re_basename or re_cmdline of the filter matches
+ */
+gboolean u_filter_match(u_proc *proc, int id) {
+  struct match_pattern *mp;
+  guint i;
+
+  if(!patterns || id < 0 || (guint)id >= patterns->len)
+    return FALSE;
+  if(dirty)
+    matcher_build();
+
+  if(proc->filter_match_gen != generation) {
+    proc->filter_match = g_renew(guint32, proc->filter_match, words);
+    memset(proc->filter_match, 0, words * sizeof(guint32));
+    u_proc_ensure(proc, CMDLINE, FALSE);
+    if(proc->cmdfile)
+      automaton_scan(&automata[MATCH_BASENAME], proc->cmdfile, proc->filter_match);
+    if(proc->cmdline_match)
+      automaton_scan(&automata[MATCH_CMDLINE], proc->cmdline_match, proc->filter_match);
+
+    // the rest, unless the automata matched the filter already
+    for(i = 0; i < patterns->len; i++) {
+      mp = &g_array_index(patterns, struct match_pattern, i);
+      if(proc->filter_match[i / 32] & (1u << (i % 32)))
+        continue;
+      if(regex_match(mp, MATCH_BASENAME, proc->cmdfile) ||
+         regex_match(mp, MATCH_CMDLINE, proc->cmdline_match))
+        proc->filter_match[i / 32] |= 1u << (i % 32);
+    }
+    proc->filter_match_gen = generation;
+    U_filter_match_stats.scans++;
+  } else {
+    U_filter_match_stats.cached++;
+  }
+  return (proc->filter_match[id / 32] & (1u << (id % 32))) != 0;
+}
@@ -25,29 +25,20 @@
 // active user pid storage
 
 GList* active_users;
-
-static gint cmp_user(gconstpointer a,gconstpointer b) {
-  const guint uid = *(guint *)b;
-  const struct user_active *ua = a;
-
-  return (ua->uid - uid);
-}
-
-static gint cmp_pid(gconstpointer a, gconstpointer b) {
-  const guint pid = *(guint *)b;
-  const struct user_active_process *up = a;
-
-  return !(up->pid == pid);
-}
+// uid -> struct user_active of active_users
+static GHashTable *active_users_index = NULL;
 
 
 struct user_active* get_userlist(guint uid, gboolean create) {
   struct user_active *ua;
   GError *error = NULL;
 
-  GList* gls = g_list_find_custom(active_users, &uid, cmp_user);
-  if(gls)
-    return (struct user_active *)gls->data;
+  if(!active_users_index)
+    active_users_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  ua = g_hash_table_lookup(active_users_index, GUINT_TO_POINTER(uid));
+  if(ua)
+    return ua;
   if(create) {
     ua = g_malloc0(sizeof(struct user_active));
     ua->uid = uid;
@@ -57,8 +48,10 @@ struct user_active* get_userlist(guint uid, gboolean create) {
       ua->max_processes = 5;
     }
     ua->last_change = time(NULL);
-    ua->actives = NULL; //g_list_alloc();
+    g_queue_init(&ua->actives);
+    ua->active_pids = g_hash_table_new(g_direct_hash, g_direct_equal);
     active_users = g_list_append(active_users, ua);
+    g_hash_table_insert(active_users_index, GUINT_TO_POINTER(uid), ua);
     return ua;
   }
   return NULL;
@@ -66,42 +59,138 @@ struct user_active* get_userlist(guint uid, gboolean create) {
 
 /*
   mark a process as active
+
+  the actives queue is kept in LRU order, so a process is moved to the front
+  instead of sorting the list. every entry stores its position, a move only
+  shifts the entries in front of the old position, so get_active_pos is a
+  lookup.
+
+  when the front changes, the process groups of the new and the former active
+  process are moved in one batch through scheduler_run_focus. the tasks files
+  are written in the background, the change is timed until the writes of the
+  focused process completed, see u_focus_tasks_written().
 */
 
-static gint cmp_last_change(gconstpointer a,gconstpointer b) {
-  const struct user_active_process *u1 = a;
-  const struct user_active_process *u2 = b;
-  return (u2->last_change - u1->last_change);
+// budget from a focus change until the focused process is placed
+#define FOCUS_LATENCY_TARGET 5 // ms
+
+// the focus change in flight. a newer change replaces it
+static struct {
+  guint pid;
+  gint64 start;         // monotonic time of the change in us
+  guint writes;         // tasks writes of pid not completed yet
+  gboolean scheduled;   // scheduler_run_focus returned
+} focus_pending;
+
+static void focus_placed(void) {
+  gdouble elapsed = (g_get_monotonic_time() - focus_pending.start) / 1000.0;
+
+  U_focus_stats.placed++;
+  U_focus_stats.latency_last = elapsed;
+  if(elapsed > U_focus_stats.latency_max)
+    U_focus_stats.latency_max = elapsed;
+  if(elapsed > FOCUS_LATENCY_TARGET) {
+    U_focus_stats.over_budget++;
+    g_debug("focus change to %d placed in %0.2F ms, over the %d ms budget",
+            focus_pending.pid, elapsed, FOCUS_LATENCY_TARGET);
+  } else {
+    g_debug("focus change to %d placed in %0.2F ms", focus_pending.pid, elapsed);
+  }
+  focus_pending.pid = 0;
+}
+
+/**
+ * a tasks file write of a process was queued
+ * @arg pid pid written
+ */
+void u_focus_tasks_queued(pid_t pid) {
+  if(focus_pending.pid && focus_pending.pid == pid)
+    focus_pending.writes++;
+}
+
+/**
+ * a tasks file write of a process completed
+ * @arg pid pid written
+ *
+ * ends the timing of the pending focus change with the last write of the
+ * focused process
+ */
+void u_focus_tasks_written(pid_t pid) {
+  if(!focus_pending.pid || focus_pending.pid != pid || !focus_pending.writes)
+    return;
+  focus_pending.writes--;
+  if(!focus_pending.writes && focus_pending.scheduled)
+    focus_placed();
+}
+
+// the head moved to the front from position old, the entries that were in
+// front of it move back by one. new entries come from behind the tail
+static void shift_active_pos(struct user_active *ua, guint old) {
+  struct user_active_process *cur;
+  GList *link;
+
+  ((struct user_active_process *)ua->actives.head->data)->pos = 1;
+  for(link = ua->actives.head->next; link; link = link->next) {
+    cur = link->data;
+    if(cur->pos >= old)
+      break;
+    cur->pos++;
+  }
 }
 
 void set_active_pid(guint uid, guint pid) 
 {
-  u_proc *proc;
+  u_proc *proc, *prev = NULL;
   struct user_active_process *up;
   struct user_active *ua = get_userlist(uid, TRUE);
-  GList* ups = g_list_find_custom(ua->actives, &pid, cmp_pid);
+  gboolean focus = TRUE;
+  gint64 start = g_get_monotonic_time();
+
+  if(ua->actives.head)
+    prev = g_hash_table_lookup(processes,
+        GUINT_TO_POINTER(((struct user_active_process *)ua->actives.head->data)->pid));
+
+  up = g_hash_table_lookup(ua->active_pids, GUINT_TO_POINTER(pid));
 
-  if(!ups) {
-    up = g_malloc(sizeof(struct user_active_process));
+  if(!up) {
+    up = g_slice_new0(struct user_active_process);
     up->pid = pid;
-    ua->actives = g_list_prepend(ua->actives, up);
-    proc = proc_by_pid(pid);
-    if(proc) {
-      proc->changed = 1;
-      process_run_one(proc, FALSE, FALSE);
-    }
+    up->link.data = up;
+    g_queue_push_head_link(&ua->actives, &up->link);
+    g_hash_table_insert(ua->active_pids, GUINT_TO_POINTER(pid), up);
+    shift_active_pos(ua, G_MAXUINT);
+  } else if(ua->actives.head != &up->link) {
+    g_queue_unlink(&ua->actives, &up->link);
+    g_queue_push_head_link(&ua->actives, &up->link);
+    shift_active_pos(ua, up->pos);
   } else {
-    up = ups->data;
+    focus = FALSE;
   }
-  // remove the entries to much
   up->last_change = time(NULL);
 
-  ua->actives = g_list_sort(ua->actives, cmp_last_change);
+  if(focus) {
+    proc = proc_by_pid(pid);
+    if(proc) {
+      focus_pending.pid = pid;
+      focus_pending.start = start;
+      focus_pending.writes = 0;
+      focus_pending.scheduled = FALSE;
+      scheduler_run_focus(proc, prev);
+      g_debug("focus change to %d queued in %0.2F ms", pid,
+              (g_get_monotonic_time() - start) / 1000.0);
+      // without a write the process was in place already
+      focus_pending.scheduled = TRUE;
+      if(focus_pending.pid == pid && !focus_pending.writes)
+        focus_placed();
+    }
+  }
 
-  while(g_list_length(ua->actives) > ua->max_processes) {
-      up = g_list_last(ua->actives)->data;
+  // remove the entries to much
+  while(ua->actives.length > ua->max_processes) {
+      up = g_queue_pop_tail_link(&ua->actives)->data;
+      g_hash_table_remove(ua->active_pids, GUINT_TO_POINTER(up->pid));
       proc = proc_by_pid(up->pid);
-      ua->actives = g_list_remove(ua->actives, up);
+      g_slice_free(struct user_active_process, up);
       if(proc) {
         proc->changed = 1;
         process_run_one(proc, FALSE, FALSE);
@@ -110,36 +199,152 @@ void set_active_pid(guint uid, guint pid)
 
 }
 
-int is_active_pid(u_proc *proc) {
-  GList* ups;
-  struct user_active *ua = get_userlist(proc->proc.ruid, FALSE);
+// the first change of a storm is applied at once, the window only delays the
+// last one. 50 ms made that final switch noticeably late, 20 ms still covers
+// the burst of property changes a window manager sends for one switch
+#define FOCUS_DEBOUNCE_DEFAULT 20 // ms
 
-  if(!ua)
-    return FALSE;
+struct u_focus_stats U_focus_stats;
 
-  ups = g_list_find_custom(ua->actives, &proc->pid, cmp_pid);
+static gboolean focus_debounce_timeout(gpointer data) {
+  struct user_active *ua = data;
+  guint pid = ua->focus_pending;
 
-  if(!ups)
+  if(!pid) {
+    ua->focus_timeout = 0;
     return FALSE;
+  }
+  ua->focus_pending = 0;
+  U_focus_stats.applied++;
+  set_active_pid(ua->uid, pid);
+  // keep the window open while changes come in
   return TRUE;
 }
 
-int get_active_pos(u_proc *proc) {
-  int rv = 0;
-  GList *cur;
-  struct user_active *ua = get_userlist(proc->proc.ruid, FALSE);
+/*
+  mark a process as active, coalescing focus storms
 
-  if(!ua)
-    return 0;
-
-  cur = ua->actives;
-  while(cur) {
-    rv++;
-    if(((struct user_active_process *)cur->data)->pid == proc->pid)
-      return rv;
-    cur = g_list_next(cur);
+  the first change is applied at once and opens a debounce window of
+  [user] focus_debounce milliseconds. changes inside the window only replace
+  the pending pid, which is applied when the window closes. so alt-tab
+  storms cause at most one reschedule per window. the number of merged
+  changes is counted in U_focus_stats.
+*/
+
+void set_active_pid_debounced(guint uid, guint pid)
+{
+  static gint interval = -1;
+  struct user_active *ua = get_userlist(uid, TRUE);
+  GError *error = NULL;
+
+  if(interval < 0) {
+    interval = g_key_file_get_integer(config_data, "user", "focus_debounce", &error);
+    if(error && error->code) {
+      interval = FOCUS_DEBOUNCE_DEFAULT;
+      g_error_free(error);
+    }
+    if(interval < 0)
+      interval = 0;
+  }
+
+  U_focus_stats.requests++;
+  if(ua->focus_timeout) {
+    if(ua->focus_pending)
+      U_focus_stats.merged++;
+    ua->focus_pending = pid;
+    return;
+  }
+  U_focus_stats.applied++;
+  set_active_pid(uid, pid);
+  if(interval)
+    ua->focus_timeout = g_timeout_add(interval, focus_debounce_timeout, ua);
+}
+
+/*
+  active agents
+
+  an active agent is a source of focus changes for the active lists, like
+  the x server watcher. agents register for a unique id and claim the active
+  list of a user before they report changes through
+  set_active_pid_debounced(). only one agent tracks a user at a time.
+*/
+
+static GHashTable *active_agents = NULL; // agent id -> name
+
+guint active_agent_register(const char *name) {
+  guint agent = get_plugin_id();
+
+  if(!active_agents)
+    active_agents = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, g_free);
+  g_hash_table_insert(active_agents, GUINT_TO_POINTER(agent), g_strdup(name));
+  g_debug("active agent %s registered as %d", name, agent);
+  return agent;
+}
+
+const char *active_agent_name(guint agent) {
+  const char *name;
+
+  switch(agent) {
+    case USER_ACTIVE_AGENT_NONE:
+      return "none";
+    case USER_ACTIVE_AGENT_DISABLED:
+      return "disabled";
+    case USER_ACTIVE_AGENT_DBUS:
+      return "dbus";
+  }
+  if(active_agents) {
+    name = g_hash_table_lookup(active_agents, GUINT_TO_POINTER(agent));
+    if(name)
+      return name;
+  }
+  return "unknown";
+}
+
+// takes over the active list of the user if no agent tracks it
+int active_agent_claim(guint uid, guint agent) {
+  struct user_active *ua = get_userlist(uid, TRUE);
+
+  if(ua->active_agent == USER_ACTIVE_AGENT_NONE) {
+    ua->active_agent = agent;
+    g_debug("active agent %s tracks uid %d", active_agent_name(agent), uid);
   }
-  return 0;
+  return ua->active_agent == agent;
+}
+
+// gives the active list free for other agents, ie. when a session is gone
+void active_agent_release(guint uid, guint agent) {
+  struct user_active *ua = get_userlist(uid, FALSE);
+
+  if(ua && ua->active_agent == agent) {
+    ua->active_agent = USER_ACTIVE_AGENT_NONE;
+    g_debug("active agent %s released uid %d", active_agent_name(agent), uid);
+  }
+}
+
+static struct user_active_process *get_active_process(u_proc *proc) {
+  struct user_active *ua;
+
+  // the real uid is parsed from status
+  if(!u_proc_ensure_fields(proc, UPROC_FIELD_STATUS, FALSE))
+    return NULL;
+
+  ua = get_userlist(proc->proc.ruid, FALSE);
+  if(!ua)
+    return NULL;
+
+  return g_hash_table_lookup(ua->active_pids, GUINT_TO_POINTER(proc->pid));
+}
+
+int is_active_pid(u_proc *proc) {
+  return get_active_process(proc) != NULL;
+}
+
+// position in the active list starting with 1, 0 if not active
+int get_active_pos(u_proc *proc) {
+  struct user_active_process *up = get_active_process(proc);
+
+  return up ? up->pos : 0;
 }
 
 // cgroups 
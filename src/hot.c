@@ -0,0 +1,439 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  hot fields of all processes
+
+  proc_t is large and the numbers most scans look at are spread over many
+  cache lines of it. every listed process gets a slot, and its hot numbers are
+  mirrored into one dense array per field. a scan over rss of all processes
+  then reads a single array from front to back.
+
+  free slots have pid 0 and are skipped by all scans. slots are reused, so
+  the arrays only grow to the highest number of processes seen.
+
+  pgrp and session hold what the rules see as proc.pgrp and proc.session,
+  a fake value set by the rules counts. sums by pgrp then match the groups
+  the rules compare against.
+
+  slots of the same process group are linked together, so the members of a
+  group are found without a scan. the link follows U_PROC_PGRP as well.
+*/
+
+#include "config.h"
+#include "ulatency.h"
+
+#include <string.h>
+#include <glib.h>
+
+#define HOT_MIN_ALLOC 1024
+
+struct u_proc_hot U_proc_hot;
+
+static GArray *hot_free = NULL; // free slots below U_proc_hot.len
+static GHashTable *group_heads = NULL; // pgrp -> first slot + 1
+
+static const char *hot_names[] = {
+  [U_HOT_PID] = "pid",
+  [U_HOT_PPID] = "ppid",
+  [U_HOT_PGRP] = "pgrp",
+  [U_HOT_SESSION] = "session",
+  [U_HOT_EUID] = "euid",
+  [U_HOT_EGID] = "egid",
+  [U_HOT_RSS] = "rss",
+  [U_HOT_VM_RSS] = "vm_rss",
+  [U_HOT_UTIME] = "utime",
+  [U_HOT_STIME] = "stime",
+  [U_HOT_SCHED] = "sched",
+  [U_HOT_RTPRIO] = "rtprio",
+  [U_HOT_NLWP] = "nlwp",
+};
+
+static void hot_grow() {
+  struct u_proc_hot *h = &U_proc_hot;
+  guint32 alloc = MAX(h->alloc * 2, HOT_MIN_ALLOC);
+
+  h->procs = g_renew(u_proc *, h->procs, alloc);
+  h->pid = g_renew(int, h->pid, alloc);
+  h->ppid = g_renew(int, h->ppid, alloc);
+  h->pgrp = g_renew(int, h->pgrp, alloc);
+  h->session = g_renew(int, h->session, alloc);
+  h->euid = g_renew(int, h->euid, alloc);
+  h->egid = g_renew(int, h->egid, alloc);
+  h->nlwp = g_renew(int, h->nlwp, alloc);
+  h->rss = g_renew(long, h->rss, alloc);
+  h->vm_rss = g_renew(unsigned long, h->vm_rss, alloc);
+  h->sched = g_renew(unsigned long, h->sched, alloc);
+  h->rtprio = g_renew(unsigned long, h->rtprio, alloc);
+  h->utime = g_renew(unsigned long long, h->utime, alloc);
+  h->stime = g_renew(unsigned long long, h->stime, alloc);
+  h->group = g_renew(int, h->group, alloc);
+  h->group_next = g_renew(int, h->group_next, alloc);
+  h->group_prev = g_renew(int, h->group_prev, alloc);
+  h->alloc = alloc;
+}
+
+static void group_unlink(guint32 slot) {
+  struct u_proc_hot *h = &U_proc_hot;
+  int next = h->group_next[slot], prev = h->group_prev[slot];
+
+  if(!h->group[slot])
+    return;
+  if(prev >= 0)
+    h->group_next[prev] = next;
+  else if(next >= 0)
+    g_hash_table_insert(group_heads, GINT_TO_POINTER(h->group[slot]),
+                        GINT_TO_POINTER(next + 1));
+  else
+    g_hash_table_remove(group_heads, GINT_TO_POINTER(h->group[slot]));
+  if(next >= 0)
+    h->group_prev[next] = prev;
+  h->group[slot] = 0;
+}
+
+static void group_link(guint32 slot, int pgrp) {
+  struct u_proc_hot *h = &U_proc_hot;
+  int head;
+
+  if(!group_heads)
+    group_heads = g_hash_table_new(g_direct_hash, g_direct_equal);
+  head = GPOINTER_TO_INT(g_hash_table_lookup(group_heads, GINT_TO_POINTER(pgrp))) - 1;
+  h->group[slot] = pgrp;
+  h->group_prev[slot] = -1;
+  h->group_next[slot] = head;
+  if(head >= 0)
+    h->group_prev[head] = slot;
+  g_hash_table_insert(group_heads, GINT_TO_POINTER(pgrp), GINT_TO_POINTER(slot + 1));
+}
+
+/**
+ * give a process a slot in the hot field store
+ * @arg proc #u_proc
+ *
+ * called when the process is added to the process list
+ */
+void u_hot_add(u_proc *proc) {
+  struct u_proc_hot *h = &U_proc_hot;
+  guint32 slot;
+
+  if(proc->slot >= 0)
+    return;
+  if(!hot_free)
+    hot_free = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+  if(hot_free->len) {
+    slot = g_array_index(hot_free, guint32, hot_free->len - 1);
+    g_array_set_size(hot_free, hot_free->len - 1);
+  } else {
+    if(h->len == h->alloc)
+      hot_grow();
+    slot = h->len++;
+  }
+  proc->slot = slot;
+  h->procs[slot] = proc;
+  h->group[slot] = 0;
+  u_hot_store(proc);
+}
+
+/**
+ * release the slot of a process
+ * @arg proc #u_proc
+ *
+ * called when the process is removed from the process list
+ */
+void u_hot_remove(u_proc *proc) {
+  struct u_proc_hot *h = &U_proc_hot;
+  guint32 slot;
+
+  if(proc->slot < 0)
+    return;
+  slot = proc->slot;
+  group_unlink(slot);
+  h->pid[slot] = 0;
+  h->procs[slot] = NULL;
+  proc->slot = -1;
+  if(slot == h->len - 1)
+    h->len--;
+  else
+    g_array_append_val(hot_free, slot);
+}
+
+/**
+ * mirror the hot fields of a process
+ * @arg proc #u_proc
+ *
+ * called whenever proc->proc was parsed again
+ */
+void u_hot_store(u_proc *proc) {
+  struct u_proc_hot *h = &U_proc_hot;
+  proc_t *p = &(proc->proc);
+  int slot = proc->slot;
+
+  if(slot < 0)
+    return;
+  h->pid[slot] = proc->pid;
+  h->ppid[slot] = p->ppid;
+  h->euid[slot] = p->euid;
+  h->egid[slot] = p->egid;
+  h->nlwp[slot] = p->nlwp;
+  h->rss[slot] = p->rss;
+  h->vm_rss[slot] = p->vm_rss;
+  h->sched[slot] = p->sched;
+  h->rtprio[slot] = p->rtprio;
+  h->utime[slot] = p->utime;
+  h->stime[slot] = p->stime;
+  u_hot_regroup(proc);
+}
+
+/**
+ * index a process under its current process group
+ * @arg proc #u_proc
+ *
+ * called by u_hot_store and whenever the fake pgrp or session of the process
+ * changed. mirrors both.
+ */
+void u_hot_regroup(u_proc *proc) {
+  struct u_proc_hot *h = &U_proc_hot;
+  int pgrp = U_PROC_PGRP(proc);
+
+  if(proc->slot < 0)
+    return;
+  h->pgrp[proc->slot] = pgrp;
+  h->session[proc->slot] = U_PROC_SESSION(proc);
+  if(h->group[proc->slot] == pgrp)
+    return;
+  group_unlink(proc->slot);
+  if(pgrp > 0)
+    group_link(proc->slot, pgrp);
+}
+
+/**
+ * members of a process group
+ * @arg pgrp process group, compared to U_PROC_PGRP
+ * @arg out #GPtrArray the #u_proc pointers are appended to
+ */
+void u_hot_group_members(pid_t pgrp, GPtrArray *out) {
+  struct u_proc_hot *h = &U_proc_hot;
+  int slot;
+
+  if(!group_heads)
+    return;
+  slot = GPOINTER_TO_INT(g_hash_table_lookup(group_heads, GINT_TO_POINTER(pgrp))) - 1;
+  for(; slot >= 0; slot = h->group_next[slot])
+    g_ptr_array_add(out, h->procs[slot]);
+}
+
+/**
+ * main parameters of a process differ from the store
+ * @arg proc #u_proc
+ * @arg p freshly parsed data
+ *
+ * compares the parameters that cause a reschedule: euid, egid, session,
+ * pgrp, sched and rtprio. pgrp and session are compared as the rules see
+ * them, a set fake value hides changes of the real one.
+ *
+ * @return TRUE if one of them changed
+ */
+int u_hot_changed(u_proc *proc, proc_t *p) {
+  struct u_proc_hot *h = &U_proc_hot;
+  int slot = proc->slot;
+
+  if(slot < 0)
+    return FALSE;
+  return (h->euid[slot] != p->euid) |
+         (h->session[slot] != (proc->fake_session ? proc->fake_session : p->session)) |
+         (h->egid[slot] != p->egid) |
+         (h->pgrp[slot] != (proc->fake_pgrp ? proc->fake_pgrp : p->pgrp)) |
+         (h->sched[slot] != p->sched) | (h->rtprio[slot] != p->rtprio);
+}
+
+/**
+ * field by name
+ * @arg name name of a proc_t member, ie. "rss"
+ *
+ * @return #U_HOT_FIELD or -1
+ */
+int u_hot_field(const char *name) {
+  int i;
+  for(i = 0; i < U_HOT_FIELDS; i++)
+    if(!strcmp(hot_names[i], name))
+      return i;
+  return -1;
+}
+
+/**
+ * copy a field of all slots into a value array
+ * @arg field #U_HOT_FIELD
+ * @arg values array of U_proc_hot.len entries
+ *
+ * every field type gets its own loop, so the compiler can vectorize it.
+ */
+void u_hot_values(int field, gint64 *values) {
+  struct u_proc_hot *h = &U_proc_hot;
+  guint32 i, n = h->len;
+
+#define HOT_COPY(ARRAY) \
+  for(i = 0; i < n; i++) values[i] = (gint64)h->ARRAY[i]; \
+  break;
+
+  switch(field) {
+    case U_HOT_PID:     HOT_COPY(pid)
+    case U_HOT_PPID:    HOT_COPY(ppid)
+    case U_HOT_PGRP:    HOT_COPY(pgrp)
+    case U_HOT_SESSION: HOT_COPY(session)
+    case U_HOT_EUID:    HOT_COPY(euid)
+    case U_HOT_EGID:    HOT_COPY(egid)
+    case U_HOT_NLWP:    HOT_COPY(nlwp)
+    case U_HOT_RSS:     HOT_COPY(rss)
+    case U_HOT_VM_RSS:  HOT_COPY(vm_rss)
+    case U_HOT_SCHED:   HOT_COPY(sched)
+    case U_HOT_RTPRIO:  HOT_COPY(rtprio)
+    case U_HOT_UTIME:   HOT_COPY(utime)
+    case U_HOT_STIME:   HOT_COPY(stime)
+    default:
+      memset(values, 0, n * sizeof(gint64));
+  }
+#undef HOT_COPY
+}
+
+static gint64 *hot_scratch(guint32 n) {
+  static gint64 *scratch = NULL;
+  static guint32 scratch_len = 0;
+
+  if(n > scratch_len) {
+    scratch_len = MAX(n, HOT_MIN_ALLOC);
+    scratch = g_renew(gint64, scratch, scratch_len);
+  }
+  return scratch;
+}
+
+// min-heap of slots ordered by values
+static void heap_swap(guint32 *heap, guint32 a, guint32 b) {
+  guint32 tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+}
+
+static void heap_up(const gint64 *values, guint32 *heap, guint32 pos) {
+  while(pos && values[heap[pos]] < values[heap[(pos - 1) / 2]]) {
+    heap_swap(heap, pos, (pos - 1) / 2);
+    pos = (pos - 1) / 2;
+  }
+}
+
+static void heap_down(const gint64 *values, guint32 *heap, guint32 len) {
+  guint32 pos = 0, child;
+
+  while((child = 2 * pos + 1) < len) {
+    if(child + 1 < len && values[heap[child + 1]] < values[heap[child]])
+      child++;
+    if(values[heap[pos]] <= values[heap[child]])
+      break;
+    heap_swap(heap, pos, child);
+    pos = child;
+  }
+}
+
+/**
+ * processes with the largest values of a field
+ * @arg field #U_HOT_FIELD
+ * @arg n maximum number of processes
+ * @arg out array of at least n #u_proc pointers
+ *
+ * a single scan keeping the n largest values in a min-heap.
+ *
+ * @return number of processes in out, largest first
+ */
+guint u_hot_top(int field, guint n, u_proc **out) {
+  struct u_proc_hot *h = &U_proc_hot;
+  gint64 *values = hot_scratch(h->len);
+  guint32 *heap;
+  guint32 i, len = 0;
+
+  if(!n)
+    return 0;
+  u_hot_values(field, values);
+  heap = g_new(guint32, n);
+
+  for(i = 0; i < h->len; i++) {
+    if(!h->pid[i])
+      continue;
+    if(len < n) {
+      heap[len] = i;
+      heap_up(values, heap, len++);
+    } else if(values[i] > values[heap[0]]) {
+      heap[0] = i;
+      heap_down(values, heap, len);
+    }
+  }
+
+  // the smallest goes to the back of out
+  for(i = len; i > 0; i--) {
+    out[i - 1] = h->procs[heap[0]];
+    heap[0] = heap[i - 1];
+    heap_down(values, heap, i - 1);
+  }
+
+  g_free(heap);
+  return len;
+}
+
+/**
+ * processes with a field at or above a threshold
+ * @arg field #U_HOT_FIELD
+ * @arg threshold minimum value
+ * @arg out #GPtrArray the #u_proc pointers are appended to
+ */
+void u_hot_above(int field, gint64 threshold, GPtrArray *out) {
+  struct u_proc_hot *h = &U_proc_hot;
+  gint64 *values = hot_scratch(h->len);
+  guint32 i;
+
+  u_hot_values(field, values);
+  for(i = 0; i < h->len; i++)
+    if(h->pid[i] && values[i] >= threshold)
+      g_ptr_array_add(out, h->procs[i]);
+}
+
+/**
+ * sum a field grouped by another one
+ * @arg field #U_HOT_FIELD to sum
+ * @arg by #U_HOT_FIELD to group by, ie. U_HOT_PGRP
+ * @arg sums #GHashTable of #gint64 pointers, key is the value of by
+ */
+void u_hot_sum_by(int field, int by, GHashTable *sums) {
+  struct u_proc_hot *h = &U_proc_hot;
+  gint64 *values = hot_scratch(h->len * 2);
+  gint64 *keys = values + h->len;
+  gint64 *sum;
+  guint32 i;
+
+  u_hot_values(field, values);
+  u_hot_values(by, keys);
+  for(i = 0; i < h->len; i++) {
+    if(!h->pid[i])
+      continue;
+    sum = g_hash_table_lookup(sums, GINT_TO_POINTER((gint)keys[i]));
+    if(!sum) {
+      sum = g_new0(gint64, 1);
+      g_hash_table_insert(sums, GINT_TO_POINTER((gint)keys[i]), sum);
+    }
+    *sum += values[i];
+  }
+}
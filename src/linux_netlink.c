@@ -28,6 +28,8 @@
 #include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <linux/netlink.h>
 #include <linux/connector.h>
 #include <linux/cn_proc.h>
@@ -49,6 +51,177 @@
 #define BUFF_SIZE (MAX(MAX(SEND_MESSAGE_SIZE, RECV_MESSAGE_SIZE), 1024))
 #define MIN_RECV_SIZE (MIN(SEND_MESSAGE_SIZE, RECV_MESSAGE_SIZE))
 
+// events waiting for the scheduler are forgotten above this number
+#define MAX_PENDING 65536
+// latencies kept for the percentiles, a uniform sample of all placements
+#define LATENCY_SAMPLES 65536
+
+struct u_netlink_stats U_netlink_stats;
+
+/* the latency is only measured while events come from a socket, a normal
+ * daemon does not keep track of them */
+static gboolean measure = FALSE;
+
+struct pending_event {
+	guint64 timestamp_ns;
+	int writes;                     // tasks writes of the pid in flight
+	gboolean scheduled;
+};
+
+// pid -> pending_event that has to be placed
+static GHashTable *pending = NULL;
+// reservoir of latencies in nanoseconds
+static gint64 *samples = NULL;
+static guint64 samples_seen = 0;
+static gint64 latency_max = 0;
+
+static gint64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the kernel stamps events with the monotonic clock, so do synthetic
+ * ones. the latency is measured from there until the process is in its
+ * cgroups. */
+static void pending_add(pid_t pid, guint64 timestamp_ns)
+{
+	struct pending_event *ev;
+
+	if (!measure)
+		return;
+	if (!pending)
+		pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	if (g_hash_table_size(pending) >= MAX_PENDING)
+		g_hash_table_remove_all(pending);
+	// the first event counts, a fork followed by exec is one placement
+	if (!g_hash_table_lookup(pending, GUINT_TO_POINTER(pid))) {
+		ev = g_new0(struct pending_event, 1);
+		ev->timestamp_ns = timestamp_ns;
+		g_hash_table_insert(pending, GUINT_TO_POINTER(pid), ev);
+	}
+}
+
+static struct pending_event *pending_get(pid_t pid)
+{
+	if (!pending || !g_hash_table_size(pending))
+		return NULL;
+	return g_hash_table_lookup(pending, GUINT_TO_POINTER(pid));
+}
+
+static void pending_done(pid_t pid, struct pending_event *ev)
+{
+	gint64 latency = now_ns() - (gint64)ev->timestamp_ns;
+	guint64 slot;
+
+	g_hash_table_remove(pending, GUINT_TO_POINTER(pid));
+	if (!samples)
+		samples = g_new(gint64, LATENCY_SAMPLES);
+	// reservoir sampling keeps the memory fixed at any event rate
+	slot = samples_seen < LATENCY_SAMPLES ? samples_seen :
+	       (guint64)g_random_double_range(0, samples_seen + 1);
+	if (slot < LATENCY_SAMPLES)
+		samples[slot] = latency;
+	samples_seen++;
+	latency_max = MAX(latency_max, latency);
+	U_netlink_stats.placed++;
+}
+
+/**
+ * events are timed until their processes are placed
+ *
+ * @return TRUE while the latency is measured
+ */
+gboolean u_netlink_measuring(void)
+{
+	return measure;
+}
+
+/**
+ * the scheduler ran on a process
+ * @arg pid pid of the process
+ *
+ * ends the latency measurement of a pending event of the process, unless
+ * the scheduler queued a tasks write for it. then the completion of the
+ * write ends it, see u_netlink_tasks_written().
+ */
+void u_netlink_placed(pid_t pid)
+{
+	struct pending_event *ev = pending_get(pid);
+
+	if (!ev)
+		return;
+	ev->scheduled = TRUE;
+	if (!ev->writes)
+		pending_done(pid, ev);
+}
+
+/**
+ * a tasks file write of a process was queued
+ * @arg pid pid written
+ */
+void u_netlink_tasks_queued(pid_t pid)
+{
+	struct pending_event *ev = pending_get(pid);
+
+	if (ev)
+		ev->writes++;
+}
+
+/**
+ * a tasks file write of a process completed
+ * @arg pid pid written
+ */
+void u_netlink_tasks_written(pid_t pid)
+{
+	struct pending_event *ev = pending_get(pid);
+
+	if (!ev || !ev->writes)
+		return;
+	ev->writes--;
+	if (!ev->writes && ev->scheduled)
+		pending_done(pid, ev);
+}
+
+static int cmp_gint64(const void *a, const void *b)
+{
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * percentiles of the event to placement latency
+ * @arg q quantiles, ie. 0.5 and 0.99. 1.0 is the exact maximum
+ * @arg out latencies in nanoseconds, 0 when nothing was measured
+ * @arg n number of quantiles
+ * @arg reset forget the measured latencies afterwards
+ *
+ * above LATENCY_SAMPLES placements the percentiles come from a uniform
+ * sample of them.
+ */
+void u_netlink_latency(const double *q, gint64 *out, int n, gboolean reset)
+{
+	gint64 *sorted;
+	guint len = MIN(samples_seen, LATENCY_SAMPLES);
+	int i;
+
+	if (!len) {
+		memset(out, 0, n * sizeof(gint64));
+		return;
+	}
+	sorted = g_memdup(samples, len * sizeof(gint64));
+	qsort(sorted, len, sizeof(gint64), cmp_gint64);
+	for (i = 0; i < n; i++)
+		out[i] = q[i] >= 1.0 ? latency_max :
+		         sorted[MIN((guint)(q[i] * len), len - 1)];
+	g_free(sorted);
+	if (reset) {
+		samples_seen = 0;
+		latency_max = 0;
+	}
+}
+
 
 
 /**
@@ -64,6 +237,7 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 {
 	/* The event to consider */
 	struct proc_event *ev;
+	u_proc *proc;
 
 	/* Return codes */
 	int ret = 0;
@@ -71,6 +245,7 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 
 	/* Get the event data.  We only care about two event types. */
 	ev = (struct proc_event*)cn_hdr->data;
+	U_netlink_stats.events++;
 	switch (ev->what) {
 	// quite seldom events on old processes changing important parameters
 	case PROC_EVENT_UID:
@@ -79,8 +254,15 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 				ev->event_data.id.process_tgid,
 				ev->event_data.id.r.ruid,
 				ev->event_data.id.e.euid);
+		pending_add(ev->event_data.id.process_pid, ev->timestamp_ns);
 		//process_update_pid(ev->event_data.id.process_pid);
 		process_new(ev->event_data.id.process_pid, FALSE);
+		// keep the environment index accounted to the right user
+		proc = proc_by_pid(ev->event_data.id.process_tgid);
+		if(proc && proc->env_values)
+			u_env_index_set_uid(proc, ev->event_data.id.e.euid);
+		else if(proc)
+			u_env_index_update(proc);
 		break;
 	case PROC_EVENT_GID:
 		u_trace("GID Event: PID = %d, tGID = %d, rGID = %d,"
@@ -88,6 +270,7 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 				ev->event_data.id.process_tgid,
 				ev->event_data.id.r.rgid,
 				ev->event_data.id.e.egid);
+		pending_add(ev->event_data.id.process_pid, ev->timestamp_ns);
 		//process_update_pid(ev->event_data.id.process_pid);
 		process_new(ev->event_data.id.process_pid, FALSE);
 		break;
@@ -96,12 +279,15 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 		//g_ptr_array_foreach(stack, remove_pid_from_stack, &pid);
 		// if the pid was found in the new stack, pid is set to 0 to indicate
 		// the removal
+		if (pending)
+			g_hash_table_remove(pending, GUINT_TO_POINTER(ev->event_data.exit.process_pid));
 		process_remove_by_pid(ev->event_data.exit.process_pid);
 		break;
 	case PROC_EVENT_EXEC:
 		u_trace("EXEC Event: PID = %d, tGID = %d",
 				ev->event_data.exec.process_pid,
 				ev->event_data.exec.process_tgid);
+		pending_add(ev->event_data.exec.process_tgid, ev->timestamp_ns);
 		process_new_delay(ev->event_data.exec.process_tgid, 0);
 		break;
 	case PROC_EVENT_FORK:
@@ -112,6 +298,7 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 		// FIXME need filter block to get those events
 		if(ev->event_data.fork.parent_tgid != ev->event_data.fork.child_pid)
 			break;
+		pending_add(ev->event_data.fork.child_tgid, ev->timestamp_ns);
 		// parent does not mean the parent of the new proc, but the parent of
 		// the forking process. so we lookup the parent of the forking process
 		// first
@@ -120,6 +307,10 @@ static int nl_handle_msg(struct cn_msg *cn_hdr)
 		if(rparent) {
 			u_proc_ensure(rparent, BASIC, FALSE);
 			process_new_delay(ev->event_data.fork.child_tgid, rparent->proc.ppid); //ev->event_data.fork.parent_pid);
+			// the child starts with the environment of the forking process
+			proc = proc_by_pid(ev->event_data.fork.child_tgid);
+			if(proc)
+				u_env_index_inherit(proc, rparent);
 		} else
 			process_new_delay(ev->event_data.fork.child_tgid, 0);
 		break;
@@ -285,6 +476,56 @@ out:
 
 }
 
+/**
+ * read proc connector messages from a local socket instead of the kernel
+ * @arg loop main loop
+ * @arg path path of the unix datagram socket to create
+ *
+ * every datagram has the layout the kernel sends, a nlmsghdr followed by the
+ * cn_msg with the proc_event. used to replay synthetic events, see
+ * tests/nl_events.c
+ *
+ * @return 0 on success
+ */
+int init_netlink_socket(GMainLoop *loop, const char *path) {
+	GSocket *gsocket;
+	GSource *source;
+	struct sockaddr_un addr;
+	int socket_fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		g_warning("netlink socket path too long: %s", path);
+		return 1;
+	}
+	socket_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (socket_fd < 0) {
+		g_warning("failed to create socket: %s", strerror(errno));
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		g_warning("binding %s failed: %s", path, strerror(errno));
+		close(socket_fd);
+		return 1;
+	}
+
+	gsocket = g_socket_new_from_fd(socket_fd, NULL);
+	if (gsocket == NULL) {
+		g_warning("can't create socket");
+		close(socket_fd);
+		return 1;
+	}
+	source = g_socket_create_source (gsocket, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL, NULL);
+	g_source_set_callback (source, (GSourceFunc) nl_connection_handler, loop, NULL);
+	g_source_attach (source, NULL);
+	g_message("reading proc events from %s", path);
+	measure = TRUE;
+	return 0;
+}
+
 #if 0
 gint
 main (void)
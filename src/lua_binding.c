@@ -27,10 +27,12 @@
 #include <proc/pwcache.h>
 #include <proc/readproc.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <glib.h>
 #include <signal.h>
 #include <time.h>
+#include <math.h>
 #include <bits/signum.h>
 //#include <errno.h>
 #ifndef __USE_GNU
@@ -81,16 +83,32 @@ void stackdump_g(lua_State* l)
     printf("\n");  /* end the listing */
 }
 
-static void l_hash_to_table(lua_State *L, GHashTable *table) {
-    GHashTableIter iter;
-    gpointer key, value;
-    lua_newtable(L);
+static void l_str_vec_to_table(lua_State *L, u_str_vec *vec) {
+    guint i = 0;
+    lua_createtable(L, vec->len, 0);
 
-    g_hash_table_iter_init (&iter, table);
-    while (g_hash_table_iter_next (&iter, &key, &value)) 
+    for (; i < vec->len; i++)
     {
-      lua_pushstring(L, (char *)key);
-      lua_pushstring(L, (char *)value);
+      lua_pushinteger(L, i+1);
+      lua_pushstring(L, U_STR_VEC_INDEX(vec, i));
+      lua_settable(L, -3);
+    }
+}
+
+// converts KEY=value entries to a table
+static void l_environ_to_table(lua_State *L, u_str_vec *vec) {
+    guint i = 0;
+    char *entry, *sep;
+    lua_createtable(L, 0, vec->len);
+
+    for (; i < vec->len; i++)
+    {
+      entry = U_STR_VEC_INDEX(vec, i);
+      sep = strchr(entry, '=');
+      if(!sep)
+        continue;
+      lua_pushlstring(L, entry, sep - entry);
+      lua_pushstring(L, sep + 1);
       lua_settable(L, -3);
     }
 }
@@ -152,10 +170,288 @@ static int l_get_last_percent(lua_State *L) {
   return 1;
 }
 
+static int l_get_cpu_usage(lua_State *L) {
+  guint i;
 
+  lua_createtable (L, 0, 3);
+  lua_pushliteral(L, "total");
+  lua_pushnumber(L, U_cpu_usage.total);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "iowait");
+  lua_pushnumber(L, U_cpu_usage.iowait);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "cpus");
+  lua_createtable (L, U_cpu_usage.n_cpus, 0);
+  for(i = 0; i < U_cpu_usage.n_cpus; i++) {
+    lua_pushnumber(L, U_cpu_usage.cpus[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_settable(L, -3);
+  return 1;
+}
+
+static int l_get_cgroup_cpu_rate(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  gdouble rate = u_cgroup_cpu_rate(path);
+
+  if(rate < 0)
+    return 0;
+  lua_pushnumber(L, rate);
+  return 1;
+}
+
+static int l_get_proc_read_stats(lua_State *L) {
+  lua_createtable (L, 0, 3);
+  lua_pushliteral(L, "lazy_reads");
+  lua_pushinteger(L, U_proc_read_stats.lazy_reads);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "files_read");
+  lua_pushinteger(L, U_proc_read_stats.files_read);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "files_avoided");
+  lua_pushinteger(L, U_proc_read_stats.files_avoided);
+  lua_settable(L, -3);
+  return 1;
+}
+
+static int l_has_scheduled_listeners(lua_State *L) {
+#ifdef ENABLE_DBUS
+  lua_pushboolean(L, u_status_enabled() || u_dbus_scheduled_listeners() > 0);
+#else
+  lua_pushboolean(L, u_status_enabled());
+#endif
+  return 1;
+}
+
+static int l_report_scheduled(lua_State *L) {
+  lua_Integer pid = luaL_checkinteger (L, 1);
+  const char *subsystem = luaL_checkstring(L, 2);
+  const char *group = luaL_checkstring(L, 3);
+  lua_Integer reason = luaL_optinteger (L, 4, 0);
+  u_proc *proc = proc_by_pid((pid_t)pid);
+
+  if(proc && u_status_set_group(proc, subsystem, group))
+    reason |= U_SCHEDULED_CHANGED;
+
+#ifdef ENABLE_DBUS
+  u_dbus_scheduled_add((pid_t)pid, subsystem, group, (guint)reason);
+#endif
+  return 0;
+}
+
+// a process is placed once the write of its pid into a tasks file completed.
+// the focused process is always timed, proc events while they are measured
+static void track_tasks(const char *path, GPtrArray *chunks, gboolean done) {
+  gboolean netlink = u_netlink_measuring();
+  pid_t pid;
+  int i;
+
+  if(!g_str_has_suffix(path, "/tasks"))
+    return;
+  for(i = 0; i < chunks->len; i++) {
+    pid = atoi(g_ptr_array_index(chunks, i));
+    if(done) {
+      u_focus_tasks_written(pid);
+      if(netlink)
+        u_netlink_tasks_written(pid);
+    } else {
+      u_focus_tasks_queued(pid);
+      if(netlink)
+        u_netlink_tasks_queued(pid);
+    }
+  }
+}
+
+// results of read_async and write_async, called in the main loop
+static void l_async_done(u_async_req *req) {
+  lua_State *L = lua_main_state;
+  int ref = GPOINTER_TO_INT(req->user_data);
+
+  if(req->type == U_ASYNC_WRITE)
+    track_tasks(req->path, req->chunks, TRUE);
+  if(ref == LUA_NOREF)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+
+  if(req->type == U_ASYNC_READ) {
+    if(req->error)
+      lua_pushnil(L);
+    else
+      lua_pushlstring(L, req->data->str, req->data->len);
+  } else {
+    lua_pushboolean(L, !req->error);
+  }
+  if(req->error)
+    lua_pushstring(L, strerror(req->error));
+  else
+    lua_pushnil(L);
+  docall(L, 2, 0);
+}
+
+static int l_read_async(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  int ref;
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  u_async_read(path, l_async_done, GINT_TO_POINTER(ref));
+  return 0;
+}
+
+static int l_write_async(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  GPtrArray *chunks = g_ptr_array_new_with_free_func(g_free);
+  const char *chunk;
+  int i, ref = LUA_NOREF;
+
+  // a table is written as one write() per entry
+  if(lua_istable(L, 2)) {
+    for(i = 1; i <= lua_objlen(L, 2); i++) {
+      lua_rawgeti(L, 2, i);
+      chunk = lua_tostring(L, -1);
+      if(!chunk) {
+        g_ptr_array_free(chunks, TRUE);
+        return luaL_error(L, "write_async: entry %d is not a string", i);
+      }
+      g_ptr_array_add(chunks, g_strdup(chunk));
+      lua_pop(L, 1);
+    }
+  } else {
+    chunk = lua_tostring(L, 2);
+    if(!chunk) {
+      g_ptr_array_free(chunks, TRUE);
+      return luaL_typerror(L, 2, "string or table");
+    }
+    g_ptr_array_add(chunks, g_strdup(chunk));
+  }
+
+  if(!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_pushvalue(L, 3);
+    ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  track_tasks(path, chunks, FALSE);
+  u_async_write(path, chunks, l_async_done, GINT_TO_POINTER(ref));
+  return 0;
+}
+
+#ifdef HAVE_IO_URING
+static int l_io_uring(lua_State *L) {
+  if(!lua_isnoneornil(L, 1))
+    u_uring_set_enabled(lua_toboolean(L, 1));
+
+  lua_createtable (L, 0, 6);
+  lua_pushliteral(L, "enabled");
+  lua_pushboolean(L, u_uring_enabled());
+  lua_settable(L, -3);
+  lua_pushliteral(L, "batches");
+  lua_pushinteger(L, U_uring_stats.batches);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "enters");
+  lua_pushinteger(L, U_uring_stats.enters);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "files");
+  lua_pushinteger(L, U_uring_stats.files);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "fallbacks");
+  lua_pushinteger(L, U_uring_stats.fallbacks);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "writes");
+  lua_pushinteger(L, g_atomic_int_get(&U_uring_stats.writes));
+  lua_settable(L, -3);
+  return 1;
+}
+#endif
+
+static int l_get_focus_stats(lua_State *L) {
+  lua_createtable (L, 0, 7);
+  lua_pushliteral(L, "requests");
+  lua_pushinteger(L, U_focus_stats.requests);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "applied");
+  lua_pushinteger(L, U_focus_stats.applied);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "merged");
+  lua_pushinteger(L, U_focus_stats.merged);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "placed");
+  lua_pushinteger(L, U_focus_stats.placed);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "over_budget");
+  lua_pushinteger(L, U_focus_stats.over_budget);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "latency_last");
+  lua_pushnumber(L, U_focus_stats.latency_last);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "latency_max");
+  lua_pushnumber(L, U_focus_stats.latency_max);
+  lua_settable(L, -3);
+  return 1;
+}
+
+// proc events and the latency until the process was placed, in milliseconds.
+// pass true to start a new latency measurement afterwards
+static int l_get_netlink_stats(lua_State *L) {
+  static const double q[] = { 0.5, 0.99, 0.999, 1.0 };
+  static const char *names[] = { "p50", "p99", "p999", "max" };
+  gint64 out[4];
+  int i;
+
+  u_netlink_latency(q, out, 4, lua_toboolean(L, 1));
+  lua_createtable (L, 0, 6);
+  lua_pushliteral(L, "events");
+  lua_pushinteger(L, U_netlink_stats.events);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "placed");
+  lua_pushinteger(L, U_netlink_stats.placed);
+  lua_settable(L, -3);
+  for(i = 0; i < 4; i++) {
+    lua_pushstring(L, names[i]);
+    lua_pushnumber(L, out[i] / 1000000.0);
+    lua_settable(L, -3);
+  }
+  return 1;
+}
+
+
+
+// the meminfo and vminfo tables are built once per main loop dispatch and
+// shared by all callers, ie. Scheduler:one() for a burst of new processes.
+// the next dispatch drops them. pass true to get fresh values anyway
+static int meminfo_ref = LUA_NOREF;
+static int vminfo_ref = LUA_NOREF;
+static guint snapshot_source = 0;
+
+static gboolean snapshot_expire(gpointer data) {
+  luaL_unref(lua_main_state, LUA_REGISTRYINDEX, meminfo_ref);
+  luaL_unref(lua_main_state, LUA_REGISTRYINDEX, vminfo_ref);
+  meminfo_ref = vminfo_ref = LUA_NOREF;
+  snapshot_source = 0;
+  return FALSE;
+}
+
+static int snapshot_push(lua_State *L, int ref) {
+  if(ref == LUA_NOREF || lua_toboolean(L, 1))
+    return FALSE;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  return TRUE;
+}
+
+// keeps the table on top of the stack until the next dispatch
+static void snapshot_keep(lua_State *L, int *ref) {
+  luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+  lua_pushvalue(L, -1);
+  *ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if(!snapshot_source)
+    snapshot_source = g_idle_add_full(G_PRIORITY_HIGH, snapshot_expire, NULL, NULL);
+}
 
 static int get_meminfo (lua_State *L) {
-  lua_createtable (L, 10, 0);
+  if(snapshot_push(L, meminfo_ref))
+    return 1;
+  lua_createtable (L, 0, 27);
   meminfo();
   LUA_TABLE_INT(kb_active)
   LUA_TABLE_INT(kb_main_shared)
@@ -184,11 +480,14 @@ static int get_meminfo (lua_State *L) {
   LUA_TABLE_INT(kb_inactive)
   LUA_TABLE_INT(kb_mapped)
   LUA_TABLE_INT(kb_pagetables)
+  snapshot_keep(L, &meminfo_ref);
   return 1;
 }
 
 static int get_vminfo (lua_State *L) {
-  lua_createtable (L, 10, 0);
+  if(snapshot_push(L, vminfo_ref))
+    return 1;
+  lua_createtable (L, 0, 23);
   vminfo();
   LUA_TABLE_INT(vm_nr_dirty)
   LUA_TABLE_INT(vm_nr_writeback)
@@ -213,6 +512,7 @@ static int get_vminfo (lua_State *L) {
   LUA_TABLE_INT(vm_kswapd_steal)
   LUA_TABLE_INT(vm_pageoutrun)
   LUA_TABLE_INT(vm_allocstall)
+  snapshot_keep(L, &vminfo_ref);
   return 1;
 }
 
@@ -343,6 +643,70 @@ static int l_list_processes (lua_State *L) {
 }
 
 
+static int check_hot_field(lua_State *L, int narg) {
+  int field = u_hot_field(luaL_checkstring(L, narg));
+  if(field < 0)
+    luaL_argerror(L, narg, "not a hot field");
+  return field;
+}
+
+static int l_top_processes (lua_State *L) {
+  int field = check_hot_field(L, 1);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  u_proc **top;
+  guint i, len;
+
+  if(n <= 0) {
+    lua_newtable(L);
+    return 1;
+  }
+  top = g_new(u_proc *, n);
+  len = u_hot_top(field, n, top);
+  lua_createtable(L, len, 0);
+  for(i = 0; i < len; i++) {
+    push_u_proc(L, top[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  g_free(top);
+  return 1;
+}
+
+static int l_processes_above (lua_State *L) {
+  int field = check_hot_field(L, 1);
+  lua_Number threshold = luaL_checknumber(L, 2);
+  GPtrArray *procs = g_ptr_array_new();
+  int i;
+
+  u_hot_above(field, (gint64)ceil(threshold), procs);
+  lua_createtable(L, procs->len, 0);
+  for(i = 0; i < procs->len; i++) {
+    push_u_proc(L, g_ptr_array_index(procs, i));
+    lua_rawseti(L, -2, i + 1);
+  }
+  g_ptr_array_free(procs, TRUE);
+  return 1;
+}
+
+static int l_sum_processes (lua_State *L) {
+  int field = check_hot_field(L, 1);
+  int by = check_hot_field(L, 2);
+  GHashTable *sums = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, g_free);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  u_hot_sum_by(field, by, sums);
+  lua_createtable(L, 0, g_hash_table_size(sums));
+  g_hash_table_iter_init(&iter, sums);
+  while(g_hash_table_iter_next(&iter, &key, &value)) {
+    lua_pushinteger(L, GPOINTER_TO_INT(key));
+    lua_pushnumber(L, (lua_Number)*(gint64 *)value);
+    lua_settable(L, -3);
+  }
+  g_hash_table_destroy(sums);
+  return 1;
+}
+
 static int l_get_number_of_processes(lua_State *L) {
 
   lua_pushinteger(L, get_number_of_processes());
@@ -359,6 +723,15 @@ static int l_set_active_pid(lua_State *L) {
   return 0;
 }
 
+static int l_set_active_pid_debounced(lua_State *L) {
+  lua_Integer uid = luaL_checkinteger (L, 1);
+  lua_Integer pid = luaL_checkinteger (L, 2);
+
+  set_active_pid_debounced((guint)uid, (guint)pid);
+
+  return 0;
+}
+
 static int l_get_active_uids(lua_State *L) {
   GList *cur = g_list_first(active_users);
   struct user_active *ua = NULL;
@@ -396,7 +769,7 @@ static int l_get_active_pids(lua_State *L) {
   if(!ua)
     return 0;
 
-  cur = g_list_first(ua->actives);
+  cur = ua->actives.head;
   lua_newtable(L);
   while(cur) {
     up = cur->data;
@@ -408,6 +781,9 @@ static int l_get_active_pids(lua_State *L) {
     lua_pushstring(L, "last_change");
     lua_pushinteger(L, up->last_change);
     lua_settable (L, -3);
+    lua_pushstring(L, "pos");
+    lua_pushinteger(L, up->pos);
+    lua_settable (L, -3);
     lua_settable (L, -3);
     i++;
     cur = g_list_next (cur);
@@ -607,25 +983,157 @@ static int u_proc_get_parent (lua_State *L)
 
 static int u_proc_get_children (lua_State *L)
 {
-  int i = 1, max;
-  u_proc *child;
+  int i = 1;
+  GNode *node;
   u_proc *proc = check_u_proc(L, 1);
 
   if(!proc->node)
     return 0;
 
-  max = g_node_n_children(proc->node);
+  lua_createtable (L, g_node_n_children(proc->node), 0);
+
+  for(node = proc->node->children; node; node = node->next) {
+    lua_pushinteger(L, i++);
+    push_u_proc(L, node->data);
+    lua_settable(L, -3);
+  }
+  return 1;
+
+}
+
+/* returns the pids of all descendants of a process in breadth first order
+   @arg 1 u_proc
+   @arg 2 if true, the pid of the process itself is the first entry */
+static int u_proc_subtree_pids (lua_State *L)
+{
+  int i = 1;
+  GNode *node;
+  GQueue queue = G_QUEUE_INIT;
+  u_proc *proc = check_u_proc(L, 1);
+  int with_self = lua_toboolean(L, 2);
 
   lua_newtable (L);
+  // removed processes have no place in the tree anymore
+  if(!proc->node)
+    return 1;
 
-  for(i = 0; i < max; i++) {
-    child = g_node_nth_child(proc->node, i)->data;
-    lua_pushinteger(L, i+1);
-    push_u_proc(L, child);
+  if(with_self) {
+    lua_pushinteger(L, i++);
+    lua_pushinteger(L, proc->pid);
     lua_settable(L, -3);
   }
+
+  g_queue_push_tail(&queue, proc->node);
+  while((node = g_queue_pop_head(&queue))) {
+    for(node = node->children; node; node = node->next) {
+      lua_pushinteger(L, i++);
+      lua_pushinteger(L, ((u_proc *)node->data)->pid);
+      lua_settable(L, -3);
+      if(node->children)
+        g_queue_push_tail(&queue, node);
+    }
+  }
   return 1;
+}
+
+static void unref_proc_array(GPtrArray *array) {
+  int i;
+  u_proc *proc;
 
+  for(i = 0; i < array->len; i++) {
+    proc = g_ptr_array_index(array, i);
+    DEC_REF(proc);
+  }
+  g_ptr_array_set_size(array, 0);
+}
+
+/* calls a function for all descendants of a process, level by level
+   @arg 1 u_proc
+   @arg 2 function(proc, depth). returning false skips the children of proc
+   @arg 3 optional table: self = true to start with the process itself at
+          depth 0, max_depth = deepest level to visit
+   @return number of visited processes
+
+   the processes are referenced while walking, so the callback may change
+   the process tree */
+static int u_proc_walk_subtree (lua_State *L)
+{
+  int i, depth = 1, max_depth = G_MAXINT, visited = 0, descend;
+  GNode *node;
+  GPtrArray *level, *next, *tmp;
+  u_proc *child;
+  u_proc *proc = check_u_proc(L, 1);
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  if(lua_istable(L, 3)) {
+    lua_getfield(L, 3, "self");
+    if(lua_toboolean(L, -1))
+      depth = 0;
+    lua_pop(L, 1);
+    lua_getfield(L, 3, "max_depth");
+    if(lua_isnumber(L, -1))
+      max_depth = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+
+  if(!proc->node) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+
+  level = g_ptr_array_new();
+  next = g_ptr_array_new();
+
+  if(depth == 0) {
+    INC_REF(proc);
+    g_ptr_array_add(level, proc);
+  } else {
+    for(node = proc->node->children; node; node = node->next) {
+      child = node->data;
+      INC_REF(child);
+      g_ptr_array_add(level, child);
+    }
+  }
+
+  while(level->len && depth <= max_depth) {
+    for(i = 0; i < level->len; i++) {
+      child = g_ptr_array_index(level, i);
+      if(U_PROC_IS_INVALID(child))
+        continue;
+      lua_pushvalue(L, 2);
+      push_u_proc(L, child);
+      lua_pushinteger(L, depth);
+      if(lua_pcall(L, 2, 1, 0)) {
+        unref_proc_array(level);
+        unref_proc_array(next);
+        g_ptr_array_free(level, TRUE);
+        g_ptr_array_free(next, TRUE);
+        return lua_error(L);
+      }
+      visited++;
+      descend = !(lua_isboolean(L, -1) && !lua_toboolean(L, -1));
+      lua_pop(L, 1);
+      if(!descend || depth == max_depth || !child->node)
+        continue;
+      for(node = child->node->children; node; node = node->next) {
+        child = node->data;
+        INC_REF(child);
+        g_ptr_array_add(next, child);
+      }
+    }
+    unref_proc_array(level);
+    tmp = level;
+    level = next;
+    next = tmp;
+    depth++;
+  }
+
+  unref_proc_array(level);
+  g_ptr_array_free(level, TRUE);
+  g_ptr_array_free(next, TRUE);
+
+  lua_pushinteger(L, visited);
+  return 1;
 }
 
 static int l_proc_list_flags (lua_State *L) {
@@ -756,6 +1264,11 @@ static int u_proc_kill (lua_State *L) {
   }
   
   if(U_PROC_IS_VALID(proc)) {
+    // the pids of a fixture belong to other processes on this box
+    if(*proc_root) {
+      g_message("replay: not sending signal %d to pid %d", signal, proc->pid);
+      return 0;
+    }
     g_message("send signal to process: pid:%d signal:%d\n", proc->pid, signal);
     kill(proc->pid, signal);
   }
@@ -764,6 +1277,37 @@ static int u_proc_kill (lua_State *L) {
 }
 
 
+#define PUSH_HISTORY(NAME) \
+  lua_pushliteral(L, #NAME); \
+  lua_createtable(L, h->count, 0); \
+  for(i = 0; i < h->count; i++) { \
+    lua_pushnumber(L, (lua_Number)h->NAME[(first + i) % h->len]); \
+    lua_rawseti(L, -2, i + 1); \
+  } \
+  lua_settable(L, -3);
+
+static int u_proc_get_history (lua_State *L) {
+  u_proc *proc = check_u_proc(L, 1);
+  struct u_proc_history *h = proc->history;
+  guint i, first;
+
+  if(!h)
+    return 0;
+
+  // oldest sample first
+  first = (h->head + h->len - h->count) % h->len;
+  lua_createtable(L, 0, 6);
+  PUSH_HISTORY(time)
+  PUSH_HISTORY(cpu)
+  PUSH_HISTORY(maj_flt)
+  PUSH_HISTORY(rss)
+  PUSH_HISTORY(read_bytes)
+  PUSH_HISTORY(write_bytes)
+  return 1;
+}
+
+#undef PUSH_HISTORY
+
 static int u_proc_get_n_children (lua_State *L) {
   u_proc *proc = check_u_proc(L, 1);
 
@@ -813,7 +1357,10 @@ static int u_proc_set_rtprio (lua_State *L) {
 
   g_log(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "rtprio set to: %d by %s", value, "(FIXME)");
 
-  sched_setscheduler(proc->pid, value, &param);
+  if(*proc_root)
+    g_debug("replay: not setting the scheduler of pid %d", proc->pid);
+  else
+    sched_setscheduler(proc->pid, value, &param);
   
   return 1;
 }
@@ -862,6 +1409,7 @@ static int u_proc_set_pgid (lua_State *L) {
   if(proc->proc.pgrp != value) {
     proc->fake_pgrp_old = proc->proc.pgrp;
     proc->fake_pgrp = value;
+    u_hot_regroup(proc);
   }
 
   proc->changed = 1;
@@ -939,9 +1487,144 @@ static int u_proc_ioprio_get (lua_State *L) {
     return 1; \
   }
 
+#ifdef LUAJIT_FFI
+/* layout of u_proc, proc_t and u_flag for the luajit ffi. core.lua builds
+   the cdefs from it, so the offsets always match the compiled daemon. */
+enum FFI_KIND {
+  FFI_KIND_UNSIGNED,
+  FFI_KIND_SIGNED,
+  FFI_KIND_CHARS,     // fixed size char array
+  FFI_KIND_STRING,    // char *
+  FFI_KIND_LIST,      // GList *
+  FFI_KIND_PROC_T,    // embedded proc_t
+};
+
+struct ffi_field {
+  const char *name;
+  size_t offset;
+  size_t size;
+  int kind;
+};
+
+#define FFI_INT(S, F) { #F, offsetof(S, F), sizeof(((S *)0)->F), \
+  ((__typeof__(((S *)0)->F))-1 < 0) ? FFI_KIND_SIGNED : FFI_KIND_UNSIGNED }
+#define FFI_TYPE(S, F, KIND) { #F, offsetof(S, F), sizeof(((S *)0)->F), KIND }
+
+static const struct ffi_field ffi_proc_t[] = {
+  FFI_INT(proc_t, tid), FFI_INT(proc_t, ppid), FFI_INT(proc_t, state),
+  FFI_INT(proc_t, utime), FFI_INT(proc_t, stime), FFI_INT(proc_t, cutime),
+  FFI_INT(proc_t, cstime), FFI_INT(proc_t, start_time),
+  FFI_INT(proc_t, priority), FFI_INT(proc_t, nice), FFI_INT(proc_t, rss),
+  FFI_INT(proc_t, size), FFI_INT(proc_t, resident), FFI_INT(proc_t, share),
+  FFI_INT(proc_t, trs), FFI_INT(proc_t, lrs), FFI_INT(proc_t, drs),
+  FFI_INT(proc_t, dt), FFI_INT(proc_t, vm_size), FFI_INT(proc_t, vm_lock),
+  FFI_INT(proc_t, vm_rss), FFI_INT(proc_t, vm_data), FFI_INT(proc_t, vm_stack),
+  FFI_INT(proc_t, vm_exe), FFI_INT(proc_t, vm_lib), FFI_INT(proc_t, rtprio),
+  FFI_INT(proc_t, sched), FFI_INT(proc_t, vsize), FFI_INT(proc_t, rss_rlim),
+  FFI_INT(proc_t, flags), FFI_INT(proc_t, min_flt), FFI_INT(proc_t, maj_flt),
+  FFI_INT(proc_t, cmin_flt), FFI_INT(proc_t, cmaj_flt),
+  FFI_TYPE(proc_t, euser, FFI_KIND_CHARS), FFI_TYPE(proc_t, cmd, FFI_KIND_CHARS),
+  FFI_INT(proc_t, pgrp), FFI_INT(proc_t, session), FFI_INT(proc_t, nlwp),
+  FFI_INT(proc_t, tgid), FFI_INT(proc_t, tty), FFI_INT(proc_t, euid),
+  FFI_INT(proc_t, egid), FFI_INT(proc_t, ruid), FFI_INT(proc_t, rgid),
+  FFI_INT(proc_t, suid), FFI_INT(proc_t, sgid), FFI_INT(proc_t, fuid),
+  FFI_INT(proc_t, fgid), FFI_INT(proc_t, tpgid), FFI_INT(proc_t, exit_signal),
+  FFI_INT(proc_t, processor),
+  { NULL }
+};
+
+static const struct ffi_field ffi_u_proc[] = {
+  FFI_INT(u_proc, pid), FFI_INT(u_proc, ustate), FFI_INT(u_proc, fields),
+  FFI_TYPE(u_proc, proc, FFI_KIND_PROC_T),
+  FFI_TYPE(u_proc, flags, FFI_KIND_LIST),
+  FFI_INT(u_proc, changed), FFI_INT(u_proc, block_scheduler),
+  FFI_INT(u_proc, received_rt), FFI_INT(u_proc, fake_pgrp),
+  FFI_INT(u_proc, fake_session),
+  { NULL }
+};
+
+static const struct ffi_field ffi_u_flag[] = {
+  FFI_TYPE(u_flag, name, FFI_KIND_STRING), FFI_TYPE(u_flag, reason, FFI_KIND_STRING),
+  FFI_INT(u_flag, tid), FFI_INT(u_flag, timeout), FFI_INT(u_flag, priority),
+  FFI_INT(u_flag, value), FFI_INT(u_flag, threshold),
+  { NULL }
+};
+
+#undef FFI_INT
+#undef FFI_TYPE
+
+static void push_ffi_layout(lua_State *L, const char *name, size_t size,
+                            const struct ffi_field *field) {
+  int i;
+
+  lua_pushstring(L, name);
+  lua_createtable(L, 0, 2);
+  lua_pushliteral(L, "size");
+  lua_pushinteger(L, size);
+  lua_settable(L, -3);
+  lua_pushliteral(L, "fields");
+  lua_newtable(L);
+  for(i = 0; field[i].name; i++) {
+    lua_pushinteger(L, i + 1);
+    lua_createtable(L, 0, 4);
+    lua_pushliteral(L, "name");
+    lua_pushstring(L, field[i].name);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "offset");
+    lua_pushinteger(L, field[i].offset);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "size");
+    lua_pushinteger(L, field[i].size);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "kind");
+    lua_pushinteger(L, field[i].kind);
+    lua_settable(L, -3);
+    lua_settable(L, -3);
+  }
+  lua_settable(L, -3);
+  lua_settable(L, -3);
+}
+
+static int l_ffi_layout (lua_State *L) {
+  lua_createtable(L, 0, 3);
+  push_ffi_layout(L, "proc_t", sizeof(proc_t), ffi_proc_t);
+  push_ffi_layout(L, "u_proc", sizeof(u_proc), ffi_u_proc);
+  push_ffi_layout(L, "u_flag", sizeof(u_flag), ffi_u_flag);
+  return 1;
+}
+
+// pointer for ffi.cast. only valid while the process is alive, so it must
+// not be stored between rule calls
+static int u_proc_cdata (lua_State *L) {
+  u_proc *proc = check_u_proc(L, 1);
+
+  if(U_PROC_IS_INVALID(proc)) {
+    lua_pushliteral(L, "u_proc state is invalid");
+    lua_error(L);
+  }
+  // the ffi can't trigger lazy reads, so load everything it may look at
+  if(!u_proc_ensure_fields(proc, UPROC_FIELD_STAT | UPROC_FIELD_STATM |
+                           UPROC_FIELD_STATUS, FALSE)) {
+    lua_pushfstring (L, "u_proc<pid %d> basic data not available ", proc->pid);
+    lua_error(L);
+  }
+  lua_pushlightuserdata(L, proc);
+  return 1;
+}
+
+static int u_flag_cdata (lua_State *L) {
+  u_flag *flag = check_u_flag(L, 1);
+
+  lua_pushlightuserdata(L, flag);
+  return 1;
+}
+#endif
+
 static const luaL_reg u_proc_methods[] = {
   {"get_parent", u_proc_get_parent},
   {"get_children", u_proc_get_children},
+  {"subtree_pids", u_proc_subtree_pids},
+  {"walk_subtree", u_proc_walk_subtree},
   {"list_flags", l_proc_list_flags},
   {"add_flag", u_proc_add_flag},
   {"del_flag", u_proc_del_flag},
@@ -952,6 +1635,7 @@ static const luaL_reg u_proc_methods[] = {
   {"kill", u_proc_kill},
   {"get_n_children", u_proc_get_n_children},
   {"get_n_nodes", u_proc_get_n_nodes},
+  {"get_history", u_proc_get_history},
   {"set_block_scheduler", u_proc_set_block_scheduler},
   {"set_rtprio", u_proc_set_rtprio},
   {"set_pgid", u_proc_set_pgid},
@@ -961,6 +1645,9 @@ static const luaL_reg u_proc_methods[] = {
   {"get_ioprio", u_proc_ioprio_get},
   {"get_tasks", u_proc_get_tasks},
   {"get_current_task_pids", _u_proc_get_current_task_pids},
+#ifdef LUAJIT_FFI
+  {"cdata", u_proc_cdata},
+#endif
   {NULL,NULL}
 };
 
@@ -1057,6 +1744,70 @@ static int handle_proc_t (lua_State *L, proc_t *proc, const char *key) {
 #undef PUSH_INT
 #undef PUSH_STR
 
+// parts of the process a key is parsed from. keys not listed here come
+// from /proc/#/stat
+static const struct {
+  const char *key;
+  int fields;
+} u_proc_key_fields[] = {
+  {"size", UPROC_FIELD_STATM},
+  {"resident", UPROC_FIELD_STATM},
+  {"share", UPROC_FIELD_STATM},
+  {"trs", UPROC_FIELD_STATM},
+  {"lrs", UPROC_FIELD_STATM},
+  {"drs", UPROC_FIELD_STATM},
+  {"dt", UPROC_FIELD_STATM},
+  {"signal", UPROC_FIELD_STATUS},
+  {"blocked", UPROC_FIELD_STATUS},
+  {"sigignore", UPROC_FIELD_STATUS},
+  {"sigcatch", UPROC_FIELD_STATUS},
+  {"_sigpnd", UPROC_FIELD_STATUS},
+  {"vm_size", UPROC_FIELD_STATUS},
+  {"vm_lock", UPROC_FIELD_STATUS},
+  {"vm_rss", UPROC_FIELD_STATUS},
+  {"vm_data", UPROC_FIELD_STATUS},
+  {"vm_stack", UPROC_FIELD_STATUS},
+  {"vm_exe", UPROC_FIELD_STATUS},
+  {"vm_lib", UPROC_FIELD_STATUS},
+  {"euser", UPROC_FIELD_STATUS},
+  {"ruser", UPROC_FIELD_STATUS},
+  {"suser", UPROC_FIELD_STATUS},
+  {"fuser", UPROC_FIELD_STATUS},
+  {"rgroup", UPROC_FIELD_STATUS},
+  {"egroup", UPROC_FIELD_STATUS},
+  {"sgroup", UPROC_FIELD_STATUS},
+  {"fgroup", UPROC_FIELD_STATUS},
+  {"tgid", UPROC_FIELD_STATUS},
+  {"euid", UPROC_FIELD_STATUS},
+  {"egid", UPROC_FIELD_STATUS},
+  {"ruid", UPROC_FIELD_STATUS},
+  {"rgid", UPROC_FIELD_STATUS},
+  {"suid", UPROC_FIELD_STATUS},
+  {"sgid", UPROC_FIELD_STATUS},
+  {"fuid", UPROC_FIELD_STATUS},
+  {"fgid", UPROC_FIELD_STATUS},
+  {"nsupgid", UPROC_FIELD_STATUS},
+  {"groups", UPROC_FIELD_STATUS | UPROC_FIELD_GROUPS},
+  {"wchan", UPROC_FIELD_STAT | UPROC_FIELD_WCHAN},
+  {"cgroup", UPROC_FIELD_CGROUP},
+  {"cgroup_origin", UPROC_FIELD_CGROUP},
+  // read by u_proc_ensure
+  {"environ", 0},
+  {"cmdline", 0},
+  {"cmdline_match", 0},
+  {"cmdfile", 0},
+  {"exe", 0},
+  {NULL, 0}
+};
+
+static int u_proc_fields_for_key(const char *key) {
+  int i;
+  for(i = 0; u_proc_key_fields[i].key; i++) {
+    if(!strcmp(u_proc_key_fields[i].key, key))
+      return u_proc_key_fields[i].fields;
+  }
+  return UPROC_FIELD_STAT;
+}
 
 static int u_proc_index (lua_State *L)
 {
@@ -1065,6 +1816,7 @@ static int u_proc_index (lua_State *L)
   const char *key = luaL_checkstring(L, 2);
   luaL_reg *lreg = (luaL_reg *)u_proc_methods;
   int rv = 0;
+  int fields;
 
 
   for (; lreg->name; lreg++) {
@@ -1109,20 +1861,28 @@ static int u_proc_index (lua_State *L)
   } else if(!strcmp(key, "received_rt" )) {
     lua_pushboolean(L, proc->received_rt);
     return 1;
+  } else if(!strcmp(key, "cpu_rate" )) {
+    lua_pushnumber(L, proc->history ? proc->history->cpu_rate : 0);
+    return 1;
+  } else if(!strcmp(key, "io_rate" )) {
+    lua_pushnumber(L, proc->history ? proc->history->io_rate : 0);
+    return 1;
   }
   
 
-  if(!u_proc_ensure(proc, BASIC, FALSE)) {
-    lua_pushfstring (L, "u_proc<pid %d> basic data not available ", proc->pid);
-    lua_error(L);
-  }
-
   // data of proc.proc must be invalidated as the process is already dead
   if(U_PROC_IS_INVALID(proc)) {
     lua_pushliteral(L, "u_proc state is invalid");
     lua_error(L);
   }
 
+  // only parse the part of /proc/#/ the key is stored in
+  fields = u_proc_fields_for_key(key);
+  if(fields && !u_proc_ensure_fields(proc, fields, FALSE)) {
+    lua_pushfstring (L, "u_proc<pid %d> basic data not available ", proc->pid);
+    lua_error(L);
+  }
+
   rv = handle_proc_t (L, &(proc->proc), key);
   if(rv)
     return rv;
@@ -1134,14 +1894,14 @@ static int u_proc_index (lua_State *L)
     // lazy read
     u_proc_ensure(proc, ENVIRONMENT, TRUE);
     if(proc->environ) {
-      l_hash_to_table(L, proc->environ);
+      l_environ_to_table(L, proc->environ);
       return 1;
     }
     return 0;
   }
   if(!strcmp(key, "cmdline" )) {
     if(u_proc_ensure(proc, CMDLINE, FALSE) && proc->cmdline) {
-      l_ptrarray_to_table(L, proc->cmdline);
+      l_str_vec_to_table(L, proc->cmdline);
       return 1;
     } else {
       return 0;
@@ -1348,6 +2108,12 @@ static int u_flag_index (lua_State *L)
   if(!strcmp(key, "is_source")) {
     lua_pushboolean(L, flag->source == L);
   }
+#ifdef LUAJIT_FFI
+  if(!strcmp(key, "cdata")) {
+    lua_pushcfunction(L, u_flag_cdata);
+    return 1;
+  }
+#endif
   return 0;
 }
 
@@ -1505,6 +2271,13 @@ static int u_sys_get_flags_changed(lua_State *L) {
   return 1;
 }
 
+static int u_sys_get_flags_generation(lua_State *L) {
+
+  lua_pushinteger(L, system_flags_generation);
+
+  return 1;
+}
+
 static int u_sys_set_flags_changed(lua_State *L) {
 
   system_flags_changed = luaL_checkint(L, 1);
@@ -1560,6 +2333,61 @@ static int wrap_l_scheduler_run_one(u_proc *proc) {
   return l_scheduler_run(lua_main_state, proc);
 }
 
+// calls scheduler method key with an optional process and a table of processes
+static int l_scheduler_run_list(const char *key, u_proc *proc, GPtrArray *group) {
+  lua_State *L = lua_main_state;
+  int base = lua_gettop(lua_main_state);
+  int rv = 1;
+  int i, args = 2;
+
+  lua_getfield(L, LUA_GLOBALSINDEX, "ulatency"); /* function to be called */
+  lua_getfield(L, -1, "scheduler");
+  lua_remove(L, 1);
+
+  if(lua_istable(L, 1)) {
+    lua_getfield(L, 1, key);
+    if(!lua_isfunction(L, 2)) {
+      // older schedulers only know about single processes
+      lua_pop(L, lua_gettop(L)-base);
+      rv = 0;
+      for(i = 0; i < group->len; i++)
+        rv |= l_scheduler_run(L, g_ptr_array_index(group, i));
+      return rv;
+    }
+    lua_pushvalue(L, 1);
+    if(proc) {
+      push_u_proc(L, proc);
+      args = 3;
+    }
+    lua_createtable(L, group->len, 0);
+    for(i = 0; i < group->len; i++) {
+      push_u_proc(L, g_ptr_array_index(group, i));
+      lua_rawseti(L, -2, i + 1);
+    }
+    if(docall(L, args, 1)) {
+      g_log(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "lua scheduler.%s failed", key);
+      goto out;
+    }
+    if(!lua_toboolean(L, -1)) {
+      g_log(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "lua scheduler.%s returned false", key);
+    } else {
+      rv = 0;
+    }
+  }
+
+out:
+  lua_pop(L, lua_gettop(L)-base);
+  return rv;
+}
+
+static int wrap_l_scheduler_run_many(GPtrArray *procs) {
+  return l_scheduler_run_list("many", NULL, procs);
+}
+
+static int wrap_l_scheduler_run_focus(u_proc *proc, GPtrArray *group) {
+  return l_scheduler_run_list("focus", proc, group);
+}
+
 static int l_scheduler_set_config(char *name) {
   lua_State *L = lua_main_state;
   int base = lua_gettop(lua_main_state);
@@ -1694,6 +2522,8 @@ out:
 u_scheduler LUA_SCHEDULER = {
   .all=wrap_l_scheduler_run,
   .one=wrap_l_scheduler_run_one,
+  .many=wrap_l_scheduler_run_many,
+  .focus=wrap_l_scheduler_run_focus,
   .list_configs = l_scheduler_list_configs,
   .set_config = l_scheduler_set_config,
   .get_config = l_scheduler_get_config,
@@ -1790,18 +2620,9 @@ int l_filter_postcheck(u_filter *flt) {
 int l_filter_check(u_proc *proc, u_filter *flt) {
   struct lua_filter *lft = (struct lua_filter *)flt->data;
 
-  if(lft->regexp_basename) {
-    u_proc_ensure(proc, CMDLINE, FALSE);
-    if(proc->cmdfile &&
-       g_regex_match(lft->regexp_basename, proc->cmdfile, 0, NULL))
-      return TRUE;
-  }
-  if(lft->regexp_cmdline) {
-    u_proc_ensure(proc, CMDLINE, FALSE);
-    if(proc->cmdline_match && 
-       g_regex_match(lft->regexp_cmdline, proc->cmdline_match, 0, NULL))
-        return TRUE;
-  }
+  // re_basename and re_cmdline of all filters are matched at once
+  if(lft->match_id >= 0 && u_filter_match(proc, lft->match_id))
+    return TRUE;
  
 /*  lua_rawgeti (cd->lua_state, LUA_REGISTRYINDEX, cd->lua_func);
   lua_rawgeti (cd->lua_state, LUA_REGISTRYINDEX, cd->lua_data);
@@ -1862,15 +2683,20 @@ static int l_register_filter (lua_State *L) {
 
   lf->regexp_cmdline = map_reg(L, "re_cmdline");
   lf->regexp_basename = map_reg(L, "re_basename");
+  lf->match_id = -1;
+  if(lf->regexp_cmdline || lf->regexp_basename)
+    lf->match_id = u_filter_match_add(lf->regexp_basename, lf->regexp_cmdline);
   lua_getfield (L, 1, "min_percent");
   if (lua_isnumber(L, -1)) {
-    lf->min_percent = lua_tonumber (L, 1);
+    lf->min_percent = lua_tonumber (L, -1);
   } else {
     lf->min_percent = 0.0;
-    lua_pop(L, 1);
   }
+  lua_pop(L, 1);
 
-  if(lf->regexp_cmdline || lf->regexp_basename || lf->min_percent)
+  // l_filter_check only knows the regular expressions, min_percent is
+  // checked in l_filter_run_table
+  if(lf->regexp_cmdline || lf->regexp_basename)
     flt->check = l_filter_check;
 
   // construct a filter name if missing
@@ -1917,7 +2743,11 @@ static int l_run_interation (lua_State *L) {
   // DANGEROUS: can cause endless loop
   g_debug("run iteration from lua");
 
-  g_timeout_add(0, iterate, GUINT_TO_POINTER(0));
+  // now instead of from the main loop, for benchmarks. not from a filter
+  if(lua_toboolean(L, 1))
+    iterate(GUINT_TO_POINTER(0));
+  else
+    g_timeout_add(0, iterate, GUINT_TO_POINTER(0));
   return 0;
 }
 
@@ -2066,6 +2896,21 @@ static const luaL_reg R[] = {
 
   {"get_last_load",  l_get_last_load},
   {"get_last_percent",  l_get_last_percent},
+  {"get_cpu_usage",  l_get_cpu_usage},
+  {"get_cgroup_cpu_rate",  l_get_cgroup_cpu_rate},
+  {"get_proc_read_stats",  l_get_proc_read_stats},
+  {"get_focus_stats",  l_get_focus_stats},
+  {"get_netlink_stats",  l_get_netlink_stats},
+  {"has_scheduled_listeners",  l_has_scheduled_listeners},
+  {"report_scheduled",  l_report_scheduled},
+  {"read_async",  l_read_async},
+  {"write_async",  l_write_async},
+#ifdef HAVE_IO_URING
+  {"io_uring",  l_io_uring},
+#endif
+#ifdef LUAJIT_FFI
+  {"ffi_layout",  l_ffi_layout},
+#endif
 
   // converts
   {"group_from_gid",  l_group_from_guid},
@@ -2077,6 +2922,9 @@ static const luaL_reg R[] = {
   {"add_timeout", l_add_interval},
   {"register_filter", l_register_filter},
   {"get_number_of_processes", l_get_number_of_processes},
+  {"top_processes", l_top_processes},
+  {"processes_above", l_processes_above},
+  {"sum_processes", l_sum_processes},
   // flag code
   {"new_flag", l_flag_new},
   // system flag manipulation
@@ -2088,9 +2936,11 @@ static const luaL_reg R[] = {
   {"clear_flag_all", u_sys_clear_flag_all},
   {"get_flags_changed", u_sys_get_flags_changed},
   {"set_flags_changed", u_sys_set_flags_changed},
+  {"get_flags_generation", u_sys_get_flags_generation},
 
   // group code
   {"set_active_pid", l_set_active_pid},
+  {"set_active_pid_debounced", l_set_active_pid_debounced},
   {"get_active_uids", l_get_active_uids},
   {"get_active_pids", l_get_active_pids},
   // config
@@ -2151,6 +3001,7 @@ int luaopen_ulatency(lua_State *L) {
   PUSH_STR(release_agent, QUOTEME(RELEASE_AGENT))
   PUSH_STR(path_rules_directory, QUOTEME(RULES_DIRECTORY))
   PUSH_STR(path_config_directory, QUOTEME(CONFIG_PATH))
+  PUSH_STR(proc_root, proc_root)
 
   //PUSH_INT(hertz, Hertz)
   PUSH_INT(smp_num_cpus, smp_num_cpus)
@@ -2185,6 +3036,13 @@ int luaopen_ulatency(lua_State *L) {
   PUSH_INT(UPROC_INVALID, UPROC_INVALID)
   PUSH_INT(UPROC_ALIVE, UPROC_ALIVE)
 
+  PUSH_INT(SCHEDULED_ITERATION, U_SCHEDULED_ITERATION)
+  PUSH_INT(SCHEDULED_FULL, U_SCHEDULED_FULL)
+  PUSH_INT(SCHEDULED_SINGLE, U_SCHEDULED_SINGLE)
+  PUSH_INT(SCHEDULED_FOCUS, U_SCHEDULED_FOCUS)
+  PUSH_INT(SCHEDULED_REQUEST, U_SCHEDULED_REQUEST)
+  PUSH_INT(SCHEDULED_CHANGED, U_SCHEDULED_CHANGED)
+
   /* remove meta table */
 	lua_remove(L, -2);
 
@@ -9,8 +9,140 @@
 #include <dbus/dbus-glib-bindings.h>
 #include <dbus/dbus-glib-lowlevel.h>
 #include <polkit/polkit.h>
+#include <time.h>
 
 #define DMAX 5000
+#define CACHE_TTL_DEFAULT 60
+
+struct u_polkit_stats U_polkit_stats;
+
+/*
+  authorization cache
+
+  automation clients call privileged methods repeatedly, so the decisions
+  are cached per sender for [core] polkit_cache_ttl seconds. the key is the
+  action id together with the details passed to polkit, rules may decide on
+  the target process or config, so a decision is only reused for the same
+  request.
+  unique bus names are never reused and a sender is dropped from the cache
+  when it leaves the bus. challenges are never cached, the user may answer
+  the next one differently.
+*/
+
+struct auth_entry {
+  time_t expires;
+  gboolean authorized;
+};
+
+static GHashTable *auth_cache = NULL; // sender -> (cache key -> auth_entry)
+static gint cache_ttl = CACHE_TTL_DEFAULT;
+
+static struct auth_entry *cache_lookup(const char *sender, const char *key) {
+  GHashTable *actions;
+  struct auth_entry *entry;
+
+  if(!auth_cache || !sender)
+    return NULL;
+  actions = g_hash_table_lookup(auth_cache, sender);
+  if(!actions)
+    return NULL;
+  entry = g_hash_table_lookup(actions, key);
+  if(entry && entry->expires <= time(NULL)) {
+    g_hash_table_remove(actions, key);
+    return NULL;
+  }
+  return entry;
+}
+
+static void cache_store(const char *sender, const char *key, gboolean authorized) {
+  GHashTable *actions;
+  struct auth_entry *entry;
+
+  if(!auth_cache || !sender)
+    return;
+  actions = g_hash_table_lookup(auth_cache, sender);
+  if(!actions) {
+    actions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_hash_table_insert(auth_cache, g_strdup(sender), actions);
+  }
+  entry = g_new(struct auth_entry, 1);
+  entry->expires = time(NULL) + cache_ttl;
+  entry->authorized = authorized;
+  g_hash_table_insert(actions, g_strdup(key), entry);
+}
+
+// the action id and every detail polkit gets, see check_polkit
+static gchar *cache_key(const char *action_id, u_proc *proc, const char *config) {
+  GString *key = g_string_new(action_id);
+
+  if(proc)
+    g_string_append_printf(key, "\npid=%d\nppid=%d\ngid=%d\npgrp=%d\nsession=%d",
+                           proc->pid, proc->proc.ppid, proc->proc.tpgid,
+                           proc->proc.pgrp, proc->proc.session);
+  if(config)
+    g_string_append_printf(key, "\nconfig=%s", config);
+  return g_string_free(key, FALSE);
+}
+
+static DBusHandlerResult name_owner_filter(DBusConnection *c, DBusMessage *m, void *user_data) {
+  const char *name, *old_owner, *new_owner;
+
+  if(dbus_message_is_signal(m, DBUS_INTERFACE_DBUS, "NameOwnerChanged") &&
+     dbus_message_get_args(m, NULL,
+                           DBUS_TYPE_STRING, &name,
+                           DBUS_TYPE_STRING, &old_owner,
+                           DBUS_TYPE_STRING, &new_owner,
+                           DBUS_TYPE_INVALID) &&
+     !new_owner[0] && g_hash_table_remove(auth_cache, name)) {
+    U_polkit_stats.invalidated++;
+  }
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+void u_polkit_init() {
+  DBusConnection *c;
+  GError *error = NULL;
+
+  cache_ttl = g_key_file_get_integer(config_data, CONFIG_CORE, "polkit_cache_ttl", &error);
+  if(error && error->code) {
+    cache_ttl = CACHE_TTL_DEFAULT;
+    g_error_free(error);
+  }
+  if(cache_ttl <= 0 || !U_dbus_connection) {
+    g_debug("polkit authorization cache disabled");
+    return;
+  }
+
+  auth_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify)g_hash_table_destroy);
+  c = dbus_g_connection_get_connection(U_dbus_connection);
+  // only names leaving the bus, not every name change of the system bus
+  dbus_bus_add_match(c, "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                        "interface='" DBUS_INTERFACE_DBUS "',"
+                        "member='NameOwnerChanged',arg2=''", NULL);
+  dbus_connection_add_filter(c, name_owner_filter, NULL, NULL);
+}
+
+static void callback_data_free(struct callback_data *data) {
+  dbus_connection_unref(data->connection);
+  dbus_message_unref(data->message);
+  g_object_unref(data->cancellable);
+  g_timer_destroy(data->timer);
+  g_free(data->sender);
+  g_free(data->cache_key);
+  g_free(data);
+}
+
+// runs the callback if authorized and answers the method call
+static void finish_authorization(struct callback_data *data, gboolean authorized) {
+  DBusMessage *ret;
+
+  if(authorized)
+    data->callback(data);
+  ret = dbus_message_new_method_return(data->message);
+  dbus_connection_send(data->connection, ret, NULL);
+  dbus_message_unref(ret);
+}
 
 static void
 check_authorization_cb (PolkitAuthority *authority,
@@ -20,33 +152,37 @@ check_authorization_cb (PolkitAuthority *authority,
   struct callback_data *data = user_data;
   PolkitAuthorizationResult *result;
   GError *error;
+  gdouble elapsed;
+
+  elapsed = g_timer_elapsed(data->timer, NULL);
+  U_polkit_stats.latency_total += elapsed;
+  U_polkit_stats.latency_max = MAX(U_polkit_stats.latency_max, elapsed);
 
   error = NULL;
   result = polkit_authority_check_authorization_finish (authority, res, &error);
   if (error != NULL) {
       g_warning("Error checking authorization: %s\n", error->message);
       g_error_free (error);
-      DBusMessage *ret = dbus_message_new_method_return(data->message);
-      dbus_connection_send(data->connection, ret, NULL);
-      dbus_message_unref(ret);
+      finish_authorization(data, FALSE);
   } else {
       const gchar *result_str;
       if (polkit_authorization_result_get_is_authorized (result)) {
-          g_debug("Authorization result: authorized");
-          data->callback(data);
+          g_debug("Authorization result: authorized (%0.2F ms)", elapsed * 1000);
+          cache_store(data->sender, data->cache_key, TRUE);
+          finish_authorization(data, TRUE);
       } else {
-          if (polkit_authorization_result_get_is_challenge (result))
+          if (polkit_authorization_result_get_is_challenge (result)) {
                result_str = "challenge";
-          else
+          } else {
                result_str = "not authorized";
-          g_debug ("Authorization result: %s\n", result_str);
+               cache_store(data->sender, data->cache_key, FALSE);
+          }
+          g_debug ("Authorization result: %s (%0.2F ms)", result_str, elapsed * 1000);
+          finish_authorization(data, FALSE);
       }
-      DBusMessage *ret = dbus_message_new_method_return(data->message);
-      dbus_connection_send(data->connection, ret, NULL);
-      dbus_message_unref(ret);
+      g_object_unref (result);
   }
-  dbus_connection_unref(data->connection);
-  dbus_message_unref(data->message);
+  callback_data_free(data);
 }
 
 int check_polkit(const char *methode,
@@ -60,13 +196,35 @@ int check_polkit(const char *methode,
     PolkitSubject *subject;
     PolkitDetails *details;
     PolkitCheckAuthorizationFlags flags;
+    struct auth_entry *cached;
     gchar tmp[DMAX+1];
-    
+
+    struct callback_data *data = g_malloc0(sizeof(struct callback_data));
+    data->cancellable = g_cancellable_new ();
+    dbus_connection_ref(connection);
+    data->connection = connection;
+    dbus_message_ref(message);
+    data->message = message;
+    data->user_data = user_data;
+    data->callback = callback;
+    data->sender = g_strdup(dbus_message_get_sender (message));
+    data->cache_key = cache_key(action_id, proc, config);
+    data->timer = g_timer_new();
+
+    cached = cache_lookup(data->sender, data->cache_key);
+    if(cached) {
+      U_polkit_stats.hits++;
+      g_debug("Authorization result: %s (cached)",
+              cached->authorized ? "authorized" : "not authorized");
+      finish_authorization(data, cached->authorized);
+      callback_data_free(data);
+      return TRUE;
+    }
+    U_polkit_stats.misses++;
 
     /* Set details - see polkit-action-lookup.c for where
      * these key/value pairs are used
      */
-    printf("a\n");
     details = polkit_details_new ();
     if (proc != NULL)
       {
@@ -86,18 +244,9 @@ int check_polkit(const char *methode,
         polkit_details_insert (details, "config", config);
     }
 
-    subject = polkit_system_bus_name_new (dbus_message_get_sender (message));
+    subject = polkit_system_bus_name_new (data->sender);
     //subject = polkit_unix_process_new (getpid());
 
-    struct callback_data *data = g_malloc0(sizeof(struct callback_data));
-    data->cancellable = g_cancellable_new ();
-    dbus_connection_ref(connection);
-    data->connection = connection;
-    dbus_message_ref(message);
-    data->message = message;
-    data->user_data = user_data;
-    data->callback = callback;
-
     flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
     if (allow_user_interaction)
       flags |= POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION;
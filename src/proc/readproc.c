@@ -15,6 +15,7 @@
 #include "pwcache.h"
 #include "devname.h"
 #include "procps.h"
+#include "statparse.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -259,28 +260,28 @@ ENTER(0x220);
         P->state = *S;
         continue;
     case_Tgid:
-        Tgid = strtol(S,&S,10);
+        Tgid = dec2ull(S,&S);
         continue;
     case_Pid:
-        Pid = strtol(S,&S,10);
+        Pid = dec2ull(S,&S);
         continue;
     case_PPid:
-        P->ppid = strtol(S,&S,10);
+        P->ppid = dec2ull(S,&S);
         continue;
     case_Threads:
-        Threads = strtol(S,&S,10);
+        Threads = dec2ull(S,&S);
         continue;
     case_Uid:
-        P->ruid = strtol(S,&S,10);
-        P->euid = strtol(S,&S,10);
-        P->suid = strtol(S,&S,10);
-        P->fuid = strtol(S,&S,10);
+        P->ruid = dec2ull(S,&S);
+        P->euid = dec2ull(S,&S);
+        P->suid = dec2ull(S,&S);
+        P->fuid = dec2ull(S,&S);
         continue;
     case_Gid:
-        P->rgid = strtol(S,&S,10);
-        P->egid = strtol(S,&S,10);
-        P->sgid = strtol(S,&S,10);
-        P->fgid = strtol(S,&S,10);
+        P->rgid = dec2ull(S,&S);
+        P->egid = dec2ull(S,&S);
+        P->sgid = dec2ull(S,&S);
+        P->fgid = dec2ull(S,&S);
         continue;
     case_Groups:
         isupgid = 0;
@@ -292,31 +293,31 @@ ENTER(0x220);
               vctsize *= 2;
               P->supgid = (int *)xrealloc(P->supgid,vctsize * sizeof(int));
             }
-            P->supgid[isupgid++] = strtol(S,&S,10);
+            P->supgid[isupgid++] = dec2ull(S,&S);
             P->nsupgid++;
           }
         }
         continue;
     case_VmData:
-        P->vm_data = strtol(S,&S,10);
+        P->vm_data = dec2ull(S,&S);
         continue;
     case_VmExe:
-        P->vm_exe = strtol(S,&S,10);
+        P->vm_exe = dec2ull(S,&S);
         continue;
     case_VmLck:
-        P->vm_lock = strtol(S,&S,10);
+        P->vm_lock = dec2ull(S,&S);
         continue;
     case_VmLib:
-        P->vm_lib = strtol(S,&S,10);
+        P->vm_lib = dec2ull(S,&S);
         continue;
     case_VmRSS:
-        P->vm_rss = strtol(S,&S,10);
+        P->vm_rss = dec2ull(S,&S);
         continue;
     case_VmSize:
-        P->vm_size = strtol(S,&S,10);
+        P->vm_size = dec2ull(S,&S);
         continue;
     case_VmStk:
-        P->vm_stack = strtol(S,&S,10);
+        P->vm_stack = dec2ull(S,&S);
         continue;
     }
 
@@ -357,11 +358,18 @@ ENTER(0x220);
 LEAVE(0x220);
 }
 
+// status2proc for buffers read elsewhere, ie. by the parser tests
+void status2proc_buf(char *S, proc_t *restrict P) {
+    status2proc(S, P, 1);
+}
+
 ///////////////////////////////////////////////////////////////////////
 
 // Reads /proc/*/stat files, being careful not to trip over processes with
 // names like ":-) 1 2 3 4 5 6".
-static void stat2proc(const char* S, proc_t *restrict P) {
+// This is the reference for stat2proc_fast in statparse.c, which is used
+// for reading. Both have to give the same result.
+void stat2proc_sscanf(const char* S, proc_t *restrict P) {
     unsigned num;
     char* tmp;
 
@@ -433,11 +441,20 @@ static void statm2proc(const char* s, proc_t *restrict P) {
 /*    fprintf(stderr, "statm2proc converted %d fields.\n",num); */
 }
 
+int (*file2str_hook)(const char *directory, const char *what, char *ret, int cap) = NULL;
+
 int file2str(const char *directory, const char *what, char *ret, int cap) {
-    static char filename[80];
+    // directory is below proc_root, which may take PROC_ROOT_MAX itself
+    static char filename[PROCPATHLEN + PROC_ROOT_MAX];
     int fd, num_read;
 
-    sprintf(filename, "%s/%s", directory, what);
+    if (file2str_hook) {
+        num_read = file2str_hook(directory, what, ret, cap);
+        if (num_read != FILE2STR_MISS)
+            return num_read;
+    }
+    num_read = snprintf(filename, sizeof filename, "%s/%s", directory, what);
+    if(unlikely(num_read >= (int)sizeof filename)) return -1;	/* truncated path */
     fd = open(filename, O_RDONLY, 0);
     if(unlikely(fd==-1)) return -1;
     num_read = read(fd, ret, cap - 1);
@@ -450,15 +467,26 @@ int file2str(const char *directory, const char *what, char *ret, int cap) {
 char** file2strvec_ext(const char* directory, const char* what, char terminator) {
     char buf[2048];	/* read buf bytes at a time */
     char *p, *rbuf = 0, *endbuf, **q, **ret;
-    int fd, tot = 0, n, c, end_of_file = 0;
-    int align;
-
-    sprintf(buf, "%s/%s", directory, what);
-    fd = open(buf, O_RDONLY, 0);
-    if(fd==-1) return NULL;
+    int fd = -1, tot = 0, n = FILE2STR_MISS, c, end_of_file = 0;
+    int align, prefetched;
+
+    if (file2str_hook) {
+        n = file2str_hook(directory, what, buf, sizeof buf);
+        if (n == -1) return NULL;
+        if (n >= (int)(sizeof buf - 1))
+            n = FILE2STR_MISS;		/* may be cut, read the whole file */
+    }
+    prefetched = (n >= 0);
+    if (!prefetched) {
+        if (snprintf(buf, sizeof buf, "%s/%s", directory, what) >= (int)sizeof buf)
+            return NULL;	/* truncated path */
+        fd = open(buf, O_RDONLY, 0);
+        if(fd==-1) return NULL;
+    }
 
     /* read whole file into a memory buffer, allocating as we go */
-    while ((n = read(fd, buf, sizeof buf - 1)) > 0) {
+    while (prefetched || (n = read(fd, buf, sizeof buf - 1)) > 0) {
+        prefetched = 0;
         if (n < (int)(sizeof buf - 1))
             end_of_file = 1;
         if (n == 0 && rbuf == 0)
@@ -476,7 +504,8 @@ char** file2strvec_ext(const char* directory, const char* what, char terminator)
         if (end_of_file)
             break;
     }
-    close(fd);
+    if (fd != -1)
+        close(fd);
     if (n <= 0 && !end_of_file) {
         if (rbuf) free(rbuf);
         return NULL;		/* read error */
@@ -510,11 +539,11 @@ char** file2strvec(const char* directory, const char* what) {
 
 // warning: interface may change
 int read_cmdline(char *restrict const dst, unsigned sz, unsigned pid){
-    char name[32];
+    char name[PROCPATHLEN];
     int fd;
     unsigned n = 0;
     dst[0] = '\0';
-    snprintf(name, sizeof name, "/proc/%u/cmdline", pid);
+    snprintf(name, sizeof name, "%s/proc/%u/cmdline", proc_root, pid);
     fd = open(name, O_RDONLY);
     if(fd==-1) return 0;
     for(;;){
@@ -583,7 +612,7 @@ static proc_t* simple_readproc(PROCTAB *restrict const PT, proc_t *restrict cons
     if (flags & PROC_FILLSTAT) {         /* read, parse /proc/#/stat */
 	if (unlikely( file2str(path, "stat", sbuf, sizeof sbuf) == -1 ))
 	    goto next_proc;			/* error reading /proc/#/stat */
-	stat2proc(sbuf, p);				/* parse /proc/#/stat */
+	stat2proc_fast(sbuf, p);				/* parse /proc/#/stat */
     }
 
     if (unlikely(flags & PROC_FILLMEM)) {	/* read, parse /proc/#/statm */
@@ -679,7 +708,7 @@ static proc_t* simple_readtask(PROCTAB *restrict const PT, const proc_t *restric
     if (flags & PROC_FILLSTAT) {         /* read, parse /proc/#/stat */
 	if (unlikely( file2str(path, "stat", sbuf, sizeof sbuf) == -1 ))
 	    goto next_task;			/* error reading /proc/#/stat */
-	stat2proc(sbuf, t);				/* parse /proc/#/stat */
+	stat2proc_fast(sbuf, t);				/* parse /proc/#/stat */
     }
 
     if (unlikely(flags & PROC_FILLMEM)) {	/* read, parse /proc/#/statm */
@@ -765,8 +794,8 @@ static int simple_nextpid(PROCTAB *restrict const PT, proc_t *restrict const p)
   }
   p->tgid = strtoul(ent->d_name, NULL, 10);
   p->tid = p->tgid;
-  memcpy(path, "/proc/", 6);
-  strcpy(path+6, ent->d_name);  // trust /proc to not contain evil top-level entries
+  // trust /proc to not contain evil top-level entries
+  snprintf(path, PROCPATHLEN, "%s/proc/%s", proc_root, ent->d_name);
   return 1;
 }
 
@@ -780,7 +809,7 @@ static int simple_nexttid(PROCTAB *restrict const PT, const proc_t *restrict con
       closedir(PT->taskdir);
     }
     // use "path" as some tmp space
-    snprintf(path, PROCPATHLEN, "/proc/%d/task", p->tgid);
+    snprintf(path, PROCPATHLEN, "%s/proc/%d/task", proc_root, p->tgid);
     PT->taskdir = opendir(path);
     if(!PT->taskdir) return 0;
     PT->taskdir_user = p->tgid;
@@ -793,7 +822,7 @@ static int simple_nexttid(PROCTAB *restrict const PT, const proc_t *restrict con
   t->tid = strtoul(ent->d_name, NULL, 10);
   t->tgid = p->tgid;
   t->ppid = p->ppid;  // cover for kernel behavior? we want both actually...?
-  snprintf(path, PROCPATHLEN, "/proc/%d/task/%s", p->tgid, ent->d_name);
+  snprintf(path, PROCPATHLEN, "%s/proc/%d/task/%s", proc_root, p->tgid, ent->d_name);
   return 1;
 }
 
@@ -804,7 +833,7 @@ static int listed_nextpid(PROCTAB *restrict const PT, proc_t *restrict const p)
   char *restrict const path = PT->path;
   pid_t tgid = *(PT->pids)++;
   if(likely( tgid )){
-    snprintf(path, PROCPATHLEN, "/proc/%d", tgid);
+    snprintf(path, PROCPATHLEN, "%s/proc/%d", proc_root, tgid);
     p->tgid = tgid;
     p->tid = tgid;  // they match for leaders
   }
@@ -902,10 +931,12 @@ PROCTAB* openproc(int flags, ...) {
     va_list ap;
     struct stat sbuf;
     static int did_stat;
+    char path[PROCPATHLEN];
     PROCTAB* PT = xmalloc(sizeof(PROCTAB));
 
     if(!did_stat){
-      task_dir_missing = stat("/proc/self/task", &sbuf);
+      snprintf(path, sizeof path, "%s/proc/self/task", proc_root);
+      task_dir_missing = stat(path, &sbuf);
       did_stat = 1;
     }
     PT->taskdir = NULL;
@@ -918,7 +949,8 @@ PROCTAB* openproc(int flags, ...) {
       PT->procfs = NULL;
       PT->finder = listed_nextpid;
     }else{
-      PT->procfs = opendir("/proc");
+      snprintf(path, sizeof path, "%s/proc", proc_root);
+      PT->procfs = opendir(path);
       if(!PT->procfs) return NULL;
       PT->finder = simple_nextpid;
     }
@@ -1014,13 +1046,14 @@ void freeproc_light(proc_t* p) {
 
 //////////////////////////////////////////////////////////////////////////////////
 void look_up_our_self(proc_t *p) {
-    char sbuf[1024];
+    char sbuf[1024], path[PROCPATHLEN];
 
-    if(file2str("/proc/self", "stat", sbuf, sizeof sbuf) == -1){
+    snprintf(path, sizeof path, "%s/proc/self", proc_root);
+    if(file2str(path, "stat", sbuf, sizeof sbuf) == -1){
         fprintf(stderr, "Error, do this: mount -t proc none /proc\n");
         _exit(47);
     }
-    stat2proc(sbuf, p);    // parse /proc/self/stat
+    stat2proc_fast(sbuf, p);    // parse /proc/self/stat
 }
 
 HIDDEN_ALIAS(readproc);
@@ -1148,17 +1181,17 @@ proc_data_t *readproctab2(int(*want_proc)(proc_t *buf), int(*want_task)(proc_t *
  * and filled out proc_t structure.
  */
 proc_t * get_proc_stats(pid_t pid, proc_t *p) {
-	static char path[32], sbuf[1024];
+	static char path[PROCPATHLEN], sbuf[1024];
 	struct stat statbuf;
 
-	sprintf(path, "/proc/%d", pid);
+	snprintf(path, sizeof path, "%s/proc/%d", proc_root, pid);
 	if (stat(path, &statbuf)) {
 		perror("stat");
 		return NULL;
 	}
 
 	if (file2str(path, "stat", sbuf, sizeof sbuf) >= 0)
-		stat2proc(sbuf, p);	/* parse /proc/#/stat */
+		stat2proc_fast(sbuf, p);	/* parse /proc/#/stat */
 	if (file2str(path, "statm", sbuf, sizeof sbuf) >= 0)
 		statm2proc(sbuf, p);	/* ignore statm errors here */
 	if (file2str(path, "status", sbuf, sizeof sbuf) >= 0)
@@ -1166,3 +1199,76 @@ proc_t * get_proc_stats(pid_t pid, proc_t *p) {
 
 	return p;
 }
+
+/*
+ * fill_proc_fields - refresh parts of an already known process
+ *
+ * Only the files selected by the PROC_FILL* bits in flags are read, buffers
+ * of the refreshed parts are released first. PROC_FILLSUPGRP and
+ * PROC_FILLWCHAN depend on status and stat data already present in 'p'.
+ * On failure, returns NULL.  On success, returns 'p'.
+ */
+proc_t * fill_proc_fields(pid_t pid, proc_t *p, unsigned flags) {
+	static char path[PROCPATHLEN], sbuf[1024];
+	struct stat sb;
+
+	snprintf(path, sizeof path, "%s/proc/%d", proc_root, pid);
+	if (unlikely(stat(path, &sb) == -1))	/* no such dirent (anymore) */
+		return NULL;
+
+	if (flags & PROC_FILLSTAT) {
+		if (unlikely(file2str(path, "stat", sbuf, sizeof sbuf) == -1))
+			return NULL;
+		stat2proc_fast(sbuf, p);
+	}
+
+	if (flags & PROC_FILLMEM) {
+		if (likely(file2str(path, "statm", sbuf, sizeof sbuf) != -1))
+			statm2proc(sbuf, p);
+	}
+
+	if (flags & PROC_FILLSTATUS) {
+		/* status2proc allocates a new supgid vector */
+		freesupgrp(p);
+		if (unlikely(file2str(path, "status", sbuf, sizeof sbuf) == -1))
+			return NULL;
+		status2proc(sbuf, p, 1);
+	}
+
+	if ((flags & PROC_FILLWCHAN) && p->nlwp > 1)
+		p->wchan = (KLONG)~0ull;
+
+	if (flags & PROC_FILLUSR) {
+		memcpy(p->euser, user_from_uid(p->euid), sizeof p->euser);
+		memcpy(p->ruser, user_from_uid(p->ruid), sizeof p->ruser);
+		memcpy(p->suser, user_from_uid(p->suid), sizeof p->suser);
+		memcpy(p->fuser, user_from_uid(p->fuid), sizeof p->fuser);
+	}
+
+	if (flags & PROC_FILLGRP) {
+		memcpy(p->egroup, group_from_gid(p->egid), sizeof p->egroup);
+		memcpy(p->rgroup, group_from_gid(p->rgid), sizeof p->rgroup);
+		memcpy(p->sgroup, group_from_gid(p->sgid), sizeof p->sgroup);
+		memcpy(p->fgroup, group_from_gid(p->fgid), sizeof p->fgroup);
+	}
+
+	if ((flags & PROC_FILLSUPGRP) && p->nsupgid > 0 && !p->supgrp) {
+		int i;
+		allocsupgrp(p);
+		for (i=0; i < p->nsupgid; i++)
+			memcpy(p->supgrp[i], group_from_gid(p->supgid[i]), P_G_SZ);
+	}
+
+	if (flags & PROC_FILLCGROUP) {
+		if (p->cgroup)
+			free((void*)*p->cgroup);
+		p->cgroup = file2strvec_ext(path, "cgroup", '\n');
+		if (p->cgroup && *p->cgroup) {
+			int i = strlen(*p->cgroup);
+			if ((*p->cgroup)[i-1] == '\n')
+				(*p->cgroup)[i-1] = ' ';
+		}
+	}
+
+	return p;
+}
@@ -153,7 +153,19 @@ typedef struct proc_t {
 #include <dirent.h>
 #include <unistd.h>
 
-#define PROCPATHLEN 64  // must hold /proc/2000222000/task/2000222000/cmdline
+#define PROC_ROOT_MAX 192
+#define PROCPATHLEN (64 + PROC_ROOT_MAX)  // must hold <proc_root>/proc/2000222000/task/2000222000/cmdline
+
+// Directory /proc and /sys are read below, "" for the live system.
+// A captured fixture has proc/ and sys/ in it, see tests/proc_capture.c
+extern char proc_root[PROC_ROOT_MAX];
+
+// change proc_root, files kept open by sysinfo are reopened below the new
+// root on their next use. returns 0 on success, -1 if root is too long.
+extern int set_proc_root(const char *root);
+
+// open path, ie. "/proc/stat", below proc_root
+extern int proc_root_open(const char *path, int flags);
 
 typedef struct PROCTAB {
     DIR*	procfs;
@@ -224,6 +236,9 @@ extern void freeproc_light(proc_t* p);
 //fill out a proc_t for a single task
 extern proc_t * get_proc_stats(pid_t pid, proc_t *p);
 
+// refresh only the parts of a known process selected by PROC_FILL* flags
+extern proc_t * fill_proc_fields(pid_t pid, proc_t *p, unsigned flags);
+
 // openproc/readproctab:
 //
 // Return PROCTAB* / *proc_t[] or NULL on error ((probably) "/proc" cannot be
@@ -267,5 +282,12 @@ extern proc_t * get_proc_stats(pid_t pid, proc_t *p);
 char** file2strvec(const char* directory, const char* what);
 char** file2strvec_ext(const char* directory, const char* what, char terminator);
 
+// file2str_hook: when set, asked first for the content of directory/what.
+// Returns the number of bytes copied into ret (NUL terminated, at most cap-1),
+// -1 if the file is known to be unreadable or FILE2STR_MISS to read it the
+// normal way. Used to hand over files prefetched in bulk.
+#define FILE2STR_MISS (-2)
+extern int (*file2str_hook)(const char *directory, const char *what, char *ret, int cap);
+
 EXTERN_C_END
 #endif
@@ -0,0 +1,198 @@
+/*
+ * Parser for /proc/#/stat without sscanf
+ * Copyright 2010,2011 ulatencyd developers
+ * May be distributed under the conditions of the
+ * GNU Library General Public License; a copy is in COPYING
+ *
+ * The fields behind the command name are located first, with SIMD compares
+ * where the cpu has them, and only the wanted ones are converted afterwards.
+ * The implementation is picked at runtime on the first call.
+ */
+#include "statparse.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define STAT_SPLIT_X86 1
+#include <immintrin.h>
+#endif
+
+// the last field stat2proc wants is sched, field 38 behind the command
+#define STAT_FIELDS 39
+
+// a separator right before the end does not start a field
+static int split_trim(const char *s, unsigned short *offs, int n) {
+    if (n > 1 && (s[offs[n-1]] == '\n' || !s[offs[n-1]]))
+        n--;
+    return n;
+}
+
+static int split_scalar(const char *s, unsigned short *offs, int max) {
+    const char *p;
+    int n = 0;
+
+    if (!*s || *s == '\n') return 0;
+    offs[n++] = 0;
+    for (p = s; *p && *p != '\n'; p++) {
+        if (*p != ' ') continue;
+        offs[n++] = p + 1 - s;
+        if (n == max) return n;
+    }
+    return split_trim(s, offs, n);
+}
+
+#ifdef STAT_SPLIT_X86
+/* The loads are aligned, so they never cross into the next page even when
+ * they read past the end of the string. Bits before s are masked off.
+ */
+#define SPLIT_SIMD(NAME, TARGET, WIDTH, VEC, LOAD, SET1, ZERO, CMPEQ, OR, MOVEMASK) \
+__attribute__((target(TARGET)))                                               \
+static int NAME(const char *s, unsigned short *offs, int max) {               \
+    const char *base = (const char *)((uintptr_t)s & ~(uintptr_t)(WIDTH - 1)); \
+    unsigned shift = s - base;                                                \
+    const VEC sp = SET1(' '), nl = SET1('\n'), zero = ZERO();                 \
+    int n = 0;                                                                \
+                                                                              \
+    if (!*s || *s == '\n') return 0;                                          \
+    offs[n++] = 0;                                                            \
+    for (;;) {                                                                \
+        VEC v = LOAD((const VEC *)base);                                      \
+        uint32_t end = MOVEMASK(OR(CMPEQ(v, nl), CMPEQ(v, zero)));            \
+        uint32_t seps = MOVEMASK(CMPEQ(v, sp));                               \
+        end &= ~0u << shift;                                                  \
+        seps &= ~0u << shift;                                                 \
+        shift = 0;                                                            \
+        if (end) seps &= (end & -end) - 1;                                    \
+        while (seps) {                                                        \
+            offs[n++] = base + __builtin_ctz(seps) + 1 - s;                   \
+            if (n == max) return n;                                           \
+            seps &= seps - 1;                                                 \
+        }                                                                     \
+        if (end) break;                                                       \
+        base += WIDTH;                                                        \
+    }                                                                         \
+    return split_trim(s, offs, n);                                            \
+}
+
+SPLIT_SIMD(split_sse2, "sse2", 16, __m128i, _mm_load_si128, _mm_set1_epi8,
+           _mm_setzero_si128, _mm_cmpeq_epi8, _mm_or_si128, (uint32_t)_mm_movemask_epi8)
+SPLIT_SIMD(split_avx2, "avx2", 32, __m256i, _mm256_load_si256, _mm256_set1_epi8,
+           _mm256_setzero_si256, _mm256_cmpeq_epi8, _mm256_or_si256, (uint32_t)_mm256_movemask_epi8)
+#endif
+
+static int split_init(const char *s, unsigned short *offs, int max);
+
+static int (*split_fn)(const char *, unsigned short *, int) = split_init;
+static const char *split_name = "scalar";
+
+int stat_split_use(const char *name) {
+    if (!strcmp(name, "scalar")) {
+        split_fn = split_scalar;
+#ifdef STAT_SPLIT_X86
+    } else if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+        split_fn = split_sse2;
+    } else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        split_fn = split_avx2;
+#endif
+    } else {
+        return 0;
+    }
+    split_name = name;
+    return 1;
+}
+
+static int split_init(const char *s, unsigned short *offs, int max) {
+#ifdef STAT_SPLIT_X86
+    __builtin_cpu_init();
+    if (!stat_split_use("avx2") && !stat_split_use("sse2"))
+#endif
+        stat_split_use("scalar");
+    return split_fn(s, offs, max);
+}
+
+int stat_split(const char *s, unsigned short *offs, int max) {
+    return split_fn(s, offs, max);
+}
+
+const char *stat_split_impl(void) {
+    if (split_fn == split_init) {
+        unsigned short off;
+        split_init("", &off, 1);
+    }
+    return split_name;
+}
+
+// Same result as stat2proc_sscanf: fields missing on old kernels keep
+// their default, the signal masks and nswap are skipped.
+void stat2proc_fast(const char *S, proc_t *restrict P) {
+    unsigned short offs[STAT_FIELDS];
+    unsigned num;
+    char *tmp;
+    int n;
+
+    /* fill in default values for older kernels */
+    P->processor = 0;
+    P->rtprio = -1;
+    P->sched = -1;
+    P->nlwp = 0;
+
+    S = strchr(S, '(') + 1;
+    tmp = strrchr(S, ')');
+    num = tmp - S;
+    if (unlikely(num >= sizeof P->cmd)) num = sizeof P->cmd - 1;
+    memcpy(P->cmd, S, num);
+    P->cmd[num] = '\0';
+    S = tmp + 2;                 // skip ") "
+
+    n = stat_split(S, offs, STAT_FIELDS);
+
+#define NUM(i) dec2ull(S + offs[i], NULL)
+    switch (n) {   // falls through, every case fills one more field
+    case 39: P->sched       = NUM(38);
+    case 38: P->rtprio      = NUM(37);
+    case 37: P->processor   = NUM(36);
+    case 36: P->exit_signal = NUM(35);
+    case 35:
+    case 34:
+    case 33: P->wchan       = NUM(32);
+    case 32:
+    case 31:
+    case 30:
+    case 29:
+    case 28: P->kstk_eip    = NUM(27);
+    case 27: P->kstk_esp    = NUM(26);
+    case 26: P->start_stack = NUM(25);
+    case 25: P->end_code    = NUM(24);
+    case 24: P->start_code  = NUM(23);
+    case 23: P->rss_rlim    = NUM(22);
+    case 22: P->rss         = NUM(21);
+    case 21: P->vsize       = NUM(20);
+    case 20: P->start_time  = NUM(19);
+    case 19: P->alarm       = NUM(18);
+    case 18: P->nlwp        = NUM(17);
+    case 17: P->nice        = NUM(16);
+    case 16: P->priority    = NUM(15);
+    case 15: P->cstime      = NUM(14);
+    case 14: P->cutime      = NUM(13);
+    case 13: P->stime       = NUM(12);
+    case 12: P->utime       = NUM(11);
+    case 11: P->cmaj_flt    = NUM(10);
+    case 10: P->maj_flt     = NUM(9);
+    case 9:  P->cmin_flt    = NUM(8);
+    case 8:  P->min_flt     = NUM(7);
+    case 7:  P->flags       = NUM(6);
+    case 6:  P->tpgid       = NUM(5);
+    case 5:  P->tty         = NUM(4);
+    case 4:  P->session     = NUM(3);
+    case 3:  P->pgrp        = NUM(2);
+    case 2:  P->ppid        = NUM(1);
+    case 1:  P->state       = *S;
+    case 0:  break;
+    }
+#undef NUM
+
+    if (!P->nlwp) {
+        P->nlwp = 1;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef PROCPS_PROC_STATPARSE_H
+#define PROCPS_PROC_STATPARSE_H
+
+#include "procps.h"
+#include "readproc.h"
+
+EXTERN_C_BEGIN
+
+// Decimal conversion for /proc files, like strtol(s, end, 10) without the
+// locale and base handling. Leading blanks are skipped, a '-' gives the
+// two's complement like strtoul does. If there are no digits *end is s.
+static inline unsigned long long dec2ull(const char *s, char **end) {
+    const char *p = s;
+    unsigned long long v = 0;
+    int neg = 0;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+    if (unlikely((unsigned)(*p - '0') > 9)) {
+        if (end) *end = (char *)s;
+        return 0;
+    }
+    do
+        v = v * 10 + (*p++ - '0');
+    while ((unsigned)(*p - '0') <= 9);
+    if (end) *end = (char *)p;
+    return neg ? -v : v;
+}
+
+// offsets of the space separated fields of a /proc/#/stat tail, up to the
+// newline. returns the number of fields found, at most max.
+extern int stat_split(const char *s, unsigned short *offs, int max);
+
+// name of the stat_split implementation in use: "avx2", "sse2" or "scalar"
+extern const char *stat_split_impl(void);
+
+// use a specific implementation, for tests and benchmarks.
+// returns 0 if the cpu does not support it
+extern int stat_split_use(const char *name);
+
+// parsers of /proc/#/stat and status, stat2proc_sscanf is the old reference
+extern void stat2proc_fast(const char *S, proc_t *restrict P);
+extern void stat2proc_sscanf(const char *S, proc_t *restrict P);
+extern void status2proc_buf(char *S, proc_t *restrict P);
+
+EXTERN_C_END
+#endif
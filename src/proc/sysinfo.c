@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include "version.h"
 #include "sysinfo.h" /* include self to verify prototypes */
+#include "readproc.h"
 
 #ifndef HZ
 #include <netinet/in.h>  /* htons */
@@ -45,7 +46,43 @@ static int vminfo_fd = -1;
 
 // As of 2.6.24 /proc/meminfo seems to need 888 on 64-bit,
 // and would need 1258 if the obsolete fields were there.
-static char buf[2048];
+// /proc/vmstat of 3.x kernels is far beyond 2048 already.
+static char buf[8192];
+
+static int getstat_fd;
+
+char proc_root[PROC_ROOT_MAX];
+
+int set_proc_root(const char *root) {
+    int *fds[] = { &stat_fd, &uptime_fd, &loadavg_fd, &meminfo_fd, &vminfo_fd };
+    unsigned i;
+
+    if (!root) root = "";
+    if (strlen(root) >= sizeof proc_root) return -1;
+    strcpy(proc_root, root);
+    for (i = 0; i < sizeof fds / sizeof fds[0]; i++) {
+	if (*fds[i] != -1) close(*fds[i]);
+	*fds[i] = -1;
+    }
+    if (getstat_fd) close(getstat_fd);
+    getstat_fd = 0;
+    return 0;
+}
+
+int proc_root_open(const char *path, int flags) {
+    char full[PROCPATHLEN];
+
+    if (!*proc_root) return open(path, flags);
+    snprintf(full, sizeof full, "%s%s", proc_root, path);
+    return open(full, flags);
+}
+
+static FILE *proc_root_fopen(const char *path, const char *mode) {
+    char full[PROCPATHLEN];
+
+    snprintf(full, sizeof full, "%s%s", proc_root, path);
+    return fopen(full, mode);
+}
 
 /* This macro opens filename only if necessary and seeks to 0 so
  * that successive calls to the functions are more efficient.
@@ -53,7 +90,7 @@ static char buf[2048];
  */
 #define FILE_TO_BUF(filename, fd) do{				\
     static int local_n;						\
-    if (fd == -1 && (fd = open(filename, O_RDONLY)) == -1) {	\
+    if (fd == -1 && (fd = proc_root_open(filename, O_RDONLY)) == -1) {	\
 	fputs(BAD_OPEN_MESSAGE, stderr);			\
 	fflush(NULL);						\
 	_exit(102);						\
@@ -348,11 +385,13 @@ static void crash(const char *filename) {
 static void getrunners(unsigned int *restrict running, unsigned int *restrict blocked) {
   struct direct *ent;
   DIR *proc;
+  char path[PROCPATHLEN];
 
   *running=0;
   *blocked=0;
 
-  if((proc=opendir("/proc"))==NULL) crash("/proc");
+  snprintf(path, sizeof path, "%s/proc", proc_root);
+  if((proc=opendir(path))==NULL) crash(path);
 
   while(( ent=readdir(proc) )) {
     char tbuf[32];
@@ -361,9 +400,9 @@ static void getrunners(unsigned int *restrict running, unsigned int *restrict bl
     char c;
 
     if (!isdigit(ent->d_name[0])) continue;
-    sprintf(tbuf, "/proc/%s/stat", ent->d_name);
+    snprintf(path, sizeof path, "%s/proc/%s/stat", proc_root, ent->d_name);
 
-    fd = open(tbuf, O_RDONLY, 0);
+    fd = open(path, O_RDONLY, 0);
     if (fd == -1) continue;
     memset(tbuf, '\0', sizeof tbuf); // didn't feel like checking read()
     read(fd, tbuf, sizeof tbuf - 1); // need 32 byte buffer at most
@@ -392,19 +431,20 @@ void getstat(jiff *restrict cuse, jiff *restrict cice, jiff *restrict csys, jiff
 	     unsigned *restrict intr, unsigned *restrict ctxt,
 	     unsigned int *restrict running, unsigned int *restrict blocked,
 	     unsigned int *restrict btime, unsigned int *restrict processes) {
-  static int fd;
+  int fd;
   unsigned long long llbuf = 0;
   int need_vmstat_file = 0;
   int need_proc_scan = 0;
   const char* b;
   buff[BUFFSIZE-1] = 0;  /* ensure null termination in buffer */
 
-  if(fd){
-    lseek(fd, 0L, SEEK_SET);
+  if(getstat_fd){
+    lseek(getstat_fd, 0L, SEEK_SET);
   }else{
-    fd = open("/proc/stat", O_RDONLY, 0);
-    if(fd == -1) crash("/proc/stat");
+    getstat_fd = proc_root_open("/proc/stat", O_RDONLY);
+    if(getstat_fd == -1) crash("/proc/stat");
   }
+  fd = getstat_fd;
   read(fd,buff,BUFFSIZE-1);
   *intr = 0; 
   *ciow = 0;  /* not separated out until the 2.5.41 kernel */
@@ -481,6 +521,50 @@ static int compare_mem_table_structs(const void *a, const void *b){
   return strcmp(((const mem_table_struct*)a)->name,((const mem_table_struct*)b)->name);
 }
 
+/* The lines of meminfo and vmstat keep their order while the kernel runs.
+ * The first parse remembers the name length and slot of each line, later
+ * parses only check the separator is where it was and convert the number.
+ * If the layout differs, the table is looked up again and the cache rebuilt.
+ */
+#define LINE_CACHE_MAX 512
+
+typedef struct line_cache {
+  int n;                                /* lines cached, 0 if not built */
+  unsigned char name_len[LINE_CACHE_MAX];
+  char first[LINE_CACHE_MAX];           /* first char of the name */
+  unsigned long *slot[LINE_CACHE_MAX];  /* NULL for unknown names */
+} line_cache;
+
+static void line_cache_add(line_cache *c, const char *name, size_t len, unsigned long *slot){
+  if(c->n < 0) return;
+  if(c->n == LINE_CACHE_MAX || len > 255){
+    c->n = -1;  /* too big to cache, stays on the slow path */
+    return;
+  }
+  c->name_len[c->n] = len;
+  c->first[c->n] = *name;
+  c->slot[c->n] = slot;
+  c->n++;
+}
+
+/* returns 0 if buf does not match the cached layout */
+static int line_cache_parse(const line_cache *c, char sep){
+  char *head = buf;
+  char *tail;
+  int i;
+
+  if(c->n <= 0) return 0;
+  for(i = 0; i < c->n; i++){
+    if(*head != c->first[i] || head[c->name_len[i]] != sep) return 0;
+    head += c->name_len[i] + 1;
+    if(c->slot[i]) *(c->slot[i]) = strtoul(head, &tail, 10);
+    tail = strchr(head, '\n');
+    if(!tail) return i == c->n - 1;
+    head = tail + 1;
+  }
+  return *head == '\0';
+}
+
 /* example data, following junk, with comments added:
  *
  * MemTotal:        61768 kB    old
@@ -601,17 +685,22 @@ void meminfo(void){
   {"Writeback",    &kb_writeback},    // kB version of vmstat nr_writeback
   };
   const int mem_table_count = sizeof(mem_table)/sizeof(mem_table_struct);
+  static line_cache cache;
 
   FILE_TO_BUF(MEMINFO_FILE,meminfo_fd);
 
   kb_inactive = ~0UL;
 
+  if(line_cache_parse(&cache, ':')) goto done;
+  cache.n = 0;
+
   head = buf;
   for(;;){
     tail = strchr(head, ':');
     if(!tail) break;
     *tail = '\0';
     if(strlen(head) >= sizeof(namebuf)){
+      line_cache_add(&cache, head, tail - head, NULL);
       head = tail+1;
       goto nextline;
     }
@@ -619,6 +708,7 @@ void meminfo(void){
     found = bsearch(&findme, mem_table, mem_table_count,
         sizeof(mem_table_struct), compare_mem_table_structs
     );
+    line_cache_add(&cache, head, tail - head, found ? found->slot : NULL);
     head = tail+1;
     if(!found) goto nextline;
     *(found->slot) = (unsigned long)strtoull(head,&tail,10);
@@ -627,6 +717,7 @@ nextline:
     if(!tail) break;
     head = tail+1;
   }
+done:
   if(!kb_low_total){  /* low==main except with large-memory support */
     kb_low_total = kb_main_total;
     kb_low_free  = kb_main_free;
@@ -751,6 +842,7 @@ void vminfo(void){
   {"slabs_scanned",       &vm_slabs_scanned},
   };
   const int vm_table_count = sizeof(vm_table)/sizeof(vm_table_struct);
+  static line_cache cache;
 
   vm_pgalloc = 0;
   vm_pgrefill = 0;
@@ -759,12 +851,16 @@ void vminfo(void){
 
   FILE_TO_BUF(VMINFO_FILE,vminfo_fd);
 
+  if(line_cache_parse(&cache, ' ')) goto done;
+  cache.n = 0;
+
   head = buf;
   for(;;){
     tail = strchr(head, ' ');
     if(!tail) break;
     *tail = '\0';
     if(strlen(head) >= sizeof(namebuf)){
+      line_cache_add(&cache, head, tail - head, NULL);
       head = tail+1;
       goto nextline;
     }
@@ -772,6 +868,7 @@ void vminfo(void){
     found = bsearch(&findme, vm_table, vm_table_count,
         sizeof(vm_table_struct), compare_vm_table_structs
     );
+    line_cache_add(&cache, head, tail - head, found ? found->slot : NULL);
     head = tail+1;
     if(!found) goto nextline;
     *(found->slot) = strtoul(head,&tail,10);
@@ -784,6 +881,7 @@ nextline:
     if(!tail) break;
     head = tail+1;
   }
+done:
   if(!vm_pgalloc)
     vm_pgalloc  = vm_pgalloc_dma + vm_pgalloc_high + vm_pgalloc_normal;
   if(!vm_pgrefill)
@@ -818,7 +916,7 @@ static int is_disk(char *dev)
 
   while ((slash = strchr(dev, '/')))
     *slash = '!';
-  snprintf(syspath, sizeof(syspath), "/sys/block/%s", dev);
+  snprintf(syspath, sizeof(syspath), "%s/sys/block/%s", proc_root, dev);
   return !(access(syspath, F_OK));
 }
 
@@ -835,7 +933,7 @@ unsigned int getdiskstat(struct disk_stat **disks, struct partition_stat **parti
   *disks = NULL;
   *partitions = NULL;
   buff[BUFFSIZE-1] = 0; 
-  fd = fopen("/proc/diskstats", "rb");
+  fd = proc_root_fopen("/proc/diskstats", "rb");
   if(!fd) crash("/proc/diskstats");
 
   for (;;) {
@@ -895,7 +993,7 @@ unsigned int getslabinfo (struct slab_cache **slab){
   int cSlab = 0;
   buff[BUFFSIZE-1] = 0; 
   *slab = NULL;
-  fd = fopen("/proc/slabinfo", "rb");
+  fd = proc_root_fopen("/proc/slabinfo", "rb");
   if(!fd) crash("/proc/slabinfo");
   while (fgets(buff,BUFFSIZE-1,fd)){
     if(!memcmp("slabinfo - version:",buff,19)) continue; // skip header
@@ -925,7 +1023,7 @@ unsigned get_pid_digits(void){
 
   if(ret) goto out;
   ret = 5;
-  fd = open("/proc/sys/kernel/pid_max", O_RDONLY);
+  fd = proc_root_open("/proc/sys/kernel/pid_max", O_RDONLY);
   if(fd==-1) goto out;
   rc = read(fd, pidbuf, sizeof pidbuf);
   close(fd);
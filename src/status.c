@@ -0,0 +1,337 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  memory mapped status file
+
+  once per iteration a snapshot of the daemon state is written into a shared
+  mapping, so monitors can read it without waking the daemon. the layout is
+  described in ulatency.h. the snapshot is protected by a sequence counter:
+  the writer makes it odd before touching the data and even again when done.
+  a reader copies the data and retries if the counter was odd or changed
+  meanwhile.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "ulatency.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define STATUS_PAGE 4096
+
+static int status_fd = -1;
+static char *status_path = NULL;
+static void *status_map = NULL;
+static size_t status_mapped = 0;
+
+// buffers of the snapshot, reused between iterations
+static GByteArray *buf_procs = NULL;
+static GByteArray *buf_flags = NULL;
+static GByteArray *buf_strings = NULL;
+static GHashTable *string_index = NULL; // string -> offset + 1
+static GString *groups_str = NULL;
+
+static guint32 add_string(const char *str) {
+  gpointer cached;
+  guint32 offset;
+
+  // offset 0 is the empty string
+  if(!str || !*str)
+    return 0;
+
+  cached = g_hash_table_lookup(string_index, str);
+  if(cached)
+    return GPOINTER_TO_UINT(cached) - 1;
+
+  offset = buf_strings->len;
+  g_byte_array_append(buf_strings, (const guint8 *)str, strlen(str) + 1);
+  g_hash_table_insert(string_index, g_strdup(str), GUINT_TO_POINTER(offset + 1));
+  return offset;
+}
+
+static void add_flag(u_flag *flag) {
+  struct u_status_flag rec;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.tid = flag->tid;
+  rec.timeout = flag->timeout;
+  rec.value = flag->value;
+  rec.threshold = flag->threshold;
+  rec.priority = flag->priority;
+  rec.name = add_string(flag->name);
+  rec.reason = add_string(flag->reason);
+  g_byte_array_append(buf_flags, (const guint8 *)&rec, sizeof(rec));
+}
+
+static guint32 add_flag_list(GList *list) {
+  guint32 n = 0;
+  for(; list; list = g_list_next(list)) {
+    add_flag(list->data);
+    n++;
+  }
+  return n;
+}
+
+static guint32 add_groups(u_proc *proc) {
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if(!proc->scheduled || !g_hash_table_size(proc->scheduled))
+    return 0;
+
+  g_string_truncate(groups_str, 0);
+  g_hash_table_iter_init(&iter, proc->scheduled);
+  while(g_hash_table_iter_next(&iter, &key, &value)) {
+    if(groups_str->len)
+      g_string_append_c(groups_str, '\n');
+    g_string_append_printf(groups_str, "%s=%s", (char *)key, (char *)value);
+  }
+  return add_string(groups_str->str);
+}
+
+static int status_resize(size_t size) {
+  void *map;
+
+  size = (size + STATUS_PAGE - 1) & ~(STATUS_PAGE - 1);
+  if(size <= status_mapped)
+    return TRUE;
+
+  // the file never shrinks, so readers with an older mapping stay valid
+  if(ftruncate(status_fd, size)) {
+    g_warning("status: can't resize %s: %s", status_path, strerror(errno));
+    return FALSE;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, status_fd, 0);
+  if(map == MAP_FAILED) {
+    g_warning("status: can't map %s: %s", status_path, strerror(errno));
+    return FALSE;
+  }
+  if(status_map)
+    munmap(status_map, status_mapped);
+  status_map = map;
+  status_mapped = size;
+  return TRUE;
+}
+
+/**
+ * open the status file
+ *
+ * reads the path from `[core] status_file`. the export is off unless a path
+ * is set, a snapshot makes the scheduler report every placement. the file is
+ * replaced atomically, so monitors still mapping the file of a previous
+ * daemon are not hurt.
+ *
+ * @return TRUE if the status export is enabled
+ */
+int u_status_init() {
+  struct u_status_header *hdr;
+  char *dir, *tmp;
+  GError *error = NULL;
+
+  status_path = g_key_file_get_string(config_data, CONFIG_CORE, "status_file", &error);
+  g_clear_error(&error);
+
+  if(!status_path || !*status_path) {
+    g_free(status_path);
+    status_path = NULL;
+    g_debug("status: export disabled");
+    return FALSE;
+  }
+
+  dir = g_path_get_dirname(status_path);
+  g_mkdir_with_parents(dir, 0755);
+  g_free(dir);
+
+  tmp = g_strdup_printf("%s.%d", status_path, getpid());
+  status_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(status_fd == -1) {
+    g_warning("status: can't create %s: %s", tmp, strerror(errno));
+    goto error;
+  }
+  if(!status_resize(STATUS_PAGE))
+    goto error;
+
+  hdr = status_map;
+  hdr->magic = U_STATUS_MAGIC;
+  hdr->version = U_STATUS_VERSION;
+  hdr->seq = 0;
+  hdr->size = sizeof(struct u_status_header);
+  hdr->off_procs = hdr->off_flags = hdr->off_strings = sizeof(struct u_status_header);
+
+  if(rename(tmp, status_path)) {
+    g_warning("status: can't rename %s: %s", tmp, strerror(errno));
+    unlink(tmp);
+    goto error;
+  }
+  g_free(tmp);
+
+  buf_procs = g_byte_array_new();
+  buf_flags = g_byte_array_new();
+  buf_strings = g_byte_array_new();
+  string_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  groups_str = g_string_sized_new(128);
+
+  g_message("status: export to %s", status_path);
+  return TRUE;
+
+error:
+  g_free(tmp);
+  if(status_map)
+    munmap(status_map, status_mapped);
+  status_map = NULL;
+  status_mapped = 0;
+  if(status_fd != -1)
+    close(status_fd);
+  status_fd = -1;
+  g_free(status_path);
+  status_path = NULL;
+  return FALSE;
+}
+
+/**
+ * status export is enabled
+ *
+ * @return TRUE if u_status_update() writes a snapshot
+ */
+int u_status_enabled() {
+  return status_map != NULL;
+}
+
+/**
+ * publish a snapshot of the current state
+ * @arg iteration number of the iteration
+ * @arg timings seconds spent in update, filter, scheduler and the whole run
+ *
+ * called once at the end of each iteration.
+ */
+void u_status_update(guint iteration, struct u_status_timings *timings) {
+  struct u_status_header *hdr;
+  struct u_status_proc rec;
+  GHashTableIter iter;
+  gpointer key, value;
+  u_proc *proc;
+  u_flag *flag;
+  GList *cur;
+  guint32 n_procs = 0, n_sysflags, pressure = 0;
+  size_t off_procs, off_flags, off_strings, size;
+
+  if(!status_map)
+    return;
+
+  g_byte_array_set_size(buf_procs, 0);
+  g_byte_array_set_size(buf_flags, 0);
+  g_byte_array_set_size(buf_strings, 0);
+  g_hash_table_remove_all(string_index);
+  // offset 0 is reserved for the empty string
+  g_byte_array_append(buf_strings, (const guint8 *)"", 1);
+
+  n_sysflags = add_flag_list(system_flags);
+  for(cur = system_flags; cur; cur = g_list_next(cur)) {
+    flag = cur->data;
+    if(!strcmp(flag->name, "pressure"))
+      pressure |= U_STATUS_PRESSURE;
+    else if(!strcmp(flag->name, "emergency"))
+      pressure |= U_STATUS_EMERGENCY;
+  }
+
+  g_hash_table_iter_init(&iter, processes);
+  while(g_hash_table_iter_next(&iter, &key, &value)) {
+    proc = value;
+    if(U_PROC_IS_INVALID(proc))
+      continue;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.pid = proc->pid;
+    rec.pgrp = proc->proc.pgrp;
+    rec.euid = proc->proc.euid;
+    rec.groups = add_groups(proc);
+    rec.flags = buf_flags->len / sizeof(struct u_status_flag);
+    rec.n_flags = add_flag_list(proc->flags);
+    g_byte_array_append(buf_procs, (const guint8 *)&rec, sizeof(rec));
+    n_procs++;
+  }
+
+  off_procs = sizeof(struct u_status_header);
+  off_flags = off_procs + buf_procs->len;
+  off_strings = off_flags + buf_flags->len;
+  size = off_strings + buf_strings->len;
+
+  if(!status_resize(size))
+    return;
+
+  hdr = status_map;
+  hdr->seq++;
+  __sync_synchronize();
+
+  hdr->size = size;
+  hdr->iteration = iteration;
+  hdr->timestamp = time(NULL);
+  hdr->t_update = timings->update;
+  hdr->t_filter = timings->filter;
+  hdr->t_scheduler = timings->scheduler;
+  hdr->t_total = timings->total;
+  hdr->pressure = pressure;
+  hdr->n_procs = n_procs;
+  hdr->n_sysflags = n_sysflags;
+  hdr->n_flags = buf_flags->len / sizeof(struct u_status_flag);
+  hdr->off_procs = off_procs;
+  hdr->off_flags = off_flags;
+  hdr->off_strings = off_strings;
+  memcpy((char *)status_map + off_procs, buf_procs->data, buf_procs->len);
+  memcpy((char *)status_map + off_flags, buf_flags->data, buf_flags->len);
+  memcpy((char *)status_map + off_strings, buf_strings->data, buf_strings->len);
+
+  __sync_synchronize();
+  hdr->seq++;
+}
+
+/**
+ * remember the group a process was placed in
+ * @arg proc #u_proc
+ * @arg subsystem name of the cgroup subsystem
+ * @arg group name of the group
+ *
+ * @return TRUE if the group differs from the last placement
+ */
+int u_status_set_group(u_proc *proc, const char *subsystem, const char *group) {
+  const char *old;
+
+  if(!proc->scheduled)
+    proc->scheduled = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+
+  old = g_hash_table_lookup(proc->scheduled, g_intern_string(subsystem));
+  if(old && !strcmp(old, group))
+    return FALSE;
+
+  g_hash_table_insert(proc->scheduled, (gpointer)g_intern_string(subsystem),
+                      g_strdup(group));
+  return TRUE;
+}
@@ -94,10 +94,21 @@ int ioprio_getpid(pid_t pid, int *ioprio, int *ioclass) {
 }
 
 
+/*
+  while replaying a fixture the pids belong to other processes on this box,
+  the setters below only log then.
+*/
+
 int ioprio_setpid(pid_t pid, int ioprio, int ioclass)
 {
-  int rc = ioprio_set(IOPRIO_WHO_PROCESS, pid,
-                      ioprio | ioclass << IOPRIO_CLASS_SHIFT);
+  int rc;
+
+  if(*proc_root) {
+    g_debug("replay: not setting ioprio of pid %d", pid);
+    return 0;
+  }
+  rc = ioprio_set(IOPRIO_WHO_PROCESS, pid,
+                  ioprio | ioclass << IOPRIO_CLASS_SHIFT);
 
   return rc;
 }
@@ -107,6 +118,11 @@ int ioprio_setpid(pid_t pid, int ioprio, int ioclass)
 int renice_pid(int pid, int prio) {
   int oldprio;
 
+  if(*proc_root) {
+    g_debug("replay: not renicing pid %d", pid);
+    return 0;
+  }
+
   errno = 0;
   oldprio = getpriority(PRIO_PROCESS, pid);
   if (oldprio == -1 && errno)
@@ -132,6 +148,12 @@ int adj_oom_killer(pid_t pid, int adj)
 
   val = MAX(OOM_SCORE_ADJ_MIN, MIN(adj, OOM_SCORE_ADJ_MAX));
 
+  // the fixture is not modified. the daemon itself is a real process
+  if(*proc_root && pid != getpid()) {
+    g_debug("replay: not setting oom_score_adj of pid %d", pid);
+    return 0;
+  }
+
   g_snprintf(&aval[0], 6, "%d", val);
   path = g_strdup_printf("/proc/%d/oom_score_adj", pid);
 
@@ -153,7 +175,7 @@ int get_oom_killer(pid_t pid)
     GError     *error = NULL;
     int         rv, res;
 
-    path = g_strdup_printf ("/proc/%u/oom_score_adj", (guint)pid);
+    path = g_strdup_printf ("%s/proc/%u/oom_score_adj", proc_root, (guint)pid);
 
     res = g_file_get_contents (path,
                                &contents,
@@ -21,6 +21,11 @@
 #include "ulatency.h"
 #include <glib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 
 GList *U_session_list;
@@ -42,7 +47,7 @@ u_read_env_hash (pid_t pid)
     contents = NULL;
     hash = NULL;
 
-    path = g_strdup_printf ("/proc/%u/environ", (guint)pid);
+    path = g_strdup_printf ("%s/proc/%u/environ", proc_root, (guint)pid);
 
     error = NULL;
     res = g_file_get_contents (path,
@@ -105,7 +110,7 @@ u_pid_get_env (pid_t       pid,
     contents = NULL;
     prefix = NULL;
 
-    path = g_strdup_printf ("/proc/%u/environ", (guint)pid);
+    path = g_strdup_printf ("%s/proc/%u/environ", proc_root, (guint)pid);
 
     error = NULL;
     res = g_file_get_contents (path,
@@ -160,7 +165,7 @@ u_read_0file (pid_t pid, const char *what)
 
     contents = NULL;
 
-    path = g_strdup_printf ("/proc/%u/%s", (guint)pid, what);
+    path = g_strdup_printf ("%s/proc/%u/%s", proc_root, (guint)pid, what);
 
     error = NULL;
     res = g_file_get_contents (path,
@@ -194,15 +199,381 @@ out:
     return rv;
 }
 
+/* reads a NUL separated /proc/#/ file into a single allocation.
+ * the raw data is kept as is and the entries are referenced by offsets.
+ * empty entries are skipped like in u_read_0file. if joined is true a space
+ * separated copy of all entries is stored behind the data, which is build by
+ * replacing the separators while copying. free the result with g_free. */
+u_str_vec *
+u_read_0file_vec (pid_t pid, const char *what, int joined)
+{
+    // scratch buffer reused between calls, so reading needs no allocation
+    static char *scratch = NULL;
+    static gsize scratch_size = 0;
+    char        path[PROCPATHLEN];
+    gsize       size = 0;
+    gsize       i, w;
+    ssize_t     n;
+    int         fd;
+    guint       count = 0;
+    gboolean    last_was_null, pending;
+    u_str_vec  *rv;
+    char       *block;
+
+    snprintf (path, sizeof(path), "%s/proc/%u/%s", proc_root, (guint)pid, what);
+    fd = open (path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    if (!scratch) {
+        scratch_size = 4096;
+        scratch = g_malloc (scratch_size);
+    }
+
+    while (TRUE) {
+        if (size + 1 >= scratch_size) {
+            scratch_size *= 2;
+            scratch = g_realloc (scratch, scratch_size);
+        }
+        n = read (fd, scratch + size, scratch_size - size - 1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close (fd);
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        size += n;
+    }
+    close (fd);
+    // terminate the last entry
+    scratch[size++] = '\0';
+
+    last_was_null = TRUE;
+    for (i = 0; i < size; i++) {
+        if (scratch[i] == '\0') {
+            last_was_null = TRUE;
+            continue;
+        }
+        if (last_was_null)
+            count++;
+        last_was_null = FALSE;
+    }
+
+    block = g_malloc (sizeof(u_str_vec) + count * sizeof(guint) +
+                      (joined ? 2 * size : size));
+    rv = (u_str_vec *)block;
+    rv->len = 0;
+    rv->size = size;
+    rv->offsets = (guint *)(block + sizeof(u_str_vec));
+    rv->data = (char *)(rv->offsets + count);
+    rv->joined = joined ? rv->data + size : NULL;
+
+    memcpy (rv->data, scratch, size);
+
+    last_was_null = TRUE;
+    for (i = 0; i < size; i++) {
+        if (rv->data[i] == '\0') {
+            last_was_null = TRUE;
+            continue;
+        }
+        if (last_was_null)
+            rv->offsets[rv->len++] = i;
+        last_was_null = FALSE;
+    }
+
+    if (joined) {
+        pending = FALSE;
+        for (i = 0, w = 0; i < size; i++) {
+            if (rv->data[i] == '\0') {
+                pending = (w > 0);
+                continue;
+            }
+            if (pending) {
+                rv->joined[w++] = ' ';
+                pending = FALSE;
+            }
+            rv->joined[w++] = rv->data[i];
+        }
+        rv->joined[w] = '\0';
+    }
+
+    return rv;
+}
+
+/* looks up a variable in a environment read with u_read_0file_vec.
+ * like the environment hash, the last definition wins. */
+const char *
+u_str_vec_getenv (const u_str_vec *vec, const char *name)
+{
+    const char *entry, *rv = NULL;
+    gsize       name_len = strlen (name);
+    guint       i;
+
+    for (i = 0; i < vec->len; i++) {
+        entry = U_STR_VEC_INDEX(vec, i);
+        if (!strncmp (entry, name, name_len) && entry[name_len] == '=')
+            rv = entry + name_len + 1;
+    }
+    return rv;
+}
+
+/* reads read_bytes and write_bytes of /proc/#/io. these count the bytes
+ * that really hit the storage layer, unlike rchar and wchar. */
+int
+u_read_io (pid_t pid, guint64 *read_bytes, guint64 *write_bytes)
+{
+    char        path[PROCPATHLEN];
+    char        buf[512];
+    char       *pos;
+    ssize_t     len;
+    int         fd;
+
+    snprintf (path, sizeof (path), "%s/proc/%u/io", proc_root, (guint)pid);
+    fd = open (path, O_RDONLY);
+    if (fd == -1)
+        return FALSE;
+    len = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (len <= 0)
+        return FALSE;
+    buf[len] = '\0';
+
+    pos = strstr (buf, "\nread_bytes: ");
+    if (!pos)
+        return FALSE;
+    *read_bytes = g_ascii_strtoull (pos + 13, NULL, 10);
+    pos = strstr (pos, "\nwrite_bytes: ");
+    if (!pos)
+        return FALSE;
+    *write_bytes = g_ascii_strtoull (pos + 14, NULL, 10);
+    return TRUE;
+}
+
+/* index of selected environment variables of all processes.
+ * maps uid -> array of hash tables, one per indexed variable, that map the
+ * value to the number of processes having it. each process remembers the
+ * values it accounted in env_values, so exit and exec can undo them. */
+static GHashTable  *env_index = NULL;
+static char       **env_index_vars = NULL;
+static gsize        env_index_len = 0;
+
+#define ENV_INDEX_DEFAULT "DISPLAY;XAUTHORITY;DBUS_SESSION_BUS_ADDRESS;WAYLAND_DISPLAY;XDG_RUNTIME_DIR"
+
+static void
+env_index_user_free (gpointer data)
+{
+    GHashTable **vars = data;
+    gsize        i;
+
+    for (i = 0; i < env_index_len; i++)
+        g_hash_table_destroy (vars[i]);
+    g_free (vars);
+}
+
+static GHashTable **
+env_index_user (uid_t uid, gboolean create)
+{
+    GHashTable **vars;
+    gsize        i;
+
+    vars = g_hash_table_lookup (env_index, GUINT_TO_POINTER(uid));
+    if (!vars && create) {
+        vars = g_new0 (GHashTable *, env_index_len);
+        for (i = 0; i < env_index_len; i++)
+            vars[i] = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+        g_hash_table_insert (env_index, GUINT_TO_POINTER(uid), vars);
+    }
+    return vars;
+}
+
+static void
+env_index_account (uid_t uid, char **values, int add)
+{
+    GHashTable **vars;
+    guint        count;
+    gsize        i;
+
+    vars = env_index_user (uid, add);
+    if (!vars)
+        return;
+
+    for (i = 0; i < env_index_len; i++) {
+        if (!values[i])
+            continue;
+        count = GPOINTER_TO_UINT(g_hash_table_lookup (vars[i], values[i]));
+        if (add)
+            count++;
+        else if (count)
+            count--;
+        if (count)
+            g_hash_table_insert (vars[i], g_strdup (values[i]),
+                                 GUINT_TO_POINTER(count));
+        else
+            g_hash_table_remove (vars[i], values[i]);
+    }
+    if (add)
+        return;
+
+    // drop users without processes left
+    for (i = 0; i < env_index_len; i++) {
+        if (g_hash_table_size (vars[i]))
+            return;
+    }
+    g_hash_table_remove (env_index, GUINT_TO_POINTER(uid));
+}
+
+static void
+env_values_free (char **values)
+{
+    gsize i;
+
+    for (i = 0; i < env_index_len; i++)
+        g_free (values[i]);
+    g_free (values);
+}
+
+void
+u_env_index_init (void)
+{
+    env_index_vars = g_key_file_get_string_list (config_data, CONFIG_CORE,
+                                                 "env_index", &env_index_len,
+                                                 NULL);
+    if (!env_index_vars) {
+        env_index_vars = g_strsplit (ENV_INDEX_DEFAULT, ";", -1);
+        env_index_len = g_strv_length (env_index_vars);
+    }
+    env_index = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                       NULL, env_index_user_free);
+}
+
+/* removes the values of a process from the index */
+void
+u_env_index_remove (u_proc *proc)
+{
+    if (!proc->env_values)
+        return;
+
+    env_index_account (proc->env_uid, proc->env_values, FALSE);
+    env_values_free (proc->env_values);
+    proc->env_values = NULL;
+}
+
+/* reads the environment of a process and puts the indexed variables into
+ * the index. called when a process is seen the first time and on exec. */
+void
+u_env_index_update (u_proc *proc)
+{
+    u_str_vec *env;
+    gsize      i;
+
+    if (!env_index)
+        return;
+
+    u_env_index_remove (proc);
+
+    if (!env_index_len || !u_proc_ensure_fields (proc, UPROC_FIELD_STATUS, FALSE))
+        return;
+
+    // the environment is only needed here, so it is not stored in proc
+    env = u_read_0file_vec (proc->pid, "environ", FALSE);
+    if (!env)
+        return;
+
+    proc->env_uid = proc->proc.euid;
+    proc->env_values = g_new0 (char *, env_index_len);
+    for (i = 0; i < env_index_len; i++)
+        proc->env_values[i] = g_strdup (u_str_vec_getenv (env,
+                                                          env_index_vars[i]));
+    g_free (env);
+
+    env_index_account (proc->env_uid, proc->env_values, TRUE);
+}
+
+/* a forked process shares the environment of its parent */
+void
+u_env_index_inherit (u_proc *proc, u_proc *parent)
+{
+    gsize i;
+
+    if (!env_index || proc == parent)
+        return;
+
+    u_env_index_remove (proc);
+
+    if (!parent->env_values)
+        return;
+
+    proc->env_uid = parent->env_uid;
+    proc->env_values = g_new0 (char *, env_index_len);
+    for (i = 0; i < env_index_len; i++)
+        proc->env_values[i] = g_strdup (parent->env_values[i]);
+
+    env_index_account (proc->env_uid, proc->env_values, TRUE);
+}
+
+/* moves the values of a process to a different uid */
+void
+u_env_index_set_uid (u_proc *proc, uid_t uid)
+{
+    if (!proc->env_values || proc->env_uid == uid)
+        return;
+
+    env_index_account (proc->env_uid, proc->env_values, FALSE);
+    proc->env_uid = uid;
+    env_index_account (proc->env_uid, proc->env_values, TRUE);
+}
+
+/* returns all values of a indexed variable for processes of uid, or NULL if
+ * the variable is not indexed. free the result with g_ptr_array_unref. */
+GPtrArray *
+u_env_index_lookup (uid_t uid, const char *name)
+{
+    GPtrArray      *rv;
+    GHashTable    **vars;
+    GHashTableIter  iter;
+    gpointer        key, value;
+    gsize           i;
+
+    if (!env_index)
+        return NULL;
+
+    for (i = 0; i < env_index_len; i++) {
+        if (!strcmp (env_index_vars[i], name))
+            break;
+    }
+    if (i == env_index_len)
+        return NULL;
+
+    rv = g_ptr_array_new_with_free_func (g_free);
+    vars = env_index_user (uid, FALSE);
+    if (!vars)
+        return rv;
+
+    g_hash_table_iter_init (&iter, vars[i]);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_ptr_array_add (rv, g_strdup (key));
+
+    return rv;
+}
+
 GPtrArray* search_user_env(uid_t uid, const char *name, int update) {
-    GPtrArray* rv = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray* rv;
     u_proc *proc = NULL;
     GHashTableIter iter;
-    char *val;
+    const char *val;
     int i, found;
 
     gpointer ikey, value;
 
+    // indexed variables are kept up to date and need no scan
+    rv = u_env_index_lookup(uid, name);
+    if(rv)
+        return rv;
+
+    rv = g_ptr_array_new_with_free_func(g_free);
     g_hash_table_iter_init (&iter, processes);
     while (g_hash_table_iter_next (&iter, &ikey, &value)) 
     {
@@ -215,7 +586,7 @@ GPtrArray* search_user_env(uid_t uid, const char *name, int update) {
         if(!proc->environ)
             continue;
 
-        val = g_hash_table_lookup(proc->environ, name);
+        val = u_str_vec_getenv(proc->environ, name);
         if(val) {
             found = FALSE;
             for(i = 0; i < rv->len; i++) {
@@ -232,11 +603,218 @@ GPtrArray* search_user_env(uid_t uid, const char *name, int update) {
     return rv;
 }
 
+/* cpu utilization from /proc/stat. the counters are jiffies since boot, so
+ * the usage is computed from the difference to the previous sample. */
+struct u_cpu_usage U_cpu_usage;
+
+struct cpu_sample {
+    guint64     total;
+    guint64     idle;       // idle + iowait
+    guint64     iowait;
+};
+
+static struct cpu_sample *cpu_last = NULL;   // [0] is the summary line
+static guint cpu_last_len = 0;
+static guint cpu_tick = 0;
+
+static gdouble
+cpu_sample_percent (struct cpu_sample *last, struct cpu_sample *cur, gdouble *iowait)
+{
+    guint64 dtotal = cur->total - last->total;
+
+    if (!last->total || !dtotal) {
+        if (iowait)
+            *iowait = 0;
+        return -1;
+    }
+    if (iowait)
+        *iowait = 100.0 * (cur->iowait - last->iowait) / dtotal;
+    return 100.0 * (dtotal - (cur->idle - last->idle)) / dtotal;
+}
+
+/* samples /proc/stat, called once per iteration.
+ * returns FALSE if no usage could be computed yet. */
+int
+u_cpu_usage_update (void)
+{
+    char               *contents = NULL, *line, *next, *path;
+    gboolean            got;
+    guint64             v[8];
+    struct cpu_sample   cur;
+    gdouble             percent;
+    guint               idx, n_cpus = 0;
+    int                 rv = FALSE, n;
+
+    cpu_tick++;
+    path = g_strdup_printf ("%s/proc/stat", proc_root);
+    got = g_file_get_contents (path, &contents, NULL, NULL);
+    g_free (path);
+    if (!got)
+        return FALSE;
+
+    for (line = contents; line && !strncmp (line, "cpu", 3); line = next) {
+        next = strchr (line, '\n');
+        if (next)
+            *next++ = '\0';
+
+        if (line[3] == ' ') {
+            idx = 0;
+        } else {
+            idx = strtoul (line + 3, NULL, 10) + 1;
+            n_cpus = MAX (n_cpus, idx);
+        }
+        memset (v, 0, sizeof (v));
+        n = sscanf (strchr (line, ' '), " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+                    " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+                    " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+        if (n < 4)
+            continue;
+        // user nice system idle iowait irq softirq steal. guest time is
+        // already accounted in user
+        cur.total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+        cur.idle = v[3] + v[4];
+        cur.iowait = v[4];
+
+        if (idx >= cpu_last_len) {
+            cpu_last = g_renew (struct cpu_sample, cpu_last, idx + 1);
+            memset (cpu_last + cpu_last_len, 0,
+                    (idx + 1 - cpu_last_len) * sizeof (struct cpu_sample));
+            cpu_last_len = idx + 1;
+        }
+        if (idx >= U_cpu_usage.n_cpus + 1 && idx > 0) {
+            U_cpu_usage.cpus = g_renew (gdouble, U_cpu_usage.cpus, idx);
+            memset (U_cpu_usage.cpus + U_cpu_usage.n_cpus, 0,
+                    (idx - U_cpu_usage.n_cpus) * sizeof (gdouble));
+            U_cpu_usage.n_cpus = idx;
+        }
+
+        if (idx == 0) {
+            percent = cpu_sample_percent (&cpu_last[0], &cur, &U_cpu_usage.iowait);
+            if (percent >= 0) {
+                U_cpu_usage.total = percent;
+                rv = TRUE;
+            }
+        } else {
+            percent = cpu_sample_percent (&cpu_last[idx], &cur, NULL);
+            U_cpu_usage.cpus[idx - 1] = MAX (percent, 0);
+        }
+        cpu_last[idx] = cur;
+    }
+    // offline cpus are missing in /proc/stat
+    if (n_cpus)
+        U_cpu_usage.n_cpus = MIN (U_cpu_usage.n_cpus, n_cpus);
+
+    g_free (contents);
+    return rv;
+}
+
+/* cpu usage of cgroups, keyed by the group path */
+struct cgroup_cpu {
+    guint       tick;       // tick of the last read
+    gdouble     time;       // monotonic time of the last read in seconds
+    guint64     usage;      // cpu time in ns
+    gdouble     rate;
+};
+
+static GHashTable *cgroup_cpu = NULL;
+
+#define CGROUP_CPU_EXPIRE 10 // ticks a group is kept without being asked for
+
+static gboolean
+cgroup_cpu_expired (gpointer key, gpointer value, gpointer data)
+{
+    struct cgroup_cpu *entry = value;
+    return entry->tick + CGROUP_CPU_EXPIRE < cpu_tick;
+}
+
+static int
+read_cgroup_usage (const char *path, guint64 *usage)
+{
+    char   *file, *contents = NULL, *pos;
+    int     rv = FALSE;
+
+    // cgroup v1 cpuacct
+    file = g_strconcat (path, "/cpuacct.usage", NULL);
+    if (g_file_get_contents (file, &contents, NULL, NULL)) {
+        *usage = g_ascii_strtoull (contents, NULL, 10);
+        rv = TRUE;
+    }
+    g_free (file);
+    g_free (contents);
+    if (rv)
+        return rv;
+
+    // unified hierarchy
+    contents = NULL;
+    file = g_strconcat (path, "/cpu.stat", NULL);
+    if (g_file_get_contents (file, &contents, NULL, NULL)) {
+        pos = strstr (contents, "usage_usec ");
+        if (pos) {
+            *usage = g_ascii_strtoull (pos + 11, NULL, 10) * 1000;
+            rv = TRUE;
+        }
+    }
+    g_free (file);
+    g_free (contents);
+    return rv;
+}
+
+/* cpu usage of a cgroup in percent of one cpu.
+ * the group is read at most once per tick, the rate covers the time between
+ * the last two reads. returns -1 if the group has no usage accounting. */
+gdouble
+u_cgroup_cpu_rate (const char *path)
+{
+    struct cgroup_cpu  *entry;
+    struct timespec     ts;
+    guint64             usage;
+    gdouble             now;
+
+    if (!cgroup_cpu)
+        cgroup_cpu = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    entry = g_hash_table_lookup (cgroup_cpu, path);
+    if (entry && entry->tick == cpu_tick)
+        return entry->rate;
+
+    if (!read_cgroup_usage (path, &usage)) {
+        if (entry)
+            g_hash_table_remove (cgroup_cpu, path);
+        return -1;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    if (!entry) {
+        entry = g_new0 (struct cgroup_cpu, 1);
+        g_hash_table_insert (cgroup_cpu, g_strdup (path), entry);
+    } else if (now > entry->time && usage >= entry->usage) {
+        entry->rate = (usage - entry->usage) / 1e7 / (now - entry->time);
+    }
+    entry->tick = cpu_tick;
+    entry->time = now;
+    entry->usage = usage;
+    return entry->rate;
+}
+
+/* forgets groups nobody asked for since a while */
+void
+u_cgroup_cpu_expire (void)
+{
+    if (cgroup_cpu)
+        g_hash_table_foreach_remove (cgroup_cpu, cgroup_cpu_expired, NULL);
+}
+
 uint64_t get_number_of_processes() {
     uint64_t rv = 0;
-    DIR             *dip = opendir("/proc");
+    char             path[PROCPATHLEN];
+    DIR             *dip;
     struct dirent   *dit;
 
+    snprintf(path, sizeof(path), "%s/proc", proc_root);
+    dip = opendir(path);
+
     if(!dip)
         return 0;
 
@@ -253,6 +831,32 @@ uint64_t get_number_of_processes() {
 }
 
 
+// called after a session was added to or removed from U_session_list
+static GHookList session_hooks;
+
+/**
+ * get notified about session changes
+ * @arg func called with data after U_session_list changed
+ * @arg data user data
+ *
+ * lets session watchers react to new sessions instead of polling the list
+ */
+void u_session_add_listener(GHookFunc func, gpointer data) {
+    GHook *hook;
+
+    if(!session_hooks.is_setup)
+        g_hook_list_init(&session_hooks, sizeof(GHook));
+    hook = g_hook_alloc(&session_hooks);
+    hook->func = func;
+    hook->data = data;
+    g_hook_append(&session_hooks, hook);
+}
+
+static void session_list_changed() {
+    if(session_hooks.is_setup)
+        g_hook_list_invoke(&session_hooks, FALSE);
+}
+
 #ifdef ENABLE_DBUS
 
 // things would be so much easier here when consolekit would just emit a 
@@ -356,6 +960,7 @@ static void ck_session_added(DBusGProxy *proxy, gchar *name, gpointer ignored) {
       error = NULL;
     }
 
+    session_list_changed();
 }
 
 static void ck_session_removed(DBusGProxy *proxy, gchar *name, gpointer ignored) {
@@ -372,6 +977,7 @@ static void ck_session_removed(DBusGProxy *proxy, gchar *name, gpointer ignored)
         g_free(sess->dbus_session);
 
         U_session_list = g_list_remove(U_session_list, sess);
+        session_list_changed();
         break;
       }
       cur = g_list_next(cur);
@@ -39,6 +39,27 @@ void recursive_rmdir(const char *path, int add_level) {
 }
 
 
+/**
+ * remove a directory with everything below it
+ * @arg path directory
+ */
+void recursive_remove(const char *path) {
+    FTS *fts;
+    FTSENT *ftsent;
+    char *const paths[] = { (char *)path, NULL };
+
+    fts = fts_open(paths, FTS_NOCHDIR|FTS_PHYSICAL, NULL);
+    if (fts == NULL)
+      return;
+    while ((ftsent = fts_read(fts)) != NULL) {
+      if (ftsent->fts_info == FTS_DP)
+        rmdir(ftsent->fts_accpath);
+      else if (ftsent->fts_info != FTS_D)
+        unlink(ftsent->fts_accpath);
+    }
+    fts_close(fts);
+}
+
 void u_timer_start(struct u_timer *t) {
     if(!t->count) {
         g_timer_continue(t->timer);
@@ -88,6 +88,31 @@ enum U_PROC_STATE {
 #define U_PROC_UNSET_STATE(P,STATE) ( P ->ustate = ( P ->ustate & ~STATE ))
 #define U_PROC_HAS_STATE(P,STATE) ( ( P ->ustate & STATE ) == STATE )
 
+// parts of a process that can be parsed independently. each one is backed by
+// one file in /proc/#/, so reading a single field only costs that file.
+enum U_PROC_FIELDS {
+  UPROC_FIELD_STAT     = (1<<0),  //!< /proc/#/stat
+  UPROC_FIELD_STATM    = (1<<1),  //!< /proc/#/statm
+  UPROC_FIELD_STATUS   = (1<<2),  //!< /proc/#/status, user and group names
+  UPROC_FIELD_CGROUP   = (1<<3),  //!< /proc/#/cgroup
+  UPROC_FIELD_GROUPS   = (1<<4),  //!< supplementary group names, needs status
+  UPROC_FIELD_WCHAN    = (1<<5),  //!< wchan fixup for threads, needs stat
+  UPROC_FIELD_ENVIRON  = (1<<6),  //!< /proc/#/environ
+  UPROC_FIELD_CMDLINE  = (1<<7),  //!< /proc/#/cmdline
+  UPROC_FIELD_EXE      = (1<<8),  //!< /proc/#/exe
+};
+
+// fields filled by a full update, equals UPROC_BASIC
+#define UPROC_FIELDS_BASIC (UPROC_FIELD_STAT | UPROC_FIELD_STATM | \
+  UPROC_FIELD_STATUS | UPROC_FIELD_CGROUP | UPROC_FIELD_GROUPS | \
+  UPROC_FIELD_WCHAN)
+
+#define U_PROC_HAS_FIELDS(P,FIELDS) ( ( P ->fields & (FIELDS) ) == (FIELDS) )
+
+// process group the rules see, the fake one if set
+#define U_PROC_PGRP(P) ( P ->fake_pgrp ? P ->fake_pgrp : P ->proc.pgrp )
+#define U_PROC_SESSION(P) ( P ->fake_session ? P ->fake_session : P ->proc.session )
+
 
 enum FILTER_TYPES {
   FILTER_LUA,
@@ -134,25 +159,57 @@ struct lua_filter {
   int filter;
   GRegex *regexp_cmdline;
   GRegex *regexp_basename;
+  int match_id;                 //!< id in the shared matcher or -1
   double min_percent;
 };
 
+// NUL separated /proc/#/ file kept in one allocation. entries are offsets
+// into the raw data, joined is an optional space separated copy.
+typedef struct {
+  guint   len;        //!< number of entries
+  gsize   size;       //!< size of data including the final NUL
+  guint  *offsets;    //!< start of each entry in data
+  char   *data;       //!< raw NUL separated data
+  char   *joined;     //!< space separated entries or NULL
+} u_str_vec;
+
+#define U_STR_VEC_INDEX(V,I) ( (V)->data + (V)->offsets[(I)] )
+
 struct filter_block {
   GTime timeout;
   int flags;
 };
 
 
+/* ring buffer of per process samples, one array per value so scans over a
+   single value stay in cache. all arrays live in one allocation behind the
+   struct. */
+struct u_proc_history {
+  guint         len;            //!< capacity of the ring
+  guint         count;          //!< number of valid samples
+  guint         head;           //!< index the next sample is written to
+  gdouble       cpu_rate;       //!< EWMA of the cpu usage in percent of one cpu
+  gdouble       io_rate;        //!< EWMA of read and written bytes per second
+  gdouble       *time;          //!< monotonic time of the sample in seconds
+  guint64       *cpu;           //!< utime + stime in ticks
+  guint64       *maj_flt;       //!< major page faults
+  guint64       *rss;           //!< resident set size in pages
+  guint64       *read_bytes;    //!< bytes read from storage
+  guint64       *write_bytes;   //!< bytes written to storage
+  guint8        *io_valid;      //!< the io counters of the sample were read
+};
+
 typedef struct {
   U_HEAD;
   int           pid;            //!< duplicate of proc.tgid
   int           ustate;         //!< status bits for process
+  int           fields;         //!< valid parts of proc, bits of #U_PROC_FIELDS
   struct proc_t proc;           //!< main data storage
   char        **cgroup_origin;  //!< the original cgroups this process was created in
-  GArray        proc_history;   //!< list of history elements
-  int           history_len;    //!< desigered history len
+  struct u_proc_history *history; //!< samples of the last updates, see u_proc_history_sample
   guint         last_update;    //!< counter for detecting dead processes
   GNode         *node;          //!< for parent/child lookups and transversal
+  int           slot;           //!< index into #U_proc_hot or -1
   GHashTable    *skip_filter;   //!< storage of #filter_block for filters
   GList         *flags;         //!< list of #u_flag
   int           changed;        //!< flags or main parameters of process like uid, gid, sid changed
@@ -163,11 +220,16 @@ typedef struct {
   int           lua_data;       //!< id for per process lua storage
   // we don't use the libproc parsers here as we do not update these values
   // that often
-  char          *cmdfile;       //!< basename of exe file
-  GPtrArray     *cmdline;       //!< array of char * of cmdline arguments
-  char          *cmdline_match; //!< space concated version of cmdline
-  GHashTable    *environ;       //!< char *:char * hash table of process environment
+  char          *cmdfile;       //!< basename of exe file, points into cmdline
+  u_str_vec     *cmdline;       //!< cmdline arguments
+  char          *cmdline_match; //!< space concated version of cmdline, points into cmdline
+  u_str_vec     *environ;       //!< process environment, entries in KEY=value form
   char          *exe;           //!< executeable of the process
+  uid_t         env_uid;        //!< uid the indexed environment is accounted to
+  char          **env_values;   //!< values of the indexed environment variables
+  GHashTable    *scheduled;     //!< subsystem -> group of the last scheduling decision
+  guint32       *filter_match;  //!< bit set of matching filter patterns, see u_filter_match
+  guint         filter_match_gen; //!< matcher generation of filter_match, 0 if stale
 
   // fake pgid because it can't be changed.
   pid_t         fake_pgrp;      //!< fake value for pgrp
@@ -252,6 +314,8 @@ struct u_cgroup_controller {
 struct user_active_process {
   guint pid;
   time_t last_change;
+  guint pos;            // position in user_active.actives starting with 1
+  GList link;           // link in user_active.actives, data points to itself
 };
 
 enum USER_ACTIVE_AGENT {
@@ -261,6 +325,16 @@ enum USER_ACTIVE_AGENT {
   USER_ACTIVE_AGENT_MODULE=1000,
 };
 
+// reasons of a scheduling decision, reported by the ProcessScheduled signal
+enum U_SCHEDULED_REASON {
+  U_SCHEDULED_ITERATION = (1<<0),  //!< run over changed processes
+  U_SCHEDULED_FULL      = (1<<1),  //!< run over all processes
+  U_SCHEDULED_SINGLE    = (1<<2),  //!< single process, usually a new one
+  U_SCHEDULED_FOCUS     = (1<<3),  //!< focus change
+  U_SCHEDULED_REQUEST   = (1<<4),  //!< set of processes, ie. a dbus batch
+  U_SCHEDULED_CHANGED   = (1<<5),  //!< group differs from the last decision
+};
+
 // tracking for user sessions
 typedef struct {
   gchar     *name;
@@ -279,19 +353,26 @@ typedef struct {
 // list of active sessions
 extern GList *U_session_list;
 
+void u_session_add_listener(GHookFunc func, gpointer data);
+
 struct user_active {
   uid_t uid;
   guint max_processes;
   guint active_agent;    // tracker of the active list
   // FIXME: last change time
   time_t last_change;   // time when the last change happend
-  GList *actives;       // list of user_active_process
+  GQueue actives;       // list of user_active_process, most recent first
+  GHashTable *active_pids; // pid -> user_active_process of actives
+  guint focus_pending;  // pid waiting for the debounce window to close
+  guint focus_timeout;  // source id of the debounce window
 };
 
 
 typedef struct {
   int (*all)(void);    // make scheduler run over all processes
   int (*one)(u_proc *);  // schedule for one (new) process
+  int (*many)(GPtrArray *);  // schedule a set of processes at once
+  int (*focus)(u_proc *, GPtrArray *);  // batch schedule the group of a newly focused process
   int (*set_config)(char *name);  // configure the scheduler for using a different configuration
   char *(*get_config)(void);  // returns the name of current config
   GPtrArray *(*list_configs)(void);  // returns a list of valid configs
@@ -313,6 +394,7 @@ extern GNode* processes_tree;
 extern lua_State *lua_main_state;
 extern GList* system_flags;
 extern int    system_flags_changed;
+extern guint  system_flags_generation;  // changes with every system flag change
 #ifdef ENABLE_DBUS
 extern DBusGConnection *U_dbus_connection; // usully the system bus, but may differ on develop mode
 extern DBusGConnection *U_dbus_connection_system; // always the system bus
@@ -325,11 +407,26 @@ struct callback_data {
     DBusMessage *message;
     void (*callback)(struct callback_data *data);
     void *user_data;
+    gchar *sender;        // unique bus name of the caller
+    gchar *cache_key;     // action id and polkit details of the request
+    GTimer *timer;        // time spent waiting for polkit
 };
 #endif
 #ifdef POLKIT_FOUND
 PolkitAuthority *U_polkit_authority;
 
+// counters of check_polkit
+struct u_polkit_stats {
+  guint64 hits;           //!< decisions answered from the cache
+  guint64 misses;         //!< decisions asked from polkit
+  guint64 invalidated;    //!< callers dropped on NameOwnerChanged
+  gdouble latency_total;  //!< seconds spent waiting for polkit
+  gdouble latency_max;    //!< longest wait for polkit
+};
+
+extern struct u_polkit_stats U_polkit_stats;
+void u_polkit_init();
+
 int check_polkit(const char *methode,
              DBusConnection *connection,
              DBusMessage *context,
@@ -370,6 +467,73 @@ enum ENSURE_WHAT {
 };
 
 int u_proc_ensure(u_proc *proc, enum ENSURE_WHAT what, int update);
+int u_proc_ensure_fields(u_proc *proc, int fields, int update);
+
+// counters of on demand reads done by u_proc_ensure_fields
+struct u_proc_read_stats {
+  guint64 lazy_reads;     //!< number of partial updates
+  guint64 files_read;     //!< /proc files read by partial updates
+  guint64 files_avoided;  //!< files a full update would have read in addition
+};
+
+extern struct u_proc_read_stats U_proc_read_stats;
+
+// hot.c
+enum U_HOT_FIELD {
+  U_HOT_PID,
+  U_HOT_PPID,
+  U_HOT_PGRP,
+  U_HOT_SESSION,
+  U_HOT_EUID,
+  U_HOT_EGID,
+  U_HOT_RSS,
+  U_HOT_VM_RSS,
+  U_HOT_UTIME,
+  U_HOT_STIME,
+  U_HOT_SCHED,
+  U_HOT_RTPRIO,
+  U_HOT_NLWP,
+  U_HOT_FIELDS,
+};
+
+/* hot numeric fields of all listed processes, one array per field indexed
+   by u_proc->slot. free slots have pid 0. the types match proc_t */
+struct u_proc_hot {
+  guint32       len;            //!< slots in use, free ones included
+  guint32       alloc;          //!< allocated slots
+  u_proc        **procs;
+  int           *pid;
+  int           *ppid;
+  int           *pgrp;          //!< U_PROC_PGRP, the fake one if set
+  int           *session;       //!< U_PROC_SESSION, the fake one if set
+  int           *euid;
+  int           *egid;
+  int           *nlwp;
+  long          *rss;
+  unsigned long *vm_rss;
+  unsigned long *sched;
+  unsigned long *rtprio;
+  unsigned long long *utime;
+  unsigned long long *stime;
+  int           *group;         //!< U_PROC_PGRP the slot is indexed under, 0 if none
+  int           *group_next;    //!< next slot of the same group or -1
+  int           *group_prev;    //!< previous slot of the same group or -1
+};
+
+extern struct u_proc_hot U_proc_hot;
+
+void u_hot_add(u_proc *proc);
+void u_hot_remove(u_proc *proc);
+void u_hot_store(u_proc *proc);
+void u_hot_regroup(u_proc *proc);
+void u_hot_group_members(pid_t pgrp, GPtrArray *out);
+int u_hot_changed(u_proc *proc, proc_t *p);
+int u_hot_field(const char *name);
+void u_hot_values(int field, gint64 *values);
+guint u_hot_top(int field, guint n, u_proc **out);
+void u_hot_above(int field, gint64 threshold, GPtrArray *out);
+void u_hot_sum_by(int field, int by, GHashTable *sums);
+void u_proc_history_sample(u_proc *proc);
 GList *u_proc_list_flags (u_proc *proc, gboolean recrusive);
 GArray *u_proc_get_current_task_pids(u_proc *proc);
 
@@ -394,6 +558,7 @@ int process_remove_by_pid(pid_t pid);
 int process_update_pids(pid_t pids[]);
 int process_update_pid(pid_t pid);
 int process_run_one(u_proc *proc, int update, int instant);
+int process_run_list(GPtrArray *procs, int update);
 void clear_process_skip_filters(u_proc *proc, int block_types);
 
 int process_update_all();
@@ -413,6 +578,8 @@ static inline u_proc *proc_by_pid_with_retry(pid_t pid) {
 
 
 int scheduler_run_one(u_proc *proc);
+int scheduler_run_focus(u_proc *proc, u_proc *prev);
+int scheduler_run_list(GPtrArray *procs);
 int scheduler_run();
 u_scheduler *scheduler_get();
 int scheduler_set(u_scheduler *scheduler);
@@ -437,6 +604,7 @@ struct u_timer {
 };
 
 void recursive_rmdir(const char *path, int add_level);
+void recursive_remove(const char *path);
 void u_timer_start(struct u_timer *t);
 void u_timer_stop(struct u_timer *t);
 void u_timer_stop_clear(struct u_timer *t);
@@ -454,7 +622,26 @@ int adj_oom_killer(pid_t pid, int adj);
 int get_oom_killer(pid_t pid);
 
 // group.c
+// counters of set_active_pid_debounced
+struct u_focus_stats {
+  guint64 requests;       //!< focus changes reported by agents
+  guint64 applied;        //!< changes applied to the active lists
+  guint64 merged;         //!< changes replaced by a later one in the window
+  guint64 placed;         //!< changes timed until the focused process was placed
+  guint64 over_budget;    //!< placements slower than FOCUS_LATENCY_TARGET
+  gdouble latency_last;   //!< ms from the change until the tasks writes completed
+  gdouble latency_max;    //!< slowest placement in ms
+};
+
+extern struct u_focus_stats U_focus_stats;
 void set_active_pid(unsigned int uid, unsigned int pid);
+void set_active_pid_debounced(unsigned int uid, unsigned int pid);
+void u_focus_tasks_queued(pid_t pid);
+void u_focus_tasks_written(pid_t pid);
+guint active_agent_register(const char *name);
+const char *active_agent_name(guint agent);
+int active_agent_claim(unsigned int uid, guint agent);
+void active_agent_release(unsigned int uid, guint agent);
 struct user_active* get_userlist(guint uid, gboolean create);
 int is_active_pid(u_proc *proc);
 int get_active_pos(u_proc *proc);
@@ -464,7 +651,28 @@ GHashTable * u_read_env_hash (pid_t pid);
 char *       u_pid_get_env (pid_t pid, const char *var);
 GPtrArray *  search_user_env(uid_t uid, const char *name, int update);
 GPtrArray *  u_read_0file (pid_t pid, const char *what);
+u_str_vec *  u_read_0file_vec (pid_t pid, const char *what, int joined);
+const char * u_str_vec_getenv (const u_str_vec *vec, const char *name);
+int          u_read_io (pid_t pid, guint64 *read_bytes, guint64 *write_bytes);
+// per uid index of selected environment variables
+void         u_env_index_init (void);
+void         u_env_index_update (u_proc *proc);
+void         u_env_index_inherit (u_proc *proc, u_proc *parent);
+void         u_env_index_set_uid (u_proc *proc, uid_t uid);
+void         u_env_index_remove (u_proc *proc);
+GPtrArray *  u_env_index_lookup (uid_t uid, const char *name);
 uint64_t     get_number_of_processes();
+// cpu utilization sampled from /proc/stat
+struct u_cpu_usage {
+  gdouble      total;           //!< percent of all cpus busy
+  gdouble      iowait;          //!< percent of all cpus waiting for io
+  guint        n_cpus;          //!< length of cpus
+  gdouble      *cpus;           //!< percent busy per cpu
+};
+extern struct u_cpu_usage U_cpu_usage;
+int          u_cpu_usage_update (void);
+gdouble      u_cgroup_cpu_rate (const char *path);
+void         u_cgroup_cpu_expire (void);
 
 // dbus consts
 #define U_DBUS_SERVICE_NAME     "org.quamquam.ulatencyd"
@@ -479,4 +687,150 @@ uint64_t     get_number_of_processes();
 #endif
 #define U_DBUS_RETRY_WAIT       500 * 1000
 
+// status.c
+/* layout of the status file. all offsets are relative to the start of the
+   file, strings are 0 terminated and offset 0 is the empty string.
+
+   header | u_status_proc[n_procs] | u_status_flag[n_flags] | strings
+
+   the first n_sysflags flags are the system flags, the flags of a process
+   follow in one block. the groups string of a process holds the placements
+   as "subsystem=group" lines. readers must copy the data and retry if seq
+   was odd or changed meanwhile. */
+#define U_STATUS_MAGIC      0x554c5354  // "ULST"
+#define U_STATUS_VERSION    1
+#define U_STATUS_PRESSURE   (1<<0)      //!< a system wide pressure flag is set
+#define U_STATUS_EMERGENCY  (1<<1)      //!< a system wide emergency flag is set
+
+struct u_status_header {
+  uint32_t  magic;
+  uint32_t  version;
+  volatile uint32_t seq;    //!< odd while the snapshot is written
+  uint32_t  size;           //!< bytes used of the file
+  uint64_t  iteration;
+  int64_t   timestamp;      //!< unix time of the snapshot
+  double    t_update;       //!< seconds spent updating processes since the last iteration
+  double    t_filter;       //!< seconds spent in filters
+  double    t_scheduler;    //!< seconds spent in the scheduler
+  double    t_total;        //!< seconds of the last iteration
+  uint32_t  pressure;       //!< bits of U_STATUS_PRESSURE, U_STATUS_EMERGENCY
+  uint32_t  n_procs;
+  uint32_t  n_sysflags;
+  uint32_t  n_flags;
+  uint32_t  off_procs;
+  uint32_t  off_flags;
+  uint32_t  off_strings;
+  uint32_t  reserved;
+};
+
+struct u_status_proc {
+  int32_t   pid;
+  int32_t   pgrp;
+  uint32_t  euid;
+  uint32_t  groups;         //!< string offset of the placements
+  uint32_t  flags;          //!< index of the first flag
+  uint32_t  n_flags;
+};
+
+struct u_status_flag {
+  int64_t   tid;
+  int64_t   timeout;
+  int64_t   value;
+  int64_t   threshold;
+  int32_t   priority;
+  uint32_t  name;           //!< string offset
+  uint32_t  reason;         //!< string offset
+  uint32_t  reserved;
+};
+
+struct u_status_timings {
+  gdouble update;
+  gdouble filter;
+  gdouble scheduler;
+  gdouble total;
+};
+
+int u_status_init();
+int u_status_enabled();
+void u_status_update(guint iteration, struct u_status_timings *timings);
+int u_status_set_group(u_proc *proc, const char *subsystem, const char *group);
+
+// async.c
+enum U_ASYNC_TYPE {
+  U_ASYNC_READ,
+  U_ASYNC_WRITE,
+};
+
+typedef struct _u_async_req u_async_req;
+typedef void (*u_async_done)(u_async_req *req);
+
+struct _u_async_req {
+  int           type;         //!< #U_ASYNC_TYPE
+  char          *path;
+  GPtrArray     *chunks;      //!< strings to write, one write() each
+  GString       *data;        //!< content read
+  int           error;        //!< errno of the failed operation or 0
+  u_async_done  done;         //!< called in the main loop
+  gpointer      user_data;
+};
+
+int u_async_init();
+void u_async_read(const char *path, u_async_done done, gpointer user_data);
+void u_async_write(const char *path, GPtrArray *chunks, u_async_done done,
+                   gpointer user_data);
+
+// uring.c
+#ifdef HAVE_IO_URING
+struct u_uring_stats {
+  guint64 batches;        //!< prefetched batches of pids
+  guint64 enters;         //!< io_uring_enter calls for prefetching
+  guint64 files;          //!< files prefetched
+  guint64 fallbacks;      //!< files read the normal way while prefetching
+  gint    writes;         //!< files written by the async io thread
+};
+
+extern struct u_uring_stats U_uring_stats;
+
+int u_uring_init();
+int u_uring_set_enabled(int enable);
+int u_uring_enabled();
+void u_uring_prefetch_begin(pid_t *pids);
+void u_uring_prefetch_end();
+int u_uring_write(const char *path, GPtrArray *chunks, int *error);
+#endif
+
+// filter_match.c
+struct u_filter_match_stats {
+  guint64 scans;          //!< processes matched against all filters
+  guint64 cached;         //!< checks answered from the bit set of a process
+  guint64 regex;          //!< patterns that needed a regular expression
+};
+
+extern struct u_filter_match_stats U_filter_match_stats;
+
+int u_filter_match_add(GRegex *basename, GRegex *cmdline);
+gboolean u_filter_match(u_proc *proc, int id);
+
+// linux_netlink.c
+struct u_netlink_stats {
+  guint64 events;         //!< proc connector events handled
+  guint64 placed;         //!< processes placed after an event, only measured
+                          //!< with a netlink socket
+};
+
+extern struct u_netlink_stats U_netlink_stats;
+
+gboolean u_netlink_measuring(void);
+void u_netlink_placed(pid_t pid);
+void u_netlink_tasks_queued(pid_t pid);
+void u_netlink_tasks_written(pid_t pid);
+void u_netlink_latency(const double *q, gint64 *out, int n, gboolean reset);
+
+// dbus.c
+#ifdef ENABLE_DBUS
+int u_dbus_scheduled_listeners();
+void u_dbus_scheduled_add(pid_t pid, const char *subsystem, const char *group, guint reason);
+void u_dbus_scheduled_flush();
+#endif
+
 #endif
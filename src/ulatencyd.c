@@ -63,6 +63,9 @@ int          log_fd = -1;
 
 GKeyFile *config_data;
 static char *config_cgroup_root;
+static char *cgroup_scratch = NULL;
+static gchar *opt_proc_root = NULL;
+static gchar *opt_netlink_socket = NULL;
 
 /*
 static gint max_size = 8;
@@ -74,6 +77,7 @@ static gboolean beep = FALSE;
 static gboolean opt_daemon = FALSE;
 
 int init_netlink(GMainLoop *loop);
+int init_netlink_socket(GMainLoop *loop, const char *path);
 
 static gboolean opt_verbose(const gchar *option_name, const gchar *value, gpointer data, GError **error) {
   int i = 1;
@@ -102,6 +106,8 @@ static GOptionEntry entries[] =
   { "quiet", 'q', G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, &opt_quiet, "More quiet. Can be passed multiple times", NULL },
   { "log-file", 'f', 0, G_OPTION_ARG_FILENAME, &log_file, "Log to file", NULL},
   { "daemonize", 'd', 0, G_OPTION_ARG_NONE, &opt_daemon, "Run daemon in background", NULL },
+  { "proc-root", 0, 0, G_OPTION_ARG_FILENAME, &opt_proc_root, "Replay a /proc fixture captured to this directory", NULL },
+  { "netlink-socket", 0, 0, G_OPTION_ARG_FILENAME, &opt_netlink_socket, "Read proc events from this socket instead of the kernel", NULL },
   { NULL }
 };
 
@@ -119,6 +125,12 @@ void cleanup() {
 #endif
   // for valgrind
   core_unload();
+  // the copy of the fixture's cgroups a replay wrote into
+  if(cgroup_scratch) {
+    recursive_remove(cgroup_scratch);
+    g_free(cgroup_scratch);
+    cgroup_scratch = NULL;
+  }
 }
 
 #define FORMAT_UNSIGNED_BUFSIZE ((GLIB_SIZEOF_LONG * 3) + 3)
@@ -309,6 +321,11 @@ void load_config() {
   mount_point = g_key_file_get_string(config_data, CONFIG_CORE, "mount_point", NULL);
   if(!mount_point)
     mount_point = "/dev/cgroups";
+
+  if(!opt_proc_root)
+    opt_proc_root = g_key_file_get_string(config_data, CONFIG_CORE, "proc_root", NULL);
+  if(!opt_netlink_socket)
+    opt_netlink_socket = g_key_file_get_string(config_data, CONFIG_CORE, "netlink_socket", NULL);
 }
 
 
@@ -470,8 +487,10 @@ int main (int argc, char *argv[])
 
   config_data = g_key_file_new();
 
+  // required for dbus and the async io thread
+  if(!g_thread_supported())
+    g_thread_init(NULL);
 #ifdef ENABLE_DBUS
-  g_thread_init(NULL);
   dbus_g_thread_init();
 
   do_dbus_init();
@@ -519,8 +538,14 @@ int main (int argc, char *argv[])
   main_context = g_main_context_default();
   main_loop = g_main_loop_new(main_context, FALSE);
 
+  if(opt_proc_root && *opt_proc_root) {
+    if(set_proc_root(opt_proc_root))
+      g_error("proc root path too long: %s", opt_proc_root);
+    g_message("replaying fixture %s. netlink and cgroup mounts are disabled", opt_proc_root);
+  }
+
 #if LIBCGROUP
-  if(cgroup_init()) {
+  if(!*proc_root && cgroup_init()) {
     g_log(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "could not init libcgroup. try mounting cgroups...");
     g_mkdir_with_parents(mount_point, 0755);
     if(!mount_cgroups() || cgroup_init()) {
@@ -557,6 +582,10 @@ int main (int argc, char *argv[])
   lua_getfield(lua_main_state, LUA_GLOBALSINDEX, "CGROUP_ROOT"); /* function to be called */
   config_cgroup_root = g_strdup(lua_tostring(lua_main_state, -1));
   lua_pop(lua_main_state, 1);
+  lua_getfield(lua_main_state, LUA_GLOBALSINDEX, "CGROUP_SCRATCH");
+  if(lua_isstring(lua_main_state, -1))
+    cgroup_scratch = g_strdup(lua_tostring(lua_main_state, -1));
+  lua_pop(lua_main_state, 1);
 
   if(!strcmp(config_cgroup_root, "/") || !strcmp(config_cgroup_root, "")) {
       g_warning("bad cgroup root path: %s", config_cgroup_root);
@@ -564,7 +593,8 @@ int main (int argc, char *argv[])
       config_cgroup_root = NULL;
   }
 
-  if(config_cgroup_root) {
+  // the groups of a fixture are part of the capture
+  if(config_cgroup_root && !*proc_root) {
       g_debug("cleanup cgroup directory: %s", config_cgroup_root);
       recursive_rmdir(config_cgroup_root, 2);
   }
@@ -576,7 +606,12 @@ int main (int argc, char *argv[])
   process_update_all();
 
   gboolean el = g_key_file_get_boolean(config_data, "core", "netlink", &error);
-  if(el || error)
+  // events of the live system do not match the processes of a fixture
+  if(opt_netlink_socket && *opt_netlink_socket)
+    init_netlink_socket(main_loop, opt_netlink_socket);
+  else if(*proc_root)
+    g_message("netlink support disabled while replaying a fixture");
+  else if(el || error)
     init_netlink(main_loop);
   else
     g_message("netlink support disabled. no fast reactions possible");
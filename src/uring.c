@@ -0,0 +1,441 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  batched /proc and cgroup io with io_uring
+
+  a process update reads stat, statm, status and cgroup of every process,
+  each one an open/read/close triplet. while an update runs, the engine reads
+  these files for a batch of pids ahead of readproc: every file is a linked
+  chain of open, read and close on a direct descriptor, so a whole batch costs
+  a single io_uring_enter. readproc gets the prefetched content through
+  file2str_hook and reads everything else, ie. task files, the normal way.
+
+  cgroup writes of the async io thread are submitted as one chain of open,
+  one write per chunk and close. the writes are hard linked, so a failing
+  chunk, ie. of a dead pid, does not cancel the following ones.
+
+  the engine is enabled by `[core] io_uring`. if the kernel lacks the needed
+  operations it disables itself and the normal path is used.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "ulatency.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <glib.h>
+#include <unistd.h>
+#include <liburing.h>
+
+#define URING_BATCH 64          // pids prefetched at once
+#define URING_NFILES 4          // files per pid
+#define URING_CHAINS (URING_BATCH * URING_NFILES)
+#define URING_DEPTH 1024        // >= 3 sqes per chain
+#define URING_BUF 4096
+#define URING_WRITE_DEPTH 256
+
+// user_data of a completion: operation in the upper bits, chain in the lower
+#define URING_OP_OPEN  (1 << 16)
+#define URING_OP_READ  (2 << 16)
+#define URING_OP_CLOSE (3 << 16)
+#define URING_OP_WRITE (4 << 16)
+#define URING_OP_MASK  (0xff << 16)
+
+static const char *uring_files[URING_NFILES] = {
+  "stat", "statm", "status", "cgroup"
+};
+
+struct u_uring_stats U_uring_stats;
+
+// read by the async io thread as well
+static gint uring_enabled = FALSE;
+static int uring_ready = FALSE;
+static struct io_uring ring;
+static struct io_uring wring; // only used by the async io thread
+static int wring_ready = FALSE;
+
+// pids of the running update in /proc order, pid -> index + 1
+static GArray *batch_pids = NULL;
+static GHashTable *batch_index = NULL;
+static int batch_start = -1;
+static int batch_len = 0;
+
+static char (*chain_path)[32] = NULL;
+static char *chain_buf = NULL;
+static int *chain_res = NULL;
+
+static int uring_setup() {
+  struct io_uring_probe *probe;
+  int files[URING_CHAINS];
+  int i, rv;
+
+  rv = io_uring_queue_init(URING_DEPTH, &ring, 0);
+  if(rv < 0) {
+    g_warning("io_uring: setup failed: %s", strerror(-rv));
+    return FALSE;
+  }
+
+  probe = io_uring_get_probe_ring(&ring);
+  if(!probe || !io_uring_opcode_supported(probe, IORING_OP_OPENAT) ||
+     !io_uring_opcode_supported(probe, IORING_OP_READ) ||
+     !io_uring_opcode_supported(probe, IORING_OP_WRITE) ||
+     !io_uring_opcode_supported(probe, IORING_OP_CLOSE)) {
+    g_warning("io_uring: kernel lacks open/read/write/close operations");
+    if(probe)
+      io_uring_free_probe(probe);
+    io_uring_queue_exit(&ring);
+    return FALSE;
+  }
+  io_uring_free_probe(probe);
+
+  // a sparse table, the chains open their files into it
+  for(i = 0; i < URING_CHAINS; i++)
+    files[i] = -1;
+  rv = io_uring_register_files(&ring, files, URING_CHAINS);
+  if(rv < 0) {
+    g_warning("io_uring: can't register file table: %s", strerror(-rv));
+    io_uring_queue_exit(&ring);
+    return FALSE;
+  }
+
+  // kept when the ring is set up again after a reset
+  if(!chain_path) {
+    chain_path = g_malloc(URING_CHAINS * sizeof(*chain_path));
+    chain_buf = g_malloc(URING_CHAINS * URING_BUF);
+    chain_res = g_new(int, URING_CHAINS);
+    batch_pids = g_array_new(FALSE, FALSE, sizeof(pid_t));
+    batch_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+
+  uring_ready = TRUE;
+  return TRUE;
+}
+
+/*
+  a ring with completions that were not reaped would hand them to the next
+  batch. the ring is torn down and the engine disabled, enabling it again
+  sets up a fresh one.
+*/
+static void uring_reset(const char *reason) {
+  g_warning("io_uring: %s, disabling", reason);
+  g_atomic_int_set(&uring_enabled, FALSE);
+  io_uring_queue_exit(&ring);
+  uring_ready = FALSE;
+  batch_start = -1;
+  batch_len = 0;
+}
+
+// reads the files of batch_pids[start..start+URING_BATCH) in one submit
+static int uring_read_batch(int start) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned head, seen;
+  int i, f, c, n, rv, nsqe = 0, done = 0;
+  pid_t pid;
+
+  n = MIN(URING_BATCH, (int)batch_pids->len - start);
+  for(i = 0; i < n; i++) {
+    pid = g_array_index(batch_pids, pid_t, start + i);
+    for(f = 0; f < URING_NFILES; f++) {
+      c = i * URING_NFILES + f;
+      snprintf(chain_path[c], sizeof(chain_path[c]), "/proc/%d/%s",
+               (int)pid, uring_files[f]);
+      chain_res[c] = -ECANCELED;
+
+      // open fails -> read and close are cancelled. the read is hard linked,
+      // so the close runs even if it fails
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_openat_direct(sqe, AT_FDCWD, chain_path[c],
+                                  O_RDONLY | O_CLOEXEC, 0, c);
+      sqe->flags |= IOSQE_IO_LINK;
+      io_uring_sqe_set_data64(sqe, URING_OP_OPEN | c);
+
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_read(sqe, c, chain_buf + c * URING_BUF, URING_BUF - 1, 0);
+      sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+      io_uring_sqe_set_data64(sqe, URING_OP_READ | c);
+
+      sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_close_direct(sqe, c);
+      io_uring_sqe_set_data64(sqe, URING_OP_CLOSE | c);
+      nsqe += 3;
+    }
+  }
+
+  rv = io_uring_submit_and_wait(&ring, nsqe);
+  if(rv < 0) {
+    uring_reset(strerror(-rv));
+    return FALSE;
+  }
+  U_uring_stats.enters++;
+
+  while(done < nsqe) {
+    seen = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      c = cqe->user_data & ~URING_OP_MASK;
+      // a failed open cancels the read, keep the reason
+      if(((cqe->user_data & URING_OP_MASK) == URING_OP_OPEN && cqe->res < 0) ||
+         ((cqe->user_data & URING_OP_MASK) == URING_OP_READ &&
+          cqe->res != -ECANCELED))
+        chain_res[c] = cqe->res;
+      seen++;
+    }
+    io_uring_cq_advance(&ring, seen);
+    done += seen;
+    if(done < nsqe) {
+      rv = io_uring_wait_cqe(&ring, &cqe);
+      if(rv < 0) {
+        uring_reset(strerror(-rv));
+        return FALSE;
+      }
+      U_uring_stats.enters++;
+    }
+  }
+
+  for(c = 0; c < n * URING_NFILES; c++)
+    if(chain_res[c] >= 0)
+      chain_buf[c * URING_BUF + chain_res[c]] = '\0';
+
+  U_uring_stats.batches++;
+  U_uring_stats.files += n * URING_NFILES;
+  batch_start = start;
+  batch_len = n;
+  return TRUE;
+}
+
+static int uring_file2str(const char *directory, const char *what, char *ret,
+                          int cap) {
+  gpointer found;
+  char *end;
+  long pid;
+  int f, idx, c, res;
+
+  if(strncmp(directory, "/proc/", 6))
+    return FILE2STR_MISS;
+  pid = strtol(directory + 6, &end, 10);
+  // task directories are not prefetched
+  if(*end || pid <= 0)
+    return FILE2STR_MISS;
+  for(f = 0; f < URING_NFILES; f++)
+    if(!strcmp(what, uring_files[f]))
+      break;
+  if(f == URING_NFILES || !g_atomic_int_get(&uring_enabled))
+    return FILE2STR_MISS;
+
+  found = g_hash_table_lookup(batch_index, GINT_TO_POINTER((int)pid));
+  // appeared after the update started
+  if(!found)
+    goto miss;
+  idx = GPOINTER_TO_INT(found) - 1;
+  if(idx < batch_start || idx >= batch_start + batch_len) {
+    if(!uring_read_batch(idx))
+      goto miss;
+  }
+
+  c = (idx - batch_start) * URING_NFILES + f;
+  res = chain_res[c];
+  // the process is gone, like a failed open() or empty read()
+  if(res == -ENOENT || res == -ESRCH || res == 0)
+    return -1;
+  // other errors and files that may be cut are read again
+  if(res < 0 || (res >= URING_BUF - 1 && cap > res))
+    goto miss;
+
+  res = MIN(res, cap - 1);
+  memcpy(ret, chain_buf + c * URING_BUF, res);
+  ret[res] = '\0';
+  return res;
+
+miss:
+  U_uring_stats.fallbacks++;
+  return FILE2STR_MISS;
+}
+
+/**
+ * configure the io_uring engine
+ *
+ * reads `[core] io_uring`, off by default.
+ *
+ * @return TRUE if the engine is used
+ */
+int u_uring_init() {
+  GError *error = NULL;
+  int enable;
+
+  enable = g_key_file_get_boolean(config_data, CONFIG_CORE, "io_uring", &error);
+  if(error) {
+    enable = FALSE;
+    g_clear_error(&error);
+  }
+  return u_uring_set_enabled(enable);
+}
+
+/**
+ * switch the io_uring engine on or off
+ * @arg enable new state
+ *
+ * @return TRUE if the engine is used now
+ */
+int u_uring_set_enabled(int enable) {
+  if(enable && !uring_ready && !uring_setup())
+    enable = FALSE;
+  if(enable && !g_atomic_int_get(&uring_enabled))
+    g_message("io_uring: batched /proc and cgroup io enabled");
+  g_atomic_int_set(&uring_enabled, enable);
+  return enable;
+}
+
+/**
+ * io_uring engine is used
+ */
+int u_uring_enabled() {
+  return g_atomic_int_get(&uring_enabled);
+}
+
+/**
+ * start prefetching for an update
+ * @arg pids 0 terminated list of pids to update, NULL for all processes
+ *
+ * until u_uring_prefetch_end() is called, readproc gets the files of these
+ * pids from the engine. the batches are read on demand in list order, which
+ * is the order readproc walks /proc.
+ */
+void u_uring_prefetch_begin(pid_t *pids) {
+  DIR *dir;
+  struct dirent *ent;
+  pid_t pid;
+  int i;
+
+  // the chains use fixed /proc paths, a fixture is read the normal way
+  if(!g_atomic_int_get(&uring_enabled) || *proc_root)
+    return;
+
+  g_array_set_size(batch_pids, 0);
+  g_hash_table_remove_all(batch_index);
+  batch_start = -1;
+  batch_len = 0;
+
+  if(pids) {
+    for(i = 0; pids[i]; i++)
+      g_array_append_val(batch_pids, pids[i]);
+  } else {
+    dir = opendir("/proc");
+    if(!dir)
+      return;
+    while((ent = readdir(dir))) {
+      if(*ent->d_name < '1' || *ent->d_name > '9')
+        continue;
+      pid = atoi(ent->d_name);
+      g_array_append_val(batch_pids, pid);
+    }
+    closedir(dir);
+  }
+
+  for(i = 0; i < batch_pids->len; i++)
+    g_hash_table_insert(batch_index,
+                        GINT_TO_POINTER(g_array_index(batch_pids, pid_t, i)),
+                        GINT_TO_POINTER(i + 1));
+  file2str_hook = uring_file2str;
+}
+
+/**
+ * stop prefetching
+ */
+void u_uring_prefetch_end() {
+  file2str_hook = NULL;
+  batch_start = -1;
+  batch_len = 0;
+}
+
+/**
+ * write chunks to a file with one submit
+ * @arg path file to write
+ * @arg chunks #GPtrArray of strings, one write each
+ * @arg error set to the errno of a failed operation
+ *
+ * called from the async io thread only.
+ *
+ * @return FALSE if the engine can't handle it and the caller must write
+ */
+int u_uring_write(const char *path, GPtrArray *chunks, int *error) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int fd = -1, i, nsqe, done = 0;
+  const char *chunk;
+
+  if(!g_atomic_int_get(&uring_enabled) || chunks->len + 2 > URING_WRITE_DEPTH)
+    return FALSE;
+  if(!wring_ready) {
+    if(io_uring_queue_init(URING_WRITE_DEPTH, &wring, 0) < 0)
+      return FALSE;
+    if(io_uring_register_files(&wring, &fd, 1) < 0) {
+      io_uring_queue_exit(&wring);
+      return FALSE;
+    }
+    wring_ready = TRUE;
+  }
+
+  sqe = io_uring_get_sqe(&wring);
+  io_uring_prep_openat_direct(sqe, AT_FDCWD, path,
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644, 0);
+  sqe->flags |= IOSQE_IO_LINK;
+  io_uring_sqe_set_data64(sqe, URING_OP_OPEN);
+  for(i = 0; i < chunks->len; i++) {
+    chunk = g_ptr_array_index(chunks, i);
+    sqe = io_uring_get_sqe(&wring);
+    // offset -1: at the current position like write() does
+    io_uring_prep_write(sqe, 0, chunk, strlen(chunk), -1);
+    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    io_uring_sqe_set_data64(sqe, URING_OP_WRITE);
+  }
+  sqe = io_uring_get_sqe(&wring);
+  io_uring_prep_close_direct(sqe, 0);
+  io_uring_sqe_set_data64(sqe, URING_OP_CLOSE);
+  nsqe = chunks->len + 2;
+
+  if(io_uring_submit_and_wait(&wring, nsqe) < 0) {
+    // drop the queued entries with the ring, the caller writes normally
+    io_uring_queue_exit(&wring);
+    wring_ready = FALSE;
+    return FALSE;
+  }
+  g_atomic_int_inc(&U_uring_stats.writes);
+
+  while(done < nsqe) {
+    if(io_uring_wait_cqe(&wring, &cqe) < 0) {
+      // unreaped completions would be mistaken for the next write's
+      io_uring_queue_exit(&wring);
+      wring_ready = FALSE;
+      *error = EIO;
+      break;
+    }
+    if(cqe->res < 0 && cqe->res != -ECANCELED &&
+       (cqe->user_data & URING_OP_MASK) != URING_OP_CLOSE)
+      *error = -cqe->res;
+    io_uring_cqe_seen(&wring, cqe);
+    done++;
+  }
+  return TRUE;
+}
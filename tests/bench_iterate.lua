@@ -0,0 +1,47 @@
+--[[
+  benchmark of full iterations against a replayed /proc fixture
+
+  capture fixtures of the wanted sizes once, ie.
+    ./tests/proc_capture -n 1000 -o fixture-1k.tar.gz
+    ./tests/proc_capture -n 10000 -o fixture-10k.tar.gz
+    ./tests/proc_capture -n 50000 -o fixture-50k.tar.gz
+  then extract one to a tmpfs and run the daemon on it, root is not needed:
+    mkdir /dev/shm/fx && tar -xzf fixture-10k.tar.gz -C /dev/shm/fx
+    src/ulatencyd --proc-root /dev/shm/fx -r tests --rule-pattern bench_iterate.lua -v
+
+  an iteration is the process update, all filters and the scheduler. the
+  fixture does not change, so after the first one every iteration has the
+  same work. the results are printed and the daemon quits afterwards.
+]]--
+
+local ROUNDS = tonumber(os.getenv("BENCH_ROUNDS") or 10)
+
+-- wall clock in seconds, os.clock misses the time spent waiting for io
+local function now()
+  local fp = io.open("/proc/uptime")
+  local uptime = fp:read("*n")
+  fp:close()
+  return uptime
+end
+
+local function bench()
+  local count = #ulatency.list_pids()
+  if ulatency.proc_root == "" then
+    print("not replaying a fixture, the numbers depend on the live system")
+  end
+  print("processes: "..count.." rounds: "..ROUNDS)
+
+  local start = now()
+  for i = 1, ROUNDS do
+    ulatency.run_iteration(true)
+  end
+  local total = now() - start
+  print(string.format("iterate    %8.2f ms/round %8.3f us/process",
+                      total * 1000 / ROUNDS, total * 1000000 / ROUNDS / count))
+
+  ulatency.quit_daemon(0)
+  return false
+end
+
+-- run after the first iteration, when all processes are parsed
+ulatency.add_timeout(bench, 1000)
@@ -0,0 +1,54 @@
+--[[
+  benchmark of the proc event path with synthetic events
+
+  the daemon replays a fixture and reads the events from a unix socket,
+  tests/nl_events creates the processes in the fixture and sends the
+  events at a fixed rate:
+    mkdir /dev/shm/fx && tar -xzf fixture-10k.tar.gz -C /dev/shm/fx
+    src/ulatencyd --proc-root /dev/shm/fx --netlink-socket /tmp/ulatency.sock \
+                  -r tests --rule-pattern bench_netlink.lua &
+    tests/nl_events -r /dev/shm/fx -s /tmp/ulatency.sock -e 5000 -d 20
+
+  every second the received events, the placed processes and the latency
+  from the event until the write into the tasks file of its cgroup
+  completed are printed. processes the scheduler left in their groups are
+  placed when the scheduler returns.
+  new processes wait delay_new_pid ms before they are scheduled, set it to
+  0 in the [core] section to measure the event path only. the daemon quits
+  after the events stopped for some seconds.
+]]--
+
+local IDLE = tonumber(os.getenv("BENCH_IDLE") or 5)
+
+local last = ulatency.get_netlink_stats(true)
+local first = nil
+local idle = 0
+
+local function report()
+  local stats = ulatency.get_netlink_stats(true)
+  local events = stats.events - last.events
+  local placed = stats.placed - last.placed
+
+  if events == 0 and placed == 0 then
+    if first then
+      idle = idle + 1
+    end
+    if first and idle >= IDLE then
+      local seconds = os.time() - first - idle
+      print(string.format("total %d events %d placed in %d s: %.0f events/s",
+                          stats.events, stats.placed, seconds,
+                          stats.events / math.max(seconds, 1)))
+      ulatency.quit_daemon(0)
+      return false
+    end
+  else
+    first = first or os.time()
+    idle = 0
+    print(string.format("%6d events/s %6d placed/s  p50 %7.2f p99 %7.2f p999 %7.2f max %7.2f ms",
+                        events, placed, stats.p50, stats.p99, stats.p999, stats.max))
+  end
+  last = stats
+  return true
+end
+
+ulatency.add_timeout(report, 1000)
@@ -0,0 +1,94 @@
+--[[
+  benchmark of a full process update with and without the io_uring engine
+
+  start enough processes first, ie. 10k with the forkbomb helper:
+    ./tests/forkbomb -n 10000 -d 0 &
+  then run the daemon built with liburing:
+    sudo src/ulatencyd -r tests --rule-pattern bench_proc_io.lua -v
+
+  read/write are the calls counted in /proc/self/io plus the io_uring_enter
+  calls of the engine. open and close are not counted there, the complete
+  count per syscall is printed by scripts/bench_proc_io.sh, which runs this
+  under strace.
+  the results are printed and the daemon quits afterwards.
+
+  BENCH_ROUNDS  update rounds, 0 only starts and quits
+  BENCH_MODE    "read" or "uring" to measure only one of them
+]]--
+
+local ROUNDS = tonumber(os.getenv("BENCH_ROUNDS") or 5)
+local MODE = os.getenv("BENCH_MODE")
+
+-- wall clock in seconds, os.clock misses the time spent waiting for io
+local function now()
+  local fp = io.open("/proc/uptime")
+  local uptime = fp:read("*n")
+  fp:close()
+  return uptime
+end
+
+local function syscalls()
+  local rv = 0
+  for line in io.lines("/proc/self/io") do
+    local key, value = string.match(line, "^(%w+): (%d+)")
+    if key == "syscr" or key == "syscw" then
+      rv = rv + tonumber(value)
+    end
+  end
+  if ulatency.io_uring then
+    rv = rv + ulatency.io_uring().enters
+  end
+  return rv
+end
+
+local function measure(name, count)
+  if ROUNDS == 0 then
+    return
+  end
+  local calls = syscalls()
+  local start = now()
+  for i = 1, ROUNDS do
+    ulatency.process_update()
+  end
+  local total = now() - start
+  calls = syscalls() - calls
+  print(string.format("%-10s %8.2f ms/round %8.3f us/process %10d read/write/enter per round",
+                      name, total * 1000 / ROUNDS, total * 1000000 / ROUNDS / count,
+                      calls / ROUNDS))
+end
+
+local function bench()
+  local count = ulatency.get_number_of_processes()
+  if count < 10000 then
+    print("only "..count.." processes, start more with tests/forkbomb for a 10k run")
+  end
+  print("processes: "..count.." rounds: "..ROUNDS)
+
+  if not ulatency.io_uring then
+    print("built without liburing, only the normal path is measured")
+    measure("read()", count)
+  else
+    local was = ulatency.io_uring().enabled
+    ulatency.io_uring(false)
+    if MODE ~= "uring" then
+      measure("read()", count)
+    end
+    if MODE ~= "read" then
+      if ulatency.io_uring(true).enabled then
+        measure("io_uring", count)
+        local stats = ulatency.io_uring()
+        print(string.format("io_uring: %d batches %d files %d fallbacks",
+                            stats.batches, stats.files, stats.fallbacks))
+      else
+        print("io_uring not supported by the kernel")
+      end
+    end
+    ulatency.io_uring(was)
+  end
+
+  ulatency.quit_daemon(0)
+  return false
+end
+
+-- run after the first iteration, when all processes are parsed
+ulatency.add_timeout(bench, 1000)
@@ -0,0 +1,78 @@
+--[[
+  benchmark of Scheduler:all() and of rule style field access
+
+  start enough processes first, ie. 10k with the forkbomb helper:
+    ./tests/forkbomb -n 10000 -d 0 &
+  then run the daemon once with plain lua and once built with -DLUA_JIT=ON:
+    sudo src/ulatencyd -r tests --rule-pattern bench_scheduler.lua -v
+
+  the results are printed and the daemon quits afterwards.
+]]--
+
+local ROUNDS = tonumber(os.getenv("BENCH_ROUNDS") or 5)
+
+if not Scheduler then
+  ulatency.load_rule("scheduler.lua")
+end
+
+local function runtime()
+  if jit then
+    return jit.version
+  end
+  return _VERSION
+end
+
+local function measure(name, count, fnc)
+  local start = os.clock()
+  for i = 1, ROUNDS do
+    fnc()
+  end
+  local total = os.clock() - start
+  print(string.format("%-24s %8.2f ms/round %8.3f us/process", name,
+                      total * 1000 / ROUNDS, total * 1000000 / ROUNDS / count))
+end
+
+local function bench()
+  local procs = ulatency.list_processes()
+  local count = #procs
+  if count < 10000 then
+    print("only "..count.." processes, start more with tests/forkbomb for a 10k run")
+  end
+  print("runtime: "..runtime().." processes: "..count.." rounds: "..ROUNDS)
+
+  measure("Scheduler:all()", count, function()
+    Scheduler.C_FILTER = false
+    Scheduler:all()
+  end)
+
+  -- the fields the memory and desktop rules look at
+  measure("fields metatable", count, function()
+    local sum = 0
+    for i, proc in ipairs(procs) do
+      if proc.is_valid then
+        sum = sum + proc.rss + proc.vm_size + proc.euid + proc.pgrp
+      end
+    end
+    return sum
+  end)
+
+  if ulatency.ffi_proc then
+    measure("fields ffi", count, function()
+      local sum = 0
+      for i, proc in ipairs(procs) do
+        if proc.is_valid then
+          local cproc = ulatency.ffi_proc(proc)
+          local p = cproc.proc
+          sum = sum + p.rss + p.vm_size + p.euid + p.pgrp
+        end
+      end
+      return sum
+    end)
+  end
+
+  ulatency.quit_daemon(0)
+  return false
+end
+
+-- run after the first iteration, when all processes are parsed
+ulatency.add_timeout(bench, 1000)
@@ -0,0 +1,223 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  checks the shared filter matcher against GRegex
+
+  every filter of the list gets its own GRegex, like register_filter
+  compiles them. for every process and every filter u_filter_match must
+  answer what g_regex_match says for re_basename or re_cmdline. the
+  processes are the running ones, the names the rules look for and random
+  strings made of the characters of the patterns.
+
+  the filters are the patterns of the rules in rules/, plus the forms
+  split_literals has to handle: escaped punctuation, leading and trailing
+  ".*", and patterns that must stay a GRegex.
+
+  filter_match_check [random strings]
+*/
+
+#include "../src/filter_match.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failed = 0;
+
+// the matcher reads the cmdline on demand, the fake processes have it set
+int u_proc_ensure(u_proc *proc, enum ENSURE_WHAT what, int update) {
+  return TRUE;
+}
+
+struct filter {
+  const char *basename;
+  const char *cmdline;
+};
+
+static const struct filter filters[] = {
+  // the rules
+  { "kuiserver|kwalletmanager|knotify4|kmix|kded4|kwin|plasma-desktop", NULL },
+  { "startkde|kdeinit4|plasma-desktop", NULL },
+  { "awesome", NULL },
+  { "pulseaudio|mpd|xmms2d", NULL },
+  { "vlc|xine|mplayer.*|kaffeine|amarok|rhythmbox|cmus|ogg123|yauap|mpg321", NULL },
+  { NULL, "/usr/bin/X" },
+  { "preload", NULL },
+  { "cron|anacron", NULL },
+  { "metacity|mutter|compiz|gtk-window-decorator|gnome-panel|gnome-shell|nautilus", NULL },
+  { "x-session-manager", NULL },
+  // escaped punctuation
+  { "b\\.c|x\\+y", NULL },
+  { NULL, "\\/usr\\/bin\\/X|\\(deleted\\)" },
+  { "a\\|b", "\\[kworker\\]" },
+  // leading and trailing .*
+  { ".*cron", NULL },
+  { "cron.*|.*kde.*", ".*X" },
+  { ".*", NULL },
+  // both patterns
+  { "plasma", "/usr/bin" },
+  { "kde", "-session" },
+  // have to stay a GRegex
+  { "^cron$", NULL },
+  { "k[dw]e", NULL },
+  { "(a|b)c", NULL },
+  { "gnome-.*-daemon", NULL },
+  { "X$", "^/usr/bin/X" },
+  { "cron|^at", NULL },
+  { "a.c", "ab?c" },
+  { "\\d+", "\\w+d$" },
+  { "plasma|", NULL },
+  { NULL, NULL },
+};
+
+#define N_FILTERS (sizeof(filters) / sizeof(filters[0]))
+
+// the names the rules look for and commands they run on
+static const char *names[] = {
+  "plasma-desktop", "kded4", "cron", "anacron", "atd", "mplayer", "mplayer2",
+  "gnome-settings-daemon", "x-session-manager", "b.c", "bxc", "x+y", "xxy",
+  "a|b", "ab", "ac", "bc", "12", "kwe", "awesome", "",
+};
+static const char *cmdlines[] = {
+  "/usr/bin/X :0 -nolisten tcp", "/usr/bin/Xorg :0", "/usr/bin/X (deleted)",
+  "[kworker]", "/usr/bin/startkde", "gnome-session --session=ubuntu",
+  "/usr/lib/kde4/libexec/kdeinit4 -d", "abc", "ac", "cmd 42 abd", "",
+};
+
+static GRegex *re[N_FILTERS][2];
+static int ids[N_FILTERS];
+
+static GRegex *compile(const char *pattern) {
+  GError *error = NULL;
+  GRegex *rv;
+
+  if(!pattern)
+    return NULL;
+  rv = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &error);
+  if(!rv) {
+    printf("FAILED: can't compile %s: %s\n", pattern, error->message);
+    g_error_free(error);
+    failed++;
+  }
+  return rv;
+}
+
+#define OR_NONE(S) ((S) ? (S) : "-")
+
+// one process against all filters
+static void check(const char *cmdfile, const char *cmdline) {
+  u_proc proc;
+  gboolean want, got;
+  int i;
+
+  memset(&proc, 0, sizeof(proc));
+  proc.cmdfile = (char *)cmdfile;
+  proc.cmdline_match = (char *)cmdline;
+  for(i = 0; i < N_FILTERS; i++) {
+    want = (re[i][0] && cmdfile && g_regex_match(re[i][0], cmdfile, 0, NULL)) ||
+           (re[i][1] && cmdline && g_regex_match(re[i][1], cmdline, 0, NULL));
+    got = u_filter_match(&proc, ids[i]);
+    if(want != got) {
+      if(failed < 20)
+        printf("FAILED: %s / %s: filter %s / %s says %d, GRegex %d\n",
+               OR_NONE(cmdfile), OR_NONE(cmdline), OR_NONE(filters[i].basename),
+               OR_NONE(filters[i].cmdline), got, want);
+      failed++;
+    }
+  }
+  g_free(proc.filter_match);
+}
+
+// the processes of this box, like u_proc_ensure fills them
+static int check_running() {
+  GDir *dir = g_dir_open("/proc", 0, NULL);
+  const char *name;
+  char *path, *contents, *cmdfile;
+  gsize len, i;
+  int n = 0;
+
+  if(!dir)
+    return 0;
+  while((name = g_dir_read_name(dir))) {
+    if(*name < '1' || *name > '9')
+      continue;
+    path = g_strdup_printf("/proc/%s/cmdline", name);
+    if(g_file_get_contents(path, &contents, &len, NULL)) {
+      // kernel threads, an empty cmdline and no cmdfile
+      if(!len) {
+        check(NULL, "");
+      } else {
+        // basename of argv[0], none if it ends with a slash
+        cmdfile = strrchr(contents, '/');
+        if(!cmdfile)
+          cmdfile = g_strdup(contents);
+        else
+          cmdfile = cmdfile[1] ? g_strdup(cmdfile + 1) : NULL;
+        for(i = 0; i + 1 < len; i++)
+          if(!contents[i])
+            contents[i] = ' ';
+        check(cmdfile, contents);
+        g_free(cmdfile);
+      }
+      g_free(contents);
+      n++;
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+  return n;
+}
+
+int main(int argc, char **argv) {
+  static const char alphabet[] = "abcdekrnoplsmtwX/uy.+-|()[]\\4 ";
+  GRand *rand = g_rand_new_with_seed(4711);
+  int n_random = argc > 1 ? atoi(argv[1]) : 100000;
+  char basename[16], cmdline[48];
+  int i, j, k, len, running;
+
+  for(i = 0; i < N_FILTERS; i++) {
+    re[i][0] = compile(filters[i].basename);
+    re[i][1] = compile(filters[i].cmdline);
+    ids[i] = u_filter_match_add(re[i][0], re[i][1]);
+  }
+
+  for(i = 0; i < G_N_ELEMENTS(names); i++)
+    for(j = 0; j < G_N_ELEMENTS(cmdlines); j++)
+      check(names[i], cmdlines[j]);
+
+  running = check_running();
+
+  for(i = 0; i < n_random; i++) {
+    len = g_rand_int_range(rand, 0, sizeof(basename));
+    for(k = 0; k < len; k++)
+      basename[k] = alphabet[g_rand_int_range(rand, 0, sizeof(alphabet) - 1)];
+    basename[len] = '\0';
+    len = g_rand_int_range(rand, 0, sizeof(cmdline));
+    for(k = 0; k < len; k++)
+      cmdline[k] = alphabet[g_rand_int_range(rand, 0, sizeof(alphabet) - 1)];
+    cmdline[len] = '\0';
+    check(basename, cmdline);
+  }
+
+  printf("%d running processes, %d random strings, %" G_GUINT64_FORMAT " scans, "
+         "%" G_GUINT64_FORMAT " regex matches\n", running, n_random,
+         U_filter_match_stats.scans, U_filter_match_stats.regex);
+  printf("%s\n", failed ? "filter match check failed" : "filter match check passed");
+  return failed ? 1 : 0;
+}
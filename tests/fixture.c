@@ -0,0 +1,165 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include "fixture.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+char fixture_data[FIXTURE_MAX_FILE + 1];
+
+// the files ulatencyd reads of every process and thread
+const char *fixture_pid_files[] = {
+  "stat", "statm", "status", "cmdline", "environ", "cgroup", "io",
+  "oom_score_adj", NULL
+};
+
+const char *fixture_task_files[] = { "stat", "statm", "status", NULL };
+
+int fixture_mkdirs(const char *path) {
+  char tmp[PATH_MAX], *p;
+
+  snprintf(tmp, sizeof(tmp), "%s", path);
+  for(p = tmp + 1; *p; p++) {
+    if(*p != '/')
+      continue;
+    *p = '\0';
+    mkdir(tmp, 0755);
+    *p = '/';
+  }
+  if(mkdir(tmp, 0755) && errno != EEXIST) {
+    perror(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// reads path into fixture_data, returns the length or -1
+int fixture_read(const char *path) {
+  int fd = open(path, O_RDONLY);
+  int n = 0, len = 0;
+
+  if(fd < 0)
+    return -1;
+  while(len < FIXTURE_MAX_FILE &&
+        (n = read(fd, fixture_data + len, FIXTURE_MAX_FILE - len)) > 0)
+    len += n;
+  close(fd);
+  if(n < 0)
+    return -1;
+  fixture_data[len] = '\0';
+  return len;
+}
+
+void fixture_write(const char *path, const char *buf, int len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(fd < 0) {
+    perror(path);
+    return;
+  }
+  if(write(fd, buf, len) != len)
+    perror(path);
+  close(fd);
+}
+
+/* copies file name of directory from to directory to, with the pid replaced.
+ * the parent is replaced too if ppid is above 0. */
+void fixture_clone_file(const char *from, const char *to, const char *name,
+                        int pid, int ppid) {
+  char path[PATH_MAX], *buf, *out, *line, *tail;
+  int len;
+
+  snprintf(path, sizeof(path), "%s/%s", from, name);
+  len = fixture_read(path);
+  if(len < 0)
+    return;
+  // only the numbers change, that is at most a few digits more
+  buf = malloc(len + 64);
+  out = buf;
+  if(!strcmp(name, "stat")) {
+    // pid (comm) state ppid ...
+    line = strchr(fixture_data, '(');
+    tail = strrchr(fixture_data, ')');
+    if(!line || !tail || tail + 4 > fixture_data + len) {
+      free(buf);
+      return;
+    }
+    out += sprintf(out, "%d %.*s", pid, (int)(tail + 4 - line), line);
+    tail += 4;
+    if(ppid > 0) {
+      out += sprintf(out, "%d", ppid);
+      tail = strchr(tail, ' ');
+      if(!tail)
+        tail = fixture_data + len;
+    }
+    memcpy(out, tail, fixture_data + len - tail);
+    out += fixture_data + len - tail;
+  } else if(!strcmp(name, "status")) {
+    for(line = strtok(fixture_data, "\n"); line; line = strtok(NULL, "\n")) {
+      if(!strncmp(line, "Pid:", 4) || !strncmp(line, "Tgid:", 5))
+        out += sprintf(out, "%.*s\t%d\n", (int)(strchr(line, ':') - line + 1), line, pid);
+      else if(ppid > 0 && !strncmp(line, "PPid:", 5))
+        out += sprintf(out, "PPid:\t%d\n", ppid);
+      else
+        out += sprintf(out, "%s\n", line);
+    }
+  } else {
+    memcpy(out, fixture_data, len);
+    out += len;
+  }
+  snprintf(path, sizeof(path), "%s/%s", to, name);
+  fixture_write(path, buf, out - buf);
+  free(buf);
+}
+
+/* a new process pid below root as copy of process from, with one thread.
+ * ppid 0 keeps the parent of from. */
+void fixture_clone_process(const char *root, int from, int pid, int ppid) {
+  char src[PATH_MAX], dst[PATH_MAX], link[PATH_MAX];
+  ssize_t len;
+  int f;
+
+  snprintf(src, sizeof(src), "%s/proc/%d", root, from);
+  snprintf(dst, sizeof(dst), "%s/proc/%d/task/%d", root, pid, pid);
+  fixture_mkdirs(dst);
+  snprintf(dst, sizeof(dst), "%s/proc/%d", root, pid);
+  for(f = 0; fixture_pid_files[f]; f++)
+    fixture_clone_file(src, dst, fixture_pid_files[f], pid, ppid);
+
+  // exe is only read as link
+  snprintf(src, sizeof(src), "%s/proc/%d/exe", root, from);
+  len = readlink(src, link, sizeof(link) - 1);
+  if(len > 0) {
+    link[len] = '\0';
+    snprintf(dst, sizeof(dst), "%s/proc/%d/exe", root, pid);
+    symlink(link, dst);
+  }
+
+  snprintf(src, sizeof(src), "%s/proc/%d", root, pid);
+  snprintf(dst, sizeof(dst), "%s/proc/%d/task/%d", root, pid, pid);
+  for(f = 0; fixture_task_files[f]; f++)
+    fixture_clone_file(src, dst, fixture_task_files[f], pid, 0);
+}
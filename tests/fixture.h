@@ -0,0 +1,40 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef __fixture_h__
+#define __fixture_h__
+
+// file helpers of the /proc fixture tools
+
+#define FIXTURE_MAX_FILE (1024 * 1024)
+
+// content of the last fixture_read
+extern char fixture_data[FIXTURE_MAX_FILE + 1];
+
+extern const char *fixture_pid_files[];
+extern const char *fixture_task_files[];
+
+int fixture_mkdirs(const char *path);
+int fixture_read(const char *path);
+void fixture_write(const char *path, const char *buf, int len);
+void fixture_clone_file(const char *from, const char *to, const char *name,
+                        int pid, int ppid);
+void fixture_clone_process(const char *root, int from, int pid, int ppid);
+
+#endif
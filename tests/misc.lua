@@ -21,7 +21,11 @@ function test_active()
   function add_active()
     print("test active list ["..tostring(TEST_I).."/8]")
     ulatency.set_active_pid(1, TEST_PIDS[TEST_I])
-    assert_cmp_table(RV[TEST_I], ulatency.get_active_pids(1), nil, {last_change=true})
+    local actives = ulatency.get_active_pids(1)
+    assert_cmp_table(RV[TEST_I], actives, nil, {last_change=true, pos=true})
+    for i, up in ipairs(actives) do
+      assert_equal(i, up.pos, "stored position of "..tostring(up.pid).." wrong")
+    end
     TEST_I = TEST_I + 1
     if TEST_I > #TEST_PIDS then
       test_active_done = true
@@ -33,6 +37,45 @@ function test_active()
   ulatency.add_timeout(add_active, 1000)
 end
 
+function test_focus_stats()
+  local stats = ulatency.get_focus_stats()
+  assert_number(stats.requests)
+  assert_number(stats.applied)
+  assert_number(stats.merged)
+  assert_true(stats.applied + stats.merged <= stats.requests, "more focus changes handled than reported")
+  assert_number(stats.placed)
+  assert_number(stats.over_budget)
+  assert_true(stats.over_budget <= stats.placed, "more placements over budget than timed")
+  assert_true(stats.latency_last <= stats.latency_max, "last placement slower than the slowest")
+end
+
+test_focus_debounce_done = false
+
+-- changes inside one debounce window are merged into one pending change
+function test_focus_debounce()
+  local uid = 4242
+  local before = ulatency.get_focus_stats()
+  -- the main loop does not run in between, so the window can't close
+  for i, pid in ipairs({101, 102, 103, 104, 105}) do
+    ulatency.set_active_pid_debounced(uid, pid)
+  end
+  local after = ulatency.get_focus_stats()
+  assert_equal(before.requests + 5, after.requests, "focus requests not counted")
+  assert_equal(before.applied + 1, after.applied, "more than one change applied in the window")
+  -- the second change becomes pending, the following three replace it
+  assert_equal(before.merged + 3, after.merged, "changes in the window not merged")
+
+  -- the pending change is applied when the window closes
+  local function check_pending()
+    local stats = ulatency.get_focus_stats()
+    assert_equal(before.applied + 2, stats.applied, "pending change not applied")
+    assert_equal(105, ulatency.get_active_pids(uid)[1].pid, "last change not active")
+    test_focus_debounce_done = true
+    return false
+  end
+  ulatency.add_timeout(check_pending, 500)
+end
+
 function test_sysflags()
   flag = ulatency.new_flag{name="hello"}
   ulatency.add_flag(flag)
@@ -49,6 +92,15 @@ function test_sysflags()
   ulatency.add_flag(flag)
   ulatency.clear_flag_name("hello")
   assert_len(0, ulatency.list_flags(), "len of system flags not right")
+
+  -- the generation changes with every change, but not when nothing changed
+  local generation = ulatency.get_flags_generation()
+  ulatency.add_flag(flag)
+  assert_equal(generation + 1, ulatency.get_flags_generation(), "flag add not counted")
+  ulatency.add_flag(flag)
+  assert_equal(generation + 1, ulatency.get_flags_generation(), "double add counted")
+  ulatency.del_flag(flag)
+  assert_equal(generation + 2, ulatency.get_flags_generation(), "flag delete not counted")
 end
 
 function test_cgroups_list()
@@ -80,6 +132,83 @@ function test_find_flags()
   assert_false(ulatency.set_sysctl("kernel.version", "bla"), "kernel.version should not be writeable")
 end
 
+function test_cpu_usage()
+  local usage = ulatency.get_cpu_usage()
+  assert_number(usage.total)
+  assert_number(usage.iowait)
+  assert_table(usage.cpus)
+  assert_true(#usage.cpus > 0, "no per cpu usage")
+  assert_true(usage.total >= 0 and usage.total <= 100, "total out of range")
+  for i, v in ipairs(usage.cpus) do
+    assert_true(v >= 0 and v <= 100, "cpu "..i.." out of range")
+  end
+  local percent = ulatency.get_last_percent()
+  assert_true(percent >= 0 and percent <= 100, "last percent out of range")
+end
+
+function test_meminfo_snapshot()
+  local mem = ulatency.get_meminfo()
+  local vm = ulatency.get_vminfo()
+  assert_true(mem.kb_main_total > 0, "no total memory")
+  assert_true(mem.kb_main_free <= mem.kb_main_total, "more free than total memory")
+  assert_equal(mem.kb_main_total - mem.kb_main_free, mem.kb_main_used)
+  assert_number(vm.vm_pgpgin)
+  -- shared until the main loop runs again
+  assert_equal(mem, ulatency.get_meminfo(), "meminfo not shared")
+  assert_equal(vm, ulatency.get_vminfo(), "vminfo not shared")
+  local fresh = ulatency.get_meminfo(true)
+  assert_not_equal(mem, fresh, "meminfo(true) not fresh")
+  assert_equal(mem.kb_main_total, fresh.kb_main_total)
+end
+
+test_async_done = false
+
+function test_async_io()
+  local path = os.tmpname()
+  ulatency.write_async(path, {"first\n", "second\n"}, function(ok, err)
+    assert_true(ok, "write_async failed: "..tostring(err))
+    ulatency.read_async(path, function(data, err)
+      os.remove(path)
+      assert_equal("first\nsecond\n", data, "read_async content differs")
+      ulatency.read_async(path, function(data, err)
+        assert_nil(data, "read of a removed file returned data")
+        assert_string(err, "no error for a removed file")
+        test_async_done = true
+      end)
+    end)
+  end)
+end
+
+test_cgroup_cleanup_done = false
+
+function test_cgroup_cleanup()
+  local name = "ulatency_test_cleanup"
+  local grp = CGroup.new(name, {}, "cpu")
+  local path = grp:path()
+  grp:commit()
+  if posix.access(path) ~= 0 then
+    -- no cgroup tree to write to, not running as root
+    CGroup.get_groups()["cpu/"..name] = nil
+    test_cgroup_cleanup_done = true
+    return
+  end
+
+  CGroup.cleanup()
+  local tries = 0
+  local function check_removed()
+    tries = tries + 1
+    if CGroup.get_group("cpu/"..name) and tries < 50 then
+      return true
+    end
+    assert_nil(CGroup.get_group("cpu/"..name), "idle group still cached")
+    assert_not_equal(0, posix.access(path), "idle group directory not removed")
+    test_cgroup_cleanup_done = true
+    return false
+  end
+  ulatency.add_timeout(check_removed, 100)
+end
+
 function test_done()
-  return test_active_done
+  return test_active_done and test_async_done and test_focus_debounce_done and
+         test_cgroup_cleanup_done
 end
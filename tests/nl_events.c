@@ -0,0 +1,343 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  synthetic proc connector events for a daemon replaying a fixture
+
+  unlike forkbomb no process is started. new processes are created as
+  copies of fixture processes below the fixture root, then the FORK, EXEC,
+  EXIT and UID messages the kernel would send are written to the socket the
+  daemon reads instead of the kernel connector. every event carries its
+  send time, the daemon measures the latency until it scheduled the process.
+
+    mkdir /dev/shm/fx && tar -xzf fixture-10k.tar.gz -C /dev/shm/fx
+    src/ulatencyd --proc-root /dev/shm/fx --netlink-socket /tmp/ulatency.sock \
+                  -r tests --rule-pattern bench_netlink.lua &
+    tests/nl_events -r /dev/shm/fx -s /tmp/ulatency.sock -e 5000 -d 20
+
+  the daemon prints events/s and the latency percentiles, see
+  tests/bench_netlink.lua. with the default delay_new_pid most of the
+  latency is the delay, set it to 0 to measure the event path itself.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include "fixture.h"
+
+#define MSG_LEN (NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(struct proc_event)))
+
+enum { EV_FORK, EV_EXEC, EV_EXIT, EV_UID, EV_TYPES };
+enum { TREE_FLAT, TREE_CHAIN, TREE_RANDOM };
+
+struct live {
+  int pid;
+  int ppid;
+};
+
+static const char *root = NULL;
+static int sock = -1;
+static struct sockaddr_un addr;
+static unsigned int seq = 0;
+
+static int *templates = NULL;     // fixture processes new ones are copied from
+static int n_templates = 0;
+static struct live *live = NULL;  // synthetic processes
+static int n_live = 0;
+static int next_pid = 0;
+
+static unsigned long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// same layout as the messages of the kernel
+static void send_event(struct proc_event *event) {
+  char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(struct proc_event))];
+  struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+  struct cn_msg *cn = NLMSG_DATA(nlh);
+
+  memset(buf, 0, sizeof(buf));
+  nlh->nlmsg_len = MSG_LEN;
+  nlh->nlmsg_type = NLMSG_DONE;
+  nlh->nlmsg_seq = seq;
+  cn->id.idx = CN_IDX_PROC;
+  cn->id.val = CN_VAL_PROC;
+  cn->seq = seq++;
+  cn->len = sizeof(struct proc_event);
+  event->timestamp_ns = now_ns();
+  memcpy(cn->data, event, sizeof(struct proc_event));
+
+  while(sendto(sock, buf, nlh->nlmsg_len, 0, (struct sockaddr *)&addr,
+               sizeof(addr)) < 0) {
+    if(errno == EINTR)
+      continue;
+    perror("sendto");
+    exit(2);
+  }
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+static void load_templates() {
+  char path[PATH_MAX];
+  struct dirent *ent;
+  DIR *dir;
+  int alloc = 0, pid;
+
+  snprintf(path, sizeof(path), "%s/proc", root);
+  dir = opendir(path);
+  if(!dir) {
+    perror(path);
+    exit(2);
+  }
+  while((ent = readdir(dir))) {
+    pid = atoi(ent->d_name);
+    if(pid <= 0)
+      continue;
+    if(n_templates == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      templates = realloc(templates, alloc * sizeof(int));
+    }
+    templates[n_templates++] = pid;
+    if(pid >= next_pid)
+      next_pid = pid + 1;
+  }
+  closedir(dir);
+  if(!n_templates) {
+    fprintf(stderr, "no processes in %s\n", path);
+    exit(2);
+  }
+}
+
+static int pick_parent(int tree, int base) {
+  if(!n_live || tree == TREE_FLAT)
+    return base;
+  if(tree == TREE_CHAIN)
+    return live[n_live - 1].pid;
+  // the existing processes are parents too
+  if(random() % 2)
+    return base;
+  return live[random() % n_live].pid;
+}
+
+static void ev_fork(int tree, int base) {
+  struct proc_event ev;
+  int parent = pick_parent(tree, base);
+  int pid = next_pid++;
+
+  fixture_clone_process(root, templates[random() % n_templates], pid, parent);
+  live = realloc(live, (n_live + 1) * sizeof(struct live));
+  live[n_live].pid = pid;
+  live[n_live].ppid = parent;
+  n_live++;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.what = PROC_EVENT_FORK;
+  ev.event_data.fork.parent_pid = parent;
+  ev.event_data.fork.parent_tgid = parent;
+  ev.event_data.fork.child_pid = pid;
+  ev.event_data.fork.child_tgid = pid;
+  send_event(&ev);
+}
+
+// the process becomes a copy of another fixture process
+static void ev_exec(struct live *p) {
+  struct proc_event ev;
+
+  fixture_clone_process(root, templates[random() % n_templates], p->pid, p->ppid);
+  memset(&ev, 0, sizeof(ev));
+  ev.what = PROC_EVENT_EXEC;
+  ev.event_data.exec.process_pid = p->pid;
+  ev.event_data.exec.process_tgid = p->pid;
+  send_event(&ev);
+}
+
+static void ev_exit(int i) {
+  struct proc_event ev;
+  char path[PATH_MAX];
+  int pid = live[i].pid;
+
+  live[i] = live[--n_live];
+  memset(&ev, 0, sizeof(ev));
+  ev.what = PROC_EVENT_EXIT;
+  ev.event_data.exit.process_pid = pid;
+  ev.event_data.exit.process_tgid = pid;
+  send_event(&ev);
+
+  snprintf(path, sizeof(path), "%s/proc/%d", root, pid);
+  nftw(path, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void ev_uid(struct live *p) {
+  struct proc_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.what = PROC_EVENT_UID;
+  ev.event_data.id.process_pid = p->pid;
+  ev.event_data.id.process_tgid = p->pid;
+  ev.event_data.id.r.ruid = getuid();
+  ev.event_data.id.e.euid = getuid();
+  send_event(&ev);
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = NULL;
+  int mix[EV_TYPES] = { 4, 2, 3, 1 };
+  int tree = TREE_RANDOM;
+  int base = 1;
+  int keep = 0;
+  double rate = 1000, duration = 10;
+  unsigned long long start, next, end, counts[EV_TYPES] = { 0 };
+  unsigned long long sent = 0;
+  struct timespec ts;
+  int c, i, total, pick;
+
+  while((c = getopt(argc, argv, "r:s:e:d:m:t:p:kh")) != -1) {
+    switch(c) {
+      case 'r':
+        root = optarg;
+        break;
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'e':
+        rate = atof(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      case 'm':
+        if(sscanf(optarg, "%d:%d:%d:%d", &mix[EV_FORK], &mix[EV_EXEC],
+                  &mix[EV_EXIT], &mix[EV_UID]) != 4) {
+          fprintf(stderr, "bad mix %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 't':
+        if(!strcmp(optarg, "flat"))
+          tree = TREE_FLAT;
+        else if(!strcmp(optarg, "chain"))
+          tree = TREE_CHAIN;
+        else
+          tree = TREE_RANDOM;
+        break;
+      case 'p':
+        base = atoi(optarg);
+        break;
+      case 'k':
+        keep = 1;
+        break;
+      default:
+        printf("nl_events -r fixture -s socket [-e rate] [-d seconds] [-m mix] [-t tree] [-p pid] [-k]\n");
+        printf("-r fixture    root of the fixture the daemon replays\n");
+        printf("-s socket     netlink_socket of the daemon\n");
+        printf("-e rate       events per second (default 1000)\n");
+        printf("-d seconds    duration (default 10)\n");
+        printf("-m f:e:x:u    ratio of fork, exec, exit and uid events (default 4:2:3:1)\n");
+        printf("-t tree       flat, chain or random parents of new processes\n");
+        printf("-p pid        parent of the tree (default 1)\n");
+        printf("-k            keep the new processes at the end\n");
+        exit(c == 'h' ? 0 : 1);
+    }
+  }
+  if(!root || !socket_path || rate <= 0) {
+    fprintf(stderr, "need -r, -s and a positive rate\n");
+    exit(1);
+  }
+  if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long\n");
+    exit(1);
+  }
+  total = mix[EV_FORK] + mix[EV_EXEC] + mix[EV_EXIT] + mix[EV_UID];
+  if(total <= 0 || mix[EV_FORK] <= 0) {
+    fprintf(stderr, "the mix needs fork events\n");
+    exit(1);
+  }
+
+  sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  load_templates();
+
+  start = now_ns();
+  end = start + (unsigned long long)(duration * 1e9);
+  for(;;) {
+    // events are sent on schedule, a slow daemon blocks the socket
+    next = start + (unsigned long long)(sent * 1e9 / rate);
+    if(next >= end || now_ns() >= end)
+      break;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+    pick = random() % total;
+    for(c = 0; pick >= mix[c]; c++)
+      pick -= mix[c];
+    if(!n_live)
+      c = EV_FORK;
+
+    switch(c) {
+      case EV_FORK:
+        ev_fork(tree, base);
+        break;
+      case EV_EXEC:
+        ev_exec(&live[random() % n_live]);
+        break;
+      case EV_EXIT:
+        ev_exit(random() % n_live);
+        break;
+      case EV_UID:
+        ev_uid(&live[random() % n_live]);
+        break;
+    }
+    counts[c]++;
+    sent++;
+  }
+  end = now_ns();
+
+  printf("sent %llu events in %.2f s: %.0f events/s (target %.0f)\n", sent,
+         (end - start) / 1e9, sent * 1e9 / (end - start), rate);
+  printf("fork %llu exec %llu exit %llu uid %llu, %d processes left\n",
+         counts[EV_FORK], counts[EV_EXEC], counts[EV_EXIT], counts[EV_UID], n_live);
+
+  if(!keep)
+    for(i = n_live - 1; i >= 0; i--)
+      ev_exit(i);
+  return 0;
+}
@@ -0,0 +1,316 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  checks the /proc/#/stat and status parsers of src/proc
+
+  stat2proc_fast is compared with the sscanf parser it replaced, with every
+  field splitter the cpu supports. the input are the stat files of all
+  processes and threads in /proc or a captured snapshot directory with the
+  same layout, and random stat lines. the numbers from status2proc_buf are
+  compared with a simple line by line parse.
+
+  parse_check [-f rounds] [-s seed] [-b rounds] [directory]
+*/
+
+#include "proc/statparse.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static const char *impls[] = { "scalar", "sse2", "avx2" };
+#define N_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static int failed = 0;
+static int checked = 0;
+
+struct input {
+  char **lines;
+  int len;
+  int alloc;
+};
+
+static void input_add(struct input *in, const char *line) {
+  if(in->len == in->alloc) {
+    in->alloc = in->alloc ? in->alloc * 2 : 1024;
+    in->lines = realloc(in->lines, in->alloc * sizeof(char *));
+  }
+  in->lines[in->len++] = strdup(line);
+}
+
+static int read_file(const char *path, char *buf, int size) {
+  int fd = open(path, O_RDONLY);
+  int n;
+
+  if(fd < 0)
+    return -1;
+  n = read(fd, buf, size - 1);
+  close(fd);
+  if(n < 0)
+    return -1;
+  buf[n] = '\0';
+  return n;
+}
+
+static void check_stat(const char *line, const char *what) {
+  // a copy at every alignment, the simd splitter masks the bytes in front
+  char buf[1024 + 64];
+  proc_t want, got;
+  unsigned int i, shift;
+  size_t len = strlen(line);
+
+  if(len >= 1024)
+    return;
+  memset(&want, 0, sizeof(want));
+  stat2proc_sscanf(line, &want);
+
+  for(i = 0; i < N_IMPLS; i++) {
+    if(!stat_split_use(impls[i]))
+      continue;
+    for(shift = 0; shift < 32; shift++) {
+      memcpy(buf + shift, line, len + 1);
+      memset(&got, 0, sizeof(got));
+      stat2proc_fast(buf + shift, &got);
+      checked++;
+      if(memcmp(&want, &got, sizeof(proc_t))) {
+        failed++;
+        printf("stat differs (%s, %s, offset %u): %s", impls[i], what, shift, line);
+        break;
+      }
+    }
+  }
+}
+
+// the reference for status2proc: only the numbers, one line at a time
+static void check_status(char *text, const char *what) {
+  proc_t want, got;
+  char *line, *save = NULL;
+  char *copy = strdup(text);
+  long threads = 0;
+
+  memset(&want, 0, sizeof(want));
+  memset(&got, 0, sizeof(got));
+  status2proc_buf(text, &got);
+
+  for(line = strtok_r(copy, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+    sscanf(line, "PPid: %d", &want.ppid);
+    sscanf(line, "Threads: %ld", &threads);
+    sscanf(line, "Uid: %d %d %d %d", &want.ruid, &want.euid, &want.suid, &want.fuid);
+    sscanf(line, "Gid: %d %d %d %d", &want.rgid, &want.egid, &want.sgid, &want.fgid);
+    sscanf(line, "VmSize: %lu", &want.vm_size);
+    sscanf(line, "VmLck: %lu", &want.vm_lock);
+    sscanf(line, "VmRSS: %lu", &want.vm_rss);
+    sscanf(line, "VmData: %lu", &want.vm_data);
+    sscanf(line, "VmStk: %lu", &want.vm_stack);
+    sscanf(line, "VmExe: %lu", &want.vm_exe);
+    sscanf(line, "VmLib: %lu", &want.vm_lib);
+  }
+  free(copy);
+  checked++;
+
+#define CMP(FIELD) \
+  if(want.FIELD != got.FIELD) { \
+    failed++; \
+    printf("status %s differs (%s): %ld != %ld\n", #FIELD, what, \
+           (long)want.FIELD, (long)got.FIELD); \
+  }
+  CMP(ppid) CMP(ruid) CMP(euid) CMP(suid) CMP(fuid)
+  CMP(rgid) CMP(egid) CMP(sgid) CMP(fgid)
+  CMP(vm_size) CMP(vm_lock) CMP(vm_rss) CMP(vm_data)
+  CMP(vm_stack) CMP(vm_exe) CMP(vm_lib)
+#undef CMP
+  if((threads ? threads : 1) != got.nlwp) {
+    failed++;
+    printf("status nlwp differs (%s)\n", what);
+  }
+  if(got.supgid)
+    free(got.supgid);
+}
+
+static void check_task(const char *dir, struct input *in) {
+  char path[PATH_MAX], buf[8192];
+
+  snprintf(path, sizeof(path), "%s/stat", dir);
+  if(read_file(path, buf, sizeof(buf)) > 0) {
+    check_stat(buf, path);
+    input_add(in, buf);
+  }
+  snprintf(path, sizeof(path), "%s/status", dir);
+  if(read_file(path, buf, sizeof(buf)) > 0)
+    check_status(buf, path);
+}
+
+// all processes and their threads below root
+static void check_dir(const char *root, struct input *in) {
+  char path[PATH_MAX], task[PATH_MAX];
+  struct dirent *ent, *tent;
+  DIR *dir, *tdir;
+
+  dir = opendir(root);
+  if(!dir) {
+    perror(root);
+    exit(2);
+  }
+  while((ent = readdir(dir))) {
+    if(ent->d_name[0] < '0' || ent->d_name[0] > '9')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", root, ent->d_name);
+    check_task(path, in);
+
+    snprintf(task, sizeof(task), "%s/task", path);
+    tdir = opendir(task);
+    if(!tdir)
+      continue;
+    while((tent = readdir(tdir))) {
+      if(tent->d_name[0] < '0' || tent->d_name[0] > '9' ||
+         !strcmp(tent->d_name, ent->d_name))
+        continue;
+      snprintf(path, sizeof(path), "%s/%s", task, tent->d_name);
+      check_task(path, in);
+    }
+    closedir(tdir);
+  }
+  closedir(dir);
+}
+
+static unsigned long long rand64() {
+  return ((unsigned long long)random() << 42) ^ ((unsigned long long)random() << 21) ^ random();
+}
+
+// number in the range of the scanf conversion of that field
+static int put_field(char *p, int field) {
+  switch(field) {
+    case 1: case 2: case 3: case 4: case 5:   // ppid .. tpgid
+    case 17: case 35: case 36:                // nlwp exit_signal processor
+      return sprintf(p, " %d", (int)rand64() >> (random() % 32));
+    case 15: case 16: case 18: case 21:       // priority nice alarm rss
+      return sprintf(p, " %ld", (long)rand64() >> (random() % 64));
+    case 28: case 29: case 30: case 31:       // signals, skipped
+      return sprintf(p, " %llu", rand64());
+    default:
+      return sprintf(p, " %llu", rand64() >> (random() % 64));
+  }
+}
+
+static const char comm_chars[] = "abc ()):-0123456789\\";
+
+static void fuzz(int rounds, struct input *in) {
+  char line[1024], *p;
+  int i, f, fields, len;
+  int keep = !in->len;   // benchmark the random lines only without others
+
+  for(i = 0; i < rounds; i++) {
+    p = line + sprintf(line, "%d (", (int)(random() % 4194304));
+    len = random() % 16;
+    for(f = 0; f < len; f++)
+      *p++ = comm_chars[random() % (sizeof(comm_chars) - 1)];
+    p += sprintf(p, ") %c", "RSDZTtWXxKWP"[random() % 12]);
+    // old kernels end early, new ones have more fields than are read
+    fields = random() % 4 ? 52 : 1 + random() % 52;
+    for(f = 1; f < fields; f++)
+      p += put_field(p, f);
+    strcpy(p, "\n");
+    check_stat(line, "fuzz");
+    if(keep && i < 4096)
+      input_add(in, line);
+  }
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(int rounds, struct input *in) {
+  proc_t p;
+  double start;
+  unsigned int i;
+  int r, l;
+
+  if(!in->len)
+    return;
+  printf("%d lines, %d rounds\n", in->len, rounds);
+
+  start = now();
+  for(r = 0; r < rounds; r++)
+    for(l = 0; l < in->len; l++)
+      stat2proc_sscanf(in->lines[l], &p);
+  printf("%-8s %8.1f ns/line\n", "sscanf",
+         (now() - start) * 1e9 / rounds / in->len);
+
+  for(i = 0; i < N_IMPLS; i++) {
+    if(!stat_split_use(impls[i]))
+      continue;
+    start = now();
+    for(r = 0; r < rounds; r++)
+      for(l = 0; l < in->len; l++)
+        stat2proc_fast(in->lines[l], &p);
+    printf("%-8s %8.1f ns/line\n", impls[i],
+           (now() - start) * 1e9 / rounds / in->len);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct input in = { NULL, 0, 0 };
+  const char *root = "/proc";
+  int fuzz_rounds = 100000;
+  int bench_rounds = 0;
+  int c;
+
+  while((c = getopt(argc, argv, "f:s:b:h")) != -1) {
+    switch(c) {
+      case 'f':
+        fuzz_rounds = atoi(optarg);
+        break;
+      case 's':
+        srandom(atoi(optarg));
+        break;
+      case 'b':
+        bench_rounds = atoi(optarg);
+        break;
+      default:
+        printf("parse_check [-f rounds] [-s seed] [-b rounds] [directory]\n");
+        printf("-f rounds    random stat lines to check (default 100000)\n");
+        printf("-s seed      seed of the random lines\n");
+        printf("-b rounds    benchmark the parsers afterwards\n");
+        printf("directory    /proc or a snapshot of it (default /proc)\n");
+        exit(c == 'h' ? 0 : 1);
+    }
+  }
+  if(optind < argc)
+    root = argv[optind];
+
+  printf("default splitter: %s\n", stat_split_impl());
+  check_dir(root, &in);
+  fuzz(fuzz_rounds, &in);
+  printf("%d checks, %d failed\n", checked, failed);
+
+  if(bench_rounds)
+    bench(bench_rounds, &in);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,286 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  captures /proc and the cgroup tree into a fixture for replaying
+
+  only the files ulatencyd reads are copied: the global files, the files of
+  every process and thread, and the cgroup tree. with -n the fixture is
+  filled up to that number of processes with copies of the captured ones,
+  so the daemon can be benchmarked with 10k or 50k processes on any box.
+
+    proc_capture -n 10000 -o fixture-10k.tar.gz
+    mkdir /tmp/fx && tar -xzf fixture-10k.tar.gz -C /tmp/fx
+    src/ulatencyd --proc-root /tmp/fx -r tests --rule-pattern bench_iterate.lua
+
+  extract to a tmpfs to not measure the disk. the daemon copies the cgroup
+  tree to a scratch directory and writes its groups there, signals, nice,
+  ioprio and scheduler changes are only logged. a fixture can be replayed
+  again and again.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "fixture.h"
+
+static const char *global_files[] = {
+  "stat", "meminfo", "vmstat", "uptime", "loadavg", "cgroups", "mounts",
+  "diskstats", "version", "sys/kernel/pid_max",
+  "sys/kernel/sched_autogroup_enabled", NULL
+};
+
+static char *root;
+static int captured = 0;
+static int max_pid = 0;
+
+// copy src to the same path below root
+static int copy(const char *src) {
+  char dst[PATH_MAX];
+  int len = fixture_read(src);
+
+  if(len < 0)
+    return -1;
+  snprintf(dst, sizeof(dst), "%s%s", root, src);
+  fixture_write(dst, fixture_data, len);
+  return 0;
+}
+
+static void copy_files(const char *dir, const char **files) {
+  char path[PATH_MAX], link[PATH_MAX];
+  int i;
+  ssize_t n;
+
+  snprintf(path, sizeof(path), "%s%s", root, dir);
+  fixture_mkdirs(path);
+  for(i = 0; files[i]; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+    copy(path);
+  }
+
+  // exe is only read as link
+  snprintf(path, sizeof(path), "%s/exe", dir);
+  n = readlink(path, link, sizeof(link) - 1);
+  if(n > 0) {
+    link[n] = '\0';
+    snprintf(path, sizeof(path), "%s%s/exe", root, dir);
+    symlink(link, path);
+  }
+}
+
+static void capture_processes() {
+  char path[PATH_MAX], link[64];
+  struct dirent *ent, *tent;
+  DIR *dir, *tdir;
+  ssize_t n;
+  int pid;
+
+  dir = opendir("/proc");
+  while((ent = readdir(dir))) {
+    pid = atoi(ent->d_name);
+    if(pid <= 0)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    copy_files(path, fixture_pid_files);
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    tdir = opendir(path);
+    if(!tdir)
+      continue;
+    while((tent = readdir(tdir))) {
+      if(atoi(tent->d_name) <= 0)
+        continue;
+      snprintf(path, sizeof(path), "/proc/%d/task/%s", pid, tent->d_name);
+      copy_files(path, fixture_task_files);
+    }
+    closedir(tdir);
+    captured++;
+    if(pid > max_pid)
+      max_pid = pid;
+  }
+  closedir(dir);
+
+  n = readlink("/proc/self", link, sizeof(link) - 1);
+  if(n > 0) {
+    link[n] = '\0';
+    snprintf(path, sizeof(path), "%s/proc/self", root);
+    symlink(link, path);
+  }
+}
+
+// more processes: copies of the captured ones with new pids above all
+// real ones. they keep the parent, so the tree stays valid.
+static void clone_processes(int total) {
+  char from[PATH_MAX], to[PATH_MAX], link[32];
+  int *pids = NULL, n = 0, alloc = 0, pid = max_pid, i;
+  struct dirent *ent;
+  DIR *dir;
+  ssize_t len;
+
+  snprintf(from, sizeof(from), "%s/proc", root);
+  dir = opendir(from);
+  while((ent = readdir(dir))) {
+    if(atoi(ent->d_name) <= 0)
+      continue;
+    if(n == alloc) {
+      alloc = alloc ? alloc * 2 : 1024;
+      pids = realloc(pids, alloc * sizeof(int));
+    }
+    pids[n++] = atoi(ent->d_name);
+  }
+  closedir(dir);
+  if(!n)
+    return;
+
+  for(i = 0; captured < total; i++, captured++)
+    fixture_clone_process(root, pids[i % n], ++pid, 0);
+  free(pids);
+
+  // the daemon sizes its pid columns from pid_max
+  snprintf(to, sizeof(to), "%s/proc/sys/kernel/pid_max", root);
+  len = fixture_read(to);
+  if(len > 0 && pid >= atoi(fixture_data)) {
+    len = sprintf(link, "%d\n", pid + 1);
+    fixture_write(to, link, len);
+  }
+}
+
+// directories and readable files of a cgroup tree
+static void capture_cgroups(const char *path) {
+  char sub[PATH_MAX], dst[PATH_MAX];
+  struct dirent *ent;
+  struct stat st;
+  DIR *dir = opendir(path);
+
+  if(!dir)
+    return;
+  snprintf(dst, sizeof(dst), "%s%s", root, path);
+  fixture_mkdirs(dst);
+  while((ent = readdir(dir))) {
+    if(ent->d_name[0] == '.')
+      continue;
+    snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+    if(lstat(sub, &st))
+      continue;
+    if(S_ISDIR(st.st_mode))
+      capture_cgroups(sub);
+    else if(S_ISREG(st.st_mode) && (st.st_mode & S_IRUSR))
+      copy(sub);
+  }
+  closedir(dir);
+}
+
+static int run(char *const argv[]) {
+  int status;
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0) {
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(1);
+  }
+  if(pid < 0 || waitpid(pid, &status, 0) < 0)
+    return -1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char **argv) {
+  char tmp[] = "/tmp/proc_capture.XXXXXX";
+  char path[PATH_MAX];
+  const char *out = NULL;
+  const char *cgroup_root = "/sys/fs/cgroup";
+  int total = 0;
+  int i, c;
+
+  root = NULL;
+  while((c = getopt(argc, argv, "o:d:n:c:h")) != -1) {
+    switch(c) {
+      case 'o':
+        out = optarg;
+        break;
+      case 'd':
+        root = optarg;
+        break;
+      case 'n':
+        total = atoi(optarg);
+        break;
+      case 'c':
+        cgroup_root = optarg;
+        break;
+      default:
+        printf("proc_capture [-o archive] [-d directory] [-n processes] [-c cgroup root]\n");
+        printf("-o archive     write a tar.gz of the fixture\n");
+        printf("-d directory   capture into directory, kept afterwards\n");
+        printf("-n processes   fill up with copies to that number of processes\n");
+        printf("-c path        cgroup tree to capture (default /sys/fs/cgroup)\n");
+        exit(c == 'h' ? 0 : 1);
+    }
+  }
+  if(!out && !root) {
+    printf("need -o or -d\n");
+    exit(1);
+  }
+  if(!root) {
+    root = mkdtemp(tmp);
+    if(!root) {
+      perror(tmp);
+      exit(2);
+    }
+  } else if(fixture_mkdirs(root)) {
+    exit(2);
+  }
+
+  snprintf(path, sizeof(path), "%s/proc/sys/kernel", root);
+  fixture_mkdirs(path);
+  for(i = 0; global_files[i]; i++) {
+    snprintf(path, sizeof(path), "/proc/%s", global_files[i]);
+    copy(path);
+  }
+  capture_processes();
+  if(total > captured)
+    clone_processes(total);
+  capture_cgroups(cgroup_root);
+  printf("captured %d processes into %s\n", captured, root);
+
+  if(out) {
+    char *tar[] = { "tar", "-C", root, "-czf", (char *)out, ".", NULL };
+    char *rm[] = { "rm", "-rf", root, NULL };
+
+    if(run(tar)) {
+      fprintf(stderr, "could not write %s\n", out);
+      exit(3);
+    }
+    printf("wrote %s\n", out);
+    if(root == tmp)
+      run(rm);
+  }
+  return 0;
+}
@@ -32,6 +32,29 @@ function test_get_pid()
 
 end
 
+function test_subtree()
+  local pid = ulatency.get_pid(1)
+
+  local pids = pid:subtree_pids()
+  assert_equal(pid:get_n_nodes() - 1, #pids, "subtree_pids misses processes")
+  assert_equal(1, pid:subtree_pids(true)[1], "subtree_pids without self")
+
+  local seen = 0
+  local visited = pid:walk_subtree(function(proc, depth)
+    assert_u_proc(proc)
+    assert_true(depth >= 1, "depth of a child < 1")
+    seen = seen + 1
+  end)
+  assert_equal(#pids, visited, "walk_subtree visited count differs")
+  assert_equal(#pids, seen, "walk_subtree callback count differs")
+
+  -- only the direct children
+  visited = pid:walk_subtree(function(proc, depth) end, {max_depth = 1})
+  assert_equal(pid:get_n_children(), visited, "max_depth not respected")
+  visited = pid:walk_subtree(function(proc, depth) return false end, {self = true})
+  assert_equal(1, visited, "returning false does not prune")
+end
+
 function test_flag_inherence() 
   pid = ulatency.get_pid(1)
 
@@ -147,3 +170,103 @@ function test_new_flag()
 end
 
 
+function test_proc_fields()
+  local pid = ulatency.get_pid(1)
+  assert_equal(0, pid.euid, "init not owned by root")
+  assert_number(pid.size, "statm field missing")
+  assert_number(pid.vm_rss, "status field missing")
+  assert_number(pid.ppid, "stat field missing")
+
+  local stats = ulatency.get_proc_read_stats()
+  assert_number(stats.lazy_reads)
+  assert_number(stats.files_read)
+  assert_number(stats.files_avoided)
+  assert_true(stats.files_read >= stats.lazy_reads, "partial read without file")
+end
+
+function test_history()
+  local pid = ulatency.get_pid(1)
+  assert_number(pid.cpu_rate, "cpu_rate missing")
+  assert_number(pid.io_rate, "io_rate missing")
+
+  local history = pid:get_history()
+  -- history_len = 0 disables it
+  if not history then
+    return
+  end
+  assert_true(#history.time > 0, "no samples recorded")
+  for i, key in ipairs({"cpu", "maj_flt", "rss", "read_bytes", "write_bytes"}) do
+    assert_equal(#history.time, #history[key], key.." length differs")
+  end
+  for i = 2, #history.time do
+    assert_true(history.time[i] >= history.time[i-1], "samples not ordered")
+    assert_true(history.cpu[i] >= history.cpu[i-1], "cpu time decreased")
+  end
+end
+
+function test_hot_fields()
+  local top = ulatency.top_processes("rss", 5)
+  assert_true(#top > 0 and #top <= 5, "no top processes")
+  for i = 2, #top do
+    assert_true(top[i-1].rss >= top[i].rss, "top processes not ordered")
+  end
+
+  local above = ulatency.processes_above("rss", top[#top].rss)
+  assert_true(#above >= #top, "less processes above the smallest top rss")
+  for i, proc in ipairs(above) do
+    assert_true(proc.rss >= top[#top].rss, "process below threshold")
+  end
+
+  local init = ulatency.get_pid(1)
+  local sums = ulatency.sum_processes("vm_rss", "pgrp")
+  assert_true(sums[init.pgrp] >= init.vm_rss, "vm_rss of init missing in its group")
+
+  -- grouped by the pgrp the rules see, fake ones included
+  local expected = {}
+  for i, proc in ipairs(ulatency.list_processes()) do
+    expected[proc.pgrp] = (expected[proc.pgrp] or 0) + proc.vm_rss
+  end
+  for pgrp, sum in pairs(expected) do
+    assert_equal(sum, sums[pgrp], "vm_rss sum of group "..pgrp.." differs")
+  end
+
+  assert_error(function() ulatency.top_processes("cmdline", 1) end)
+end
+
+function test_cmdline()
+  local pid = ulatency.get_pid(1)
+  local cmdline = pid.cmdline
+
+  assert_table(cmdline, "cmdline not a table")
+  assert_true(#cmdline > 0, "init without cmdline")
+  assert_equal(table.concat(cmdline, " "), pid.cmdline_match, "cmdline_match differs")
+  assert_true(string.find(cmdline[1], pid.cmdfile, 1, true), "cmdfile not part of argv[0]")
+  assert_table(pid.environ, "environ not a table")
+end
+
+
+function test_ffi_proc()
+  -- only available in luajit builds
+  if not ulatency.ffi_proc then
+    return
+  end
+  local pid = ulatency.get_pid(1)
+  local cproc = ulatency.ffi_proc(pid)
+
+  assert_equal(pid.pid, cproc.pid, "pid differs")
+  assert_equal(pid.euid, cproc.proc.euid, "euid differs")
+  assert_equal(pid.ppid, cproc.proc.ppid, "ppid differs")
+  assert_equal(pid.vm_rss, tonumber(cproc.proc.vm_rss), "vm_rss differs")
+
+  local flag = ulatency.new_flag{name = "ffi", value = 23}
+  pid:add_flag(flag)
+  local found = false
+  for cflag in ulatency.ffi_flags(cproc) do
+    if cflag.name ~= nil and require("ffi").string(cflag.name) == "ffi" then
+      assert_equal(23, tonumber(cflag.value), "flag value differs")
+      found = true
+    end
+  end
+  pid:del_flag(flag)
+  assert_true(found, "flag not found in ffi list")
+end
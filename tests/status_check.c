@@ -0,0 +1,312 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  checks the memory mapped status file
+
+  the writer of src/status.c publishes snapshots of fake processes, a forked
+  reader maps the file like a monitor would and copies snapshots with the
+  sequence counter protocol. every copy must be consistent: all processes of
+  a snapshot carry its iteration as pgrp and their number fits the
+  iteration. the file grows meanwhile, so the reader has to map it again.
+  the last snapshot is compared field by field with the fake processes.
+
+  status_check [iterations]
+*/
+
+#include "../src/status.c"
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+GKeyFile *config_data;
+GHashTable *processes;
+GList *system_flags;
+
+#define BASE_PROCS 50
+
+static int failed = 0;
+
+#define CHECK(COND, ...) \
+  if(!(COND)) { \
+    failed++; \
+    printf("FAILED: " __VA_ARGS__); \
+    printf("\n"); \
+  }
+
+/*
+  reader side, what a monitor does. the copy is only good if seq was even
+  before and unchanged after copying.
+*/
+struct reader {
+  int fd;
+  void *map;
+  size_t mapped;
+  guint8 *copy;
+  size_t len;
+};
+
+static int reader_map(struct reader *r) {
+  struct stat st;
+
+  if(r->map)
+    munmap(r->map, r->mapped);
+  r->map = NULL;
+  if(fstat(r->fd, &st) || st.st_size < sizeof(struct u_status_header))
+    return FALSE;
+  r->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->fd, 0);
+  if(r->map == MAP_FAILED) {
+    r->map = NULL;
+    return FALSE;
+  }
+  r->mapped = st.st_size;
+  return TRUE;
+}
+
+static int reader_copy(struct reader *r) {
+  volatile struct u_status_header *hdr;
+  uint32_t seq, size;
+  int tries;
+
+  for(tries = 0; tries < 100000; tries++) {
+    hdr = r->map;
+    seq = hdr->seq;
+    __sync_synchronize();
+    if(seq & 1)
+      continue;
+    size = hdr->size;
+    if(size > r->mapped) {
+      // the writer grew the file
+      if(!reader_map(r))
+        return FALSE;
+      continue;
+    }
+    r->copy = g_realloc(r->copy, size);
+    memcpy(r->copy, r->map, size);
+    __sync_synchronize();
+    if(hdr->seq == seq) {
+      r->len = size;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static const char *snap_string(guint8 *snap, size_t len, uint32_t offset) {
+  struct u_status_header *hdr = (struct u_status_header *)snap;
+
+  if(hdr->off_strings + offset >= len)
+    return NULL;
+  return (const char *)snap + hdr->off_strings + offset;
+}
+
+// layout of a copied snapshot
+static int snap_valid(guint8 *snap, size_t len) {
+  struct u_status_header *hdr = (struct u_status_header *)snap;
+  struct u_status_proc *procs;
+  uint32_t i;
+
+  if(len < sizeof(*hdr) || hdr->magic != U_STATUS_MAGIC ||
+     hdr->version != U_STATUS_VERSION || hdr->size != len || (hdr->seq & 1))
+    return FALSE;
+  if(hdr->off_procs != sizeof(*hdr) ||
+     hdr->off_flags != hdr->off_procs + hdr->n_procs * sizeof(struct u_status_proc) ||
+     hdr->off_strings != hdr->off_flags + hdr->n_flags * sizeof(struct u_status_flag) ||
+     hdr->off_strings >= len || snap[len - 1] != '\0' ||
+     hdr->n_sysflags > hdr->n_flags)
+    return FALSE;
+  procs = (struct u_status_proc *)(snap + hdr->off_procs);
+  for(i = 0; i < hdr->n_procs; i++) {
+    if(procs[i].flags + procs[i].n_flags > hdr->n_flags ||
+       !snap_string(snap, len, procs[i].groups))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+static int run_reader(const char *path, guint iterations) {
+  struct reader r;
+  struct u_status_header *hdr;
+  struct u_status_proc *procs;
+  guint snapshots = 0, i;
+  int bad = 0;
+
+  memset(&r, 0, sizeof(r));
+  r.fd = open(path, O_RDONLY);
+  if(r.fd == -1 || !reader_map(&r)) {
+    printf("FAILED: reader can't map %s\n", path);
+    return 1;
+  }
+
+  do {
+    if(!reader_copy(&r)) {
+      printf("FAILED: no consistent snapshot\n");
+      return 1;
+    }
+    hdr = (struct u_status_header *)r.copy;
+    if(!hdr->iteration)
+      continue;
+    snapshots++;
+    if(!snap_valid(r.copy, r.len)) {
+      printf("FAILED: broken snapshot of iteration %" G_GUINT64_FORMAT "\n", hdr->iteration);
+      bad++;
+      continue;
+    }
+    procs = (struct u_status_proc *)(r.copy + hdr->off_procs);
+    if(hdr->n_procs != BASE_PROCS + hdr->iteration) {
+      printf("FAILED: %u processes in iteration %" G_GUINT64_FORMAT "\n",
+             hdr->n_procs, hdr->iteration);
+      bad++;
+    }
+    for(i = 0; i < hdr->n_procs; i++)
+      if(procs[i].pgrp != (int32_t)hdr->iteration) {
+        printf("FAILED: torn snapshot of iteration %" G_GUINT64_FORMAT "\n", hdr->iteration);
+        bad++;
+        break;
+      }
+  } while(hdr->iteration < iterations && bad < 10);
+
+  printf("reader: %u snapshots, %d bad\n", snapshots, bad);
+  return bad ? 1 : 0;
+}
+
+static u_flag *fake_flag(const char *name, const char *reason) {
+  u_flag *flag = g_new0(u_flag, 1);
+
+  flag->name = g_strdup(name);
+  flag->reason = g_strdup(reason);
+  flag->priority = 3;
+  flag->value = 42;
+  return flag;
+}
+
+static u_proc *fake_proc(int pid) {
+  u_proc *proc = g_new0(u_proc, 1);
+
+  proc->pid = pid;
+  proc->proc.euid = 1000 + pid % 3;
+  u_status_set_group(proc, "cpu", pid % 2 ? "usr_1000_active" : "system");
+  if(pid % 5 == 0)
+    proc->flags = g_list_append(proc->flags, fake_flag("user.bg_high", "test"));
+  g_hash_table_insert(processes, GUINT_TO_POINTER(pid), proc);
+  return proc;
+}
+
+// the last snapshot against the fake processes
+static void check_last(const char *path, guint iteration) {
+  struct reader r;
+  struct u_status_header *hdr;
+  struct u_status_proc *rec;
+  struct u_status_flag *flags;
+  u_proc *proc;
+  char *groups;
+  uint32_t i;
+
+  memset(&r, 0, sizeof(r));
+  r.fd = open(path, O_RDONLY);
+  if(r.fd == -1 || !reader_map(&r) || !reader_copy(&r)) {
+    CHECK(FALSE, "can't read %s", path);
+    return;
+  }
+  hdr = (struct u_status_header *)r.copy;
+  CHECK(snap_valid(r.copy, r.len), "last snapshot broken");
+  CHECK(hdr->iteration == iteration, "iteration %" G_GUINT64_FORMAT " instead of %u",
+        hdr->iteration, iteration);
+  CHECK(hdr->n_procs == g_hash_table_size(processes), "%u processes instead of %u",
+        hdr->n_procs, g_hash_table_size(processes));
+  CHECK(hdr->pressure == U_STATUS_PRESSURE, "pressure bit missing");
+  CHECK(hdr->n_sysflags == 1, "%u system flags", hdr->n_sysflags);
+  flags = (struct u_status_flag *)(r.copy + hdr->off_flags);
+  CHECK(!strcmp(snap_string(r.copy, r.len, flags[0].name), "pressure") &&
+        !strcmp(snap_string(r.copy, r.len, flags[0].reason), "memory"),
+        "system flag differs");
+  CHECK(hdr->t_total == 0.25, "timings differ");
+
+  for(i = 0; i < hdr->n_procs; i++) {
+    rec = (struct u_status_proc *)(r.copy + hdr->off_procs) + i;
+    proc = g_hash_table_lookup(processes, GUINT_TO_POINTER(rec->pid));
+    if(!proc) {
+      CHECK(FALSE, "unknown pid %d", rec->pid);
+      continue;
+    }
+    groups = g_strdup_printf("cpu=%s", (char *)g_hash_table_lookup(proc->scheduled,
+                             g_intern_string("cpu")));
+    CHECK(rec->euid == proc->proc.euid && rec->pgrp == proc->proc.pgrp,
+          "pid %d: numbers differ", rec->pid);
+    CHECK(!strcmp(snap_string(r.copy, r.len, rec->groups), groups),
+          "pid %d: groups differ", rec->pid);
+    CHECK(rec->n_flags == g_list_length(proc->flags), "pid %d: flags differ", rec->pid);
+    if(rec->n_flags)
+      CHECK(!strcmp(snap_string(r.copy, r.len, flags[rec->flags].name), "user.bg_high") &&
+            flags[rec->flags].value == 42 && flags[rec->flags].priority == 3,
+            "pid %d: flag differs", rec->pid);
+    g_free(groups);
+  }
+  g_free(r.copy);
+  munmap(r.map, r.mapped);
+  close(r.fd);
+}
+
+int main(int argc, char **argv) {
+  struct u_status_timings timings = { 0.1, 0.05, 0.05, 0.25 };
+  GHashTableIter iter;
+  gpointer key, value;
+  guint iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  guint i;
+  char *dir, *path;
+  pid_t child;
+  int status;
+
+  dir = g_dir_make_tmp("status_check.XXXXXX", NULL);
+  path = g_build_filename(dir, "status", NULL);
+  config_data = g_key_file_new();
+  g_key_file_set_string(config_data, CONFIG_CORE, "status_file", path);
+  processes = g_hash_table_new(g_direct_hash, g_direct_equal);
+  system_flags = g_list_append(NULL, fake_flag("pressure", "memory"));
+
+  if(!u_status_init()) {
+    printf("FAILED: status export not enabled\n");
+    return 1;
+  }
+
+  for(i = 1; i <= BASE_PROCS; i++)
+    fake_proc(i);
+
+  child = fork();
+  if(child == 0)
+    _exit(run_reader(path, iterations));
+
+  // the number of processes grows, so the file is resized while read
+  for(i = 1; i <= iterations; i++) {
+    fake_proc(BASE_PROCS + i);
+    g_hash_table_iter_init(&iter, processes);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+      ((u_proc *)value)->proc.pgrp = i;
+    u_status_update(i, &timings);
+  }
+
+  waitpid(child, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0, "reader saw inconsistent snapshots");
+  check_last(path, iterations);
+
+  unlink(path);
+  rmdir(dir);
+  printf("%s\n", failed ? "status check failed" : "status check passed");
+  return failed ? 1 : 0;
+}
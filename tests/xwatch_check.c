@@ -0,0 +1,176 @@
+/*
+    Copyright 2010,2011 ulatencyd developers
+
+    This file is part of ulatencyd.
+
+    ulatencyd is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License,
+    or (at your option) any later version.
+
+    ulatencyd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with ulatencyd. If not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+  checks the event driven active window tracking of xwatch
+
+  run against a throwaway x server, ie.
+    xvfb-run -a tests/xwatch_check
+
+  a second connection plays the window manager: it creates windows with
+  _NET_WM_PID and WM_CLIENT_MACHINE and sets _NET_ACTIVE_WINDOW on the root.
+  xwatch has to report the pid without polling, drop the cached window when
+  it is destroyed and must not arm any timer while the server is connected.
+*/
+
+#define G_LOG_DOMAIN "xwatch_check"
+
+#include "config.h"
+#include "ulatency.h"
+
+#define TEST_XWATCH
+
+#include "../modules/xwatch.c"
+
+GHashTable *processes;
+
+static unsigned int last_uid = 0, last_pid = 0;
+static int failed = 0;
+static char *xauthority = NULL;
+
+// the daemon functions xwatch uses
+
+void set_active_pid_debounced(unsigned int uid, unsigned int pid) {
+  last_uid = uid;
+  last_pid = pid;
+}
+
+guint active_agent_register(const char *name) {
+  return 1;
+}
+
+int active_agent_claim(unsigned int uid, guint agent) {
+  return TRUE;
+}
+
+void active_agent_release(unsigned int uid, guint agent) {
+}
+
+// the xauthority of xvfb-run is not in the environment of any process
+GPtrArray *search_user_env(uid_t uid, const char *name, int update) {
+  GPtrArray *rv = g_ptr_array_new_with_free_func(g_free);
+
+  if(xauthority)
+    g_ptr_array_add(rv, g_strdup(xauthority));
+  return rv;
+}
+
+#define CHECK(COND, ...) \
+  if(!(COND)) { \
+    failed++; \
+    printf("FAILED: " __VA_ARGS__); \
+    printf("\n"); \
+  }
+
+// runs the main loop until the condition holds or a second passed
+#define WAIT_FOR(COND) \
+  do { \
+    gint64 _end = g_get_monotonic_time() + G_USEC_PER_SEC; \
+    while(!(COND) && g_get_monotonic_time() < _end) { \
+      if(!g_main_context_iteration(NULL, FALSE)) \
+        g_usleep(1000); \
+    } \
+  } while(0)
+
+static xcb_atom_t atom(xcb_connection_t *c, const char *name) {
+  return get_atom(c, intern_string(c, name));
+}
+
+// a client window of the process pid on this host
+static xcb_window_t client_window(xcb_connection_t *c, xcb_screen_t *screen, uint32_t pid) {
+  xcb_window_t win = xcb_generate_id(c);
+
+  xcb_create_window(c, XCB_COPY_FROM_PARENT, win, screen->root, 0, 0, 10, 10, 0,
+                    XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, 0, NULL);
+  xcb_change_property(c, XCB_PROP_MODE_REPLACE, win, atom(c, "_NET_WM_PID"),
+                      atom(c, "CARDINAL"), 32, 1, &pid);
+  xcb_change_property(c, XCB_PROP_MODE_REPLACE, win, atom(c, "WM_CLIENT_MACHINE"),
+                      atom(c, "STRING"), 8, strlen(localhost), localhost);
+  return win;
+}
+
+static void activate(xcb_connection_t *c, xcb_screen_t *screen, xcb_window_t win) {
+  xcb_change_property(c, XCB_PROP_MODE_REPLACE, screen->root,
+                      atom(c, "_NET_ACTIVE_WINDOW"), atom(c, "WINDOW"), 32, 1, &win);
+  xcb_flush(c);
+}
+
+static int cached(struct x_server *xs, xcb_window_t win) {
+  return g_hash_table_lookup_extended(xs->pid_cache, GUINT_TO_POINTER(win),
+                                      NULL, NULL);
+}
+
+int main(int argc, char **argv) {
+  struct x_server *xs;
+  xcb_connection_t *wm;
+  xcb_screen_t *screen;
+  xcb_window_t win1, win2;
+  const char *display = getenv("DISPLAY");
+  u_proc dummy;
+  int n;
+
+  if(!display) {
+    printf("DISPLAY not set, run with xvfb-run -a\n");
+    return 1;
+  }
+  xauthority = g_strdup(getenv("XAUTHORITY"));
+
+  processes = g_hash_table_new(g_direct_hash, g_direct_equal);
+  memset(&dummy, 0, sizeof(dummy));
+  g_hash_table_insert(processes, GUINT_TO_POINTER(4711), &dummy);
+  g_hash_table_insert(processes, GUINT_TO_POINTER(4712), &dummy);
+
+  xwatch_init();
+  xs = add_connection("check", getuid(), display);
+  if(!xs || !xs->connection) {
+    printf("FAILED: can't connect to %s\n", display);
+    return 1;
+  }
+
+  wm = xcb_connect(display, &n);
+  screen = xcb_setup_roots_iterator(xcb_get_setup(wm)).data;
+
+  win1 = client_window(wm, screen, 4711);
+  activate(wm, screen, win1);
+  WAIT_FOR(last_pid == 4711);
+  CHECK(last_pid == 4711, "first window not reported, got pid %u", last_pid);
+  CHECK(last_uid == getuid(), "wrong uid %u", last_uid);
+  CHECK(cached(xs, win1), "pid of the first window not cached");
+
+  win2 = client_window(wm, screen, 4712);
+  activate(wm, screen, win2);
+  WAIT_FOR(last_pid == 4712);
+  CHECK(last_pid == 4712, "focus change not reported, got pid %u", last_pid);
+
+  // a destroyed window must not keep its pid for a reused window id
+  xcb_destroy_window(wm, win1);
+  xcb_flush(wm);
+  WAIT_FOR(!cached(xs, win1));
+  CHECK(!cached(xs, win1), "destroyed window still cached");
+  CHECK(cached(xs, win2), "living window dropped from cache");
+
+  // connected servers need no timer
+  CHECK(retry_source == 0, "retry timer armed while connected");
+
+  xcb_disconnect(wm);
+  del_connection(xs);
+
+  printf("%s\n", failed ? "xwatch check failed" : "xwatch check passed");
+  return failed ? 1 : 0;
+}